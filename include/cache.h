@@ -70,27 +70,30 @@ struct cache {
 	unsigned int extra_offset;
 	size_t object_size;
 
+	/* streaming dumps in progress */
+	struct list_head dumps;
+
         /* statistics */
 	struct {
 		uint32_t	active;
 	
-		uint32_t	add_ok;
-		uint32_t	del_ok;
-		uint32_t	upd_ok;
+		uint64_t	add_ok;
+		uint64_t	del_ok;
+		uint64_t	upd_ok;
 		
-		uint32_t	add_fail;
-		uint32_t	del_fail;
-		uint32_t	upd_fail;
+		uint64_t	add_fail;
+		uint64_t	del_fail;
+		uint64_t	upd_fail;
 
-		uint32_t	add_fail_enomem;
-		uint32_t	add_fail_enospc;
-		uint32_t	del_fail_enoent;
-		uint32_t	upd_fail_enoent;
+		uint64_t	add_fail_enomem;
+		uint64_t	add_fail_enospc;
+		uint64_t	del_fail_enoent;
+		uint64_t	upd_fail_enoent;
 
-		uint32_t	commit_ok;
-		uint32_t	commit_fail;
+		uint64_t	commit_ok;
+		uint64_t	commit_fail;
 
-		uint32_t	flush;
+		uint64_t	flush;
 
 		uint32_t	objects;
 	} stats;
@@ -151,6 +154,8 @@ void cache_del(struct cache *c, struct cache_object *obj);
 struct cache_object *cache_find(struct cache *c, void *ptr, int *pos);
 void cache_stats(const struct cache *c, int fd);
 void cache_stats_extended(const struct cache *c, int fd);
+struct metrics;
+void cache_metrics(struct cache **caches, int num, struct metrics *m);
 void *cache_get_extra(struct cache_object *);
 void cache_iterate(struct cache *c, void *data, int (*iterate)(void *data1, void *data2));
 void cache_iterate_limit(struct cache *c, void *data, uint32_t from, uint32_t steps, int (*iterate)(void *data1, void *data2));
@@ -158,12 +163,27 @@ void cache_iterate_limit(struct cache *c, void *data, uint32_t from, uint32_t st
 /* iterators */
 struct nfct_handle;
 
+struct ct_dump_filter;
+
 struct __dump_container {
 	int fd;
 	int type;
+	const struct ct_dump_filter *filter;
+	/* output buffer, only used by streaming dumps. */
+	char	*buf;
+	size_t	len;
+	size_t	size;
 };
 
 void cache_dump(struct cache *c, int fd, int type);
+void cache_dump_close_clients(int keep);
+void cache_dump_kernel(int fd, int type, const struct ct_dump_filter *filter,
+		       void (*dump)(int fd, int type,
+				    const struct ct_dump_filter *filter));
+void cache_dump_stream(struct cache *c, int fd, int type,
+		       const struct ct_dump_filter *filter);
+int cache_dump_output(struct __dump_container *container,
+		      const char *buf, int size);
 
 struct __commit_container {
 	struct nfct_handle	*h;
@@ -171,6 +191,19 @@ struct __commit_container {
 };
 
 int cache_commit(struct cache *c, struct nfct_handle *h, int clientfd);
+
+/* JSON and binary dump formats */
+int cache_ct_dump_json(char *buf, size_t size, const struct nf_conntrack *ct,
+		       long age);
+int cache_ct_dump_binary(char *buf, const struct nf_conntrack *ct);
+
+/* background commit of the external conntrack cache */
+extern struct cache_extra cache_ct_precommit_extra;
+int cache_ct_precommit_init(struct cache *c);
+void cache_ct_precommit_fini(void);
+void cache_ct_precommit_del(struct cache_object *obj);
+void cache_ct_precommit_invalidate(void);
+void cache_ct_precommit_stats(int fd);
 void cache_flush(struct cache *c);
 void cache_bulk(struct cache *c);
 
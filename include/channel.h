@@ -52,6 +52,14 @@ struct channel_conf {
 };
 
 struct nlif_handle;
+struct metrics;
+
+/* traffic counters of the client (tx) and server (rx) sockets. */
+struct channel_counters {
+	uint64_t	bytes;
+	uint64_t	messages;
+	uint64_t	error;
+};
 
 #define CHANNEL_T_DATAGRAM	0
 #define CHANNEL_T_STREAM	1
@@ -70,6 +78,8 @@ struct channel_ops {
 	void	(*stats)(struct channel *c, int fd);
 	void	(*stats_extended)(struct channel *c, int active,
 				  struct nlif_handle *h, int fd);
+	void	(*counters)(struct channel *c, struct channel_counters *tx,
+			    struct channel_counters *rx);
 };
 
 struct channel_buffer;
@@ -101,6 +111,8 @@ int channel_isset(struct channel *c, fd_set *readfds);
 void channel_stats(struct channel *c, int fd);
 void channel_stats_extended(struct channel *c, int active,
 			    struct nlif_handle *h, int fd);
+void channel_counters(struct channel *c, struct channel_counters *tx,
+		      struct channel_counters *rx);
 
 int channel_type(struct channel *c);
 
@@ -122,6 +134,7 @@ int multichannel_recv(struct multichannel *c, char *buf, int size);
 void multichannel_stats(struct multichannel *m, int fd);
 void multichannel_stats_extended(struct multichannel *m,
 				 struct nlif_handle *h, int fd);
+void multichannel_metrics(struct multichannel *m, struct metrics *metrics);
 
 int multichannel_get_ifindex(struct multichannel *m, int i);
 int multichannel_get_current_ifindex(struct multichannel *m);
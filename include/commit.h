@@ -0,0 +1,25 @@
+#ifndef _COMMIT_H_
+#define _COMMIT_H_
+
+struct nf_conntrack;
+
+/* not yet committed, or to be created again after deletion */
+#define COMMIT_PENDING	-1
+#define COMMIT_RETRY	-2
+
+/* delete this entry from the kernel instead of creating it */
+#define COMMIT_F_DELETE	(1 << 0)
+
+struct commit_item {
+	const struct nf_conntrack	*ct;
+	int				timeout;
+	int				flags;
+	int				err;	/* zero or errno after commit */
+	void				*data;	/* caller private data */
+};
+
+int commit_open(unsigned int nworkers);
+void commit_close(void);
+void commit_run(struct commit_item *items, unsigned int n);
+
+#endif
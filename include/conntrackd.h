@@ -49,6 +49,15 @@
 #define ALL_COMMIT		46	/* commit all tables		*/
 #define EXP_DUMP_INT_XML	47	/* dump internal cache in XML	*/
 #define EXP_DUMP_EXT_XML	48	/* dump external cache in XML	*/
+#define CT_DUMP_INT_FILTER	49	/* dump internal cache w/filter	*/
+#define CT_DUMP_EXT_FILTER	50	/* dump external cache w/filter	*/
+#define STATS_METRICS		51	/* all counters in OpenMetrics	*/
+#define STATS_ACCOUNTING	52	/* accounting tables		*/
+#define STATS_TOP		53	/* heavy hitters		*/
+
+/* dump formats, in addition to NFCT_O_PLAIN and NFCT_O_XML */
+#define CTD_DUMP_JSON		16	/* newline-delimited JSON	*/
+#define CTD_DUMP_BINARY		17	/* stream of ctnetlink messages	*/
 
 #define DEFAULT_CONFIGFILE	"/etc/conntrackd/conntrackd.conf"
 #define DEFAULT_LOCKFILE	"/var/lock/conntrackd.lock"
@@ -98,6 +107,8 @@ struct ct_conf {
 	int refresh;
 	int cache_timeout;		/* cache entries timeout */
 	int commit_timeout;		/* committed entries timeout */
+	unsigned int commit_threads;	/* threads used to commit */
+	unsigned int precommit_rate;	/* background commit entries/s */
 	unsigned int purge_timeout;	/* purge kernel entries timeout */
 	unsigned int netlink_buffer_size;
 	unsigned int netlink_buffer_size_max_grown;
@@ -108,6 +119,8 @@ struct ct_conf {
 	int poll_kernel_secs;
 	int filter_from_kernelspace;
 	int event_iterations_limit;
+	unsigned int dump_children;
+	unsigned int metrics_port;
 	int systemd;
 	int running_mode;
 	int startup_resync;
@@ -118,6 +131,10 @@ struct ct_conf {
 		int internal_cache_disable;
 		int external_cache_disable;
 		int tcp_window_tracking;
+		int adaptive_ack;
+		char snapshot_path[FILENAME_MAXLEN + 1];
+		unsigned int snapshot_interval;
+		unsigned int snapshot_max_age;
 	} sync;
 	struct {
 		int subsys_id;
@@ -134,7 +151,31 @@ struct ct_conf {
 	struct {
 		char logfile[FILENAME_MAXLEN + 1];
 		int syslog_facility;
-		size_t buffer_size;
+		size_t buffer_size;		/* flow log ring buffer */
+		unsigned int flush_interval;	/* flow log flush, msecs */
+		struct {
+			int ipproto;		/* collector family, 0 if none */
+			union inet_address collector;
+			unsigned short port;
+			char path[FILENAME_MAXLEN + 1];
+			unsigned int mtu;
+			unsigned int domain;
+			unsigned int template_refresh;	/* secs */
+			unsigned int flush_interval;	/* msecs */
+		} ipfix;
+		struct {
+			int enabled;
+			int zone;
+			int mark;
+			uint32_t mark_mask;
+			int labels;
+			unsigned int max_entries;	/* per hash table */
+		} acct;
+		struct {
+			int enabled;
+			unsigned int entries;		/* per table */
+			unsigned int window;		/* secs */
+		} hitters;
 	} stats;
 	struct {
 		struct list_head list;
@@ -180,22 +221,32 @@ struct ct_general_state {
 
 		uint64_t		nl_events_received;
 		uint64_t		nl_events_filtered;
-		uint32_t		nl_events_unknown_type;
-		uint32_t		nl_catch_event_failed;
-		uint32_t		nl_overrun;
-		uint32_t		nl_dump_unknown_type;
-		uint32_t		nl_kernel_table_flush;
-		uint32_t		nl_kernel_table_resync;
-
-		uint32_t		child_process_failed;
-		uint32_t		child_process_error_segfault;
-		uint32_t		child_process_error_term;
-
-		uint32_t		select_failed;
-		uint32_t		wait_failed;
-
-		uint32_t		local_read_failed;
-		uint32_t		local_unknown_request;
+		uint64_t		nl_events_unknown_type;
+		uint64_t		nl_catch_event_failed;
+		uint64_t		nl_overrun;
+		uint64_t		nl_dump_unknown_type;
+		uint64_t		nl_kernel_table_flush;
+		uint64_t		nl_kernel_table_resync;
+		uint64_t		nl_kernel_table_flush_entries;
+		uint64_t		nl_kernel_table_flush_usecs;
+
+		uint64_t		child_process_failed;
+		uint64_t		child_process_error_segfault;
+		uint64_t		child_process_error_term;
+
+		uint64_t		select_failed;
+		uint64_t		wait_failed;
+
+		uint64_t		local_read_failed;
+		uint64_t		local_unknown_request;
+
+		uint64_t		dump_streams;
+		uint64_t		dump_forked;
+		uint64_t		dump_queued;
+		uint64_t		dump_aborted;
+		uint64_t		dump_entries;
+		uint64_t		dump_bytes;
+		uint64_t		dump_usecs;
 
 	} stats;
 };
@@ -225,26 +276,27 @@ struct ct_sync_state {
 		int			current;
 		struct commit_runqueue  rq[2];
 		struct {
-			int 		ok;
-			int		fail;
+			uint64_t	ok;
+			uint64_t	fail;
 			struct timeval	start;
 		} stats;
 	} commit;
 
 	struct alarm_block		reset_cache_alarm;
+	struct alarm_block		snapshot_alarm;
 
 	struct sync_mode *sync;		/* sync mode */
 
 	/* statistics */
 	struct {
 		uint64_t	msg_rcv_malformed;
-		uint32_t	msg_rcv_bad_version;
-		uint32_t	msg_rcv_bad_payload;
-		uint32_t	msg_rcv_bad_header;
-		uint32_t	msg_rcv_bad_type;
-		uint32_t	msg_rcv_truncated;
-		uint32_t	msg_rcv_bad_size;
-		uint32_t	msg_snd_malformed;
+		uint64_t	msg_rcv_bad_version;
+		uint64_t	msg_rcv_bad_payload;
+		uint64_t	msg_rcv_bad_header;
+		uint64_t	msg_rcv_bad_type;
+		uint64_t	msg_rcv_truncated;
+		uint64_t	msg_rcv_bad_size;
+		uint64_t	msg_snd_malformed;
 		uint64_t	msg_rcv_lost;
 		uint64_t	msg_rcv_before;
 	} error;
@@ -257,6 +309,10 @@ struct ct_sync_state {
 
 struct ct_stats_state {
 	struct cache *cache;            /* internal events cache (netlink) */
+	struct flowlog *flowlog;	/* asynchronous flow log, if any */
+	struct ipfix_exporter *ipfix;	/* IPFIX flow export, if any */
+	struct traffic_acct *acct;	/* accounting tables, if any */
+	struct hitters *hitters;	/* heavy hitters, if any */
 };
 
 #define STATE_CTH(x) state.cthelper->x
@@ -276,10 +332,13 @@ extern struct ct_conf conf;
 extern struct ct_state state;
 extern struct ct_general_state st;
 
+struct metrics;
+
 struct ct_mode {
 	struct internal_handler *internal;
 	int (*init)(void);
 	int (*local)(int fd, int type, void *data);
+	void (*metrics)(struct metrics *m);
 	void (*kill)(void);
 };
 
@@ -2,21 +2,34 @@
 #define _EXTERNAL_H_
 
 struct nf_conntrack;
+struct nethdr;
+struct ct_dump_filter;
+struct metrics;
 
 struct external_handler {
 	int	(*init)(void);
 	void	(*close)(void);
 
 	struct {
+		void	*data;
+
 		void	(*new)(struct nf_conntrack *ct);
 		void	(*upd)(struct nf_conntrack *ct);
 		void	(*del)(struct nf_conntrack *ct);
+		/*
+		 * optional: handle network message, no nf_conntrack object.
+		 * If set, new, upd and del are never called.
+		 */
+		int	(*msg)(struct nethdr *net, size_t remain);
 
-		void	(*dump)(int fd, int type);
+		void	(*dump)(int fd, int type,
+				const struct ct_dump_filter *filter);
 		void	(*flush)(void);
 		int	(*commit)(struct nfct_handle *h, int fd);
 		void	(*stats)(int fd);
 		void	(*stats_ext)(int fd);
+		/* optional: counters not covered by the cache metrics */
+		void	(*metrics)(struct metrics *m);
 	} ct;
 	struct {
 		void	(*new)(struct nf_expect *exp);
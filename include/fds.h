@@ -6,6 +6,7 @@
 struct fds {
 	int	maxfd;
 	fd_set	readfds;
+	fd_set	writefds;
 	struct list_head list;
 };
 
@@ -14,11 +15,13 @@ struct fds_item {
 	int                     fd;
 	void			(*cb)(void *data);
 	void			*data;
+	int			write;
 };
 
 struct fds *create_fds(void);
 void destroy_fds(struct fds *);
 int register_fd(int fd, void (*cb)(void *data), void *data, struct fds *fds);
+int register_write_fd(int fd, void (*cb)(void *data), void *data, struct fds *fds);
 int unregister_fd(int fd, struct fds *fds);
 
 #endif
@@ -53,6 +53,37 @@ void ct_filter_set_logic(struct ct_filter *f,
 int ct_filter_conntrack(const struct nf_conntrack *ct, int userspace);
 int ct_filter_master(const struct nf_conntrack *master);
 
+/* filter passed by the client along with dump requests. */
+enum ct_dump_filter_flags {
+	CT_DUMP_F_L4PROTO	= (1 << 0),
+	CT_DUMP_F_ADDRESS	= (1 << 1),
+	CT_DUMP_F_PORT		= (1 << 2),
+	CT_DUMP_F_MARK		= (1 << 3),
+	CT_DUMP_F_ZONE		= (1 << 4),
+	CT_DUMP_F_STATE		= (1 << 5),
+};
+
+struct ct_dump_filter {
+	uint32_t	flags;
+	uint32_t	format;		/* NFCT_O_* or CTD_DUMP_* */
+	uint8_t		family;
+	uint8_t		l4proto;
+	uint8_t		state;
+	uint8_t		pad;
+	uint32_t	addr[4];	/* network byte order */
+	uint32_t	mask[4];
+	uint16_t	port;
+	uint16_t	zone;
+	uint32_t	mark;
+	uint32_t	mark_mask;
+};
+
+int ct_dump_filter_parse(struct ct_dump_filter *f, char *arg);
+int ct_dump_filter_recv(int fd, struct ct_dump_filter *f);
+int ct_dump_filter_match(const struct ct_dump_filter *f,
+			 const struct nf_conntrack *ct);
+const char *ct_dump_tcp_state_name(uint8_t state);
+
 struct exp_filter;
 struct nf_expect;
 
@@ -0,0 +1,18 @@
+#ifndef _FLOWLOG_H_
+#define _FLOWLOG_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+struct nf_conntrack;
+struct metrics;
+struct flowlog;
+
+struct flowlog *flowlog_create(FILE *fp, int syslog_facility, size_t size,
+			       unsigned int flush_interval);
+void flowlog_destroy(struct flowlog *fl);
+int flowlog_put(struct flowlog *fl, const struct nf_conntrack *ct);
+void flowlog_stats(struct flowlog *fl, int fd);
+void flowlog_metrics(struct flowlog *fl, struct metrics *m);
+
+#endif
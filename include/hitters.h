@@ -0,0 +1,15 @@
+#ifndef _HITTERS_H_
+#define _HITTERS_H_
+
+struct nf_conntrack;
+struct metrics;
+struct hitters;
+
+struct hitters *hitters_create(unsigned int entries, unsigned int window);
+void hitters_destroy(struct hitters *h);
+void hitters_flow_new(struct hitters *h, const struct nf_conntrack *ct);
+void hitters_flow_end(struct hitters *h, const struct nf_conntrack *ct);
+void hitters_dump(struct hitters *h, int fd);
+void hitters_metrics(struct hitters *h, struct metrics *m);
+
+#endif
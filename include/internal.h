@@ -4,6 +4,7 @@
 #include <libnetfilter_conntrack/libnetfilter_conntrack.h>
 
 struct nf_conntrack;
+struct ct_dump_filter;
 
 enum {
 	INTERNAL_F_POPULATE	= (1 << 0),
@@ -24,7 +25,8 @@ struct internal_handler {
 		void	(*upd)(struct nf_conntrack *ct, int origin_type);
 		int	(*del)(struct nf_conntrack *ct, int origin_type);
 
-		void	(*dump)(int fd, int type);
+		void	(*dump)(int fd, int type,
+				const struct ct_dump_filter *filter);
 		void	(*populate)(struct nf_conntrack *ct);
 		void	(*purge)(void);
 		int	(*resync)(enum nf_conntrack_msg_type type,
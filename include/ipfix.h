@@ -0,0 +1,44 @@
+#ifndef _IPFIX_H_
+#define _IPFIX_H_
+
+#include <stdint.h>
+#include <time.h>
+
+struct nf_conntrack;
+struct metrics;
+struct ipfix_exporter;
+
+#define IPFIX_VERSION		10
+#define IPFIX_SET_TEMPLATE	2
+#define IPFIX_TEMPLATE_IPV4	256
+#define IPFIX_TEMPLATE_IPV6	257
+
+#define IPFIX_PORT		4739
+#define IPFIX_MSG_MAX		65535
+
+/* enterprise numbers of the non-IANA information elements */
+#define IPFIX_PEN_REVERSE	29305	/* RFC 5103 biflow reverse elements */
+#define IPFIX_PEN_NETFILTER	21373	/* netfilter.org */
+
+struct ipfix_hdr {
+	uint16_t	version;
+	uint16_t	length;
+	uint32_t	export_time;
+	uint32_t	seq;		/* data records sent before this one */
+	uint32_t	domain;		/* observation domain ID */
+} __attribute__((packed));
+
+struct ipfix_set_hdr {
+	uint16_t	id;
+	uint16_t	length;
+} __attribute__((packed));
+
+struct ipfix_exporter *ipfix_create(void);
+void ipfix_destroy(struct ipfix_exporter *exp);
+int ipfix_put(struct ipfix_exporter *exp, const struct nf_conntrack *ct,
+	      time_t start);
+void ipfix_flush(struct ipfix_exporter *exp);
+void ipfix_stats(struct ipfix_exporter *exp, int fd);
+void ipfix_metrics(struct ipfix_exporter *exp, struct metrics *m);
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+enum metrics_type {
+	METRICS_COUNTER,
+	METRICS_GAUGE,
+	METRICS_HISTOGRAM,
+};
+
+/* OpenMetrics text exposition, built in memory and sent in one go. */
+struct metrics {
+	char			*buf;
+	size_t			len;
+	size_t			size;
+	const char		*family;	/* current metric family */
+	enum metrics_type	type;
+	int			err;
+};
+
+/* upper bounds in usecs, the last bucket is +Inf. */
+#define METRICS_HIST_BUCKETS	12
+
+struct metrics_histogram {
+	uint64_t	bucket[METRICS_HIST_BUCKETS];	/* not cumulative */
+	uint64_t	count;
+	uint64_t	sum;				/* usecs */
+};
+
+void metrics_histogram_observe(struct metrics_histogram *h, uint64_t usecs);
+
+int metrics_init(struct metrics *m);
+void metrics_free(struct metrics *m);
+int metrics_send(struct metrics *m, int fd);
+
+void metrics_family(struct metrics *m, const char *name,
+		    enum metrics_type type, const char *help);
+void metrics_sample(struct metrics *m, uint64_t value,
+		    const char *labels, ...)
+		    __attribute__((format(printf, 3, 4)));
+void metrics_histogram(struct metrics *m, const struct metrics_histogram *h,
+		       const char *labels, ...)
+		       __attribute__((format(printf, 3, 4)));
+
+/* optional HTTP listener on the loopback interface */
+int metrics_http_create(unsigned short port,
+			void (*build)(struct metrics *m));
+void metrics_http_destroy(void);
+
+#endif
@@ -12,8 +12,9 @@ struct nlif_handle *nl_init_interface_handler(void);
 int nl_send_resync(struct nfct_handle *h);
 void nl_resize_socket_buffer(struct nfct_handle *h);
 int nl_dump_conntrack_table(struct nfct_handle *h);
-int nl_flush_conntrack_table_selective(void);
+int nl_flush_conntrack_table_selective(void (*cb)(void *data), void *data);
 int nl_get_conntrack(struct nfct_handle *h, const struct nf_conntrack *ct);
+struct nf_conntrack *nl_prepare_create_conntrack(const struct nf_conntrack *orig, int timeout);
 int nl_create_conntrack(struct nfct_handle *h, const struct nf_conntrack *ct, int timeout);
 int nl_update_conntrack(struct nfct_handle *h, const struct nf_conntrack *ct, int timeout);
 int nl_destroy_conntrack(struct nfct_handle *h, const struct nf_conntrack *ct);
@@ -76,6 +76,7 @@ enum {
 	NET_F_ALIVE 	= (1 << 4),
 	NET_F_HELLO	= (1 << 5),
 	NET_F_HELLO_BACK= (1 << 6),
+	NET_F_ACK_DELAYED= (1 << 7),	/* ack sent once the ack delay expired */
 };
 
 enum {
@@ -257,6 +258,11 @@ struct nta_attr_synproxy {
 void ct2msg(const struct nf_conntrack *ct, struct nethdr *n);
 int msg2ct(struct nf_conntrack *ct, struct nethdr *n, size_t remain);
 
+struct nlmsghdr;
+int msg2nl_ct_parse(struct nethdr *net, size_t remain,
+		    const struct netattr *tb[NTA_MAX]);
+struct nlmsghdr *msg2nl_ct(void *buf, const struct netattr *tb[], int type);
+
 enum nta_exp_attr {
 	NTA_EXP_MASTER_IPV4 = 0,	/* struct nfct_attr_grp_ipv4 */
 	NTA_EXP_MASTER_IPV6,		/* struct nfct_attr_grp_ipv6 */
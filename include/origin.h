@@ -10,7 +10,9 @@ enum {
 };
 
 int origin_register(struct nfct_handle *h, int origin_type);
+int origin_register_portid(unsigned int portid, int origin_type);
 int origin_find(const struct nlmsghdr *nlh);
 int origin_unregister(struct nfct_handle *h);
+int origin_unregister_portid(unsigned int portid);
 
 #endif
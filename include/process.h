@@ -1,10 +1,14 @@
 #ifndef _PROCESS_H_
 #define _PROCESS_H_
 
+#include <sys/time.h>
+
 enum process_type {
 	CTD_PROC_ANY,		/* any type */
 	CTD_PROC_FLUSH,		/* flush process */
 	CTD_PROC_COMMIT,	/* commit process */
+	CTD_PROC_DUMP,		/* cache dump process */
+	CTD_PROC_SNAPSHOT,	/* cache snapshot process */
 	CTD_PROC_MAX
 };
 
@@ -16,10 +20,14 @@ struct child_process {
 	int			type;
 	void			(*cb)(void *data);
 	void			*data;
+	struct timeval		start;
 };
 
 int fork_process_new(int type, int flags, void (*cb)(void *data), void *data);
 int fork_process_delete(int pid);
+int fork_process_running(int type);
 void fork_process_dump(int fd);
+struct metrics;
+void fork_process_metrics(struct metrics *m);
 
 #endif
@@ -49,6 +49,8 @@ struct queue *queue_create(const char *name,
 			   int max_objects, unsigned int flags);
 void queue_destroy(struct queue *b);
 void queue_stats_show(int fd);
+struct metrics;
+void queue_metrics(struct metrics *m);
 unsigned int queue_len(const struct queue *b);
 int queue_add(struct queue *b, struct queue_node *n);
 int queue_del(struct queue_node *n);
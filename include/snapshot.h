@@ -0,0 +1,42 @@
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+
+#include <stdint.h>
+
+struct cache;
+
+#define SNAPSHOT_MAGIC		"CTDSNAP"
+#define SNAPSHOT_VERSION	2
+
+/* the internal cache is populated from the kernel table, it is not saved. */
+enum snapshot_section {
+	SNAPSHOT_EXTERNAL,
+	SNAPSHOT_MAX
+};
+
+struct snapshot_hdr {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	hdrlen;
+	int64_t		created;
+	struct {
+		uint64_t	offset;
+		uint64_t	len;
+		uint32_t	count;
+		uint32_t	pad;
+	} section[SNAPSHOT_MAX];
+};
+
+/* followed by a IPCTNL_MSG_CT_NEW message. */
+struct snapshot_record {
+	uint32_t	len;		/* including this header */
+	uint32_t	lastupdate;	/* secs before the snapshot was taken */
+	uint32_t	lifetime;	/* ditto */
+	uint32_t	pad;
+};
+
+int snapshot_save(const char *path, struct cache *external);
+int snapshot_load(const char *path, enum snapshot_section section,
+		  struct cache *c, unsigned int max_age);
+
+#endif
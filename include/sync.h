@@ -6,6 +6,7 @@
 struct nethdr;
 struct cache_object;
 struct fds;
+struct metrics;
 
 struct sync_mode {
 	int internal_cache_flags;
@@ -19,6 +20,7 @@ struct sync_mode {
 	int  (*recv)(const struct nethdr *net);
 	void (*enqueue)(struct cache_object *obj, int type);
 	void (*xmit)(void);
+	void (*metrics)(struct metrics *m);
 };
 
 extern struct sync_mode sync_alarm;
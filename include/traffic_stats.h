@@ -1,10 +1,25 @@
 #ifndef _TRAFFIC_STATS_H_
 #define _TRAFFIC_STATS_H_
 
+#include <stdint.h>
+
 struct nf_conntrack;
+struct metrics;
 
 void update_traffic_stats(struct nf_conntrack *ct);
 
 void dump_traffic_stats(int fd);
 
+/* per-protocol, per-zone, per-mark and per-label accounting tables */
+struct traffic_acct;
+
+struct traffic_acct *traffic_acct_create(int zone, int mark,
+					 uint32_t mark_mask, int labels,
+					 unsigned int max_entries);
+void traffic_acct_destroy(struct traffic_acct *acct);
+void traffic_acct_update(struct traffic_acct *acct,
+			 const struct nf_conntrack *ct);
+void traffic_acct_dump(struct traffic_acct *acct, int fd);
+void traffic_acct_metrics(struct traffic_acct *acct, struct metrics *m);
+
 #endif
@@ -25,11 +25,17 @@
 #include "event.h"
 #include "jhash.h"
 #include "network.h"
+#include "commit.h"
+#include "alarm.h"
+#include "filter.h"
 
 #include <errno.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <libmnl/libmnl.h>
 #include <libnetfilter_conntrack/libnetfilter_conntrack.h>
+#include <arpa/inet.h>
 
 static uint32_t
 cache_hash4_ct(const struct nf_conntrack *ct, const struct hashtable *table)
@@ -113,6 +119,129 @@ static void cache_ct_copy(void *dst, void *src, unsigned int flags)
 	nfct_copy(dst, src, flags);
 }
 
+static int
+cache_ct_dump_addr(const struct nf_conntrack *ct, int attr4, int attr6,
+		   char *buf, size_t size)
+{
+	switch(nfct_get_attr_u8(ct, ATTR_L3PROTO)) {
+	case AF_INET:
+		if (!inet_ntop(AF_INET, nfct_get_attr(ct, attr4), buf, size))
+			return -1;
+		break;
+	case AF_INET6:
+		if (!inet_ntop(AF_INET6, nfct_get_attr(ct, attr6), buf, size))
+			return -1;
+		break;
+	default:
+		return -1;
+	}
+	return 0;
+}
+
+/* one JSON object per line, age is omitted if negative. */
+int cache_ct_dump_json(char *buf, size_t size, const struct nf_conntrack *ct,
+		       long age)
+{
+	char src[INET6_ADDRSTRLEN], dst[INET6_ADDRSTRLEN];
+	char rsrc[INET6_ADDRSTRLEN], rdst[INET6_ADDRSTRLEN];
+	uint8_t l4proto = nfct_get_attr_u8(ct, ATTR_L4PROTO);
+	int len;
+
+	if (cache_ct_dump_addr(ct, ATTR_ORIG_IPV4_SRC, ATTR_ORIG_IPV6_SRC,
+			       src, sizeof(src)) == -1 ||
+	    cache_ct_dump_addr(ct, ATTR_ORIG_IPV4_DST, ATTR_ORIG_IPV6_DST,
+			       dst, sizeof(dst)) == -1 ||
+	    cache_ct_dump_addr(ct, ATTR_REPL_IPV4_SRC, ATTR_REPL_IPV6_SRC,
+			       rsrc, sizeof(rsrc)) == -1 ||
+	    cache_ct_dump_addr(ct, ATTR_REPL_IPV4_DST, ATTR_REPL_IPV6_DST,
+			       rdst, sizeof(rdst)) == -1)
+		return 0;
+
+	len = snprintf(buf, size,
+		       "{\"family\":\"%s\",\"proto\":%u,"
+		       "\"src\":\"%s\",\"dst\":\"%s\"",
+		       nfct_get_attr_u8(ct, ATTR_L3PROTO) == AF_INET ?
+		       "ipv4" : "ipv6", l4proto, src, dst);
+	if (nfct_attr_is_set(ct, ATTR_ORIG_PORT_SRC)) {
+		len += snprintf(buf+len, size-len,
+				",\"sport\":%u,\"dport\":%u",
+				ntohs(nfct_get_attr_u16(ct, ATTR_ORIG_PORT_SRC)),
+				ntohs(nfct_get_attr_u16(ct, ATTR_ORIG_PORT_DST)));
+	}
+	len += snprintf(buf+len, size-len,
+			",\"reply_src\":\"%s\",\"reply_dst\":\"%s\"",
+			rsrc, rdst);
+	if (nfct_attr_is_set(ct, ATTR_REPL_PORT_SRC)) {
+		len += snprintf(buf+len, size-len,
+				",\"reply_sport\":%u,\"reply_dport\":%u",
+				ntohs(nfct_get_attr_u16(ct, ATTR_REPL_PORT_SRC)),
+				ntohs(nfct_get_attr_u16(ct, ATTR_REPL_PORT_DST)));
+	}
+	if (l4proto == IPPROTO_TCP && nfct_attr_is_set(ct, ATTR_TCP_STATE)) {
+		len += snprintf(buf+len, size-len, ",\"state\":\"%s\"",
+			ct_dump_tcp_state_name(nfct_get_attr_u8(ct,
+							ATTR_TCP_STATE)));
+	}
+	if (nfct_attr_is_set(ct, ATTR_STATUS)) {
+		len += snprintf(buf+len, size-len, ",\"status\":%u",
+				nfct_get_attr_u32(ct, ATTR_STATUS));
+	}
+	if (nfct_attr_is_set(ct, ATTR_MARK)) {
+		len += snprintf(buf+len, size-len, ",\"mark\":%u",
+				nfct_get_attr_u32(ct, ATTR_MARK));
+	}
+	if (nfct_attr_is_set(ct, ATTR_ZONE)) {
+		len += snprintf(buf+len, size-len, ",\"zone\":%u",
+				nfct_get_attr_u16(ct, ATTR_ZONE));
+	}
+	if (nfct_attr_is_set(ct, ATTR_ORIG_COUNTER_PACKETS)) {
+		len += snprintf(buf+len, size-len,
+			",\"packets\":%llu,\"bytes\":%llu,"
+			"\"reply_packets\":%llu,\"reply_bytes\":%llu",
+			(unsigned long long)
+			nfct_get_attr_u64(ct, ATTR_ORIG_COUNTER_PACKETS),
+			(unsigned long long)
+			nfct_get_attr_u64(ct, ATTR_ORIG_COUNTER_BYTES),
+			(unsigned long long)
+			nfct_get_attr_u64(ct, ATTR_REPL_COUNTER_PACKETS),
+			(unsigned long long)
+			nfct_get_attr_u64(ct, ATTR_REPL_COUNTER_BYTES));
+	}
+	if (age >= 0)
+		len += snprintf(buf+len, size-len, ",\"age\":%ld", age);
+
+	len += snprintf(buf+len, size-len, "}\n");
+	if (len >= (int)size)
+		return 0;
+
+	return len;
+}
+
+/*
+ * The binary format is a stream of IPCTNL_MSG_CT_NEW messages, the netlink
+ * header provides the length of each record. The buffer must be at least
+ * MNL_SOCKET_BUFFER_SIZE bytes long.
+ */
+int cache_ct_dump_binary(char *buf, const struct nf_conntrack *ct)
+{
+	struct nlmsghdr *nlh;
+	struct nfgenmsg *nfh;
+
+	nlh = mnl_nlmsg_put_header(buf);
+	nlh->nlmsg_type = (NFNL_SUBSYS_CTNETLINK << 8) | IPCTNL_MSG_CT_NEW;
+	nlh->nlmsg_flags = NLM_F_MULTI;
+
+	nfh = mnl_nlmsg_put_extra_header(nlh, sizeof(struct nfgenmsg));
+	nfh->nfgen_family = nfct_get_attr_u8(ct, ATTR_L3PROTO);
+	nfh->version = NFNETLINK_V0;
+	nfh->res_id = 0;
+
+	if (nfct_nlmsg_build(nlh, ct) == -1)
+		return 0;
+
+	return nlh->nlmsg_len;
+}
+
 static int cache_ct_dump_step(void *data1, void *n)
 {
 	char buf[1024];
@@ -135,10 +264,30 @@ static int cache_ct_dump_step(void *data1, void *n)
 	if (CONFIG(flags) & CTD_SYNC_FTFW && obj->status == C_OBJ_DEAD)
 		return 0;
 
+	if (!ct_dump_filter_match(container->filter, obj->ptr))
+		return 0;
+
 	/* do not show cached timeout, this may confuse users */
 	if (nfct_attr_is_set(obj->ptr, ATTR_TIMEOUT))
 		nfct_attr_unset(obj->ptr, ATTR_TIMEOUT);
 
+	switch(container->type) {
+	case CTD_DUMP_JSON:
+		size = cache_ct_dump_json(buf, sizeof(buf), obj->ptr,
+					  time(NULL) - obj->lifetime);
+		if (size == 0)
+			return 0;
+		return cache_dump_output(container, buf, size);
+	case CTD_DUMP_BINARY: {
+		char nlbuf[MNL_SOCKET_BUFFER_SIZE];
+
+		size = cache_ct_dump_binary(nlbuf, obj->ptr);
+		if (size == 0)
+			return 0;
+		return cache_dump_output(container, nlbuf, size);
+	}
+	}
+
 	memset(buf, 0, sizeof(buf));
 	size = nfct_snprintf(buf, 
 			     sizeof(buf), 
@@ -162,91 +311,547 @@ static int cache_ct_dump_step(void *data1, void *n)
 				tm - obj->lifetime);
 	}
 	size += sprintf(buf+size, "\n");
-	if (send(container->fd, buf, size, 0) == -1) {
-		if (errno != EPIPE)
-			return -1;
+
+	return cache_dump_output(container, buf, size);
+}
+
+static int cache_ct_commit_timeout(const struct cache_object *obj)
+{
+	struct nf_conntrack *ct = obj->ptr;
+	int timeout;
+
+	if (CONFIG(commit_timeout))
+		return CONFIG(commit_timeout);
+
+	timeout = time(NULL) - obj->lastupdate;
+	if (timeout < 0) {
+		/* XXX: Arbitrarily set the timer to one minute, how
+		 * can this happen? For example, an adjustment due to
+		 * daylight-saving. Probably other situations can
+		 * trigger this. */
+		timeout = 60;
+	}
+	/* calculate an estimation of the current timeout */
+	timeout = nfct_get_attr_u32(ct, ATTR_TIMEOUT) - timeout;
+	if (timeout < 0) {
+		timeout = 60;
 	}
+	return timeout;
+}
 
+#define COMMIT_ERRNO_MAX	256
+
+static struct {
+	/* entries to be committed in this step */
+	struct commit_item	*items;
+	unsigned int		len, size;
+	/* related entries, committed once all masters are there */
+	struct commit_item	*related;
+	unsigned int		related_len, related_size;
+	unsigned int		related_cur;
+	/* entries that were already committed in the background */
+	unsigned int		skipped;
+	/* failures per errno */
+	uint32_t		errors[COMMIT_ERRNO_MAX];
+} ct_commit;
+
+static int
+commit_item_add(struct commit_item **items, unsigned int *len,
+		unsigned int *size, const struct nf_conntrack *ct, int timeout,
+		int flags, void *data)
+{
+	if (*len == *size) {
+		unsigned int new_size = *size ? *size * 2 : 1024;
+		struct commit_item *new_items;
+
+		new_items = realloc(*items, new_size * sizeof(*new_items));
+		if (new_items == NULL)
+			return -1;
+
+		*items = new_items;
+		*size = new_size;
+	}
+	(*items)[*len].ct = ct;
+	(*items)[*len].timeout = timeout;
+	(*items)[*len].flags = flags;
+	(*items)[*len].err = COMMIT_PENDING;
+	(*items)[*len].data = data;
+	(*len)++;
 	return 0;
 }
 
-static void
-cache_ct_commit_step(struct __commit_container *tmp, struct cache_object *obj)
+/*
+ * Background commit of the external cache for warm standby. New and
+ * updated entries are queued in the dirty list and a rate-limited alarm
+ * commits them into the kernel, so only the entries that are not there
+ * yet need to be committed at failover.
+ */
+#define PRECOMMIT_F_DIRTY	(1 << 0)	/* in the dirty list */
+#define PRECOMMIT_F_COMMITTED	(1 << 1)	/* this version is in kernel */
+#define PRECOMMIT_HZ		10
+
+struct precommit_obj {
+	struct list_head	head;
+	int			flags;
+	long			expires;	/* kernel entry expiration */
+};
+
+static struct {
+	struct cache		*cache;
+	struct alarm_block	alarm;
+	struct list_head	dirty;
+	unsigned int		dirty_len;
+	/* entries deleted via sync messages that are in the kernel */
+	struct commit_item	*stale;
+	unsigned int		stale_len, stale_size;
+	/* entries that are committed in one alarm run */
+	struct commit_item	*items;
+	unsigned int		budget;
+	struct {
+		uint64_t	ok;
+		uint64_t	fail;
+		uint64_t	deleted;
+		uint64_t	busy_usecs;
+	} stats;
+} precommit;
+
+static void precommit_add(struct cache_object *obj, void *data)
 {
-	int ret, retry = 1, timeout;
-	struct nf_conntrack *ct = obj->ptr;
+	struct precommit_obj *p = data;
 
-	if (CONFIG(commit_timeout)) {
-		timeout = CONFIG(commit_timeout);
-	} else {
-		timeout = time(NULL) - obj->lastupdate;
-		if (timeout < 0) {
-			/* XXX: Arbitrarily set the timer to one minute, how
-			 * can this happen? For example, an adjustment due to
-			 * daylight-saving. Probably other situations can
-			 * trigger this. */
-			timeout = 60;
-		}
-		/* calculate an estimation of the current timeout */
-		timeout = nfct_get_attr_u32(ct, ATTR_TIMEOUT) - timeout;
-		if (timeout < 0) {
-			timeout = 60;
-		}
+	p->flags = PRECOMMIT_F_DIRTY;
+	p->expires = 0;
+	list_add_tail(&p->head, &precommit.dirty);
+	precommit.dirty_len++;
+}
+
+static void precommit_update(struct cache_object *obj, void *data)
+{
+	struct precommit_obj *p = data;
+
+	p->flags &= ~PRECOMMIT_F_COMMITTED;
+	if (p->flags & PRECOMMIT_F_DIRTY)
+		return;
+
+	p->flags |= PRECOMMIT_F_DIRTY;
+	list_add_tail(&p->head, &precommit.dirty);
+	precommit.dirty_len++;
+}
+
+static void precommit_destroy(struct cache_object *obj, void *data)
+{
+	struct precommit_obj *p = data;
+
+	if (p->flags & PRECOMMIT_F_DIRTY) {
+		list_del(&p->head);
+		precommit.dirty_len--;
+	}
+	p->flags = 0;
+}
+
+struct cache_extra cache_ct_precommit_extra = {
+	.size		= sizeof(struct precommit_obj),
+	.add		= precommit_add,
+	.update		= precommit_update,
+	.destroy	= precommit_destroy,
+};
+
+/* this version of the entry is in the kernel and it has not expired */
+static int cache_ct_precommit_done(struct cache *c, struct cache_object *obj)
+{
+	struct precommit_obj *p;
+
+	if (precommit.cache != c)
+		return 0;
+
+	p = cache_get_extra(obj);
+	return (p->flags & PRECOMMIT_F_COMMITTED) && p->expires > time_cached();
+}
+
+static void cache_ct_precommit_set(struct cache_object *obj, int timeout)
+{
+	struct precommit_obj *p;
+
+	if (precommit.cache != obj->cache)
+		return;
+
+	p = cache_get_extra(obj);
+	if (p->flags & PRECOMMIT_F_DIRTY) {
+		list_del(&p->head);
+		precommit.dirty_len--;
+	}
+	p->flags = PRECOMMIT_F_COMMITTED;
+	p->expires = time_cached() + timeout;
+}
+
+static void cache_ct_precommit_delete(unsigned int max)
+{
+	unsigned int i, n = max < precommit.stale_len ? max : precommit.stale_len;
+	struct commit_item *items;
+
+	if (n == 0)
+		return;
+
+	/* they all go away, the order does not matter */
+	items = precommit.stale + precommit.stale_len - n;
+	commit_run(items, n);
+
+	for (i = 0; i < n; i++) {
+		if (items[i].err == 0)
+			precommit.stats.deleted++;
+		else
+			precommit.stats.fail++;
+
+		nfct_destroy((struct nf_conntrack *)items[i].ct);
+	}
+	precommit.stale_len -= n;
+}
+
+static void do_precommit_alarm(struct alarm_block *a, void *data)
+{
+	struct precommit_obj *p, *tmp;
+	struct timespec start, stop;
+	unsigned int i, n = 0, budget = precommit.budget;
+
+	add_alarm(a, 0, 1000000 / PRECOMMIT_HZ);
+
+	/* don't get in the way of the commit at failover */
+	if (STATE_SYNC(commit).state != COMMIT_STATE_INACTIVE)
+		return;
+
+	if (precommit.stale_len == 0 && precommit.dirty_len == 0)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	/* deletions go first, the entry may have been created again */
+	if (precommit.stale_len) {
+		n = budget < precommit.stale_len ? budget : precommit.stale_len;
+		cache_ct_precommit_delete(n);
+		budget -= n;
 	}
 
-retry:
-	if (nl_create_conntrack(tmp->h, ct, timeout) == -1) {
-		if (errno == EEXIST && retry == 1) {
-			ret = nl_destroy_conntrack(tmp->h, ct);
-			if (ret == 0 || (ret == -1 && errno == ENOENT)) {
-				if (retry) {
-					retry = 0;
-					goto retry;
-				}
-			}
-			dlog(LOG_ERR, "commit-destroy: %s", strerror(errno));
-			dlog_ct(STATE(log), ct, NFCT_O_PLAIN);
-			tmp->c->stats.commit_fail++;
+	n = 0;
+	list_for_each_entry_safe(p, tmp, &precommit.dirty, head) {
+		struct cache_object *obj;
+
+		if (n >= budget)
+			break;
+
+		obj = (struct cache_object *)
+			((char *)p - precommit.cache->extra_offset);
+
+		precommit.items[n].ct = obj->ptr;
+		precommit.items[n].timeout = cache_ct_commit_timeout(obj);
+		precommit.items[n].flags = 0;
+		precommit.items[n].err = COMMIT_PENDING;
+		precommit.items[n].data = obj;
+		n++;
+
+		/* if it fails, it is committed again at failover */
+		list_del(&p->head);
+		p->flags &= ~PRECOMMIT_F_DIRTY;
+		precommit.dirty_len--;
+	}
+	commit_run(precommit.items, n);
+
+	for (i = 0; i < n; i++) {
+		if (precommit.items[i].err == 0) {
+			cache_ct_precommit_set(precommit.items[i].data,
+					       precommit.items[i].timeout);
+			precommit.stats.ok++;
 		} else {
-			dlog(LOG_ERR, "commit-create: %s", strerror(errno));
-			dlog_ct(STATE(log), ct, NFCT_O_PLAIN);
-			tmp->c->stats.commit_fail++;
+			precommit.stats.fail++;
 		}
-	} else {
-		tmp->c->stats.commit_ok++;
 	}
+
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	precommit.stats.busy_usecs +=
+		(stop.tv_sec - start.tv_sec) * 1000000LL +
+		(stop.tv_nsec - start.tv_nsec) / 1000;
+}
+
+int cache_ct_precommit_init(struct cache *c)
+{
+	precommit.budget = CONFIG(precommit_rate) / PRECOMMIT_HZ;
+	if (precommit.budget == 0)
+		precommit.budget = 1;
+
+	precommit.items = calloc(precommit.budget, sizeof(struct commit_item));
+	if (precommit.items == NULL)
+		return -1;
+
+	if (commit_open(CONFIG(commit_threads)) == -1) {
+		free(precommit.items);
+		return -1;
+	}
+	INIT_LIST_HEAD(&precommit.dirty);
+	precommit.cache = c;
+
+	init_alarm(&precommit.alarm, NULL, do_precommit_alarm);
+	add_alarm(&precommit.alarm, 0, 1000000 / PRECOMMIT_HZ);
+
+	return 0;
+}
+
+static void cache_ct_precommit_drop_stale(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < precommit.stale_len; i++)
+		nfct_destroy((struct nf_conntrack *)precommit.stale[i].ct);
+
+	precommit.stale_len = 0;
 }
 
-static int cache_ct_commit_related(void *data, void *n)
+void cache_ct_precommit_fini(void)
+{
+	if (precommit.cache == NULL)
+		return;
+
+	del_alarm(&precommit.alarm);
+	cache_ct_precommit_drop_stale();
+	free(precommit.stale);
+	free(precommit.items);
+	commit_close();
+	precommit.cache = NULL;
+}
+
+/* entry deleted via sync message, remove it from the kernel too */
+void cache_ct_precommit_del(struct cache_object *obj)
+{
+	struct nf_conntrack *ct;
+
+	if (!cache_ct_precommit_done(obj->cache, obj))
+		return;
+
+	ct = nfct_clone(obj->ptr);
+	if (ct == NULL)
+		return;
+
+	if (commit_item_add(&precommit.stale, &precommit.stale_len,
+			    &precommit.stale_size, ct, 0,
+			    COMMIT_F_DELETE, NULL) == -1)
+		nfct_destroy(ct);
+}
+
+static int precommit_invalidate(void *data, void *n)
 {
 	struct cache_object *obj = n;
+	struct precommit_obj *p = cache_get_extra(obj);
 
-	if (ct_is_related(obj->ptr))
-		cache_ct_commit_step(data, obj);
+	precommit_update(obj, p);
+	return 0;
+}
+
+/* the kernel table has been flushed, everything has to go there again */
+void cache_ct_precommit_invalidate(void)
+{
+	if (precommit.cache == NULL)
+		return;
+
+	cache_ct_precommit_drop_stale();
+	cache_iterate(precommit.cache, NULL, precommit_invalidate);
+}
+
+static int precommit_count(void *data, void *n)
+{
+	struct cache_object *obj = n;
+	unsigned int *committed = data;
+
+	if (cache_ct_precommit_done(obj->cache, obj))
+		(*committed)++;
 
-	/* keep iterating even if we have found errors */
 	return 0;
 }
 
-static int cache_ct_commit_master(void *data, void *n)
+void cache_ct_precommit_stats(int fd)
 {
+	unsigned int committed = 0, pending;
+	unsigned long long rate = 0, msecs = 0;
+	char buf[512];
+	int size;
+
+	if (precommit.cache == NULL)
+		return;
+
+	cache_iterate(precommit.cache, &committed, precommit_count);
+	pending = precommit.cache->stats.active > committed ?
+		  precommit.cache->stats.active - committed : 0;
+
+	/* estimation based on the background commit rate */
+	if (precommit.stats.busy_usecs) {
+		rate = (precommit.stats.ok + precommit.stats.deleted) *
+		       1000000ULL / precommit.stats.busy_usecs;
+	}
+	if (rate)
+		msecs = (pending + precommit.stale_len) * 1000ULL / rate;
+
+	size = sprintf(buf, "background commit:\n"
+			    "entries in kernel:\t\t%12u\n"
+			    "entries to commit:\t\t%12u\n"
+			    "dirty entries:\t\t\t%12u\n"
+			    "pending deletions:\t\t%12u\n"
+			    "committed:\t\t\t%12llu\tfailed:\t%12llu\n"
+			    "deleted:\t\t\t%12llu\n"
+			    "estimated commit time:\t\t%8llu.%03llu secs\n\n",
+			    committed, pending, precommit.dirty_len,
+			    precommit.stale_len,
+			    (unsigned long long)precommit.stats.ok,
+			    (unsigned long long)precommit.stats.fail,
+			    (unsigned long long)precommit.stats.deleted,
+			    msecs / 1000, msecs % 1000);
+
+	send(fd, buf, size, 0);
+}
+
+static int cache_ct_commit_collect(void *data, void *n)
+{
+	struct cache *c = data;
 	struct cache_object *obj = n;
+	struct nf_conntrack *ct;
+	int ret;
 
-	if (ct_is_related(obj->ptr))
+	/* already committed in the background, nothing to do */
+	if (cache_ct_precommit_done(c, obj)) {
+		ct_commit.skipped++;
 		return 0;
+	}
 
-	cache_ct_commit_step(data, obj);
+	/* the master entry has to be there before the related one, these
+	 * are deferred to a side list. Keep a copy, the cache object may
+	 * be gone before we get to it. */
+	if (ct_is_related(obj->ptr)) {
+		ct = nfct_clone(obj->ptr);
+		if (ct == NULL) {
+			ret = -1;
+		} else {
+			ret = commit_item_add(&ct_commit.related,
+					      &ct_commit.related_len,
+					      &ct_commit.related_size, ct,
+					      cache_ct_commit_timeout(obj),
+					      0, NULL);
+			if (ret == -1)
+				nfct_destroy(ct);
+		}
+	} else {
+		ret = commit_item_add(&ct_commit.items, &ct_commit.len,
+				      &ct_commit.size, obj->ptr,
+				      cache_ct_commit_timeout(obj), 0, obj);
+	}
+
+	if (ret == -1) {
+		dlog(LOG_ERR, "commit: %s", strerror(errno));
+		dlog_ct(STATE(log), obj->ptr, NFCT_O_PLAIN);
+		c->stats.commit_fail++;
+		if (errno < COMMIT_ERRNO_MAX)
+			ct_commit.errors[errno]++;
+	}
+	/* keep iterating even if we have found errors */
 	return 0;
 }
 
-static int cache_ct_commit(struct cache *c, struct nfct_handle *h, int clientfd)
+static void
+cache_ct_commit_items(struct cache *c, struct commit_item *items,
+		      unsigned int len)
+{
+	unsigned int i;
+
+	commit_run(items, len);
+
+	for (i = 0; i < len; i++) {
+		int err = items[i].err;
+
+		if (err == 0) {
+			c->stats.commit_ok++;
+			if (items[i].data)
+				cache_ct_precommit_set(items[i].data,
+						       items[i].timeout);
+			continue;
+		}
+		dlog(LOG_ERR, "commit-create: %s", strerror(err));
+		dlog_ct(STATE(log), (struct nf_conntrack *)items[i].ct,
+			NFCT_O_PLAIN);
+		c->stats.commit_fail++;
+		if (err > 0 && err < COMMIT_ERRNO_MAX)
+			ct_commit.errors[err]++;
+	}
+}
+
+static void cache_ct_commit_release(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < ct_commit.related_len; i++)
+		nfct_destroy((struct nf_conntrack *)ct_commit.related[i].ct);
+
+	free(ct_commit.items);
+	free(ct_commit.related);
+	memset(&ct_commit, 0, sizeof(ct_commit));
+	commit_close();
+}
+
+static void cache_ct_commit_report(struct cache *c, int fd)
 {
 	unsigned int commit_ok, commit_fail;
-	struct __commit_container tmp = {
-		.h = h,
-		.c = c,
-	};
 	struct timeval commit_stop, res;
+	unsigned long long usecs, rate = 0;
+	char buf[4096];
+	int size, i;
+
+	/* calculate the time that commit has taken */
+	gettimeofday(&commit_stop, NULL);
+	timersub(&commit_stop, &STATE_SYNC(commit).stats.start, &res);
+	usecs = res.tv_sec * 1000000ULL + res.tv_usec;
+
+	/* calculate new entries committed */
+	commit_ok = c->stats.commit_ok - STATE_SYNC(commit).stats.ok;
+	commit_fail = c->stats.commit_fail - STATE_SYNC(commit).stats.fail;
+	if (usecs)
+		rate = commit_ok * 1000000ULL / usecs;
+
+	/* log results */
+	dlog(LOG_NOTICE, "Committed %u new entries", commit_ok);
+
+	if (commit_fail)
+		dlog(LOG_NOTICE, "%u entries can't be "
+				 "committed", commit_fail);
+
+	dlog(LOG_NOTICE, "commit has taken %lu.%06lu seconds (%llu entries/s)",
+			res.tv_sec, res.tv_usec, rate);
+
+	if (fd == -1)
+		return;
+
+	size = snprintf(buf, sizeof(buf),
+			"committed entries:\t\t%12u\tfailed:\t%12u\n"
+			"commit duration:\t\t%5lu.%06lu secs\n"
+			"commit rate:\t\t\t%12llu entries/s\n",
+			commit_ok, commit_fail, res.tv_sec, res.tv_usec, rate);
+
+	if (precommit.cache == c) {
+		size += snprintf(buf + size, sizeof(buf) - size,
+				 "committed in background:\t%12u\n",
+				 ct_commit.skipped);
+	}
+
+	for (i = 0; i < COMMIT_ERRNO_MAX; i++) {
+		if (ct_commit.errors[i] == 0 || size >= (int)sizeof(buf))
+			continue;
+
+		size += snprintf(buf + size, sizeof(buf) - size,
+				 "commit failures (%s):\t%12u\n",
+				 strerror(i), ct_commit.errors[i]);
+	}
+	if (size > (int)sizeof(buf))
+		size = sizeof(buf);
+
+	send(fd, buf, size, 0);
+}
+
+static int cache_ct_commit(struct cache *c, struct nfct_handle *h, int clientfd)
+{
+	unsigned int steps;
 
 	/* we already have one commit in progress, skip this. The clientfd
 	 * descriptor has to be closed by the caller. */
@@ -259,13 +864,33 @@ static int cache_ct_commit(struct cache *c, struct nfct_handle *h, int clientfd)
 		STATE_SYNC(commit).stats.ok = c->stats.commit_ok;
 		STATE_SYNC(commit).stats.fail = c->stats.commit_fail;
 		STATE_SYNC(commit).clientfd = clientfd;
+		if (commit_open(CONFIG(commit_threads)) == -1) {
+			int err = errno;
+
+			dlog(LOG_ERR, "cannot start commit: %s", strerror(err));
+			/* tell the client, this is not an empty commit */
+			c->stats.commit_fail++;
+			if (err > 0 && err < COMMIT_ERRNO_MAX)
+				ct_commit.errors[err]++;
+			cache_ct_commit_report(c, clientfd);
+			memset(&ct_commit, 0, sizeof(ct_commit));
+			STATE_SYNC(commit).clientfd = -1;
+			return 0;
+		}
+		/* entries deleted after being committed in the background */
+		if (precommit.cache == c)
+			cache_ct_precommit_delete(precommit.stale_len);
 		/* fall through */
 	case COMMIT_STATE_MASTER:
+		/* one single pass, related entries are deferred */
+		ct_commit.len = 0;
 		STATE_SYNC(commit).current =
-			hashtable_iterate_limit(c->h, &tmp,
+			hashtable_iterate_limit(c->h, c,
 						STATE_SYNC(commit).current,
 						CONFIG(general).commit_steps,
-						cache_ct_commit_master);
+						cache_ct_commit_collect);
+		cache_ct_commit_items(c, ct_commit.items, ct_commit.len);
+
 		if (STATE_SYNC(commit).current < CONFIG(hashsize)) {
 			STATE_SYNC(commit).state = COMMIT_STATE_MASTER;
 			/* give it another step as soon as possible */
@@ -276,35 +901,26 @@ static int cache_ct_commit(struct cache *c, struct nfct_handle *h, int clientfd)
 		STATE_SYNC(commit).state = COMMIT_STATE_RELATED;
 		/* fall through */
 	case COMMIT_STATE_RELATED:
-		STATE_SYNC(commit).current =
-			hashtable_iterate_limit(c->h, &tmp,
-						STATE_SYNC(commit).current,
-						CONFIG(general).commit_steps,
-						cache_ct_commit_related);
-		if (STATE_SYNC(commit).current < CONFIG(hashsize)) {
+		steps = ct_commit.related_len - ct_commit.related_cur;
+		if (steps > (unsigned int)CONFIG(general).commit_steps)
+			steps = CONFIG(general).commit_steps;
+
+		cache_ct_commit_items(c, ct_commit.related + ct_commit.related_cur,
+				      steps);
+		ct_commit.related_cur += steps;
+
+		if (ct_commit.related_cur < ct_commit.related_len) {
 			STATE_SYNC(commit).state = COMMIT_STATE_RELATED;
 			/* give it another step as soon as possible */
 			write_evfd(STATE_SYNC(commit).evfd);
 			return 1;
 		}
-		/* calculate the time that commit has taken */
-		gettimeofday(&commit_stop, NULL);
-		timersub(&commit_stop, &STATE_SYNC(commit).stats.start, &res);
-
-		/* calculate new entries committed */
-		commit_ok = c->stats.commit_ok - STATE_SYNC(commit).stats.ok;
-		commit_fail = 
-			c->stats.commit_fail - STATE_SYNC(commit).stats.fail;
-
-		/* log results */
-		dlog(LOG_NOTICE, "Committed %u new entries", commit_ok);
-
-		if (commit_fail)
-			dlog(LOG_NOTICE, "%u entries can't be "
-					 "committed", commit_fail);
+		cache_ct_commit_report(c, STATE_SYNC(commit).clientfd);
+		cache_ct_commit_release();
 
-		dlog(LOG_NOTICE, "commit has taken %lu.%06lu seconds", 
-				res.tv_sec, res.tv_usec);
+		/* the caller closes the client socket */
+		if (clientfd)
+			STATE_SYNC(commit).clientfd = -1;
 
 		/* prepare the state machine for new commits */
 		STATE_SYNC(commit).current = 0;
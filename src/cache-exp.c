@@ -157,12 +157,8 @@ static int cache_exp_dump_step(void *data1, void *n)
 				tm - obj->lifetime);
 	}
 	size += sprintf(buf+size, "\n");
-	if (send(container->fd, buf, size, 0) == -1) {
-		if (errno != EPIPE)
-			return -1;
-	}
 
-	return 0;
+	return cache_dump_output(container, buf, size);
 }
 
 static int cache_exp_commit_step(void *data, void *n)
@@ -22,12 +22,19 @@
 #include "hash.h"
 #include "log.h"
 #include "conntrackd.h"
+#include "fds.h"
+#include "filter.h"
+#include "alarm.h"
+#include "process.h"
+#include "metrics.h"
 
 #include <libnetfilter_conntrack/libnetfilter_conntrack.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <sys/socket.h>
+#include <sys/time.h>
 
 struct cache_feature *cache_feature[CACHE_MAX_FEATURE] = {
 	[TIMER_FEATURE]		= &timer_feature,
@@ -110,12 +117,16 @@ struct cache *cache_create(const char *name, enum cache_type type,
 		return NULL;
 	}
 	c->object_size = size;
+	INIT_LIST_HEAD(&c->dumps);
 
 	return c;
 }
 
+static void cache_dump_stream_abort(struct cache *c);
+
 void cache_destroy(struct cache *c)
 {
+	cache_dump_stream_abort(c);
 	cache_flush(c);
 	hashtable_destroy(c->h);
 	free(c->features);
@@ -316,17 +327,18 @@ void cache_stats(const struct cache *c, int fd)
 
 	size = sprintf(buf, "cache %s:\n"
 			    "current active connections:\t%12u\n"
-			    "connections created:\t\t%12u\tfailed:\t%12u\n"
-			    "connections updated:\t\t%12u\tfailed:\t%12u\n"
-			    "connections destroyed:\t\t%12u\tfailed:\t%12u\n\n",
+			    "connections created:\t\t%12llu\tfailed:\t%12llu\n"
+			    "connections updated:\t\t%12llu\tfailed:\t%12llu\n"
+			    "connections destroyed:\t\t%12llu\tfailed:\t%12llu\n"
+			    "\n",
 			    			 c->name,
 						 c->stats.active,
-			    			 c->stats.add_ok, 
-			    			 c->stats.add_fail,
-						 c->stats.upd_ok,
-						 c->stats.upd_fail,
-						 c->stats.del_ok,
-						 c->stats.del_fail);
+			    (unsigned long long)c->stats.add_ok,
+			    (unsigned long long)c->stats.add_fail,
+			    (unsigned long long)c->stats.upd_ok,
+			    (unsigned long long)c->stats.upd_fail,
+			    (unsigned long long)c->stats.del_ok,
+			    (unsigned long long)c->stats.del_fail);
 	send(fd, buf, size, 0);
 }
 
@@ -338,29 +350,103 @@ void cache_stats_extended(const struct cache *c, int fd)
 	size = snprintf(buf, sizeof(buf),
 			    "cache:%s\tactive objects:\t\t%12u\n"
 			    "\tactive/total entries:\t\t%12u/%12u\n"
-			    "\tcreation OK/failed:\t\t%12u/%12u\n"
-			    "\t\tno memory available:\t%12u\n"
-			    "\t\tno space left in cache:\t%12u\n"
-			    "\tupdate OK/failed:\t\t%12u/%12u\n"
-			    "\t\tentry not found:\t%12u\n"
-			    "\tdeletion created/failed:\t%12u/%12u\n"
-			    "\t\tentry not found:\t%12u\n\n",
+			    "\tcreation OK/failed:\t\t%12llu/%12llu\n"
+			    "\t\tno memory available:\t%12llu\n"
+			    "\t\tno space left in cache:\t%12llu\n"
+			    "\tupdate OK/failed:\t\t%12llu/%12llu\n"
+			    "\t\tentry not found:\t%12llu\n"
+			    "\tdeletion created/failed:\t%12llu/%12llu\n"
+			    "\t\tentry not found:\t%12llu\n\n",
 			    c->name, c->stats.objects,
 			    c->stats.active, hashtable_counter(c->h),
-			    c->stats.add_ok,
-			    c->stats.add_fail,
-			    c->stats.add_fail_enomem,
-			    c->stats.add_fail_enospc,
-			    c->stats.upd_ok,
-			    c->stats.upd_fail,
-			    c->stats.upd_fail_enoent,
-			    c->stats.del_ok,
-			    c->stats.del_fail,
-			    c->stats.del_fail_enoent);
+			    (unsigned long long)c->stats.add_ok,
+			    (unsigned long long)c->stats.add_fail,
+			    (unsigned long long)c->stats.add_fail_enomem,
+			    (unsigned long long)c->stats.add_fail_enospc,
+			    (unsigned long long)c->stats.upd_ok,
+			    (unsigned long long)c->stats.upd_fail,
+			    (unsigned long long)c->stats.upd_fail_enoent,
+			    (unsigned long long)c->stats.del_ok,
+			    (unsigned long long)c->stats.del_fail,
+			    (unsigned long long)c->stats.del_fail_enoent);
 
 	send(fd, buf, size, 0);
 }
 
+#define CACHE_STAT(x)	offsetof(struct cache, stats.x)
+
+static const struct {
+	const char	*name;
+	const char	*help;
+	size_t		offset;
+} cache_metrics_counters[] = {
+	{ "cache_created", "Entries added to the cache",
+	  CACHE_STAT(add_ok) },
+	{ "cache_create_failed", "Entries that could not be added",
+	  CACHE_STAT(add_fail) },
+	{ "cache_create_enomem", "Entries not added for lack of memory",
+	  CACHE_STAT(add_fail_enomem) },
+	{ "cache_create_enospc", "Entries not added for lack of space",
+	  CACHE_STAT(add_fail_enospc) },
+	{ "cache_updated", "Entries updated in the cache",
+	  CACHE_STAT(upd_ok) },
+	{ "cache_update_failed", "Entries that could not be updated",
+	  CACHE_STAT(upd_fail) },
+	{ "cache_update_enoent", "Updates of entries not in the cache",
+	  CACHE_STAT(upd_fail_enoent) },
+	{ "cache_destroyed", "Entries deleted from the cache",
+	  CACHE_STAT(del_ok) },
+	{ "cache_destroy_failed", "Entries that could not be deleted",
+	  CACHE_STAT(del_fail) },
+	{ "cache_destroy_enoent", "Deletions of entries not in the cache",
+	  CACHE_STAT(del_fail_enoent) },
+	{ "cache_committed", "Entries committed to the kernel",
+	  CACHE_STAT(commit_ok) },
+	{ "cache_commit_failed", "Entries that could not be committed",
+	  CACHE_STAT(commit_fail) },
+	{ "cache_flushes", "Times the cache has been flushed",
+	  CACHE_STAT(flush) },
+};
+
+/* samples of one family must be contiguous, hence families go first. */
+void cache_metrics(struct cache **caches, int num, struct metrics *m)
+{
+	unsigned int i;
+	int j;
+
+	metrics_family(m, "cache_objects", METRICS_GAUGE,
+		       "Objects allocated by the cache");
+	for (j = 0; j < num; j++)
+		metrics_sample(m, caches[j]->stats.objects,
+			       "cache=\"%s\"", caches[j]->name);
+
+	metrics_family(m, "cache_active_entries", METRICS_GAUGE,
+		       "Entries that are alive in the cache");
+	for (j = 0; j < num; j++)
+		metrics_sample(m, caches[j]->stats.active,
+			       "cache=\"%s\"", caches[j]->name);
+
+	metrics_family(m, "cache_entries", METRICS_GAUGE,
+		       "Entries in the cache, including dead ones");
+	for (j = 0; j < num; j++)
+		metrics_sample(m, hashtable_counter(caches[j]->h),
+			       "cache=\"%s\"", caches[j]->name);
+
+	for (i = 0; i < sizeof(cache_metrics_counters) /
+			sizeof(cache_metrics_counters[0]); i++) {
+		metrics_family(m, cache_metrics_counters[i].name,
+			       METRICS_COUNTER, cache_metrics_counters[i].help);
+
+		for (j = 0; j < num; j++) {
+			const char *base = (const char *)caches[j];
+
+			metrics_sample(m, *(const uint64_t *)(base +
+					cache_metrics_counters[i].offset),
+				       "cache=\"%s\"", caches[j]->name);
+		}
+	}
+}
+
 void cache_iterate(struct cache *c, 
 		   void *data, 
 		   int (*iterate)(void *data1, void *data2))
@@ -375,15 +461,374 @@ void cache_iterate_limit(struct cache *c, void *data,
 	hashtable_iterate_limit(c->h, data, from, steps, iterate);
 }
 
-void cache_dump(struct cache *c, int fd, int type)
+static void __cache_dump(struct cache *c, int fd, int type,
+			 const struct ct_dump_filter *filter)
 {
 	struct __dump_container tmp = {
 		.fd	= fd,
-		.type	= type
+		.type	= type,
+		.filter	= filter,
 	};
 	hashtable_iterate(c->h, (void *) &tmp, c->ops->dump_step);
 }
 
+void cache_dump(struct cache *c, int fd, int type)
+{
+	__cache_dump(c, fd, type, NULL);
+}
+
+int cache_dump_output(struct __dump_container *container,
+		      const char *buf, int size)
+{
+	size_t len;
+	char *tmp;
+
+	/* blocking dump, send it straight to the client. */
+	if (container->size == 0) {
+		if (send(container->fd, buf, size, 0) == -1) {
+			if (errno != EPIPE)
+				return -1;
+		}
+		return 0;
+	}
+	if (container->len + size > container->size) {
+		len = container->size * 2;
+		if (len < container->len + size)
+			len = container->len + size;
+
+		tmp = realloc(container->buf, len);
+		if (tmp == NULL)
+			return -1;
+
+		container->buf = tmp;
+		container->size = len;
+	}
+	memcpy(container->buf + container->len, buf, size);
+	container->len += size;
+	STATE(stats).dump_entries++;
+	return 0;
+}
+
+/*
+ * Streaming dumps: instead of walking over the whole table in one go, we
+ * fill the output buffer with a range of buckets every time the client
+ * socket is writable. Only the bucket cursor is kept between rounds, so
+ * entries that are added or removed meanwhile are safe to deal with.
+ */
+#define CACHE_DUMP_BUFSIZ	65536
+#define CACHE_DUMP_BUCKETS	64
+
+struct cache_dump {
+	struct list_head	head;
+	struct list_head	all;		/* see cache_dump_close_clients */
+	struct cache		*c;
+	struct __dump_container	container;
+	struct ct_dump_filter	filter;
+	uint32_t		bucket;
+	size_t			off;
+	/* kernel dump, no cache, see cache_dump_kernel(). */
+	void			(*dump)(int fd, int type,
+					const struct ct_dump_filter *filter);
+};
+
+/* streaming and queued dumps, their client sockets are still open. */
+static LIST_HEAD(cache_dump_all);
+
+static void cache_dump_free(struct cache_dump *d)
+{
+	list_del(&d->all);
+	free(d->container.buf);
+	free(d);
+}
+
+static void cache_dump_stream_end(struct cache_dump *d)
+{
+	unregister_fd(d->container.fd, STATE(fds));
+	close(d->container.fd);
+	list_del(&d->head);
+	cache_dump_free(d);
+}
+
+/*
+ * Child processes inherit the client sockets of the other dumps, the
+ * clients would not see the end of their dump until the child exits.
+ */
+void cache_dump_close_clients(int keep)
+{
+	struct cache_dump *d;
+
+	list_for_each_entry(d, &cache_dump_all, all) {
+		if (d->container.fd != keep)
+			close(d->container.fd);
+	}
+}
+
+/* dumps waiting for a free child process, see DumpChildren. */
+static LIST_HEAD(cache_dump_queue);
+static struct alarm_block cache_dump_alarm;
+static unsigned int cache_dump_children;
+
+static void cache_dump_stream_abort(struct cache *c)
+{
+	struct cache_dump *d, *tmp;
+
+	list_for_each_entry_safe(d, tmp, &c->dumps, head) {
+		STATE(stats).dump_aborted++;
+		cache_dump_stream_end(d);
+	}
+	list_for_each_entry_safe(d, tmp, &cache_dump_queue, head) {
+		if (d->c != c)
+			continue;
+
+		STATE(stats).dump_aborted++;
+		cache_dump_stream_end(d);
+	}
+}
+
+static void cache_dump_stream_cb(void *data)
+{
+	struct cache_dump *d = data;
+	struct __dump_container *container = &d->container;
+	uint32_t hashsize = d->c->h->hashsize;
+	struct timeval start, stop;
+	ssize_t ret;
+	int done = 0;
+
+	gettimeofday(&start, NULL);
+
+	if (d->off == container->len) {
+		d->off = container->len = 0;
+
+		while (container->len < CACHE_DUMP_BUFSIZ &&
+		       d->bucket < hashsize) {
+			ret = hashtable_iterate_limit(d->c->h, container,
+						      d->bucket,
+						      CACHE_DUMP_BUCKETS,
+						      d->c->ops->dump_step);
+			if (ret == -1) {
+				STATE(stats).dump_aborted++;
+				done = 1;
+				goto out;
+			}
+			d->bucket = ret;
+		}
+	}
+	if (d->off < container->len) {
+		ret = send(container->fd, container->buf + d->off,
+			   container->len - d->off, MSG_DONTWAIT);
+		if (ret == -1) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK &&
+			    errno != EINTR) {
+				/* client is gone, eg. EPIPE. */
+				STATE(stats).dump_aborted++;
+				done = 1;
+			}
+			goto out;
+		}
+		d->off += ret;
+		STATE(stats).dump_bytes += ret;
+	}
+	if (d->off == container->len && d->bucket >= hashsize)
+		done = 1;
+out:
+	gettimeofday(&stop, NULL);
+	STATE(stats).dump_usecs += (stop.tv_sec - start.tv_sec) * 1000000 +
+				   (stop.tv_usec - start.tv_usec);
+	if (done)
+		cache_dump_stream_end(d);
+}
+
+static int cache_dump_stream_start(struct cache_dump *d)
+{
+	if (register_write_fd(d->container.fd, cache_dump_stream_cb, d,
+			      STATE(fds)) == -1)
+		return -1;
+
+	list_add_tail(&d->head, &d->c->dumps);
+	STATE(stats).dump_streams++;
+	return 0;
+}
+
+/* the kernel dumps are blocking, they always take a child process. */
+static unsigned int cache_dump_children_max(void)
+{
+	return CONFIG(dump_children) ? CONFIG(dump_children) : 1;
+}
+
+static void cache_dump_child_done(void *data)
+{
+	cache_dump_children--;
+	if (!list_empty(&cache_dump_queue))
+		add_alarm(&cache_dump_alarm, 0, 0);
+}
+
+/*
+ * The child process works on a copy-on-write snapshot of the cache, so it
+ * can use a plain blocking dump and the main loop is left alone.
+ */
+static int cache_dump_fork(struct cache_dump *d)
+{
+	int pid;
+
+	pid = fork_process_new(CTD_PROC_DUMP, 0, cache_dump_child_done, NULL);
+	if (pid == -1)
+		return -1;
+
+	if (pid == 0) {
+		cache_dump_close_clients(d->container.fd);
+		if (d->dump)
+			d->dump(d->container.fd, d->container.type,
+				d->container.filter);
+		else
+			__cache_dump(d->c, d->container.fd, d->container.type,
+				     d->container.filter);
+		exit(EXIT_SUCCESS);
+	}
+	cache_dump_children++;
+	STATE(stats).dump_forked++;
+
+	close(d->container.fd);
+	cache_dump_free(d);
+	return 0;
+}
+
+static void do_cache_dump_alarm(struct alarm_block *a, void *data)
+{
+	struct cache_dump *d;
+
+	while (cache_dump_children < cache_dump_children_max() &&
+	       !list_empty(&cache_dump_queue)) {
+		d = list_entry(cache_dump_queue.next, struct cache_dump, head);
+		list_del(&d->head);
+
+		if (cache_dump_fork(d) == 0)
+			continue;
+
+		dlog(LOG_WARNING, "cannot fork dump process: %s",
+		     strerror(errno));
+
+		/* cannot fork, dump it from here. */
+		if (d->dump) {
+			d->dump(d->container.fd, d->container.type,
+				d->container.filter);
+			close(d->container.fd);
+			cache_dump_free(d);
+		} else if (cache_dump_stream_start(d) == -1) {
+			STATE(stats).dump_aborted++;
+			close(d->container.fd);
+			cache_dump_free(d);
+		}
+	}
+}
+
+static int cache_dump_child(struct cache_dump *d)
+{
+	static int alarm_init;
+
+	if (!alarm_init) {
+		init_alarm(&cache_dump_alarm, NULL, do_cache_dump_alarm);
+		alarm_init = 1;
+	}
+	if (cache_dump_children < cache_dump_children_max())
+		return cache_dump_fork(d);
+
+	list_add_tail(&d->head, &cache_dump_queue);
+	STATE(stats).dump_queued++;
+	return 0;
+}
+
+void cache_dump_stream(struct cache *c, int fd, int type,
+		       const struct ct_dump_filter *filter)
+{
+	struct cache_dump *d;
+
+	d = calloc(1, sizeof(struct cache_dump));
+	if (d == NULL)
+		goto err;
+
+	d->container.buf = malloc(CACHE_DUMP_BUFSIZ);
+	if (d->container.buf == NULL)
+		goto err_free;
+
+	d->container.size = CACHE_DUMP_BUFSIZ;
+	d->container.type = type;
+	d->c = c;
+
+	if (filter != NULL) {
+		d->filter = *filter;
+		d->container.filter = &d->filter;
+	}
+
+	/* the local server closes the client socket once we return. */
+	d->container.fd = dup(fd);
+	if (d->container.fd == -1)
+		goto err_buf;
+
+	list_add_tail(&d->all, &cache_dump_all);
+
+	if (CONFIG(dump_children) && cache_dump_child(d) == 0)
+		return;
+
+	if (cache_dump_stream_start(d) == -1)
+		goto err_close;
+
+	return;
+
+err_close:
+	list_del(&d->all);
+	close(d->container.fd);
+err_buf:
+	free(d->container.buf);
+err_free:
+	free(d);
+err:
+	dlog(LOG_WARNING, "cannot stream dump, fallback to blocking dump");
+	__cache_dump(c, fd, type, filter);
+}
+
+/*
+ * Dumps that do not come from a cache, ie. the kernel table dumps of the
+ * bypass mode. They share the child processes of the cache dumps, so they
+ * are bounded by DumpChildren, or run one at a time if it is not set.
+ */
+void cache_dump_kernel(int fd, int type, const struct ct_dump_filter *filter,
+		       void (*dump)(int fd, int type,
+				    const struct ct_dump_filter *filter))
+{
+	struct cache_dump *d;
+
+	d = calloc(1, sizeof(struct cache_dump));
+	if (d == NULL)
+		goto err;
+
+	d->container.type = type;
+	d->dump = dump;
+
+	if (filter != NULL) {
+		d->filter = *filter;
+		d->container.filter = &d->filter;
+	}
+
+	/* the local server closes the client socket once we return. */
+	d->container.fd = dup(fd);
+	if (d->container.fd == -1)
+		goto err_free;
+
+	list_add_tail(&d->all, &cache_dump_all);
+
+	if (cache_dump_child(d) == 0)
+		return;
+
+	list_del(&d->all);
+	close(d->container.fd);
+err_free:
+	free(d);
+err:
+	dlog(LOG_WARNING, "cannot fork dump process, fallback to blocking "
+			  "dump");
+	dump(fd, type, filter);
+}
+
 int cache_commit(struct cache *c, struct nfct_handle *h, int clientfd)
 {
 	return c->ops->commit(c, h, clientfd);
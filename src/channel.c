@@ -297,6 +297,12 @@ void channel_stats_extended(struct channel *c, int active,
 	return c->ops->stats_extended(c, active, h, fd);
 }
 
+void channel_counters(struct channel *c, struct channel_counters *tx,
+		      struct channel_counters *rx)
+{
+	c->ops->counters(c, tx, rx);
+}
+
 int channel_accept_isset(struct channel *c, fd_set *readfds)
 {
 	return c->ops->accept_isset(c, readfds);
@@ -125,6 +125,20 @@ channel_mcast_accept_isset(struct channel *c, fd_set *readfds)
 	return 0;
 }
 
+static void
+channel_mcast_counters(struct channel *c, struct channel_counters *tx,
+		       struct channel_counters *rx)
+{
+	struct mcast_channel *m = c->data;
+
+	tx->bytes = m->client->stats.bytes;
+	tx->messages = m->client->stats.messages;
+	tx->error = m->client->stats.error;
+	rx->bytes = m->server->stats.bytes;
+	rx->messages = m->server->stats.messages;
+	rx->error = m->server->stats.error;
+}
+
 struct channel_ops channel_mcast = {
 	.headersiz	= 28, /* IP header (20 bytes) + UDP header 8 (bytes) */
 	.open		= channel_mcast_open,
@@ -136,4 +150,5 @@ struct channel_ops channel_mcast = {
 	.accept_isset	= channel_mcast_accept_isset,
 	.stats		= channel_mcast_stats,
 	.stats_extended = channel_mcast_stats_extended,
+	.counters	= channel_mcast_counters,
 };
@@ -135,6 +135,20 @@ channel_tcp_accept(struct channel *c)
 	return tcp_accept(m->server);
 }
 
+static void
+channel_tcp_counters(struct channel *c, struct channel_counters *tx,
+		     struct channel_counters *rx)
+{
+	struct tcp_channel *m = c->data;
+
+	tx->bytes = m->client->stats.bytes;
+	tx->messages = m->client->stats.messages;
+	tx->error = m->client->stats.error;
+	rx->bytes = m->server->stats.bytes;
+	rx->messages = m->server->stats.messages;
+	rx->error = m->server->stats.error;
+}
+
 struct channel_ops channel_tcp = {
 	.headersiz	= 40, /* IP header (20 bytes) + TCP header 20 (bytes) */
 	.type		= CHANNEL_T_STREAM,
@@ -148,4 +162,5 @@ struct channel_ops channel_tcp = {
 	.accept_isset	= channel_tcp_accept_isset,
 	.stats		= channel_tcp_stats,
 	.stats_extended = channel_tcp_stats_extended,
+	.counters	= channel_tcp_counters,
 };
@@ -125,6 +125,20 @@ channel_udp_accept_isset(struct channel *c, fd_set *readfds)
 	return 0;
 }
 
+static void
+channel_udp_counters(struct channel *c, struct channel_counters *tx,
+		     struct channel_counters *rx)
+{
+	struct udp_channel *m = c->data;
+
+	tx->bytes = m->client->stats.bytes;
+	tx->messages = m->client->stats.messages;
+	tx->error = m->client->stats.error;
+	rx->bytes = m->server->stats.bytes;
+	rx->messages = m->server->stats.messages;
+	rx->error = m->server->stats.error;
+}
+
 struct channel_ops channel_udp = {
 	.headersiz	= 28, /* IP header (20 bytes) + UDP header 8 (bytes) */
 	.open		= channel_udp_open,
@@ -136,4 +150,5 @@ struct channel_ops channel_udp = {
 	.accept_isset	= channel_udp_accept_isset,
 	.stats		= channel_udp_stats,
 	.stats_extended = channel_udp_stats_extended,
+	.counters	= channel_udp_counters,
 };
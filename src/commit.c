@@ -0,0 +1,328 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Batched commit of conntrack entries into the kernel. Requests are sent
+ * in batches of netlink messages, the kernel processes them from the
+ * sendmsg() call itself and acknowledges each of them. Thus, several
+ * sockets only help if each one is driven by its own thread.
+ */
+#include "conntrackd.h"
+#include "commit.h"
+#include "netlink.h"
+#include "origin.h"
+#include "log.h"
+
+#include <libmnl/libmnl.h>
+#include <libnetfilter_conntrack/libnetfilter_conntrack.h>
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef SO_RCVBUFFORCE
+#define SO_RCVBUFFORCE 33
+#endif
+
+#ifndef NETLINK_CAP_ACK
+#define NETLINK_CAP_ACK 10
+#endif
+
+#define COMMIT_BATCH_SIZE	65536
+#define COMMIT_MSG_MAX		8192	/* largest request we may build */
+#define COMMIT_RCVBUF		(4 * 1024 * 1024)
+
+struct commit_worker {
+	pthread_t		thread;
+	struct mnl_socket	*nl;
+	char			buf[COMMIT_BATCH_SIZE + COMMIT_MSG_MAX];
+	struct commit_item	*items;
+	unsigned int		n;
+};
+
+static struct commit_worker *workers;
+static unsigned int nworkers;
+static unsigned int users;
+
+enum {
+	COMMIT_ROUND_CREATE,	/* create entries */
+	COMMIT_ROUND_DELETE,	/* delete entries that already exist ... */
+	COMMIT_ROUND_RETRY,	/* ... and create them again */
+};
+
+static int commit_worker_todo(const struct commit_item *item, int round)
+{
+	switch (round) {
+	case COMMIT_ROUND_CREATE:
+		return item->err == COMMIT_PENDING &&
+		       !(item->flags & COMMIT_F_DELETE);
+	case COMMIT_ROUND_DELETE:
+		if (item->flags & COMMIT_F_DELETE)
+			return item->err == COMMIT_PENDING;
+		return item->err == EEXIST;
+	case COMMIT_ROUND_RETRY:
+		return item->err == COMMIT_RETRY;
+	}
+	return 0;
+}
+
+static int commit_worker_build(void *buf, struct commit_item *item,
+			       uint32_t seq, int round)
+{
+	struct nf_conntrack *ct = NULL;
+	struct nlmsghdr *nlh;
+	struct nfgenmsg *nfh;
+
+	nlh = mnl_nlmsg_put_header(buf);
+	nlh->nlmsg_seq = seq;
+
+	if (round == COMMIT_ROUND_DELETE) {
+		nlh->nlmsg_type = (NFNL_SUBSYS_CTNETLINK << 8) |
+				  IPCTNL_MSG_CT_DELETE;
+		nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+	} else {
+		ct = nl_prepare_create_conntrack(item->ct, item->timeout);
+		if (ct == NULL)
+			return -1;
+
+		nlh->nlmsg_type = (NFNL_SUBSYS_CTNETLINK << 8) |
+				  IPCTNL_MSG_CT_NEW;
+		nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_CREATE |
+				   NLM_F_EXCL | NLM_F_ACK;
+	}
+
+	nfh = mnl_nlmsg_put_extra_header(nlh, sizeof(struct nfgenmsg));
+	nfh->nfgen_family = nfct_get_attr_u8(item->ct, ATTR_L3PROTO);
+	nfh->version = NFNETLINK_V0;
+	nfh->res_id = 0;
+
+	nfct_nlmsg_build(nlh, ct ? ct : item->ct);
+	if (ct)
+		nfct_destroy(ct);
+
+	return 0;
+}
+
+static void commit_worker_ack(struct commit_worker *w,
+			      const struct nlmsghdr *nlh, int round)
+{
+	const struct nlmsgerr *err;
+	struct commit_item *item;
+
+	if (nlh->nlmsg_type != NLMSG_ERROR ||
+	    nlh->nlmsg_len < mnl_nlmsg_size(sizeof(struct nlmsgerr)) ||
+	    nlh->nlmsg_seq >= w->n)
+		return;
+
+	err = mnl_nlmsg_get_payload(nlh);
+	item = &w->items[nlh->nlmsg_seq];
+
+	if (round != COMMIT_ROUND_DELETE ||
+	    (err->error != 0 && err->error != -ENOENT))
+		item->err = -err->error;
+	else if (item->flags & COMMIT_F_DELETE)
+		item->err = 0;
+	else
+		item->err = COMMIT_RETRY;
+}
+
+static void commit_worker_send(struct commit_worker *w,
+			       struct mnl_nlmsg_batch *b,
+			       unsigned int from, unsigned int to, int round)
+{
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+	unsigned int i;
+	int ret;
+
+	if (mnl_socket_sendto(w->nl, mnl_nlmsg_batch_head(b),
+			      mnl_nlmsg_batch_size(b)) < 0) {
+		ret = errno;
+		for (i = from; i < to; i++) {
+			if (commit_worker_todo(&w->items[i], round))
+				w->items[i].err = ret;
+		}
+		return;
+	}
+
+	/* acknowledgments are already there once sendmsg() returns */
+	while ((ret = mnl_socket_recvfrom(w->nl, buf, sizeof(buf))) > 0 ||
+	       errno == ENOBUFS) {
+		const struct nlmsghdr *nlh = (const struct nlmsghdr *)buf;
+
+		while (ret > 0 && mnl_nlmsg_ok(nlh, ret)) {
+			commit_worker_ack(w, nlh, round);
+			nlh = mnl_nlmsg_next(nlh, &ret);
+		}
+	}
+
+	/* acknowledgment lost due to receiver overrun */
+	for (i = from; i < to; i++) {
+		if (commit_worker_todo(&w->items[i], round))
+			w->items[i].err = ENOBUFS;
+	}
+}
+
+static void commit_worker_round(struct commit_worker *w, int round)
+{
+	struct mnl_nlmsg_batch *b;
+	unsigned int i, from = 0;
+
+	b = mnl_nlmsg_batch_start(w->buf, COMMIT_BATCH_SIZE);
+	if (b == NULL)
+		return;
+
+	for (i = 0; i < w->n; i++) {
+		if (!commit_worker_todo(&w->items[i], round))
+			continue;
+
+		if (commit_worker_build(mnl_nlmsg_batch_current(b),
+					&w->items[i], i, round) == -1) {
+			w->items[i].err = errno;
+			continue;
+		}
+		/* batch is full, the last message goes in the next one */
+		if (!mnl_nlmsg_batch_next(b)) {
+			commit_worker_send(w, b, from, i, round);
+			mnl_nlmsg_batch_reset(b);
+			from = i;
+		}
+	}
+	if (!mnl_nlmsg_batch_is_empty(b))
+		commit_worker_send(w, b, from, w->n, round);
+
+	mnl_nlmsg_batch_stop(b);
+}
+
+static void *commit_worker_run(void *data)
+{
+	struct commit_worker *w = data;
+
+	commit_worker_round(w, COMMIT_ROUND_CREATE);
+	commit_worker_round(w, COMMIT_ROUND_DELETE);
+	commit_worker_round(w, COMMIT_ROUND_RETRY);
+
+	return NULL;
+}
+
+void commit_run(struct commit_item *items, unsigned int n)
+{
+	unsigned int i, chunk = (n + nworkers - 1) / nworkers;
+	int ret;
+
+	for (i = 0; i < nworkers; i++) {
+		struct commit_worker *w = &workers[i];
+		unsigned int from = i * chunk;
+
+		w->items = items + from;
+		w->n = from < n ? (n - from < chunk ? n - from : chunk) : 0;
+
+		/* the first worker runs in the main thread */
+		if (i == 0 || w->n == 0)
+			continue;
+
+		ret = pthread_create(&w->thread, NULL, commit_worker_run, w);
+		if (ret != 0) {
+			dlog(LOG_WARNING, "can't create commit thread: %s",
+			     strerror(ret));
+			commit_worker_run(w);
+			w->n = 0;
+		}
+	}
+
+	commit_worker_run(&workers[0]);
+
+	for (i = 1; i < nworkers; i++) {
+		if (workers[i].n)
+			pthread_join(workers[i].thread, NULL);
+	}
+}
+
+int commit_open(unsigned int num)
+{
+	int on = 1, rcvbuf = COMMIT_RCVBUF, err;
+	unsigned int i;
+
+	/* sockets are shared with the users that are already there */
+	if (users++ > 0)
+		return 0;
+
+	if (num == 0)
+		num = 1;
+
+	workers = calloc(num, sizeof(struct commit_worker));
+	if (workers == NULL) {
+		users = 0;
+		return -1;
+	}
+
+	for (nworkers = 0; nworkers < num; nworkers++) {
+		struct commit_worker *w = &workers[nworkers];
+		int fd;
+
+		w->nl = mnl_socket_open(NETLINK_NETFILTER);
+		if (w->nl == NULL)
+			goto err;
+
+		if (mnl_socket_bind(w->nl, 0, MNL_SOCKET_AUTOPID) < 0) {
+			mnl_socket_close(w->nl);
+			goto err;
+		}
+		fd = mnl_socket_get_fd(w->nl);
+		fcntl(fd, F_SETFL, O_NONBLOCK);
+
+		/* acknowledgments do not include the original request */
+		mnl_socket_setsockopt(w->nl, NETLINK_CAP_ACK, &on, sizeof(on));
+
+		/* room for the acknowledgments of one batch */
+		if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE,
+			       &rcvbuf, sizeof(rcvbuf)) == -1)
+			setsockopt(fd, SOL_SOCKET, SO_RCVBUF,
+				   &rcvbuf, sizeof(rcvbuf));
+
+		origin_register_portid(mnl_socket_get_portid(w->nl),
+				       CTD_ORIGIN_COMMIT);
+	}
+	return 0;
+err:
+	err = errno;
+	dlog(LOG_ERR, "can't open netlink handler to commit: %s",
+	     strerror(err));
+	for (i = 0; i < nworkers; i++) {
+		origin_unregister_portid(mnl_socket_get_portid(workers[i].nl));
+		mnl_socket_close(workers[i].nl);
+	}
+	free(workers);
+	workers = NULL;
+	nworkers = 0;
+	users = 0;
+	errno = err;
+	return -1;
+}
+
+void commit_close(void)
+{
+	unsigned int i;
+
+	if (users == 0 || --users > 0)
+		return;
+
+	for (i = 0; i < nworkers; i++) {
+		origin_unregister_portid(mnl_socket_get_portid(workers[i].nl));
+		mnl_socket_close(workers[i].nl);
+	}
+	free(workers);
+	workers = NULL;
+	nworkers = 0;
+}
@@ -38,7 +38,9 @@
  * Part of this code has been funded by Sophos Astaro <http://www.sophos.com>
  */
 
+#define _GNU_SOURCE
 #include "conntrack.h"
+#include "jhash.h"
 
 #include <stdio.h>
 #include <assert.h>
@@ -64,9 +66,14 @@
 #include <netdb.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <pthread.h>
 #include <libmnl/libmnl.h>
 #include <linux/netfilter/nf_conntrack_common.h>
 #include <libnetfilter_conntrack/libnetfilter_conntrack.h>
+#include <libnetfilter_conntrack/libnetfilter_conntrack_tcp.h>
 
 struct nfct_mnl_socket {
 	struct mnl_socket	*mnl;
@@ -119,6 +126,7 @@ struct ct_cmd {
 	int		family;
 	int		protonum;
 	size_t		socketbuffersize;
+	unsigned int	lineno;		/* in the --load-file file */
 	struct ct_tmpl	tmpl;
 };
 
@@ -247,6 +255,12 @@ enum ct_options {
 
 	CT_OPT_REPL_ZONE_BIT	= 28,
 	CT_OPT_REPL_ZONE	= (1 << CT_OPT_REPL_ZONE_BIT),
+
+	CT_OPT_GROUP_BY_BIT	= 29,
+	CT_OPT_GROUP_BY		= (1 << CT_OPT_GROUP_BY_BIT),
+
+	CT_OPT_SPLIT_BIT	= 30,
+	CT_OPT_SPLIT		= (1 << CT_OPT_SPLIT_BIT),
 };
 /* If you add a new option, you have to update NUMBER_OF_OPT in conntrack.h */
 
@@ -286,6 +300,8 @@ static const char *optflags[NUMBER_OF_OPT] = {
 	[CT_OPT_DEL_LABEL_BIT]	= "label-del",
 	[CT_OPT_ORIG_ZONE_BIT]	= "orig-zone",
 	[CT_OPT_REPL_ZONE_BIT]	= "reply-zone",
+	[CT_OPT_GROUP_BY_BIT]	= "group-by",
+	[CT_OPT_SPLIT_BIT]	= "split",
 };
 
 static struct option original_opts[] = {
@@ -332,12 +348,17 @@ static struct option original_opts[] = {
 	{"label-del", 2, 0, '>'},
 	{"orig-zone", 1, 0, '('},
 	{"reply-zone", 1, 0, ')'},
+	{"group-by", 1, 0, '*'},
+	{"top", 1, 0, '#'},
+	{"split", 1, 0, '&'},
+	{"ordered", 0, 0, '@'},
+	{"watch", 1, 0, '~'},
 	{0, 0, 0, 0}
 };
 
 static const char *getopt_str = ":L::I::U::D::G::E::F::A::hVs:d:r:q:"
 				"p:t:u:e:a:z[:]:{:}:m:i:f:o:n::"
-				"g::c:b:C::Sj::w:l:<:>::(:):";
+				"g::c:b:C::Sj::w:l:<:>::(:):*:#:&:@~:";
 
 /* Table of legal combinations of commands and options.  If any of the
  * given commands make an option legal, that option is legal (applies to
@@ -352,27 +373,27 @@ static const char *getopt_str = ":L::I::U::D::G::E::F::A::hVs:d:r:q:"
 static char commands_v_options[NUMBER_OF_CMD][NUMBER_OF_OPT] =
 /* Well, it's better than "Re: Linux vs FreeBSD" */
 {
-			/* s d r q p t u z e [ ] { } a m i f n g o c b j w l < > ( ) */
-	[CT_LIST_BIT]	= {2,2,2,2,2,0,2,2,0,0,0,2,2,0,2,0,2,2,2,2,2,0,2,2,2,0,0,2,2},
-	[CT_CREATE_BIT]	= {3,3,3,3,1,1,2,0,0,0,0,0,0,2,2,0,0,2,2,0,0,0,0,2,0,2,0,2,2},
-	[CT_UPDATE_BIT]	= {2,2,2,2,2,2,2,0,0,0,0,2,2,0,2,2,2,2,2,2,0,0,0,0,2,2,2,0,0},
-	[CT_DELETE_BIT]	= {2,2,2,2,2,2,2,0,0,0,0,2,2,0,2,2,2,2,2,2,0,0,0,2,2,0,0,2,2},
-	[CT_GET_BIT]	= {3,3,3,3,1,0,0,0,0,0,0,0,0,0,0,2,0,0,0,2,0,0,0,0,2,0,0,0,0},
-	[CT_FLUSH_BIT]	= {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,2,0,0,0,0,0,0,0,0,0,0,0,0},
-	[CT_EVENT_BIT]	= {2,2,2,2,2,0,0,0,2,0,0,2,2,0,2,0,2,2,2,2,2,2,2,2,2,0,0,2,2},
-	[CT_VERSION_BIT]= {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
-	[CT_HELP_BIT]	= {0,0,0,0,2,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
-	[EXP_LIST_BIT]	= {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,2,0,0,2,0,0,0,0,0,0,0,0,0},
-	[EXP_CREATE_BIT]= {1,1,2,2,1,1,2,0,0,1,1,1,1,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
-	[EXP_DELETE_BIT]= {1,1,2,2,1,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
-	[EXP_GET_BIT]	= {1,1,2,2,1,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
-	[EXP_FLUSH_BIT]	= {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
-	[EXP_EVENT_BIT]	= {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,2,0,0,0,0,0,0,0,0,0},
-	[CT_COUNT_BIT]	= {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
-	[EXP_COUNT_BIT]	= {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
-	[CT_STATS_BIT]	= {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
-	[EXP_STATS_BIT]	= {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
-	[CT_ADD_BIT]	= {3,3,3,3,1,1,2,0,0,0,0,0,0,2,2,0,0,2,2,0,0,0,0,2,0,2,0,2,2},
+			/* s d r q p t u z e [ ] { } a m i f n g o c b j w l < > ( ) * & */
+	[CT_LIST_BIT]	= {2,2,2,2,2,0,2,2,0,0,0,2,2,0,2,0,2,2,2,2,2,0,2,2,2,0,0,2,2,2,2},
+	[CT_CREATE_BIT]	= {3,3,3,3,1,1,2,0,0,0,0,0,0,2,2,0,0,2,2,0,0,0,0,2,0,2,0,2,2,0,0},
+	[CT_UPDATE_BIT]	= {2,2,2,2,2,2,2,0,0,0,0,2,2,0,2,2,2,2,2,2,0,0,0,0,2,2,2,0,0,0,0},
+	[CT_DELETE_BIT]	= {2,2,2,2,2,2,2,0,0,0,0,2,2,0,2,2,2,2,2,2,0,0,0,2,2,0,0,2,2,0,2},
+	[CT_GET_BIT]	= {3,3,3,3,1,0,0,0,0,0,0,0,0,0,0,2,0,0,0,2,0,0,0,0,2,0,0,0,0,0,0},
+	[CT_FLUSH_BIT]	= {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,2,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
+	[CT_EVENT_BIT]	= {2,2,2,2,2,0,0,0,2,0,0,2,2,0,2,0,2,2,2,2,2,2,2,2,2,0,0,2,2,0,0},
+	[CT_VERSION_BIT]= {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
+	[CT_HELP_BIT]	= {0,0,0,0,2,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
+	[EXP_LIST_BIT]	= {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,2,0,0,2,0,0,0,0,0,0,0,0,0,0,0},
+	[EXP_CREATE_BIT]= {1,1,2,2,1,1,2,0,0,1,1,1,1,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
+	[EXP_DELETE_BIT]= {1,1,2,2,1,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
+	[EXP_GET_BIT]	= {1,1,2,2,1,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
+	[EXP_FLUSH_BIT]	= {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
+	[EXP_EVENT_BIT]	= {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,2,0,0,0,0,0,0,0,0,0,0,0},
+	[CT_COUNT_BIT]	= {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
+	[EXP_COUNT_BIT]	= {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
+	[CT_STATS_BIT]	= {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
+	[EXP_STATS_BIT]	= {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
+	[CT_ADD_BIT]	= {3,3,3,3,1,1,2,0,0,0,0,0,0,2,2,0,0,2,2,0,0,0,0,2,0,2,0,2,2,0,0},
 };
 
 static const int cmd2type[][2] = {
@@ -519,7 +540,12 @@ static const char usage_conntrack_parameters[] =
 	"  -e, --event-mask eventmask\t\tEvent mask, eg. NEW,DESTROY\n"
 	"  -z, --zero \t\t\t\tZero counters while listing\n"
 	"  -o, --output type[,...]\t\tOutput format, eg. xml\n"
-	"  -l, --label label[,...]\t\tconntrack labels\n";
+	"  -l, --label label[,...]\t\tconntrack labels\n"
+	"  --group-by key[,...]\t\tCount entries per key, eg. src\n"
+	"  --top num\t\t\t\tShow the num largest groups only\n"
+	"  --split family|zone=zone[,...]\tOne dump per family or zone\n"
+	"  --ordered\t\t\t\tDo not mix up the output of --split\n"
+	"  --watch secs\t\t\t\tShow the changes between dumps\n";
 
 static const char usage_expectation_parameters[] =
 	"Expectation parameters and options:\n"
@@ -832,6 +858,169 @@ static int ct_save_snprintf(char *buf, size_t len,
 	return size;
 }
 
+static const char *ct_json_tcp_states[TCP_CONNTRACK_MAX] = {
+	[TCP_CONNTRACK_NONE]		= "NONE",
+	[TCP_CONNTRACK_SYN_SENT]	= "SYN_SENT",
+	[TCP_CONNTRACK_SYN_RECV]	= "SYN_RECV",
+	[TCP_CONNTRACK_ESTABLISHED]	= "ESTABLISHED",
+	[TCP_CONNTRACK_FIN_WAIT]	= "FIN_WAIT",
+	[TCP_CONNTRACK_CLOSE_WAIT]	= "CLOSE_WAIT",
+	[TCP_CONNTRACK_LAST_ACK]	= "LAST_ACK",
+	[TCP_CONNTRACK_TIME_WAIT]	= "TIME_WAIT",
+	[TCP_CONNTRACK_CLOSE]		= "CLOSE",
+	[TCP_CONNTRACK_SYN_SENT2]	= "SYN_SENT2",
+};
+
+static int ct_json_snprintf_addr(char *buf, size_t len, const char *name,
+				 const struct nf_conntrack *ct,
+				 int attr4, int attr6)
+{
+	char addr[INET6_ADDRSTRLEN];
+
+	if (nfct_attr_is_set(ct, attr4)) {
+		if (!inet_ntop(AF_INET, nfct_get_attr(ct, attr4),
+			       addr, sizeof(addr)))
+			return 0;
+	} else if (nfct_attr_is_set(ct, attr6)) {
+		if (!inet_ntop(AF_INET6, nfct_get_attr(ct, attr6),
+			       addr, sizeof(addr)))
+			return 0;
+	} else {
+		return 0;
+	}
+
+	return snprintf(buf, len, ",\"%s\":\"%s\"", name, addr);
+}
+
+static int ct_json_snprintf_ports(char *buf, size_t len, const char *sport,
+				  const char *dport,
+				  const struct nf_conntrack *ct,
+				  int attr_src, int attr_dst)
+{
+	if (!nfct_attr_is_set(ct, attr_src))
+		return 0;
+
+	return snprintf(buf, len, ",\"%s\":%u,\"%s\":%u",
+			sport, ntohs(nfct_get_attr_u16(ct, attr_src)),
+			dport, ntohs(nfct_get_attr_u16(ct, attr_dst)));
+}
+
+/*
+ * One JSON object per entry, the field names are those of the JSON dump of
+ * conntrackd. This does not go through nfct_snprintf(), so the formatting
+ * cost stays small compared to the dump itself.
+ */
+static int ct_json_snprintf(char *buf, size_t len,
+			    const struct nf_conntrack *ct,
+			    enum nf_conntrack_msg_type type)
+{
+	unsigned int size = 0, offset = 0;
+	uint8_t l3proto, l4proto;
+	int ret;
+
+	switch (type) {
+	case NFCT_T_NEW:
+		ret = snprintf(buf + offset, len, "{\"type\":\"new\",");
+		break;
+	case NFCT_T_UPDATE:
+		ret = snprintf(buf + offset, len, "{\"type\":\"update\",");
+		break;
+	case NFCT_T_DESTROY:
+		ret = snprintf(buf + offset, len, "{\"type\":\"destroy\",");
+		break;
+	default:
+		ret = snprintf(buf + offset, len, "{");
+		break;
+	}
+	BUFFER_SIZE(ret, size, len, offset);
+
+	l3proto = nfct_get_attr_u8(ct, ATTR_ORIG_L3PROTO);
+	l4proto = nfct_get_attr_u8(ct, ATTR_ORIG_L4PROTO);
+	ret = snprintf(buf + offset, len, "\"family\":\"%s\",\"proto\":%u",
+		       l3proto == AF_INET6 ? "ipv6" : "ipv4", l4proto);
+	BUFFER_SIZE(ret, size, len, offset);
+
+	ret = ct_json_snprintf_addr(buf + offset, len, "src", ct,
+				    ATTR_ORIG_IPV4_SRC, ATTR_ORIG_IPV6_SRC);
+	BUFFER_SIZE(ret, size, len, offset);
+	ret = ct_json_snprintf_addr(buf + offset, len, "dst", ct,
+				    ATTR_ORIG_IPV4_DST, ATTR_ORIG_IPV6_DST);
+	BUFFER_SIZE(ret, size, len, offset);
+	ret = ct_json_snprintf_ports(buf + offset, len, "sport", "dport", ct,
+				     ATTR_ORIG_PORT_SRC, ATTR_ORIG_PORT_DST);
+	BUFFER_SIZE(ret, size, len, offset);
+
+	ret = ct_json_snprintf_addr(buf + offset, len, "reply_src", ct,
+				    ATTR_REPL_IPV4_SRC, ATTR_REPL_IPV6_SRC);
+	BUFFER_SIZE(ret, size, len, offset);
+	ret = ct_json_snprintf_addr(buf + offset, len, "reply_dst", ct,
+				    ATTR_REPL_IPV4_DST, ATTR_REPL_IPV6_DST);
+	BUFFER_SIZE(ret, size, len, offset);
+	ret = ct_json_snprintf_ports(buf + offset, len,
+				     "reply_sport", "reply_dport", ct,
+				     ATTR_REPL_PORT_SRC, ATTR_REPL_PORT_DST);
+	BUFFER_SIZE(ret, size, len, offset);
+
+	if (nfct_attr_is_set(ct, ATTR_ICMP_TYPE)) {
+		ret = snprintf(buf + offset, len,
+			       ",\"icmp_type\":%u,\"icmp_code\":%u,"
+			       "\"icmp_id\":%u",
+			       nfct_get_attr_u8(ct, ATTR_ICMP_TYPE),
+			       nfct_get_attr_u8(ct, ATTR_ICMP_CODE),
+			       ntohs(nfct_get_attr_u16(ct, ATTR_ICMP_ID)));
+		BUFFER_SIZE(ret, size, len, offset);
+	}
+
+	if (l4proto == IPPROTO_TCP && nfct_attr_is_set(ct, ATTR_TCP_STATE) &&
+	    nfct_get_attr_u8(ct, ATTR_TCP_STATE) < TCP_CONNTRACK_MAX) {
+		ret = snprintf(buf + offset, len, ",\"state\":\"%s\"",
+			       ct_json_tcp_states[nfct_get_attr_u8(ct,
+							ATTR_TCP_STATE)]);
+		BUFFER_SIZE(ret, size, len, offset);
+	}
+	if (nfct_attr_is_set(ct, ATTR_STATUS)) {
+		ret = snprintf(buf + offset, len, ",\"status\":%u",
+			       nfct_get_attr_u32(ct, ATTR_STATUS));
+		BUFFER_SIZE(ret, size, len, offset);
+	}
+	if (nfct_attr_is_set(ct, ATTR_TIMEOUT)) {
+		ret = snprintf(buf + offset, len, ",\"timeout\":%u",
+			       nfct_get_attr_u32(ct, ATTR_TIMEOUT));
+		BUFFER_SIZE(ret, size, len, offset);
+	}
+	if (nfct_attr_is_set(ct, ATTR_MARK)) {
+		ret = snprintf(buf + offset, len, ",\"mark\":%u",
+			       nfct_get_attr_u32(ct, ATTR_MARK));
+		BUFFER_SIZE(ret, size, len, offset);
+	}
+	if (nfct_attr_is_set(ct, ATTR_ZONE)) {
+		ret = snprintf(buf + offset, len, ",\"zone\":%u",
+			       nfct_get_attr_u16(ct, ATTR_ZONE));
+		BUFFER_SIZE(ret, size, len, offset);
+	}
+	if (nfct_attr_is_set(ct, ATTR_ID)) {
+		ret = snprintf(buf + offset, len, ",\"id\":%u",
+			       nfct_get_attr_u32(ct, ATTR_ID));
+		BUFFER_SIZE(ret, size, len, offset);
+	}
+	if (nfct_attr_is_set(ct, ATTR_ORIG_COUNTER_PACKETS)) {
+		ret = snprintf(buf + offset, len,
+			       ",\"packets\":%" PRIu64 ",\"bytes\":%" PRIu64
+			       ",\"reply_packets\":%" PRIu64
+			       ",\"reply_bytes\":%" PRIu64,
+			       nfct_get_attr_u64(ct, ATTR_ORIG_COUNTER_PACKETS),
+			       nfct_get_attr_u64(ct, ATTR_ORIG_COUNTER_BYTES),
+			       nfct_get_attr_u64(ct, ATTR_REPL_COUNTER_PACKETS),
+			       nfct_get_attr_u64(ct, ATTR_REPL_COUNTER_BYTES));
+		BUFFER_SIZE(ret, size, len, offset);
+	}
+
+	ret = snprintf(buf + offset, len, "}");
+	BUFFER_SIZE(ret, size, len, offset);
+
+	return size;
+}
+
 extern struct ctproto_handler ct_proto_unknown;
 
 static int parse_proto_num(const char *str)
@@ -921,6 +1110,14 @@ static void free_options(void)
 	}
 }
 
+/* --load-file in progress, see ct_text_load(). */
+struct ct_load;
+static struct ct_load *cur_load;
+
+static bool ct_load_in_parser(void);
+static void __attribute__((noreturn))
+ct_load_abort(enum exittype status, const char *msg, va_list args);
+
 void __attribute__((noreturn))
 exit_error(enum exittype status, const char *msg, ...)
 {
@@ -928,6 +1125,10 @@ exit_error(enum exittype status, const char *msg, ...)
 
 	free_options();
 	va_start(args, msg);
+	/* the main thread reports it once the previous lines are sent. */
+	if (ct_load_in_parser())
+		ct_load_abort(status, msg, args);
+
 	fprintf(stderr,"%s v%s (conntrack-tools): ", PROGNAME, VERSION);
 	vfprintf(stderr, msg, args);
 	fprintf(stderr, "\n");
@@ -1095,6 +1296,8 @@ enum {
 	_O_KTMS	= (1 << 4),
 	_O_CL	= (1 << 5),
 	_O_SAVE	= (1 << 6),
+	_O_JSON	= (1 << 7),
+	_O_BIN	= (1 << 8),
 };
 
 enum {
@@ -1105,16 +1308,16 @@ enum {
 };
 
 static struct parse_parameter {
-	const char	*parameter[8];
+	const char	*parameter[10];
 	size_t  size;
-	unsigned int value[8];
+	unsigned int value[10];
 } parse_array[PARSE_MAX] = {
 	{ {"ASSURED", "SEEN_REPLY", "UNSET", "FIXED_TIMEOUT", "EXPECTED", "OFFLOAD", "HW_OFFLOAD"}, 7,
 	  { IPS_ASSURED, IPS_SEEN_REPLY, 0, IPS_FIXED_TIMEOUT, IPS_EXPECTED, IPS_OFFLOAD, IPS_HW_OFFLOAD} },
 	{ {"ALL", "NEW", "UPDATES", "DESTROY"}, 4,
 	  { CT_EVENT_F_ALL, CT_EVENT_F_NEW, CT_EVENT_F_UPD, CT_EVENT_F_DEL } },
-	{ {"xml", "extended", "timestamp", "id", "ktimestamp", "labels", "userspace", "save"}, 8,
-	  { _O_XML, _O_EXT, _O_TMS, _O_ID, _O_KTMS, _O_CL, 0, _O_SAVE },
+	{ {"xml", "extended", "timestamp", "id", "ktimestamp", "labels", "userspace", "save", "json", "binary"}, 10,
+	  { _O_XML, _O_EXT, _O_TMS, _O_ID, _O_KTMS, _O_CL, 0, _O_SAVE, _O_JSON, _O_BIN },
 	},
 };
 
@@ -1684,16 +1887,35 @@ nfct_filter(struct ct_cmd *cmd, struct nf_conntrack *ct,
 static int counter;
 static int dump_xml_header_done = 1;
 
+/* entries received in the dump and those dropped by nfct_filter(). */
+static unsigned int filter_recv, filter_user;
+
+/* events received from the kernel and lost due to socket overruns. */
+static unsigned int event_recv, event_lost;
+static volatile sig_atomic_t event_stop;
+
+static void event_sighandler(int s)
+{
+	event_stop = 1;
+}
+
 static void __attribute__((noreturn))
-event_sighandler(int s)
+event_exit(void)
 {
-	if (dump_xml_header_done == 0) {
+	if (dump_xml_header_done == 0)
 		printf("</conntrack>\n");
-		fflush(stdout);
-	}
+	fflush(stdout);
 
 	fprintf(stderr, "%s v%s (conntrack-tools): ", PROGNAME, VERSION);
 	fprintf(stderr, "%d flow events have been shown.\n", counter);
+	/* some events were lost to socket overruns */
+	if (event_lost) {
+		fprintf(stderr, "%s v%s (conntrack-tools): ",
+			PROGNAME, VERSION);
+		fprintf(stderr, "%u flow events received, %u lost.\n",
+			event_recv, event_lost);
+	}
+	mnl_socket_close(_event_sock.mnl);
 	mnl_socket_close(_sock.mnl);
 	exit(0);
 }
@@ -1828,7 +2050,7 @@ static char *name_by_portid(uint32_t portid, unsigned long inode)
 	return prog;
 }
 
-static char *get_progname(uint32_t portid)
+static char *lookup_progname(uint32_t portid)
 {
 	FILE *fp = fopen("/proc/net/netlink", "r");
 	uint32_t portid_check;
@@ -1851,28 +2073,70 @@ static char *get_progname(uint32_t portid)
 			break;
 
 		if (ret == 3 && portid_check == portid && prot == NETLINK_NETFILTER) {
-			static uint32_t last_portid;
-			static uint32_t last_inode;
-			static char *last_program;
-			char *prog;
-
 			fclose(fp);
+			return name_by_portid(portid, inode);
+		}
+	}
+
+	fclose(fp);
+	return NULL;
+}
+
+/*
+ * Looking up the program scans /proc, so the result is cached per portid
+ * for a while. A portid that is reused by another program within that
+ * time is shown with the former name.
+ */
+#define PROGNAME_CACHE_SIZE	256
+#define PROGNAME_CACHE_TTL	10	/* seconds */
+
+static struct {
+	uint32_t	portid;
+	time_t		expires;
+	char		*prog;		/* NULL if not found */
+} progname_cache[PROGNAME_CACHE_SIZE];
+
+static char *get_progname(uint32_t portid)
+{
+	unsigned int i = portid % PROGNAME_CACHE_SIZE;
+	time_t now = time(NULL);
+
+	if (progname_cache[i].portid == portid &&
+	    progname_cache[i].expires > now)
+		return progname_cache[i].prog;
+
+	free(progname_cache[i].prog);
+	progname_cache[i].prog = lookup_progname(portid);
+	progname_cache[i].portid = portid;
+	progname_cache[i].expires = now + PROGNAME_CACHE_TTL;
 
-			if (last_portid == portid && last_inode == inode)
-				return last_program;
+	return progname_cache[i].prog;
+}
+
+/* the events dropped by the kernel on this socket, -1 if unknown. */
+static int netlink_drops(uint32_t portid)
+{
+	FILE *fp = fopen("/proc/net/netlink", "r");
+	uint32_t portid_check;
+	unsigned int drops;
+	char line[256];
+	int ret, prot;
 
-			prog = name_by_portid(portid, inode);
+	if (!fp)
+		return -1;
 
-			free(last_program);
-			last_program = prog;
-			last_portid = portid;
-			last_inode = inode;
-			return prog;
+	while (fgets(line, sizeof(line), fp)) {
+		ret = sscanf(line, "%*x %d %u %*x %*d %*d %*x %*d %u",
+			     &prot, &portid_check, &drops);
+		if (ret == 3 && portid_check == portid &&
+		    prot == NETLINK_NETFILTER) {
+			fclose(fp);
+			return drops;
 		}
 	}
 
 	fclose(fp);
-	return NULL;
+	return -1;
 }
 
 static int event_cb(const struct nlmsghdr *nlh, void *data)
@@ -1885,6 +2149,8 @@ static int event_cb(const struct nlmsghdr *nlh, void *data)
 	struct nf_conntrack *ct;
 	char buf[1024];
 
+	event_recv++;
+
 	switch(nlh->nlmsg_type & 0xff) {
 	case IPCTNL_MSG_CT_NEW:
 		if (nlh->nlmsg_flags & NLM_F_CREATE)
@@ -1913,6 +2179,18 @@ static int event_cb(const struct nlmsghdr *nlh, void *data)
 	    nfct_filter(cmd, ct, cur_tmpl))
 		goto out;
 
+	/* the netlink header keeps the event type and the portid. */
+	if (output_mask & _O_BIN) {
+		fwrite(nlh, nlh->nlmsg_len, 1, stdout);
+		counter++;
+		goto out;
+	}
+
+	if (output_mask & _O_JSON) {
+		ct_json_snprintf(buf, sizeof(buf), ct, type);
+		goto done;
+	}
+
 	if (output_mask & _O_SAVE) {
 		ct_save_snprintf(buf, sizeof(buf), ct, labelmap, type);
 		goto done;
@@ -1953,7 +2231,6 @@ done:
 	} else {
 		puts(buf);
 	}
-	fflush(stdout);
 
 	counter++;
 out:
@@ -1961,137 +2238,573 @@ out:
 	return MNL_CB_OK;
 }
 
-static int nfct_mnl_request(struct nfct_mnl_socket *sock, uint16_t subsys,
-			    int family, uint16_t type, uint16_t flags,
-			    mnl_cb_t cb, const struct nf_conntrack *ct,
-			    const struct ct_cmd *cmd);
+#define EVENT_BATCH		64	/* messages per recvmmsg() */
+#define EVENT_STDOUT_BUFSIZ	(1 << 16)
+#define EVENT_FLUSH_INTERVAL	1	/* seconds */
+#define EVENT_STATS_INTERVAL	10	/* seconds */
 
-static int mnl_nfct_delete_cb(const struct nlmsghdr *nlh, void *data)
+static void event_overrun(const struct nfct_mnl_socket *sock)
 {
-	struct nfct_mnl_socket *modifier_sock = &_modifier_sock;
-	unsigned int op_type = NFCT_O_DEFAULT;
-	unsigned int op_flags = 0;
-	struct ct_cmd *cmd = data;
-	struct nf_conntrack *ct;
-	char buf[1024];
-	int res;
+	static time_t last_stats;
+	time_t now = time(NULL);
+	int drops;
+
+	if (last_stats == 0) {
+		fprintf(stderr, "WARNING: We have hit ENOBUFS! We are losing "
+				"events.\nThis message means that the current "
+				"netlink socket buffer size is too small.\n"
+				"Please, check --buffer-size in conntrack(8) "
+				"manpage.\n");
+	}
 
-	ct = nfct_new();
-	if (ct == NULL)
-		return MNL_CB_OK;
+	drops = netlink_drops(sock->portid);
+	if (drops >= 0)
+		event_lost = drops;
+	else
+		event_lost++;
 
-	nfct_nlmsg_parse(nlh, ct);
+	if (now - last_stats >= EVENT_STATS_INTERVAL) {
+		if (last_stats) {
+			fprintf(stderr, "WARNING: %u flow events received, "
+					"%d printed, %u lost so far.\n",
+				event_recv, counter, event_lost);
+		}
+		last_stats = now;
+	}
+}
 
-	if (nfct_filter(cmd, ct, cur_tmpl))
-		goto destroy_ok;
+/*
+ * Events are read in batches and stdout is fully buffered: it is flushed
+ * once the socket has been drained, at most once per EVENT_FLUSH_INTERVAL
+ * unless stdout is a terminal. An idle socket flushes the pending output.
+ */
+static void event_loop(const struct nfct_mnl_socket *sock, struct ct_cmd *cmd)
+{
+	int fd = mnl_socket_get_fd(sock->mnl);
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	size_t bufsiz = MNL_SOCKET_BUFFER_SIZE;
+	struct mmsghdr msgs[EVENT_BATCH];
+	struct iovec iov[EVENT_BATCH];
+	bool tty = isatty(STDOUT_FILENO);
+	time_t last_flush = time(NULL);
+	char *buf;
+	int i, n;
+
+	buf = malloc(EVENT_BATCH * bufsiz);
+	if (buf == NULL)
+		exit_error(OTHER_PROBLEM, "OOM");
 
-	res = nfct_mnl_request(modifier_sock, NFNL_SUBSYS_CTNETLINK,
-			       nfct_get_attr_u8(ct, ATTR_ORIG_L3PROTO),
-			       IPCTNL_MSG_CT_DELETE, NLM_F_ACK, NULL, ct, NULL);
-	if (res < 0)
-		exit_error(OTHER_PROBLEM,
-			   "Operation failed: %s",
-			   err2str(errno, CT_DELETE));
+	setvbuf(stdout, NULL, _IOFBF, EVENT_STDOUT_BUFSIZ);
 
-	if (output_mask & _O_SAVE) {
-		ct_save_snprintf(buf, sizeof(buf), ct, labelmap, NFCT_T_DESTROY);
-		goto done;
-	}
+	while (!event_stop) {
+		memset(msgs, 0, sizeof(msgs));
+		for (i = 0; i < EVENT_BATCH; i++) {
+			iov[i].iov_base = buf + i * bufsiz;
+			iov[i].iov_len = bufsiz;
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
 
-	if (output_mask & _O_XML)
-		op_type = NFCT_O_XML;
-	if (output_mask & _O_EXT)
-		op_flags = NFCT_OF_SHOW_LAYER3;
-	if (output_mask & _O_ID)
-		op_flags |= NFCT_OF_ID;
+		n = recvmmsg(fd, msgs, EVENT_BATCH, MSG_DONTWAIT, NULL);
+		if (n < 0) {
+			switch (errno) {
+			case EAGAIN:
+				if (tty || time(NULL) - last_flush >=
+						EVENT_FLUSH_INTERVAL) {
+					fflush(stdout);
+					last_flush = time(NULL);
+				}
+				if (poll(&pfd, 1, tty ? -1 :
+					 EVENT_FLUSH_INTERVAL * 1000) == 0) {
+					fflush(stdout);
+					last_flush = time(NULL);
+				}
+				continue;
+			case EINTR:
+				continue;
+			case ENOBUFS:
+				event_overrun(sock);
+				continue;
+			}
+			exit_error(OTHER_PROBLEM,
+				   "failed to received netlink event: %s",
+				   strerror(errno));
+		}
 
-	nfct_snprintf(buf, sizeof(buf), ct, NFCT_T_UNKNOWN, op_type, op_flags);
-done:
-	printf("%s\n", buf);
+		for (i = 0; i < n; i++) {
+			if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+				continue;
+			mnl_cb_run(iov[i].iov_base, msgs[i].msg_len, 0, 0,
+				   event_cb, cmd);
+		}
 
-	counter++;
+		if (!tty && time(NULL) - last_flush >= EVENT_FLUSH_INTERVAL) {
+			fflush(stdout);
+			last_flush = time(NULL);
+		}
+	}
 
-destroy_ok:
-	nfct_destroy(ct);
-	return MNL_CB_OK;
+	free(buf);
+
+	if (event_lost) {
+		int drops = netlink_drops(sock->portid);
+
+		if (drops >= 0)
+			event_lost = drops;
+	}
 }
 
-static int mnl_nfct_print_cb(const struct nlmsghdr *nlh, void *data)
-{
-	unsigned int op_type = NFCT_O_DEFAULT;
-	unsigned int op_flags = 0;
-	struct nf_conntrack *ct;
-	char buf[1024];
+#ifndef SO_RCVBUFFORCE
+#define SO_RCVBUFFORCE 33
+#endif
 
-	ct = nfct_new();
-	if (ct == NULL)
-		return MNL_CB_OK;
+#ifndef NETLINK_CAP_ACK
+#define NETLINK_CAP_ACK 10
+#endif
 
-	nfct_nlmsg_parse(nlh, ct);
+/*
+ * Requests that modify the table (--load-file, and the entries that match
+ * -D and -U) are packed into large buffers that the kernel processes in one
+ * go. Only the last request of every batch asks for an acknowledgment, so
+ * the kernel only replies to the failing requests and to the queries; the
+ * replies are matched to their request by sequence number.
+ */
+#define CT_BATCH_SIZE		(1 << 16)
+#define CT_BATCH_RCVBUF		(4 * 1024 * 1024)
+/* upper bound of the receive buffer space used by the reply of a request */
+#define CT_BATCH_ACK_SIZE	1024
+#define CT_BATCH_GET_SIZE	8192
+
+struct ct_batch_req {
+	unsigned int		lineno;		/* in the --load-file file */
+	unsigned int		command;
+	mnl_cb_t		cb;		/* for the replies, if any */
+	char			*line;		/* shown on success, if any */
+	bool			count;		/* in the summary on success */
+	bool			failed;
+};
 
-	if (output_mask & _O_SAVE) {
-		ct_save_snprintf(buf, sizeof(buf), ct, labelmap, NFCT_T_NEW);
-		goto done;
-	}
+struct ct_batch {
+	struct nfct_mnl_socket	*sock;
+	struct mnl_nlmsg_batch	*b;
+	char			*buf;
+	struct nlmsghdr		*last;
+	struct ct_batch_req	*req;		/* in flight, by seq - first */
+	unsigned int		num;
+	unsigned int		max;
+	unsigned int		space;		/* left for the replies */
+	unsigned int		rcvbuf;
+	uint32_t		first;		/* seq of the first request */
+	uint32_t		seq;
+	int			res;		/* of the batches sent so far */
+};
 
-	if (output_mask & _O_XML)
-		op_type = NFCT_O_XML;
-	if (output_mask & _O_EXT)
-		op_flags = NFCT_OF_SHOW_LAYER3;
-	if (output_mask & _O_ID)
-		op_flags |= NFCT_OF_ID;
+static struct ct_batch _modifier_batch;
 
-	nfct_snprintf_labels(buf, sizeof(buf), ct, NFCT_T_UNKNOWN, op_type, op_flags, labelmap);
-done:
-	printf("%s\n", buf);
+static struct nlmsghdr *
+nfct_mnl_nlmsghdr_put(char *buf, uint16_t subsys, uint16_t type,
+		      uint16_t flags, uint8_t family);
 
-	nfct_destroy(ct);
+static void ct_batch_init(struct ct_batch *batch, struct nfct_mnl_socket *sock)
+{
+	int fd = mnl_socket_get_fd(sock->mnl);
+	int rcvbuf = CT_BATCH_RCVBUF, on = 1;
+	socklen_t len = sizeof(rcvbuf);
+
+	memset(batch, 0, sizeof(*batch));
+	batch->sock = sock;
+	batch->seq = time(NULL);
+
+	/* error messages do not include the original request */
+	mnl_socket_setsockopt(sock->mnl, NETLINK_CAP_ACK, &on, sizeof(on));
+
+	/* every request in flight may fail, make room for all the replies */
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE,
+		       &rcvbuf, sizeof(rcvbuf)) == -1)
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+	if (getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, &len) == -1 ||
+	    rcvbuf < CT_BATCH_GET_SIZE)
+		rcvbuf = CT_BATCH_GET_SIZE;
+
+	batch->rcvbuf = batch->space = rcvbuf;
+	batch->max = rcvbuf / CT_BATCH_ACK_SIZE;
+
+	batch->buf = malloc(CT_BATCH_SIZE);
+	batch->req = calloc(batch->max, sizeof(struct ct_batch_req));
+	if (batch->buf == NULL || batch->req == NULL)
+		exit_error(OTHER_PROBLEM, "OOM");
 
-	return MNL_CB_OK;
+	batch->b = mnl_nlmsg_batch_start(batch->buf, CT_BATCH_SIZE);
+	if (batch->b == NULL)
+		exit_error(OTHER_PROBLEM, "OOM");
 }
 
-static void copy_mark(const struct ct_cmd *cmd, struct nf_conntrack *tmp,
-		      const struct nf_conntrack *ct,
-		      const struct u32_mask *m)
+static void ct_batch_check_init(struct ct_batch *batch,
+				struct nfct_mnl_socket *sock)
 {
-	if (cmd->options & CT_OPT_MARK) {
-		uint32_t mark = nfct_get_attr_u32(ct, ATTR_MARK);
-		mark = (mark & ~m->mask) ^ m->value;
-		nfct_set_attr_u32(tmp, ATTR_MARK, mark);
-	}
+	if (batch->b == NULL)
+		ct_batch_init(batch, sock);
 }
 
-static void copy_status(const struct ct_cmd *cmd, struct nf_conntrack *tmp,
-			const struct nf_conntrack *ct)
+static void ct_batch_error(const struct ct_batch_req *req, int err)
 {
-	if (cmd->options & CT_OPT_STATUS) {
-		/* copy existing flags, we only allow setting them. */
-		uint32_t status = nfct_get_attr_u32(ct, ATTR_STATUS);
-		status |= nfct_get_attr_u32(tmp, ATTR_STATUS);
-		nfct_set_attr_u32(tmp, ATTR_STATUS, status);
+	if (req->lineno) {
+		fprintf(stderr, "%s v%s (conntrack-tools): line %u: %s\n",
+			PROGNAME, VERSION, req->lineno,
+			err2str(err, req->command));
+	} else {
+		fprintf(stderr, "Operation failed: %s\n",
+			err2str(err, req->command));
 	}
 }
 
-static struct nfct_bitmask *xnfct_bitmask_clone(const struct nfct_bitmask *a)
+static int ct_batch_reply(struct ct_batch *batch, const struct nlmsghdr *nlh)
 {
-	struct nfct_bitmask *b = nfct_bitmask_clone(a);
-	if (!b)
-		exit_error(OTHER_PROBLEM, "out of memory");
-	return b;
-}
+	const struct nlmsgerr *err;
+	struct ct_batch_req *req;
+	uint32_t idx;
 
-static void copy_label(const struct ct_cmd *cmd, struct nf_conntrack *tmp,
-		       const struct nf_conntrack *ct,
-		       const struct ct_tmpl *tmpl)
-{
-	struct nfct_bitmask *ctb, *newmask;
-	unsigned int i;
+	if (!mnl_nlmsg_portid_ok(nlh, batch->sock->portid))
+		return 0;
 
-	if ((cmd->options & (CT_OPT_ADD_LABEL|CT_OPT_DEL_LABEL)) == 0)
-		return;
+	idx = nlh->nlmsg_seq - batch->first;
+	if (idx >= batch->num)
+		return 0;
 
-	nfct_copy_attr(tmp, ct, ATTR_CONNLABELS);
-	ctb = (void *) nfct_get_attr(tmp, ATTR_CONNLABELS);
+	req = &batch->req[idx];
+
+	if (nlh->nlmsg_type != NLMSG_ERROR) {
+		if (req->cb && nlh->nlmsg_type != NLMSG_DONE)
+			req->cb(nlh, NULL);
+		return 0;
+	}
+
+	err = mnl_nlmsg_get_payload(nlh);
+	if (err->error == 0)
+		return 0;
+
+	req->failed = true;
+
+	/*
+	 * -A is fine with existing entries. The entries that match -D and -U
+	 * may expire before the request reaches the kernel.
+	 */
+	if ((err->error == -EEXIST && req->command == CT_ADD) ||
+	    (err->error == -ENOENT &&
+	     req->command & (CT_DELETE | CT_UPDATE)))
+		return 0;
+
+	ct_batch_error(req, -err->error);
+	return -1;
+}
+
+static int ct_batch_recv(struct ct_batch *batch)
+{
+	int fd = mnl_socket_get_fd(batch->sock->mnl);
+	uint32_t last = batch->first + batch->num - 1;
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+	const struct nlmsghdr *nlh;
+	int flags = 0, res = 0;
+	unsigned int i;
+	int len;
+
+	/*
+	 * The kernel handles the whole batch before sendto() returns, so all
+	 * the replies are already queued. If some of them did not fit into
+	 * the buffer, the acknowledgment may be lost too: only drain the rest.
+	 */
+	for (;;) {
+		len = recv(fd, buf, sizeof(buf), flags);
+		if (len == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == ENOBUFS) {
+				fprintf(stderr, "%s v%s (conntrack-tools): "
+					"netlink buffer overrun, some errors "
+					"may not be reported\n",
+					PROGNAME, VERSION);
+				flags = MSG_DONTWAIT;
+				res = -1;
+				continue;
+			}
+			if (errno != EAGAIN)
+				res = -1;
+			break;
+		}
+		if (len == 0)
+			break;
+
+		nlh = (const struct nlmsghdr *)buf;
+		while (mnl_nlmsg_ok(nlh, len)) {
+			if (ct_batch_reply(batch, nlh) < 0)
+				res = -1;
+			if (nlh->nlmsg_type == NLMSG_ERROR &&
+			    nlh->nlmsg_seq == last)
+				goto out;
+			nlh = mnl_nlmsg_next(nlh, &len);
+		}
+	}
+out:
+	for (i = 0; i < batch->num; i++) {
+		struct ct_batch_req *req = &batch->req[i];
+
+		if (req->failed)
+			continue;
+		if (req->line)
+			printf("%s\n", req->line);
+		if (req->count)
+			counter++;
+	}
+	return res;
+}
+
+static void ct_batch_send(struct ct_batch *batch)
+{
+	unsigned int i;
+	int res;
+
+	batch->last->nlmsg_flags |= NLM_F_ACK;
+
+	res = mnl_socket_sendto(batch->sock->mnl,
+				mnl_nlmsg_batch_head(batch->b),
+				mnl_nlmsg_batch_size(batch->b));
+	if (res < 0) {
+		fprintf(stderr, "%s v%s (conntrack-tools): %s\n",
+			PROGNAME, VERSION, strerror(errno));
+	} else {
+		res = ct_batch_recv(batch);
+	}
+
+	for (i = 0; i < batch->num; i++)
+		free(batch->req[i].line);
+	memset(batch->req, 0, batch->num * sizeof(struct ct_batch_req));
+
+	mnl_nlmsg_batch_reset(batch->b);
+	batch->num = 0;
+	batch->space = batch->rcvbuf;
+
+	if (res < 0)
+		batch->res = -1;
+}
+
+/* send the pending requests, returns -1 if any request has failed. */
+static int ct_batch_flush(struct ct_batch *batch)
+{
+	int res;
+
+	if (batch->num)
+		ct_batch_send(batch);
+
+	res = batch->res;
+	batch->res = 0;
+
+	return res;
+}
+
+/*
+ * Adds a request to the batch, the batch is sent first if it is full. The
+ * caller fills in the returned request, which is NULL if it is invalid.
+ */
+static struct ct_batch_req *
+ct_batch_add(struct ct_batch *batch, uint16_t type, uint16_t flags,
+	     uint8_t family, const struct nf_conntrack *ct)
+{
+	unsigned int space = type == IPCTNL_MSG_CT_GET ?
+			     CT_BATCH_GET_SIZE : CT_BATCH_ACK_SIZE;
+	struct nlmsghdr *nlh;
+
+	/* make sure that the largest request and its reply fit in. */
+	if (batch->num == batch->max || batch->space < space ||
+	    mnl_nlmsg_batch_size(batch->b) >
+			(size_t)(CT_BATCH_SIZE - MNL_SOCKET_BUFFER_SIZE))
+		ct_batch_send(batch);
+
+	if (batch->num == 0)
+		batch->first = batch->seq;
+
+	nlh = nfct_mnl_nlmsghdr_put(mnl_nlmsg_batch_current(batch->b),
+				    NFNL_SUBSYS_CTNETLINK, type, flags, family);
+	nlh->nlmsg_seq = batch->seq;
+
+	if (nfct_nlmsg_build(nlh, ct) < 0) {
+		batch->res = -1;
+		return NULL;
+	}
+	mnl_nlmsg_batch_next(batch->b);
+
+	batch->seq++;
+	batch->space -= space;
+	batch->last = nlh;
+
+	return &batch->req[batch->num++];
+}
+
+static void ct_batch_fini(struct ct_batch *batch)
+{
+	mnl_nlmsg_batch_stop(batch->b);
+	free(batch->buf);
+	free(batch->req);
+}
+
+static void ct_batch_check_fini(struct ct_batch *batch)
+{
+	if (batch->b) {
+		ct_batch_fini(batch);
+		memset(batch, 0, sizeof(*batch));
+	}
+}
+
+static int nfct_mnl_request(struct nfct_mnl_socket *sock, uint16_t subsys,
+			    int family, uint16_t type, uint16_t flags,
+			    mnl_cb_t cb, const struct nf_conntrack *ct,
+			    const struct ct_cmd *cmd);
+
+static int mnl_nfct_delete_cb(const struct nlmsghdr *nlh, void *data)
+{
+	unsigned int op_type = NFCT_O_DEFAULT;
+	unsigned int op_flags = 0;
+	struct ct_cmd *cmd = data;
+	struct ct_batch_req *req;
+	struct nf_conntrack *ct;
+	char buf[1024];
+
+	ct = nfct_new();
+	if (ct == NULL)
+		return MNL_CB_OK;
+
+	nfct_nlmsg_parse(nlh, ct);
+	filter_recv++;
+
+	if (nfct_filter(cmd, ct, cur_tmpl)) {
+		filter_user++;
+		goto destroy_ok;
+	}
+
+	/* the entry is shown and counted once the batch has been sent. */
+	req = ct_batch_add(&_modifier_batch, IPCTNL_MSG_CT_DELETE, 0,
+			   nfct_get_attr_u8(ct, ATTR_ORIG_L3PROTO), ct);
+	if (req == NULL)
+		exit_error(OTHER_PROBLEM,
+			   "Operation failed: %s",
+			   err2str(errno, CT_DELETE));
+	req->command = CT_DELETE;
+	req->count = true;
+
+	if (output_mask & _O_JSON) {
+		ct_json_snprintf(buf, sizeof(buf), ct, NFCT_T_DESTROY);
+		goto done;
+	}
+
+	if (output_mask & _O_SAVE) {
+		ct_save_snprintf(buf, sizeof(buf), ct, labelmap, NFCT_T_DESTROY);
+		goto done;
+	}
+
+	if (output_mask & _O_XML)
+		op_type = NFCT_O_XML;
+	if (output_mask & _O_EXT)
+		op_flags = NFCT_OF_SHOW_LAYER3;
+	if (output_mask & _O_ID)
+		op_flags |= NFCT_OF_ID;
+
+	nfct_snprintf(buf, sizeof(buf), ct, NFCT_T_UNKNOWN, op_type, op_flags);
+done:
+	req->line = strdup(buf);
+	if (req->line == NULL)
+		exit_error(OTHER_PROBLEM, "OOM");
+
+destroy_ok:
+	nfct_destroy(ct);
+	return MNL_CB_OK;
+}
+
+static int mnl_nfct_print_cb(const struct nlmsghdr *nlh, void *data)
+{
+	unsigned int op_type = NFCT_O_DEFAULT;
+	unsigned int op_flags = 0;
+	struct nf_conntrack *ct;
+	char buf[1024];
+
+	/* -G, the record is loaded back by -R as it is. */
+	if (output_mask & _O_BIN) {
+		fwrite(nlh, nlh->nlmsg_len, 1, stdout);
+		return MNL_CB_OK;
+	}
+
+	ct = nfct_new();
+	if (ct == NULL)
+		return MNL_CB_OK;
+
+	nfct_nlmsg_parse(nlh, ct);
+
+	if (output_mask & _O_JSON) {
+		ct_json_snprintf(buf, sizeof(buf), ct, NFCT_T_UNKNOWN);
+		goto done;
+	}
+
+	if (output_mask & _O_SAVE) {
+		ct_save_snprintf(buf, sizeof(buf), ct, labelmap, NFCT_T_NEW);
+		goto done;
+	}
+
+	if (output_mask & _O_XML)
+		op_type = NFCT_O_XML;
+	if (output_mask & _O_EXT)
+		op_flags = NFCT_OF_SHOW_LAYER3;
+	if (output_mask & _O_ID)
+		op_flags |= NFCT_OF_ID;
+
+	nfct_snprintf_labels(buf, sizeof(buf), ct, NFCT_T_UNKNOWN, op_type, op_flags, labelmap);
+done:
+	printf("%s\n", buf);
+
+	nfct_destroy(ct);
+
+	return MNL_CB_OK;
+}
+
+static void copy_mark(const struct ct_cmd *cmd, struct nf_conntrack *tmp,
+		      const struct nf_conntrack *ct,
+		      const struct u32_mask *m)
+{
+	if (cmd->options & CT_OPT_MARK) {
+		uint32_t mark = nfct_get_attr_u32(ct, ATTR_MARK);
+		mark = (mark & ~m->mask) ^ m->value;
+		nfct_set_attr_u32(tmp, ATTR_MARK, mark);
+	}
+}
+
+static void copy_status(const struct ct_cmd *cmd, struct nf_conntrack *tmp,
+			const struct nf_conntrack *ct)
+{
+	if (cmd->options & CT_OPT_STATUS) {
+		/* copy existing flags, we only allow setting them. */
+		uint32_t status = nfct_get_attr_u32(ct, ATTR_STATUS);
+		status |= nfct_get_attr_u32(tmp, ATTR_STATUS);
+		nfct_set_attr_u32(tmp, ATTR_STATUS, status);
+	}
+}
+
+static struct nfct_bitmask *xnfct_bitmask_clone(const struct nfct_bitmask *a)
+{
+	struct nfct_bitmask *b = nfct_bitmask_clone(a);
+	if (!b)
+		exit_error(OTHER_PROBLEM, "out of memory");
+	return b;
+}
+
+static void copy_label(const struct ct_cmd *cmd, struct nf_conntrack *tmp,
+		       const struct nf_conntrack *ct,
+		       const struct ct_tmpl *tmpl)
+{
+	struct nfct_bitmask *ctb, *newmask;
+	unsigned int i;
+
+	if ((cmd->options & (CT_OPT_ADD_LABEL|CT_OPT_DEL_LABEL)) == 0)
+		return;
+
+	nfct_copy_attr(tmp, ct, ATTR_CONNLABELS);
+	ctb = (void *) nfct_get_attr(tmp, ATTR_CONNLABELS);
 
 	if (cmd->options & CT_OPT_ADD_LABEL) {
 		if (ctb == NULL) {
@@ -2143,9 +2856,8 @@ static void copy_label(const struct ct_cmd *cmd, struct nf_conntrack *tmp,
 static int mnl_nfct_update_cb(const struct nlmsghdr *nlh, void *data)
 {
 	struct ct_cmd *cmd = data;
-	struct nfct_mnl_socket *modifier_sock = &_modifier_sock;
 	struct nf_conntrack *ct, *obj = cmd->tmpl.ct, *tmp = NULL;
-	int res;
+	struct ct_batch_req *req;
 
 	ct = nfct_new();
 	if (ct == NULL)
@@ -2183,26 +2895,24 @@ static int mnl_nfct_update_cb(const struct nlmsghdr *nlh, void *data)
 	if (nfct_cmp(tmp, ct, NFCT_CMP_ALL | NFCT_CMP_MASK))
 		goto destroy_ok;
 
-	res = nfct_mnl_request(modifier_sock, NFNL_SUBSYS_CTNETLINK, cmd->family,
-			       IPCTNL_MSG_CT_NEW, NLM_F_ACK, NULL, tmp, NULL);
-	if (res < 0) {
-		fprintf(stderr, "Operation failed: %s\n",
-			err2str(errno, CT_UPDATE));
-	}
-
-	res = nfct_mnl_request(modifier_sock, NFNL_SUBSYS_CTNETLINK, cmd->family,
-			       IPCTNL_MSG_CT_GET, NLM_F_ACK,
-			       mnl_nfct_print_cb, tmp, NULL);
-	if (res < 0) {
-		/* the entry has vanish in middle of the update */
-		if (errno == ENOENT)
-			goto destroy_ok;
+	/* update the entry and then fetch it to show the result. */
+	req = ct_batch_add(&_modifier_batch, IPCTNL_MSG_CT_NEW, 0,
+			   cmd->family, tmp);
+	if (req == NULL)
 		exit_error(OTHER_PROBLEM,
 			   "Operation failed: %s",
 			   err2str(errno, CT_UPDATE));
-	}
+	req->command = CT_UPDATE;
+	req->count = true;
 
-	counter++;
+	req = ct_batch_add(&_modifier_batch, IPCTNL_MSG_CT_GET, 0,
+			   cmd->family, tmp);
+	if (req == NULL)
+		exit_error(OTHER_PROBLEM,
+			   "Operation failed: %s",
+			   err2str(errno, CT_UPDATE));
+	req->command = CT_UPDATE;
+	req->cb = mnl_nfct_print_cb;
 
 destroy_ok:
 	if (tmp)
@@ -2628,29 +3338,440 @@ static int nfct_global_stats_cb(const struct nlmsghdr *nlh, void *data)
 	return MNL_CB_OK;
 }
 
-static int mnl_nfct_dump_cb(const struct nlmsghdr *nlh, void *data)
+enum {
+	CT_GROUP_SRC	= (1 << 0),
+	CT_GROUP_DST	= (1 << 1),
+	CT_GROUP_DPORT	= (1 << 2),
+	CT_GROUP_PROTO	= (1 << 3),
+	CT_GROUP_MARK	= (1 << 4),
+	CT_GROUP_ZONE	= (1 << 5),
+	CT_GROUP_STATE	= (1 << 6),
+};
+
+static const struct {
+	const char	*name;
+	unsigned int	flag;
+} group_keys[] = {
+	{ "src",	CT_GROUP_SRC },
+	{ "dst",	CT_GROUP_DST },
+	{ "dport",	CT_GROUP_DPORT },
+	{ "proto",	CT_GROUP_PROTO },
+	{ "mark",	CT_GROUP_MARK },
+	{ "zone",	CT_GROUP_ZONE },
+	{ "state",	CT_GROUP_STATE },
+};
+
+/* the fields that are not part of the grouping stay zero. */
+struct ct_group_key {
+	uint32_t	src[4];
+	uint32_t	dst[4];
+	uint32_t	mark;
+	uint16_t	zone;
+	uint16_t	dport;
+	uint8_t		family;
+	uint8_t		proto;
+	uint8_t		state;		/* TCP state + 1, zero if none */
+	uint8_t		has_port;
+};
+
+struct ct_group {
+	struct ct_group_key	key;
+	uint32_t		count;
+	uint64_t		packets;
+	uint64_t		bytes;
+};
+
+#define CT_GROUP_HASHSIZE	1024	/* initial size, power of two */
+
+/* open addressing with linear probing, a zero count is a free slot. */
+static struct {
+	unsigned int	by;
+	unsigned int	top;
+	struct ct_group	*table;
+	unsigned int	size;
+	unsigned int	num;
+} group;
+
+static void parse_group_by(const char *arg)
 {
-	unsigned int op_type = NFCT_O_DEFAULT;
-	unsigned int op_flags = 0;
-	struct ct_cmd *cmd = data;
-	struct nf_conntrack *ct;
-	char buf[4096];
+	const char *comma;
+	size_t len, i;
 
-	ct = nfct_new();
-	if (ct == NULL)
-		return MNL_CB_OK;
+	do {
+		comma = strchr(arg, ',');
+		len = comma ? (size_t)(comma - arg) : strlen(arg);
 
-	nfct_nlmsg_parse(nlh, ct);
+		for (i = 0; i < sizeof(group_keys) / sizeof(group_keys[0]); i++) {
+			if (strlen(group_keys[i].name) == len &&
+			    strncasecmp(arg, group_keys[i].name, len) == 0)
+				break;
+		}
+		if (i == sizeof(group_keys) / sizeof(group_keys[0]))
+			exit_error(PARAMETER_PROBLEM,
+				   "unknown --group-by key `%.*s', use "
+				   "src, dst, dport, proto, mark, zone or state",
+				   (int)len, arg);
 
-	if (nfct_filter(cmd, ct, cur_tmpl)) {
-		nfct_destroy(ct);
-		return MNL_CB_OK;
-	}
+		group.by |= group_keys[i].flag;
+		arg = comma + 1;
+	} while (comma);
+}
 
-	if (output_mask & _O_SAVE) {
-		ct_save_snprintf(buf, sizeof(buf), ct, labelmap, NFCT_T_NEW);
-		goto done;
-	}
+static void ct_group_key_build(struct ct_group_key *key,
+			       const struct nf_conntrack *ct)
+{
+	uint8_t l4proto = nfct_get_attr_u8(ct, ATTR_ORIG_L4PROTO);
+
+	memset(key, 0, sizeof(*key));
+
+	if (group.by & (CT_GROUP_SRC | CT_GROUP_DST))
+		key->family = nfct_get_attr_u8(ct, ATTR_ORIG_L3PROTO);
+
+	if (group.by & CT_GROUP_SRC) {
+		if (key->family == AF_INET6)
+			memcpy(key->src, nfct_get_attr(ct, ATTR_ORIG_IPV6_SRC),
+			       sizeof(key->src));
+		else
+			key->src[0] = nfct_get_attr_u32(ct, ATTR_ORIG_IPV4_SRC);
+	}
+	if (group.by & CT_GROUP_DST) {
+		if (key->family == AF_INET6)
+			memcpy(key->dst, nfct_get_attr(ct, ATTR_ORIG_IPV6_DST),
+			       sizeof(key->dst));
+		else
+			key->dst[0] = nfct_get_attr_u32(ct, ATTR_ORIG_IPV4_DST);
+	}
+	if ((group.by & CT_GROUP_DPORT) &&
+	    nfct_attr_is_set(ct, ATTR_ORIG_PORT_DST)) {
+		key->dport = ntohs(nfct_get_attr_u16(ct, ATTR_ORIG_PORT_DST));
+		key->has_port = 1;
+	}
+	if (group.by & CT_GROUP_PROTO)
+		key->proto = l4proto;
+	if (group.by & CT_GROUP_MARK)
+		key->mark = nfct_get_attr_u32(ct, ATTR_MARK);
+	if (group.by & CT_GROUP_ZONE)
+		key->zone = nfct_get_attr_u16(ct, ATTR_ZONE);
+	if ((group.by & CT_GROUP_STATE) && l4proto == IPPROTO_TCP &&
+	    nfct_attr_is_set(ct, ATTR_TCP_STATE) &&
+	    nfct_get_attr_u8(ct, ATTR_TCP_STATE) < TCP_CONNTRACK_MAX)
+		key->state = nfct_get_attr_u8(ct, ATTR_TCP_STATE) + 1;
+}
+
+static struct ct_group *ct_group_lookup(struct ct_group *table,
+					unsigned int size,
+					const struct ct_group_key *key)
+{
+	unsigned int i;
+
+	i = jhash2((const uint32_t *)key, sizeof(*key) / sizeof(uint32_t), 0);
+	for (i &= size - 1; table[i].count; i = (i + 1) & (size - 1)) {
+		if (memcmp(&table[i].key, key, sizeof(*key)) == 0)
+			break;
+	}
+	return &table[i];
+}
+
+static void ct_group_resize(void)
+{
+	unsigned int i, size = group.size ? group.size * 2 : CT_GROUP_HASHSIZE;
+	struct ct_group *table;
+
+	table = calloc(size, sizeof(struct ct_group));
+	if (table == NULL)
+		exit_error(OTHER_PROBLEM, "OOM");
+
+	for (i = 0; i < group.size; i++) {
+		if (group.table[i].count == 0)
+			continue;
+
+		*ct_group_lookup(table, size, &group.table[i].key) =
+			group.table[i];
+	}
+	free(group.table);
+	group.table = table;
+	group.size = size;
+}
+
+static void ct_group_add(const struct nf_conntrack *ct)
+{
+	struct ct_group_key key;
+	struct ct_group *g;
+
+	/* keep the load factor under 3/4 */
+	if ((group.num + 1) * 4 > group.size * 3)
+		ct_group_resize();
+
+	ct_group_key_build(&key, ct);
+
+	g = ct_group_lookup(group.table, group.size, &key);
+	if (g->count == 0) {
+		g->key = key;
+		group.num++;
+	}
+	g->count++;
+
+	if (nfct_attr_is_set(ct, ATTR_ORIG_COUNTER_PACKETS)) {
+		g->packets += nfct_get_attr_u64(ct, ATTR_ORIG_COUNTER_PACKETS) +
+			      nfct_get_attr_u64(ct, ATTR_REPL_COUNTER_PACKETS);
+		g->bytes += nfct_get_attr_u64(ct, ATTR_ORIG_COUNTER_BYTES) +
+			    nfct_get_attr_u64(ct, ATTR_REPL_COUNTER_BYTES);
+	}
+}
+
+static int ct_group_cmp(const void *a, const void *b)
+{
+	const struct ct_group *ga = a, *gb = b;
+
+	if (ga->count != gb->count)
+		return ga->count < gb->count ? 1 : -1;
+
+	return memcmp(&ga->key, &gb->key, sizeof(ga->key));
+}
+
+static void ct_group_snprintf_addr(char *buf, size_t len, uint8_t family,
+				   const uint32_t *addr)
+{
+	if (!inet_ntop(family == AF_INET6 ? AF_INET6 : AF_INET, addr,
+		       buf, len))
+		snprintf(buf, len, "-");
+}
+
+static void ct_group_print(const struct ct_group *g)
+{
+	char addr[INET6_ADDRSTRLEN];
+	bool json = output_mask & _O_JSON;
+
+	if (json)
+		printf("{\"count\":%u", g->count);
+	else
+		printf("%10u", g->count);
+
+	if (group.by & CT_GROUP_SRC) {
+		ct_group_snprintf_addr(addr, sizeof(addr), g->key.family,
+				       g->key.src);
+		printf(json ? ",\"src\":\"%s\"" : " src=%s", addr);
+	}
+	if (group.by & CT_GROUP_DST) {
+		ct_group_snprintf_addr(addr, sizeof(addr), g->key.family,
+				       g->key.dst);
+		printf(json ? ",\"dst\":\"%s\"" : " dst=%s", addr);
+	}
+	if (group.by & CT_GROUP_PROTO)
+		printf(json ? ",\"proto\":%u" : " proto=%u", g->key.proto);
+	if (group.by & CT_GROUP_DPORT) {
+		if (g->key.has_port)
+			printf(json ? ",\"dport\":%u" : " dport=%u",
+			       g->key.dport);
+		else if (!json)
+			printf(" dport=-");
+	}
+	if (group.by & CT_GROUP_STATE) {
+		if (g->key.state)
+			printf(json ? ",\"state\":\"%s\"" : " state=%s",
+			       ct_json_tcp_states[g->key.state - 1]);
+		else if (!json)
+			printf(" state=-");
+	}
+	if (group.by & CT_GROUP_MARK)
+		printf(json ? ",\"mark\":%u" : " mark=%u", g->key.mark);
+	if (group.by & CT_GROUP_ZONE)
+		printf(json ? ",\"zone\":%u" : " zone=%u", g->key.zone);
+
+	if (g->packets) {
+		printf(json ? ",\"packets\":%" PRIu64 ",\"bytes\":%" PRIu64 :
+			      " packets=%" PRIu64 " bytes=%" PRIu64,
+		       g->packets, g->bytes);
+	}
+	printf(json ? "}\n" : "\n");
+}
+
+/* compact the used slots at the head of the table, then sort them. */
+static void ct_group_dump(void)
+{
+	unsigned int i, num = 0;
+
+	for (i = 0; i < group.size; i++) {
+		if (group.table[i].count)
+			group.table[num++] = group.table[i];
+	}
+	qsort(group.table, num, sizeof(struct ct_group), ct_group_cmp);
+
+	if (group.top && num > group.top)
+		num = group.top;
+
+	for (i = 0; i < num; i++)
+		ct_group_print(&group.table[i]);
+
+	free(group.table);
+	group.table = NULL;
+	group.size = group.num = 0;
+}
+
+/*
+ * --split runs one dump per family or per zone, each one in a child process
+ * with its own netlink socket, so the kernel walks and serializes the table
+ * on several CPUs at once. The children write to a pipe and the parent only
+ * forwards complete records to stdout. With --ordered, each child writes to
+ * a temporary file instead, which is copied once all of them are done.
+ */
+#define CT_SPLIT_MAX	64
+#define CT_SPLIT_BUFSIZ	(1 << 16)
+
+enum {
+	CT_SPLIT_FAMILY	= 1,
+	CT_SPLIT_ZONE,
+};
+
+static struct {
+	unsigned int	mode;
+	bool		ordered;
+	uint16_t	zone[CT_SPLIT_MAX];
+	unsigned int	num;
+} split;
+
+static void parse_split(const char *arg)
+{
+	unsigned long zone;
+	char *endptr;
+
+	if (strcmp(arg, "family") == 0) {
+		split.mode = CT_SPLIT_FAMILY;
+		split.num = 2;
+		return;
+	}
+	if (strncmp(arg, "zone=", strlen("zone=")) != 0)
+		exit_error(PARAMETER_PROBLEM,
+			   "unknown --split mode `%s', use family or "
+			   "zone=ZONE[,...]", arg);
+
+	split.mode = CT_SPLIT_ZONE;
+	split.num = 0;
+	arg += strlen("zone=");
+	do {
+		zone = strtoul(arg, &endptr, 0);
+		if (endptr == arg || (*endptr != ',' && *endptr != '\0') ||
+		    zone > UINT16_MAX)
+			exit_error(PARAMETER_PROBLEM,
+				   "invalid zone in --split `%s'", arg);
+		if (split.num == CT_SPLIT_MAX)
+			exit_error(PARAMETER_PROBLEM,
+				   "too many zones in --split, maximum is %u",
+				   CT_SPLIT_MAX);
+
+		split.zone[split.num++] = zone;
+		arg = endptr + 1;
+	} while (*endptr == ',');
+}
+
+/*
+ * --watch dumps the table every interval and compares it with the previous
+ * dump. The two snapshots are hash tables keyed on the original tuple and
+ * the ID, each one with an arena that keeps the netlink message of every
+ * entry to print the removed ones. Both are reused from one interval to
+ * the next, they only grow with the table.
+ */
+struct ct_watch_key {
+	uint32_t	src[4];
+	uint32_t	dst[4];
+	uint32_t	id;
+	uint16_t	sport;
+	uint16_t	dport;
+	uint16_t	zone;
+	uint8_t		l3proto;
+	uint8_t		l4proto;
+};
+
+struct ct_watch_entry {
+	struct ct_watch_key	key;
+	uint32_t		status;
+	uint32_t		mark;
+	uint32_t		off;	/* message in the arena */
+	uint8_t			state;
+	uint8_t			used;
+	uint8_t			seen;
+};
+
+struct ct_watch_snap {
+	struct ct_watch_entry	*table;
+	unsigned int		size;
+	unsigned int		num;
+	char			*arena;
+	size_t			len;
+	size_t			cap;
+};
+
+#define CT_WATCH_HASHSIZE	4096	/* initial size, power of two */
+#define CT_WATCH_ARENA		(1 << 20)
+
+static struct {
+	unsigned int		interval;	/* milliseconds */
+	struct ct_watch_snap	snap[2];
+	struct ct_watch_snap	*cur;
+	struct ct_watch_snap	*prev;
+	bool			first;
+} watch;
+
+static volatile sig_atomic_t watch_stop;
+
+static void watch_sighandler(int s)
+{
+	watch_stop = 1;
+}
+
+static void parse_watch(const char *arg)
+{
+	char *endptr;
+	double secs;
+
+	secs = strtod(arg, &endptr);
+	if (endptr == arg || *endptr != '\0' || secs < 0.001 || secs > 86400)
+		exit_error(PARAMETER_PROBLEM, "invalid --watch interval `%s'",
+			   arg);
+
+	watch.interval = secs * 1000;
+}
+
+static int mnl_nfct_dump_cb(const struct nlmsghdr *nlh, void *data)
+{
+	unsigned int op_type = NFCT_O_DEFAULT;
+	unsigned int op_flags = 0;
+	struct ct_cmd *cmd = data;
+	struct nf_conntrack *ct;
+	char buf[4096];
+
+	ct = nfct_new();
+	if (ct == NULL)
+		return MNL_CB_OK;
+
+	nfct_nlmsg_parse(nlh, ct);
+	filter_recv++;
+
+	if (nfct_filter(cmd, ct, cur_tmpl)) {
+		filter_user++;
+		nfct_destroy(ct);
+		return MNL_CB_OK;
+	}
+
+	if (cmd->options & CT_OPT_GROUP_BY) {
+		ct_group_add(ct);
+		goto out;
+	}
+
+	if (output_mask & _O_BIN) {
+		fwrite(nlh, nlh->nlmsg_len, 1, stdout);
+		goto out;
+	}
+
+	if (output_mask & _O_JSON) {
+		ct_json_snprintf(buf, sizeof(buf), ct, NFCT_T_UNKNOWN);
+		goto done;
+	}
+
+	if (output_mask & _O_SAVE) {
+		ct_save_snprintf(buf, sizeof(buf), ct, labelmap, NFCT_T_NEW);
+		goto done;
+	}
 
 	if (output_mask & _O_XML) {
 		op_type = NFCT_O_XML;
@@ -2671,7 +3792,7 @@ static int mnl_nfct_dump_cb(const struct nlmsghdr *nlh, void *data)
 			     op_flags, labelmap);
 done:
 	printf("%s\n", buf);
-
+out:
 	nfct_destroy(ct);
 
 	counter++;
@@ -2743,6 +3864,232 @@ static void nfct_filter_init(const struct ct_cmd *cmd)
 	}
 }
 
+/*
+ * Attributes of the template that the kernel can match in the dump
+ * (CTA_FILTER), the rest of the filtering is still done by nfct_filter().
+ * The kernel only does exact matches, so --mask-src/--mask-dst keep the
+ * original addresses in userspace.
+ *
+ * The NAT address given to --src-nat/--dst-nat is the reply destination
+ * or source, so it is pushed as such. The rest of filter_nat() stays in
+ * userspace: --any-nat is an "or" of both directions, the NAT ports need
+ * the layer 4 protocol and the kernel has no filter for the NAT status
+ * bits.
+ */
+static const struct {
+	enum nf_conntrack_attr	attr;
+	unsigned int		mask;	/* not pushed with these options */
+} filter_dump_tuple_attrs[] = {
+	{ ATTR_ORIG_L3PROTO,	0 },
+	{ ATTR_ORIG_IPV4_SRC,	CT_OPT_MASK_SRC },
+	{ ATTR_ORIG_IPV4_DST,	CT_OPT_MASK_DST },
+	{ ATTR_ORIG_IPV6_SRC,	CT_OPT_MASK_SRC },
+	{ ATTR_ORIG_IPV6_DST,	CT_OPT_MASK_DST },
+	{ ATTR_REPL_IPV4_SRC,	0 },
+	{ ATTR_REPL_IPV4_DST,	0 },
+	{ ATTR_REPL_IPV6_SRC,	0 },
+	{ ATTR_REPL_IPV6_DST,	0 },
+	{ ATTR_ORIG_L4PROTO,	0 },
+	{ ATTR_ORIG_PORT_SRC,	0 },
+	{ ATTR_ORIG_PORT_DST,	0 },
+	{ ATTR_REPL_PORT_SRC,	0 },
+	{ ATTR_REPL_PORT_DST,	0 },
+	{ ATTR_ICMP_TYPE,	0 },
+	{ ATTR_ICMP_CODE,	0 },
+	{ ATTR_ICMP_ID,		0 },
+};
+
+static struct nf_conntrack *filter_dump_tuple;
+
+static unsigned int
+nfct_filter_dump_nat(struct nf_conntrack *tuple, const struct ct_cmd *cmd)
+{
+	const struct nf_conntrack *obj = cmd->tmpl.ct;
+	unsigned int num = 0;
+
+	if (cmd->options & CT_OPT_ANY_NAT)
+		return 0;
+
+	if ((cmd->options & CT_OPT_SRC_NAT) &&
+	    nfct_attr_is_set(obj, ATTR_SNAT_IPV4) &&
+	    !nfct_attr_is_set(tuple, ATTR_REPL_IPV4_DST)) {
+		nfct_set_attr_u32(tuple, ATTR_REPL_IPV4_DST,
+				  nfct_get_attr_u32(obj, ATTR_SNAT_IPV4));
+		num++;
+	}
+	if ((cmd->options & CT_OPT_DST_NAT) &&
+	    nfct_attr_is_set(obj, ATTR_DNAT_IPV4) &&
+	    !nfct_attr_is_set(tuple, ATTR_REPL_IPV4_SRC)) {
+		nfct_set_attr_u32(tuple, ATTR_REPL_IPV4_SRC,
+				  nfct_get_attr_u32(obj, ATTR_DNAT_IPV4));
+		num++;
+	}
+	if (num && !nfct_attr_is_set(tuple, ATTR_ORIG_L3PROTO))
+		nfct_set_attr_u8(tuple, ATTR_ORIG_L3PROTO, AF_INET);
+
+	return num;
+}
+
+static struct nf_conntrack *nfct_filter_dump_tuple(const struct ct_cmd *cmd)
+{
+	const struct nf_conntrack *obj = cmd->tmpl.ct;
+	struct nf_conntrack *tuple;
+	unsigned int i, num = 0;
+
+	if (!(cmd->options & (CT_OPT_TUPLE_ORIG | CT_OPT_TUPLE_REPL |
+			      CT_OPT_SRC_NAT | CT_OPT_DST_NAT)))
+		return NULL;
+
+	tuple = nfct_new();
+	if (tuple == NULL)
+		exit_error(OTHER_PROBLEM, "OOM");
+
+	for (i = 0; i < sizeof(filter_dump_tuple_attrs) /
+			sizeof(filter_dump_tuple_attrs[0]); i++) {
+		enum nf_conntrack_attr attr = filter_dump_tuple_attrs[i].attr;
+
+		if (cmd->options & filter_dump_tuple_attrs[i].mask ||
+		    !nfct_attr_is_set(obj, attr))
+			continue;
+
+		nfct_copy_attr(tuple, obj, attr);
+		if (attr != ATTR_ORIG_L3PROTO)
+			num++;
+	}
+	num += nfct_filter_dump_nat(tuple, cmd);
+	if (num == 0) {
+		nfct_destroy(tuple);
+		return NULL;
+	}
+	return tuple;
+}
+
+/* the dump filter, @kernel also pushes the tuple and the zone. */
+static struct nfct_filter_dump *
+nfct_filter_dump_build(const struct ct_cmd *cmd, bool status, bool kernel)
+{
+	struct nfct_filter_dump *filter_dump;
+
+	filter_dump = nfct_filter_dump_create();
+	if (filter_dump == NULL)
+		exit_error(OTHER_PROBLEM, "OOM");
+
+	if (cmd->tmpl.filter_mark_kernel_set) {
+		nfct_filter_dump_set_attr(filter_dump,
+					  NFCT_FILTER_DUMP_MARK,
+					  &cmd->tmpl.filter_mark_kernel);
+	}
+	nfct_filter_dump_set_attr_u8(filter_dump,
+				     NFCT_FILTER_DUMP_L3NUM,
+				     cmd->family);
+	if (status && cmd->tmpl.filter_status_kernel_set) {
+		nfct_filter_dump_set_attr(filter_dump,
+					  NFCT_FILTER_DUMP_STATUS,
+					  &cmd->tmpl.filter_status_kernel);
+	}
+	if (!kernel)
+		return filter_dump;
+
+	if (cmd->options & CT_OPT_ZONE) {
+		nfct_filter_dump_set_attr_u16(filter_dump,
+					      NFCT_FILTER_DUMP_ZONE,
+					      nfct_get_attr_u16(cmd->tmpl.ct,
+								ATTR_ZONE));
+	}
+	filter_dump_tuple = nfct_filter_dump_tuple(cmd);
+	if (filter_dump_tuple) {
+		nfct_filter_dump_set_attr(filter_dump,
+					  NFCT_FILTER_DUMP_TUPLE,
+					  filter_dump_tuple);
+	}
+	return filter_dump;
+}
+
+static void nfct_filter_dump_release(struct nfct_filter_dump *filter_dump)
+{
+	nfct_filter_dump_destroy(filter_dump);
+	if (filter_dump_tuple) {
+		nfct_destroy(filter_dump_tuple);
+		filter_dump_tuple = NULL;
+	}
+}
+
+static uint32_t filter_table_entries;
+
+static int nfct_table_entries_cb(const struct nlmsghdr *nlh, void *data)
+{
+	struct nlattr *tb[CTA_STATS_GLOBAL_MAX+1] = {};
+	struct nfgenmsg *nfg = mnl_nlmsg_get_payload(nlh);
+
+	mnl_attr_parse(nlh, sizeof(*nfg), nfct_stats_global_attr_cb, tb);
+
+	if (tb[CTA_STATS_GLOBAL_ENTRIES]) {
+		filter_table_entries =
+			ntohl(mnl_attr_get_u32(tb[CTA_STATS_GLOBAL_ENTRIES]));
+	}
+	return MNL_CB_OK;
+}
+
+static bool filter_kernel = true, filter_kernel_used;
+
+/*
+ * Dumps the table with the filter pushed into the kernel, if the kernel
+ * rejects it (no CTA_FILTER support for some attribute), the dump is done
+ * again with the basic filter and nfct_filter() does the rest.
+ */
+static int nfct_mnl_filter_dump(struct nfct_mnl_socket *sock, uint16_t type,
+				mnl_cb_t cb, struct ct_cmd *cmd, bool status)
+{
+	struct nfct_filter_dump *filter_dump;
+	int res;
+
+	filter_kernel_used = false;
+	filter_recv = filter_user = 0;
+
+	if (filter_kernel) {
+		filter_dump = nfct_filter_dump_build(cmd, status, true);
+		filter_kernel_used = filter_dump_tuple ||
+				     cmd->options & CT_OPT_ZONE;
+		if (filter_kernel_used) {
+			nfct_mnl_request(sock, NFNL_SUBSYS_CTNETLINK,
+					 AF_UNSPEC, IPCTNL_MSG_CT_GET_STATS, 0,
+					 nfct_table_entries_cb, NULL, NULL);
+		}
+
+		res = nfct_mnl_dump(sock, NFNL_SUBSYS_CTNETLINK, type,
+				    cb, cmd, filter_dump);
+		nfct_filter_dump_release(filter_dump);
+
+		if (!(res < 0 && filter_kernel_used && filter_recv == 0 &&
+		      (errno == EOPNOTSUPP || errno == EINVAL)))
+			return res;
+
+		filter_kernel = filter_kernel_used = false;
+	}
+
+	filter_dump = nfct_filter_dump_build(cmd, status, false);
+	res = nfct_mnl_dump(sock, NFNL_SUBSYS_CTNETLINK, type,
+			    cb, cmd, filter_dump);
+	nfct_filter_dump_release(filter_dump);
+
+	return res;
+}
+
+static void print_filter_stats(void)
+{
+	unsigned int kernel = 0;
+
+	if (filter_kernel_used && filter_table_entries > filter_recv)
+		kernel = filter_table_entries - filter_recv;
+
+	if (!filter_kernel_used && filter_user == 0)
+		return;
+
+	fprintf(stderr, "%s v%s (conntrack-tools): ", PROGNAME, VERSION);
+	fprintf(stderr, "%u flow entries have been filtered out by the "
+			"kernel, %u by conntrack.\n", kernel, filter_user);
+}
+
 static void merge_bitmasks(struct nfct_bitmask **current,
 			  struct nfct_bitmask *src)
 {
@@ -3023,6 +4370,14 @@ static void do_parse(struct ct_cmd *ct_cmd, int argc, char *argv[])
 			    (output_mask & (_O_EXT |_O_TMS |_O_ID | _O_KTMS | _O_CL | _O_XML)))
 				exit_error(OTHER_PROBLEM,
 					   "cannot combine save output with any other output type, use -o save only");
+			if ((output_mask & _O_JSON) &&
+			    (output_mask & ~_O_JSON))
+				exit_error(OTHER_PROBLEM,
+					   "cannot combine json output with any other output type, use -o json only");
+			if ((output_mask & _O_BIN) &&
+			    (output_mask & ~_O_BIN))
+				exit_error(OTHER_PROBLEM,
+					   "cannot combine binary output with any other output type, use -o binary only");
 			break;
 		case 'z':
 			options |= CT_OPT_ZERO;
@@ -3089,127 +4444,834 @@ static void do_parse(struct ct_cmd *ct_cmd, int argc, char *argv[])
 
 			labelmap_init();
 
-			if ((options & (CT_OPT_DEL_LABEL|CT_OPT_ADD_LABEL)) ==
-			    (CT_OPT_DEL_LABEL|CT_OPT_ADD_LABEL))
-				exit_error(OTHER_PROBLEM, "cannot use --label-add and "
-							"--label-del at the same time");
+			if ((options & (CT_OPT_DEL_LABEL|CT_OPT_ADD_LABEL)) ==
+			    (CT_OPT_DEL_LABEL|CT_OPT_ADD_LABEL))
+				exit_error(OTHER_PROBLEM, "cannot use --label-add and "
+							"--label-del at the same time");
+
+			if (c == '>') { /* DELETE */
+				char *tmp = get_optional_arg(argc, argv);
+				if (tmp == NULL) /* delete all labels */
+					break;
+				optarg = tmp;
+			}
+
+			char *optarg2 = strdup(optarg);
+			unsigned int max = parse_label_get_max(optarg);
+			struct nfct_bitmask * b = nfct_bitmask_new(max);
+			if (!b)
+				exit_error(OTHER_PROBLEM, "out of memory");
+
+			parse_label(b, optarg2);
+
+			/* join "-l foo -l bar" into single bitmask object */
+			if (c == 'l') {
+				merge_bitmasks(&tmpl->label, b);
+			} else {
+				merge_bitmasks(&tmpl->label_modify, b);
+			}
+
+			free(optarg2);
+			break;
+		case 'a':
+			fprintf(stderr, "WARNING: ignoring -%c, "
+					"deprecated option.\n", c);
+			break;
+		case 'f':
+			options |= CT_OPT_FAMILY;
+			if (strncmp(optarg, "ipv4", strlen("ipv4")) == 0)
+				set_family(&family, AF_INET);
+			else if (strncmp(optarg, "ipv6", strlen("ipv6")) == 0)
+				set_family(&family, AF_INET6);
+			else
+				exit_error(PARAMETER_PROBLEM,
+					   "`%s' unsupported protocol",
+					   optarg);
+			break;
+		case 'b':
+			socketbuffersize = atol(optarg);
+			options |= CT_OPT_BUFFERSIZE;
+			break;
+		case '*':
+			options |= CT_OPT_GROUP_BY;
+			parse_group_by(optarg);
+			break;
+		case '&':
+			options |= CT_OPT_SPLIT;
+			parse_split(optarg);
+			break;
+		case '@':
+			split.ordered = true;
+			break;
+		case '~':
+			parse_watch(optarg);
+			break;
+		case '#': {
+			unsigned long top;
+			char *endptr;
+
+			top = strtoul(optarg, &endptr, 0);
+			if (endptr == optarg || *endptr != '\0' ||
+			    top == 0 || top > UINT_MAX)
+				exit_error(PARAMETER_PROBLEM,
+					   "invalid --top value `%s'", optarg);
+			group.top = top;
+			break;
+		}
+		case ':':
+			exit_error(PARAMETER_PROBLEM,
+				   "option `%s' requires an "
+				   "argument", argv[optind-1]);
+		case '?':
+			exit_error(PARAMETER_PROBLEM,
+				   "unknown option `%s'", argv[optind-1]);
+			break;
+		default:
+			if (h && h->parse_opts &&
+			    !h->parse_opts(c - h->option_offset, tmpl->ct,
+					   tmpl->exptuple, tmpl->mask,
+					   &l4flags))
+				exit_error(PARAMETER_PROBLEM, "parse error");
+			break;
+		}
+	}
+
+	/* default family only for the following commands */
+	if (family == AF_UNSPEC) {
+		switch (command) {
+		case CT_LIST:
+		case CT_UPDATE:
+		case CT_DELETE:
+		case CT_GET:
+		case CT_FLUSH:
+		case CT_EVENT:
+			break;
+		default:
+			family = AF_INET;
+			break;
+		}
+	}
+
+
+	/* we cannot check these combinations with generic_opt_check. */
+	if (group.top && !(options & CT_OPT_GROUP_BY))
+		exit_error(PARAMETER_PROBLEM, "`--top' requires `--group-by'");
+	if ((options & CT_OPT_GROUP_BY) &&
+	    (output_mask & ~_O_JSON))
+		exit_error(PARAMETER_PROBLEM,
+			   "`--group-by' only supports the json output");
+	if (watch.interval &&
+	    (command != CT_LIST || type == CT_TABLE_DYING ||
+	     type == CT_TABLE_UNCONFIRMED ||
+	     options & (CT_OPT_GROUP_BY | CT_OPT_SPLIT) ||
+	     output_mask & (_O_XML | _O_BIN)))
+		exit_error(PARAMETER_PROBLEM,
+			   "`--watch' can only be used with -L on the "
+			   "conntrack table, without `--group-by', `--split', "
+			   "xml or binary output");
+	if (split.ordered && !(options & CT_OPT_SPLIT))
+		exit_error(PARAMETER_PROBLEM, "`--ordered' requires `--split'");
+	if (options & CT_OPT_SPLIT) {
+		if (options & CT_OPT_GROUP_BY || output_mask & _O_XML ||
+		    type == CT_TABLE_DYING || type == CT_TABLE_UNCONFIRMED)
+			exit_error(PARAMETER_PROBLEM,
+				   "`--split' cannot be combined with "
+				   "`--group-by', xml output or this table");
+		if (split.mode == CT_SPLIT_FAMILY && family != AF_UNSPEC)
+			exit_error(PARAMETER_PROBLEM,
+				   "`--split family' cannot be used with a "
+				   "given family");
+		if (split.mode == CT_SPLIT_ZONE && options & CT_OPT_ZONE)
+			exit_error(PARAMETER_PROBLEM,
+				   "`--split zone' cannot be used with `--zone'");
+	}
+
+	if (options & CT_OPT_ANY_NAT &&
+	   ((options & CT_OPT_SRC_NAT) || (options & CT_OPT_DST_NAT))) {
+		exit_error(PARAMETER_PROBLEM, "cannot specify `--src-nat' or "
+					      "`--dst-nat' with `--any-nat'");
+	}
+	cmd = bit2cmd(command);
+	res = generic_opt_check(options, NUMBER_OF_OPT,
+				commands_v_options[cmd], optflags,
+				addr_valid_flags, ADDR_VALID_FLAGS_MAX,
+				&partial);
+	if (!res) {
+		switch(partial) {
+		case -1:
+		case 0:
+			exit_error(PARAMETER_PROBLEM, "you have to specify "
+						      "`--src' and `--dst'");
+			break;
+		case 1:
+			exit_error(PARAMETER_PROBLEM, "you have to specify "
+						      "`--reply-src' and "
+						      "`--reply-dst'");
+			break;
+		}
+	}
+	if (!(command & CT_HELP) && h && h->final_check)
+		h->final_check(l4flags, cmd, tmpl->ct);
+
+	if ((output_mask & _O_BIN) &&
+	    !(command & (CT_LIST | CT_GET | CT_EVENT)))
+		exit_error(PARAMETER_PROBLEM,
+			   "binary output is only supported by -L, -G and -E");
+
+	free_options();
+
+	ct_cmd->command = command;
+	ct_cmd->cmd = cmd;
+	ct_cmd->options = options;
+	ct_cmd->family = family;
+	ct_cmd->type = type;
+	ct_cmd->protonum = protonum;
+	ct_cmd->event_mask = event_mask;
+	ct_cmd->socketbuffersize = socketbuffersize;
+}
+
+static void ct_create_prepare(struct ct_cmd *cmd)
+{
+	if ((cmd->options & CT_OPT_ORIG) && !(cmd->options & CT_OPT_REPL))
+		nfct_setobjopt(cmd->tmpl.ct, NFCT_SOPT_SETUP_REPLY);
+	else if (!(cmd->options & CT_OPT_ORIG) && (cmd->options & CT_OPT_REPL))
+		nfct_setobjopt(cmd->tmpl.ct, NFCT_SOPT_SETUP_ORIGINAL);
+
+	if (cmd->options & CT_OPT_MARK)
+		nfct_set_attr_u32(cmd->tmpl.ct, ATTR_MARK, cmd->tmpl.mark.value);
+
+	if (cmd->options & CT_OPT_ADD_LABEL)
+		nfct_set_attr(cmd->tmpl.ct, ATTR_CONNLABELS,
+				xnfct_bitmask_clone(cmd->tmpl.label_modify));
+}
+
+static int ct_list_dump(struct ct_cmd *cmd, struct nfct_mnl_socket *sock)
+{
+	uint16_t type = IPCTNL_MSG_CT_GET;
+
+	if (cmd->options & CT_OPT_ZERO)
+		type = IPCTNL_MSG_CT_GET_CTRZERO;
+
+	return nfct_mnl_filter_dump(sock, type, mnl_nfct_dump_cb, cmd, true);
+}
+
+static int ct_delete_dump(struct ct_cmd *cmd, struct nfct_mnl_socket *sock)
+{
+	struct nfct_mnl_socket *modifier_sock = &_modifier_sock;
+	int res;
+
+	if (nfct_mnl_socket_check_open(modifier_sock, 0) < 0)
+		exit_error(OTHER_PROBLEM, "Can't open handler");
+	ct_batch_check_init(&_modifier_batch, modifier_sock);
+
+	res = nfct_mnl_filter_dump(sock, IPCTNL_MSG_CT_GET,
+				   mnl_nfct_delete_cb, cmd, false);
+	res |= ct_batch_flush(&_modifier_batch);
+
+	return res;
+}
+
+/* filled in by the children, in memory shared with the parent. */
+struct ct_split_stats {
+	int		counter;
+	unsigned int	filter_recv;
+	unsigned int	filter_user;
+	uint32_t	filter_table_entries;
+	bool		filter_kernel_used;
+};
+
+struct ct_split_worker {
+	pid_t		pid;
+	int		fd;
+	FILE		*tmp;
+	char		*buf;
+	size_t		len;
+};
+
+static void __attribute__((noreturn))
+ct_split_child(struct ct_cmd *cmd, unsigned int i,
+	       int (*fn)(struct ct_cmd *cmd, struct nfct_mnl_socket *sock),
+	       struct ct_split_stats *stats)
+{
+	struct nfct_mnl_socket sock = {};
+	int res;
+
+	/* do not share the sockets of the parent. */
+	ct_batch_check_fini(&_modifier_batch);
+	nfct_mnl_socket_check_close(&_modifier_sock);
+
+	if (split.mode == CT_SPLIT_FAMILY) {
+		cmd->family = i == 0 ? AF_INET : AF_INET6;
+		filter_family = cmd->family;
+	} else {
+		nfct_set_attr_u16(cmd->tmpl.ct, ATTR_ZONE, split.zone[i]);
+		cmd->options |= CT_OPT_ZONE;
+	}
+
+	if (nfct_mnl_socket_open(&sock, 0) < 0)
+		_exit(OTHER_PROBLEM);
+
+	counter = 0;
+	res = fn(cmd, &sock);
+
+	stats->counter = counter;
+	stats->filter_recv = filter_recv;
+	stats->filter_user = filter_user;
+	stats->filter_table_entries = filter_table_entries;
+	stats->filter_kernel_used = filter_kernel_used;
+
+	fflush(stdout);
+	_exit(res < 0 ? OTHER_PROBLEM : 0);
+}
+
+/* length of the complete records at the head of the buffer. */
+static size_t ct_split_records(const char *buf, size_t len)
+{
+	struct nlmsghdr nlh;
+	size_t n;
+
+	if (!(output_mask & _O_BIN)) {
+		for (n = len; n > 0 && buf[n - 1] != '\n'; n--)
+			;
+		return n;
+	}
+
+	for (n = 0; len - n >= sizeof(nlh); n += nlh.nlmsg_len) {
+		memcpy(&nlh, buf + n, sizeof(nlh));
+		if (nlh.nlmsg_len < sizeof(nlh) || nlh.nlmsg_len > len - n)
+			break;
+	}
+	return n;
+}
+
+static int ct_split_forward(struct ct_split_worker *w, unsigned int num)
+{
+	struct pollfd pfd[CT_SPLIT_MAX];
+	unsigned int i, active = num;
+	ssize_t ret;
+	size_t n;
+
+	while (active) {
+		for (i = 0; i < num; i++) {
+			pfd[i].fd = w[i].fd;
+			pfd[i].events = POLLIN;
+			pfd[i].revents = 0;
+		}
+		if (poll(pfd, num, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		for (i = 0; i < num; i++) {
+			if (pfd[i].revents == 0)
+				continue;
+
+			ret = read(w[i].fd, w[i].buf + w[i].len,
+				   CT_SPLIT_BUFSIZ - w[i].len);
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret <= 0) {
+				/* the child is gone, flush what is left. */
+				fwrite(w[i].buf, 1, w[i].len, stdout);
+				close(w[i].fd);
+				w[i].fd = -1;
+				active--;
+				continue;
+			}
+			w[i].len += ret;
+
+			n = ct_split_records(w[i].buf, w[i].len);
+			fwrite(w[i].buf, 1, n, stdout);
+			memmove(w[i].buf, w[i].buf + n, w[i].len - n);
+			w[i].len -= n;
+		}
+	}
+
+	return 0;
+}
+
+static void ct_split_copy(FILE *tmp)
+{
+	char buf[CT_SPLIT_BUFSIZ];
+	size_t n;
+
+	rewind(tmp);
+	while ((n = fread(buf, 1, sizeof(buf), tmp)) > 0)
+		fwrite(buf, 1, n, stdout);
+	fclose(tmp);
+}
+
+static int ct_split_run(struct ct_cmd *cmd,
+			int (*fn)(struct ct_cmd *cmd,
+				  struct nfct_mnl_socket *sock))
+{
+	struct ct_split_worker w[CT_SPLIT_MAX] = {};
+	struct ct_split_stats *stats;
+	unsigned int i;
+	int fds[2], status, res = 0;
+
+	stats = mmap(NULL, split.num * sizeof(*stats), PROT_READ | PROT_WRITE,
+		     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (stats == MAP_FAILED)
+		exit_error(OTHER_PROBLEM, "OOM");
+	memset(stats, 0, split.num * sizeof(*stats));
+
+	/* the children inherit the stdio buffers. */
+	fflush(stdout);
+
+	for (i = 0; i < split.num; i++) {
+		if (split.ordered) {
+			w[i].tmp = tmpfile();
+			if (w[i].tmp == NULL)
+				exit_error(OTHER_PROBLEM,
+					   "cannot create temporary file: %s",
+					   strerror(errno));
+			fds[1] = fileno(w[i].tmp);
+		} else {
+			w[i].buf = malloc(CT_SPLIT_BUFSIZ);
+			if (w[i].buf == NULL || pipe(fds) < 0)
+				exit_error(OTHER_PROBLEM, "OOM");
+			w[i].fd = fds[0];
+		}
+
+		w[i].pid = fork();
+		if (w[i].pid < 0)
+			exit_error(OTHER_PROBLEM, "cannot fork: %s",
+				   strerror(errno));
+		if (w[i].pid == 0) {
+			if (dup2(fds[1], STDOUT_FILENO) < 0)
+				_exit(OTHER_PROBLEM);
+			if (!split.ordered) {
+				close(fds[0]);
+				close(fds[1]);
+			}
+			ct_split_child(cmd, i, fn, &stats[i]);
+		}
+		if (!split.ordered)
+			close(fds[1]);
+	}
+
+	if (!split.ordered && ct_split_forward(w, split.num) < 0)
+		res = -1;
+
+	for (i = 0; i < split.num; i++) {
+		if (waitpid(w[i].pid, &status, 0) < 0 ||
+		    !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			res = -1;
+		free(w[i].buf);
+	}
+
+	for (i = 0; i < split.num; i++) {
+		if (split.ordered)
+			ct_split_copy(w[i].tmp);
+
+		counter += stats[i].counter;
+		filter_recv += stats[i].filter_recv;
+		filter_user += stats[i].filter_user;
+		if (stats[i].filter_kernel_used) {
+			filter_kernel_used = true;
+			filter_table_entries = stats[i].filter_table_entries;
+		}
+	}
+	fflush(stdout);
+	munmap(stats, split.num * sizeof(*stats));
+
+	return res;
+}
+
+static void ct_watch_key_build(struct ct_watch_key *key,
+			       const struct nf_conntrack *ct)
+{
+	memset(key, 0, sizeof(*key));
+
+	key->l3proto = nfct_get_attr_u8(ct, ATTR_ORIG_L3PROTO);
+	key->l4proto = nfct_get_attr_u8(ct, ATTR_ORIG_L4PROTO);
+	if (key->l3proto == AF_INET6) {
+		memcpy(key->src, nfct_get_attr(ct, ATTR_ORIG_IPV6_SRC),
+		       sizeof(key->src));
+		memcpy(key->dst, nfct_get_attr(ct, ATTR_ORIG_IPV6_DST),
+		       sizeof(key->dst));
+	} else {
+		key->src[0] = nfct_get_attr_u32(ct, ATTR_ORIG_IPV4_SRC);
+		key->dst[0] = nfct_get_attr_u32(ct, ATTR_ORIG_IPV4_DST);
+	}
+
+	if (nfct_attr_is_set(ct, ATTR_ORIG_PORT_SRC)) {
+		key->sport = nfct_get_attr_u16(ct, ATTR_ORIG_PORT_SRC);
+		key->dport = nfct_get_attr_u16(ct, ATTR_ORIG_PORT_DST);
+	} else if (nfct_attr_is_set(ct, ATTR_ICMP_TYPE)) {
+		key->sport = nfct_get_attr_u16(ct, ATTR_ICMP_ID);
+		key->dport = nfct_get_attr_u8(ct, ATTR_ICMP_TYPE) << 8 |
+			     nfct_get_attr_u8(ct, ATTR_ICMP_CODE);
+	}
+	key->zone = nfct_get_attr_u16(ct, ATTR_ZONE);
+	key->id = nfct_get_attr_u32(ct, ATTR_ID);
+}
+
+static struct ct_watch_entry *
+ct_watch_lookup(const struct ct_watch_snap *snap, const struct ct_watch_key *key)
+{
+	unsigned int i;
+
+	i = jhash2((const uint32_t *)key, sizeof(*key) / sizeof(uint32_t), 0);
+	for (i &= snap->size - 1; snap->table[i].used;
+	     i = (i + 1) & (snap->size - 1)) {
+		if (memcmp(&snap->table[i].key, key, sizeof(*key)) == 0)
+			break;
+	}
+	return &snap->table[i];
+}
+
+static void ct_watch_resize(struct ct_watch_snap *snap)
+{
+	struct ct_watch_snap old = *snap;
+	unsigned int i;
+
+	snap->size = old.size ? old.size * 2 : CT_WATCH_HASHSIZE;
+	snap->table = calloc(snap->size, sizeof(struct ct_watch_entry));
+	if (snap->table == NULL)
+		exit_error(OTHER_PROBLEM, "OOM");
+
+	for (i = 0; i < old.size; i++) {
+		if (old.table[i].used)
+			*ct_watch_lookup(snap, &old.table[i].key) =
+				old.table[i];
+	}
+	free(old.table);
+}
+
+static void ct_watch_add(struct ct_watch_snap *snap,
+			 const struct nlmsghdr *nlh,
+			 const struct nf_conntrack *ct,
+			 const struct ct_watch_key *key)
+{
+	size_t len = NLMSG_ALIGN(nlh->nlmsg_len);
+	struct ct_watch_entry *e;
+
+	if ((snap->num + 1) * 4 > snap->size * 3)
+		ct_watch_resize(snap);
+
+	if (snap->len + len > snap->cap) {
+		size_t cap = snap->cap ? snap->cap : CT_WATCH_ARENA;
+		char *arena;
+
+		while (snap->len + len > cap)
+			cap *= 2;
+		arena = realloc(snap->arena, cap);
+		if (arena == NULL)
+			exit_error(OTHER_PROBLEM, "OOM");
+		snap->arena = arena;
+		snap->cap = cap;
+	}
+
+	e = ct_watch_lookup(snap, key);
+	if (!e->used)
+		snap->num++;
+
+	e->key = *key;
+	e->status = nfct_get_attr_u32(ct, ATTR_STATUS);
+	e->mark = nfct_get_attr_u32(ct, ATTR_MARK);
+	e->state = nfct_get_attr_u8(ct, ATTR_TCP_STATE);
+	e->off = snap->len;
+	e->used = 1;
+	e->seen = 0;
+
+	memcpy(snap->arena + snap->len, nlh, nlh->nlmsg_len);
+	snap->len += len;
+}
+
+static void ct_watch_print(const struct nf_conntrack *ct,
+			   enum nf_conntrack_msg_type type)
+{
+	unsigned int op_flags = 0;
+	char buf[4096];
+
+	if (output_mask & _O_JSON) {
+		ct_json_snprintf(buf, sizeof(buf), ct, type);
+	} else if (output_mask & _O_SAVE) {
+		ct_save_snprintf(buf, sizeof(buf), ct, labelmap, type);
+	} else {
+		if (output_mask & _O_EXT)
+			op_flags = NFCT_OF_SHOW_LAYER3;
+		if (output_mask & _O_KTMS)
+			op_flags |= NFCT_OF_TIMESTAMP;
+		if (output_mask & _O_ID)
+			op_flags |= NFCT_OF_ID;
+
+		nfct_snprintf_labels(buf, sizeof(buf), ct, type,
+				     NFCT_O_DEFAULT, op_flags, labelmap);
+	}
+	printf("%s\n", buf);
+	counter++;
+}
+
+static int mnl_nfct_watch_cb(const struct nlmsghdr *nlh, void *data)
+{
+	struct ct_cmd *cmd = data;
+	struct ct_watch_entry *e;
+	struct ct_watch_key key;
+	struct nf_conntrack *ct;
+
+	ct = nfct_new();
+	if (ct == NULL)
+		return MNL_CB_OK;
+
+	nfct_nlmsg_parse(nlh, ct);
+	filter_recv++;
+
+	if (nfct_filter(cmd, ct, cur_tmpl)) {
+		filter_user++;
+		goto out;
+	}
+
+	ct_watch_key_build(&key, ct);
+	ct_watch_add(watch.cur, nlh, ct, &key);
+
+	if (watch.first)
+		goto out;
+
+	e = ct_watch_lookup(watch.prev, &key);
+	if (!e->used) {
+		ct_watch_print(ct, NFCT_T_NEW);
+	} else {
+		e->seen = 1;
+		if (e->status != nfct_get_attr_u32(ct, ATTR_STATUS) ||
+		    e->mark != nfct_get_attr_u32(ct, ATTR_MARK) ||
+		    e->state != nfct_get_attr_u8(ct, ATTR_TCP_STATE))
+			ct_watch_print(ct, NFCT_T_UPDATE);
+	}
+out:
+	nfct_destroy(ct);
+	return MNL_CB_OK;
+}
+
+/* the entries of the previous dump that are not in the last one. */
+static void ct_watch_removed(const struct ct_watch_snap *snap)
+{
+	struct nf_conntrack *ct;
+	unsigned int i;
+
+	for (i = 0; i < snap->size; i++) {
+		const struct ct_watch_entry *e = &snap->table[i];
+
+		if (!e->used || e->seen)
+			continue;
+
+		ct = nfct_new();
+		if (ct == NULL)
+			exit_error(OTHER_PROBLEM, "OOM");
+
+		nfct_nlmsg_parse((const struct nlmsghdr *)(snap->arena + e->off),
+				 ct);
+		ct_watch_print(ct, NFCT_T_DESTROY);
+		nfct_destroy(ct);
+	}
+}
+
+static int ct_watch_run(struct ct_cmd *cmd, struct nfct_mnl_socket *sock)
+{
+	uint16_t type = IPCTNL_MSG_CT_GET;
+	struct ct_watch_snap *tmp;
+	unsigned int i;
+	int res = 0;
 
-			if (c == '>') { /* DELETE */
-				char *tmp = get_optional_arg(argc, argv);
-				if (tmp == NULL) /* delete all labels */
-					break;
-				optarg = tmp;
-			}
+	if (cmd->options & CT_OPT_ZERO)
+		type = IPCTNL_MSG_CT_GET_CTRZERO;
 
-			char *optarg2 = strdup(optarg);
-			unsigned int max = parse_label_get_max(optarg);
-			struct nfct_bitmask * b = nfct_bitmask_new(max);
-			if (!b)
-				exit_error(OTHER_PROBLEM, "out of memory");
+	watch.cur = &watch.snap[0];
+	watch.prev = &watch.snap[1];
+	watch.first = true;
 
-			parse_label(b, optarg2);
+	signal(SIGINT, watch_sighandler);
+	signal(SIGTERM, watch_sighandler);
 
-			/* join "-l foo -l bar" into single bitmask object */
-			if (c == 'l') {
-				merge_bitmasks(&tmpl->label, b);
-			} else {
-				merge_bitmasks(&tmpl->label_modify, b);
-			}
+	while (!watch_stop) {
+		watch.cur->num = 0;
+		watch.cur->len = 0;
+		if (watch.cur->table) {
+			memset(watch.cur->table, 0,
+			       watch.cur->size * sizeof(struct ct_watch_entry));
+		}
 
-			free(optarg2);
-			break;
-		case 'a':
-			fprintf(stderr, "WARNING: ignoring -%c, "
-					"deprecated option.\n", c);
-			break;
-		case 'f':
-			options |= CT_OPT_FAMILY;
-			if (strncmp(optarg, "ipv4", strlen("ipv4")) == 0)
-				set_family(&family, AF_INET);
-			else if (strncmp(optarg, "ipv6", strlen("ipv6")) == 0)
-				set_family(&family, AF_INET6);
-			else
-				exit_error(PARAMETER_PROBLEM,
-					   "`%s' unsupported protocol",
-					   optarg);
-			break;
-		case 'b':
-			socketbuffersize = atol(optarg);
-			options |= CT_OPT_BUFFERSIZE;
-			break;
-		case ':':
-			exit_error(PARAMETER_PROBLEM,
-				   "option `%s' requires an "
-				   "argument", argv[optind-1]);
-		case '?':
-			exit_error(PARAMETER_PROBLEM,
-				   "unknown option `%s'", argv[optind-1]);
-			break;
-		default:
-			if (h && h->parse_opts &&
-			    !h->parse_opts(c - h->option_offset, tmpl->ct,
-					   tmpl->exptuple, tmpl->mask,
-					   &l4flags))
-				exit_error(PARAMETER_PROBLEM, "parse error");
+		res = nfct_mnl_filter_dump(sock, type, mnl_nfct_watch_cb,
+					   cmd, true);
+		if (res < 0)
 			break;
-		}
+
+		if (!watch.first)
+			ct_watch_removed(watch.prev);
+		fflush(stdout);
+
+		tmp = watch.prev;
+		watch.prev = watch.cur;
+		watch.cur = tmp;
+		watch.first = false;
+
+		/* a signal interrupts the wait */
+		if (!watch_stop)
+			poll(NULL, 0, watch.interval);
 	}
 
-	/* default family only for the following commands */
-	if (family == AF_UNSPEC) {
-		switch (command) {
-		case CT_LIST:
-		case CT_UPDATE:
-		case CT_DELETE:
-		case CT_GET:
-		case CT_FLUSH:
-		case CT_EVENT:
-			break;
-		default:
-			family = AF_INET;
-			break;
-		}
+	for (i = 0; i < 2; i++) {
+		free(watch.snap[i].table);
+		free(watch.snap[i].arena);
 	}
+	memset(&watch, 0, sizeof(watch));
 
+	return res;
+}
 
-	/* we cannot check this combination with generic_opt_check. */
-	if (options & CT_OPT_ANY_NAT &&
-	   ((options & CT_OPT_SRC_NAT) || (options & CT_OPT_DST_NAT))) {
-		exit_error(PARAMETER_PROBLEM, "cannot specify `--src-nat' or "
-					      "`--dst-nat' with `--any-nat'");
+/*
+ * The binary output starts with this header, followed by the ctnetlink
+ * messages as received from the kernel. The netlink headers are in host byte
+ * order, so the file can only be loaded on a host with the same byte order.
+ */
+#define CT_BINARY_MAGIC		"\x89" "CTB"
+#define CT_BINARY_VERSION	1
+#define CT_BINARY_BYTEORDER	0x01020304
+
+struct ct_binary_hdr {
+	char		magic[4];
+	uint16_t	version;	/* network byte order */
+	uint16_t	len;		/* header length, network byte order */
+	uint32_t	byteorder;	/* CT_BINARY_BYTEORDER, host byte order */
+};
+
+static void ct_binary_header(void)
+{
+	struct ct_binary_hdr hdr = {
+		.version	= htons(CT_BINARY_VERSION),
+		.len		= htons(sizeof(hdr)),
+		.byteorder	= CT_BINARY_BYTEORDER,
+	};
+
+	memcpy(hdr.magic, CT_BINARY_MAGIC, sizeof(hdr.magic));
+	fwrite(&hdr, sizeof(hdr), 1, stdout);
+}
+
+static bool ct_binary_file(FILE *file)
+{
+	int c = getc(file);
+
+	if (c == EOF)
+		return false;
+
+	ungetc(c, file);
+	return c == (unsigned char)CT_BINARY_MAGIC[0];
+}
+
+static void ct_binary_check_header(FILE *file)
+{
+	struct ct_binary_hdr hdr;
+	int len;
+
+	if (fread(&hdr, sizeof(hdr), 1, file) != 1 ||
+	    memcmp(hdr.magic, CT_BINARY_MAGIC, sizeof(hdr.magic)) != 0)
+		exit_error(PARAMETER_PROBLEM, "Not a conntrack binary file");
+	if (ntohs(hdr.version) != CT_BINARY_VERSION)
+		exit_error(PARAMETER_PROBLEM,
+			   "Unsupported binary file version %u",
+			   ntohs(hdr.version));
+	if (hdr.byteorder != CT_BINARY_BYTEORDER)
+		exit_error(PARAMETER_PROBLEM, "The binary file has been "
+			   "written on a host with a different byte order");
+
+	/* skip the fields added by later versions, if any. */
+	for (len = ntohs(hdr.len) - sizeof(hdr); len > 0; len--) {
+		if (getc(file) == EOF)
+			exit_error(PARAMETER_PROBLEM, "Truncated binary file");
 	}
-	cmd = bit2cmd(command);
-	res = generic_opt_check(options, NUMBER_OF_OPT,
-				commands_v_options[cmd], optflags,
-				addr_valid_flags, ADDR_VALID_FLAGS_MAX,
-				&partial);
-	if (!res) {
-		switch(partial) {
-		case -1:
-		case 0:
-			exit_error(PARAMETER_PROBLEM, "you have to specify "
-						      "`--src' and `--dst'");
+}
+
+/*
+ * Loads a binary file in batches: the entries of the dumps and of the new
+ * events are added, the destroy events are deleted. The records are parsed
+ * as they are read, there is no text to tokenize.
+ */
+static int ct_binary_load(FILE *file, struct nfct_mnl_socket *sock)
+{
+	uint32_t buf[MNL_SOCKET_BUFFER_SIZE / sizeof(uint32_t)];
+	struct nlmsghdr *nlh = (struct nlmsghdr *)buf;
+	struct ct_batch_req *req;
+	struct nf_conntrack *ct;
+	unsigned int recno = 0;
+	struct ct_batch batch;
+	int res = 0;
+
+	ct_binary_check_header(file);
+
+	ct_batch_init(&batch, sock);
+	while (fread(nlh, sizeof(*nlh), 1, file) == 1) {
+		uint16_t type = nlh->nlmsg_type & 0xff;
+		uint32_t status;
+
+		recno++;
+		if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(struct nfgenmsg)) ||
+		    nlh->nlmsg_len > sizeof(buf)) {
+			fprintf(stderr, "%s v%s (conntrack-tools): record %u: "
+				"bad length %u\n", PROGNAME, VERSION, recno,
+				nlh->nlmsg_len);
+			res = -1;
 			break;
-		case 1:
-			exit_error(PARAMETER_PROBLEM, "you have to specify "
-						      "`--reply-src' and "
-						      "`--reply-dst'");
+		}
+		if (fread(nlh + 1, nlh->nlmsg_len - sizeof(*nlh), 1,
+			  file) != 1) {
+			fprintf(stderr, "%s v%s (conntrack-tools): record %u: "
+				"truncated\n", PROGNAME, VERSION, recno);
+			res = -1;
 			break;
 		}
-	}
-	if (!(command & CT_HELP) && h && h->final_check)
-		h->final_check(l4flags, cmd, tmpl->ct);
 
-	free_options();
+		if ((nlh->nlmsg_type >> 8) != NFNL_SUBSYS_CTNETLINK ||
+		    (type != IPCTNL_MSG_CT_NEW && type != IPCTNL_MSG_CT_DELETE))
+			continue;
 
-	ct_cmd->command = command;
-	ct_cmd->cmd = cmd;
-	ct_cmd->options = options;
-	ct_cmd->family = family;
-	ct_cmd->type = type;
-	ct_cmd->protonum = protonum;
-	ct_cmd->event_mask = event_mask;
-	ct_cmd->socketbuffersize = socketbuffersize;
+		ct = nfct_new();
+		if (ct == NULL)
+			exit_error(OTHER_PROBLEM, "OOM");
+
+		if (nfct_nlmsg_parse(nlh, ct) < 0) {
+			fprintf(stderr, "%s v%s (conntrack-tools): record %u: "
+				"cannot parse\n", PROGNAME, VERSION, recno);
+			res = -1;
+			nfct_destroy(ct);
+			continue;
+		}
+
+		if (type == IPCTNL_MSG_CT_DELETE) {
+			req = ct_batch_add(&batch, IPCTNL_MSG_CT_DELETE, 0,
+					   nfct_get_attr_u8(ct, ATTR_ORIG_L3PROTO),
+					   ct);
+			if (req)
+				req->command = CT_DELETE;
+		} else {
+			/* we hit error if we try to change the expected bit */
+			if (nfct_attr_is_set(ct, ATTR_STATUS)) {
+				status = nfct_get_attr_u32(ct, ATTR_STATUS);
+				nfct_set_attr_u32(ct, ATTR_STATUS,
+						  status & ~IPS_EXPECTED);
+			}
+			req = ct_batch_add(&batch, IPCTNL_MSG_CT_NEW,
+					   NLM_F_CREATE | NLM_F_EXCL,
+					   nfct_get_attr_u8(ct, ATTR_ORIG_L3PROTO),
+					   ct);
+			if (req)
+				req->command = CT_ADD;
+		}
+		if (req == NULL) {
+			fprintf(stderr, "%s v%s (conntrack-tools): record %u: "
+				"%s\n", PROGNAME, VERSION, recno,
+				strerror(errno));
+		} else {
+			req->count = true;
+		}
+		nfct_destroy(ct);
+	}
+	res |= ct_batch_flush(&batch);
+	ct_batch_fini(&batch);
+
+	return res;
 }
 
 static int do_command_ct(const char *progname, struct ct_cmd *cmd,
@@ -3217,20 +5279,27 @@ static int do_command_ct(const char *progname, struct ct_cmd *cmd,
 {
 	struct nfct_mnl_socket *modifier_sock = &_modifier_sock;
 	struct nfct_mnl_socket *event_sock = &_event_sock;
-	struct nfct_filter_dump *filter_dump;
 	int res = 0;
 
+	/* do_parse() only allows it with -L, -G and -E. */
+	if (output_mask & _O_BIN)
+		ct_binary_header();
+
 	switch(cmd->command) {
 	case CT_LIST:
 		if (cmd->type == CT_TABLE_DYING) {
 			res = nfct_mnl_dump(sock, NFNL_SUBSYS_CTNETLINK,
 					    IPCTNL_MSG_CT_GET_DYING,
 					    mnl_nfct_dump_cb, cmd, NULL);
+			if (cmd->options & CT_OPT_GROUP_BY)
+				ct_group_dump();
 			break;
 		} else if (cmd->type == CT_TABLE_UNCONFIRMED) {
 			res = nfct_mnl_dump(sock, NFNL_SUBSYS_CTNETLINK,
 					    IPCTNL_MSG_CT_GET_UNCONFIRMED,
 					    mnl_nfct_dump_cb, cmd, NULL);
+			if (cmd->options & CT_OPT_GROUP_BY)
+				ct_group_dump();
 			break;
 		}
 
@@ -3241,34 +5310,15 @@ static int do_command_ct(const char *progname, struct ct_cmd *cmd,
 
 		nfct_filter_init(cmd);
 
-		filter_dump = nfct_filter_dump_create();
-		if (filter_dump == NULL)
-			exit_error(OTHER_PROBLEM, "OOM");
-
-		if (cmd->tmpl.filter_mark_kernel_set) {
-			nfct_filter_dump_set_attr(filter_dump,
-						  NFCT_FILTER_DUMP_MARK,
-						  &cmd->tmpl.filter_mark_kernel);
-		}
-		nfct_filter_dump_set_attr_u8(filter_dump,
-					     NFCT_FILTER_DUMP_L3NUM,
-					     cmd->family);
-		if (cmd->tmpl.filter_status_kernel_set) {
-			nfct_filter_dump_set_attr(filter_dump,
-						  NFCT_FILTER_DUMP_STATUS,
-						  &cmd->tmpl.filter_status_kernel);
-		}
-		if (cmd->options & CT_OPT_ZERO) {
-			res = nfct_mnl_dump(sock, NFNL_SUBSYS_CTNETLINK,
-					    IPCTNL_MSG_CT_GET_CTRZERO,
-					    mnl_nfct_dump_cb, cmd, filter_dump);
-		} else {
-			res = nfct_mnl_dump(sock, NFNL_SUBSYS_CTNETLINK,
-					    IPCTNL_MSG_CT_GET,
-					    mnl_nfct_dump_cb, cmd, filter_dump);
-		}
+		if (watch.interval)
+			res = ct_watch_run(cmd, sock);
+		else if (cmd->options & CT_OPT_SPLIT)
+			res = ct_split_run(cmd, ct_list_dump);
+		else
+			res = ct_list_dump(cmd, sock);
 
-		nfct_filter_dump_destroy(filter_dump);
+		if (cmd->options & CT_OPT_GROUP_BY)
+			ct_group_dump();
 
 		if (dump_xml_header_done == 0) {
 			printf("</conntrack>\n");
@@ -3292,17 +5342,7 @@ static int do_command_ct(const char *progname, struct ct_cmd *cmd,
 
 	case CT_CREATE:
 	case CT_ADD:
-		if ((cmd->options & CT_OPT_ORIG) && !(cmd->options & CT_OPT_REPL))
-			nfct_setobjopt(cmd->tmpl.ct, NFCT_SOPT_SETUP_REPLY);
-		else if (!(cmd->options & CT_OPT_ORIG) && (cmd->options & CT_OPT_REPL))
-			nfct_setobjopt(cmd->tmpl.ct, NFCT_SOPT_SETUP_ORIGINAL);
-
-		if (cmd->options & CT_OPT_MARK)
-			nfct_set_attr_u32(cmd->tmpl.ct, ATTR_MARK, cmd->tmpl.mark.value);
-
-		if (cmd->options & CT_OPT_ADD_LABEL)
-			nfct_set_attr(cmd->tmpl.ct, ATTR_CONNLABELS,
-					xnfct_bitmask_clone(cmd->tmpl.label_modify));
+		ct_create_prepare(cmd);
 
 		res = nfct_mnl_request(sock, NFNL_SUBSYS_CTNETLINK, cmd->family,
 				       IPCTNL_MSG_CT_NEW,
@@ -3330,37 +5370,22 @@ static int do_command_ct(const char *progname, struct ct_cmd *cmd,
 	case CT_UPDATE:
 		if (nfct_mnl_socket_check_open(modifier_sock, 0) < 0)
 			exit_error(OTHER_PROBLEM, "Can't open handler");
+		ct_batch_check_init(&_modifier_batch, modifier_sock);
 
 		nfct_filter_init(cmd);
 		res = nfct_mnl_dump(sock, NFNL_SUBSYS_CTNETLINK,
 				    IPCTNL_MSG_CT_GET, mnl_nfct_update_cb,
 				    cmd, NULL);
+		res |= ct_batch_flush(&_modifier_batch);
 		break;
 
 	case CT_DELETE:
-		if (nfct_mnl_socket_check_open(modifier_sock, 0) < 0)
-			exit_error(OTHER_PROBLEM, "Can't open handler");
-
 		nfct_filter_init(cmd);
 
-		filter_dump = nfct_filter_dump_create();
-		if (filter_dump == NULL)
-			exit_error(OTHER_PROBLEM, "OOM");
-
-		if (cmd->tmpl.filter_mark_kernel_set) {
-			nfct_filter_dump_set_attr(filter_dump,
-						  NFCT_FILTER_DUMP_MARK,
-						  &cmd->tmpl.filter_mark_kernel);
-		}
-		nfct_filter_dump_set_attr_u8(filter_dump,
-					     NFCT_FILTER_DUMP_L3NUM,
-					     cmd->family);
-
-		res = nfct_mnl_dump(sock, NFNL_SUBSYS_CTNETLINK,
-				    IPCTNL_MSG_CT_GET, mnl_nfct_delete_cb,
-				    cmd, filter_dump);
-
-		nfct_filter_dump_destroy(filter_dump);
+		if (cmd->options & CT_OPT_SPLIT)
+			res = ct_split_run(cmd, ct_delete_dump);
+		else
+			res = ct_delete_dump(cmd, sock);
 		break;
 
 	case EXP_DELETE:
@@ -3437,18 +5462,19 @@ static int do_command_ct(const char *progname, struct ct_cmd *cmd,
 
 			socklen_t socklen = sizeof(socketbuffersize);
 
-			res = setsockopt(mnl_socket_get_fd(sock->mnl),
+			res = setsockopt(mnl_socket_get_fd(event_sock->mnl),
 					 SOL_SOCKET, SO_RCVBUFFORCE,
 					 &socketbuffersize,
 					 sizeof(socketbuffersize));
 			if (res < 0) {
-				setsockopt(mnl_socket_get_fd(sock->mnl),
+				setsockopt(mnl_socket_get_fd(event_sock->mnl),
 					   SOL_SOCKET, SO_RCVBUF,
 					   &socketbuffersize,
 					   sizeof(socketbuffersize));
 			}
-			getsockopt(mnl_socket_get_fd(sock->mnl), SOL_SOCKET,
-				   SO_RCVBUF, &socketbuffersize, &socklen);
+			getsockopt(mnl_socket_get_fd(event_sock->mnl),
+				   SOL_SOCKET, SO_RCVBUF, &socketbuffersize,
+				   &socklen);
 			fprintf(stderr, "NOTICE: Netlink socket buffer size "
 					"has been set to %zu bytes.\n",
 					socketbuffersize);
@@ -3459,29 +5485,8 @@ static int do_command_ct(const char *progname, struct ct_cmd *cmd,
 		signal(SIGINT, event_sighandler);
 		signal(SIGTERM, event_sighandler);
 
-		while (1) {
-			char buf[MNL_SOCKET_BUFFER_SIZE];
-
-			res = mnl_socket_recvfrom(event_sock->mnl, buf, sizeof(buf));
-			if (res < 0) {
-				if (errno == ENOBUFS) {
-					fprintf(stderr,
-						"WARNING: We have hit ENOBUFS! We "
-						"are losing events.\nThis message "
-						"means that the current netlink "
-						"socket buffer size is too small.\n"
-						"Please, check --buffer-size in "
-						"conntrack(8) manpage.\n");
-					continue;
-				}
-				exit_error(OTHER_PROBLEM,
-					   "failed to received netlink event: %s",
-					   strerror(errno));
-				break;
-			}
-			res = mnl_cb_run(buf, res, 0, 0, event_cb, cmd);
-		}
-		mnl_socket_close(event_sock->mnl);
+		event_loop(event_sock, cmd);
+		event_exit();
 		break;
 
 	case EXP_EVENT:
@@ -3711,8 +5716,8 @@ static void add_param_to_argv(struct argv_store *store, char *parsestart)
 	}
 }
 
-static void ct_file_parse_line(struct list_head *cmd_list,
-			       const char *progname, char *buffer)
+static struct ct_cmd *ct_file_parse_line(const char *progname, char *buffer,
+					 unsigned int lineno)
 {
 	struct argv_store store = {};
 	struct ct_cmd *ct_cmd;
@@ -3722,7 +5727,7 @@ static void ct_file_parse_line(struct list_head *cmd_list,
 
 	if (buffer[0] == '\n' ||
 	    buffer[0] == '#')
-		return;
+		return NULL;
 
 	add_argv(&store, progname, false);
 	add_param_to_argv(&store, buffer);
@@ -3732,15 +5737,16 @@ static void ct_file_parse_line(struct list_head *cmd_list,
 		exit_error(OTHER_PROBLEM, "OOM");
 
 	do_parse(ct_cmd, store.argc, store.argv);
+	ct_cmd->lineno = lineno;
 	free_argv(&store);
 
-	list_add_tail(&ct_cmd->list, cmd_list);
+	return ct_cmd;
 }
 
-static void ct_parse_file(struct list_head *cmd_list, const char *progname,
-			  const char *file_name)
+#define CT_LOAD_READ_SIZE	(1 << 20)
+
+static FILE *ct_open_file(const char *file_name)
 {
-	char buffer[10240] = {};
 	FILE *file;
 
 	if (!strcmp(file_name, "-"))
@@ -3751,10 +5757,10 @@ static void ct_parse_file(struct list_head *cmd_list, const char *progname,
 		exit_error(PARAMETER_PROBLEM,
 			   "Failed to open file %s for reading", file_name);
 
-	while (fgets(buffer, sizeof(buffer), file))
-		ct_file_parse_line(cmd_list, progname, buffer);
+	/* the file is streamed, read it in large chunks. */
+	setvbuf(file, NULL, _IOFBF, CT_LOAD_READ_SIZE);
 
-	fclose(file);
+	return file;
 }
 
 static struct {
@@ -3791,12 +5797,196 @@ static const char *ct_unsupp_cmd_file(const struct ct_cmd *cmd)
 	return "unknown";
 }
 
+/* parsed commands waiting to be sent, this bounds the memory usage. */
+#define CT_LOAD_QUEUE_MAX	4096
+
+/*
+ * The lines of the file are parsed by a separate thread while the previous
+ * commands are being sent. getopt_long() and do_parse() are not reentrant,
+ * so there is a single parser thread, and it waits for every command other
+ * than -I and -A to complete since do_command_ct() shares their state.
+ */
+struct ct_load {
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	struct list_head	queue;
+	unsigned int		num;
+	bool			done;		/* end of file or error reached */
+	bool			wait;		/* parser waits for the last one */
+	FILE			*file;
+	const char		*progname;
+	pthread_t		parser;
+	bool			parsing;	/* parser thread is running */
+	/* error record, left by the parser thread when it stops early. */
+	enum exittype		status;
+	unsigned int		lineno;
+	char			errmsg[1024];
+};
+
+static bool ct_load_in_parser(void)
+{
+	return cur_load && cur_load->parsing &&
+	       pthread_equal(pthread_self(), cur_load->parser);
+}
+
+/*
+ * exit_error() called from the parser thread: do not exit under the feet of
+ * the main thread, record the error after the commands already queued and
+ * stop parsing instead.
+ */
+static void __attribute__((noreturn))
+ct_load_abort(enum exittype status, const char *msg, va_list args)
+{
+	struct ct_load *load = cur_load;
+
+	vsnprintf(load->errmsg, sizeof(load->errmsg), msg, args);
+	va_end(args);
+
+	pthread_mutex_lock(&load->lock);
+	load->status = status;
+	load->done = true;
+	pthread_cond_broadcast(&load->cond);
+	pthread_mutex_unlock(&load->lock);
+
+	pthread_exit(NULL);
+}
+
+static void *ct_load_parser(void *data)
+{
+	struct ct_load *load = data;
+	char buffer[10240] = {};
+	struct ct_cmd *cmd;
+
+	/* the creator may not have stored the thread id yet */
+	load->parser = pthread_self();
+	load->parsing = true;
+
+	while (fgets(buffer, sizeof(buffer), load->file)) {
+		cmd = ct_file_parse_line(load->progname, buffer,
+					 ++load->lineno);
+		if (cmd == NULL)
+			continue;
+
+		if (!(cmd->command &
+		      (CT_CREATE | CT_ADD | CT_UPDATE | CT_DELETE | CT_FLUSH)))
+			exit_error(PARAMETER_PROBLEM,
+				   "Cannot use command `%s' with --load-file",
+				   ct_unsupp_cmd_file(cmd));
+
+		pthread_mutex_lock(&load->lock);
+		while (load->num == CT_LOAD_QUEUE_MAX)
+			pthread_cond_wait(&load->cond, &load->lock);
+
+		list_add_tail(&cmd->list, &load->queue);
+		load->num++;
+		if (!(cmd->command & (CT_CREATE | CT_ADD)))
+			load->wait = true;
+		pthread_cond_broadcast(&load->cond);
+
+		while (load->wait)
+			pthread_cond_wait(&load->cond, &load->lock);
+		pthread_mutex_unlock(&load->lock);
+	}
+
+	pthread_mutex_lock(&load->lock);
+	load->done = true;
+	pthread_cond_broadcast(&load->cond);
+	pthread_mutex_unlock(&load->lock);
+
+	return NULL;
+}
+
+static struct ct_cmd *ct_load_next(struct ct_load *load)
+{
+	struct ct_cmd *cmd = NULL;
+
+	pthread_mutex_lock(&load->lock);
+	while (list_empty(&load->queue) && !load->done)
+		pthread_cond_wait(&load->cond, &load->lock);
+
+	if (!list_empty(&load->queue)) {
+		cmd = list_entry(load->queue.next, struct ct_cmd, list);
+		list_del(&cmd->list);
+		load->num--;
+		pthread_cond_broadcast(&load->cond);
+	}
+	pthread_mutex_unlock(&load->lock);
+
+	return cmd;
+}
+
+static void ct_load_resume(struct ct_load *load)
+{
+	pthread_mutex_lock(&load->lock);
+	load->wait = false;
+	pthread_cond_broadcast(&load->cond);
+	pthread_mutex_unlock(&load->lock);
+}
+
+static int ct_text_load(FILE *file, const char *progname,
+			struct nfct_mnl_socket *sock)
+{
+	struct ct_load load = {
+		.lock		= PTHREAD_MUTEX_INITIALIZER,
+		.cond		= PTHREAD_COND_INITIALIZER,
+		.file		= file,
+		.progname	= progname,
+	};
+	struct ct_batch_req *req;
+	struct ct_batch batch;
+	struct ct_cmd *cmd;
+	pthread_t parser;
+	int res = 0;
+
+	INIT_LIST_HEAD(&load.queue);
+	cur_load = &load;
+	if (pthread_create(&parser, NULL, ct_load_parser, &load) != 0)
+		exit_error(OTHER_PROBLEM, "Can't create the parser thread");
+
+	ct_batch_init(&batch, sock);
+	while ((cmd = ct_load_next(&load)) != NULL) {
+		if (cmd->command & (CT_CREATE | CT_ADD)) {
+			ct_create_prepare(cmd);
+			req = ct_batch_add(&batch, IPCTNL_MSG_CT_NEW,
+					   NLM_F_CREATE | NLM_F_EXCL,
+					   cmd->family, cmd->tmpl.ct);
+			if (req == NULL) {
+				fprintf(stderr, "%s v%s (conntrack-tools): "
+					"line %u: %s\n", PROGNAME,
+					VERSION, cmd->lineno,
+					strerror(errno));
+			} else {
+				req->lineno = cmd->lineno;
+				req->command = cmd->command;
+				req->count = true;
+			}
+		} else {
+			/* keep the order of the commands in the file */
+			res |= ct_batch_flush(&batch);
+			res |= do_command_ct(progname, cmd, sock);
+			ct_load_resume(&load);
+		}
+		free(cmd);
+	}
+	pthread_join(parser, NULL);
+	cur_load = NULL;
+
+	res |= ct_batch_flush(&batch);
+	ct_batch_fini(&batch);
+
+	if (load.status)
+		exit_error(load.status, "line %u: %s",
+			   load.lineno, load.errmsg);
+
+	return res;
+}
+
 int main(int argc, char *argv[])
 {
 	struct nfct_mnl_socket *modifier_sock = &_modifier_sock;
 	struct nfct_mnl_socket *sock = &_sock;
-	struct ct_cmd *cmd, *next;
-	LIST_HEAD(cmd_list);
+	struct ct_cmd *cmd;
+	FILE *file;
 	int res = 0;
 
 	register_tcp();
@@ -3814,20 +6004,12 @@ int main(int argc, char *argv[])
 
 	if (argc > 2 &&
 	    (!strcmp(argv[1], "-R") || !strcmp(argv[1], "--load-file"))) {
-		ct_parse_file(&cmd_list, argv[0], argv[2]);
-
-		list_for_each_entry(cmd, &cmd_list, list) {
-			if (!(cmd->command &
-			      (CT_CREATE | CT_ADD | CT_UPDATE | CT_DELETE | CT_FLUSH)))
-				exit_error(PARAMETER_PROBLEM,
-					   "Cannot use command `%s' with --load-file",
-					   ct_unsupp_cmd_file(cmd));
-		}
-		list_for_each_entry_safe(cmd, next, &cmd_list, list) {
-			res |= do_command_ct(argv[0], cmd, sock);
-			list_del(&cmd->list);
-			free(cmd);
-		}
+		file = ct_open_file(argv[2]);
+		if (ct_binary_file(file))
+			res = ct_binary_load(file, sock);
+		else
+			res = ct_text_load(file, argv[0], sock);
+		fclose(file);
 	} else {
 		cmd = calloc(1, sizeof(*cmd));
 		if (!cmd)
@@ -3836,8 +6018,11 @@ int main(int argc, char *argv[])
 		do_parse(cmd, argc, argv);
 		do_command_ct(argv[0], cmd, sock);
 		res = print_stats(cmd);
+		if (cmd->command & (CT_LIST | CT_DELETE))
+			print_filter_stats();
 		free(cmd);
 	}
+	ct_batch_check_fini(&_modifier_batch);
 	nfct_mnl_socket_close(sock);
 	nfct_mnl_socket_check_close(modifier_sock);
 
@@ -25,7 +25,6 @@
 #include "alarm.h"
 #include "fds.h"
 #include "traffic_stats.h"
-#include "process.h"
 #include "origin.h"
 #include "date.h"
 #include "internal.h"
@@ -63,13 +62,7 @@ static void local_flush_master(void)
 	STATE(stats).nl_kernel_table_flush++;
 	dlog(LOG_NOTICE, "flushing kernel conntrack table");
 
-	/* fork a child process that performs the flush operation,
-	 * meanwhile the parent process handles events. */
-	if (fork_process_new(CTD_PROC_FLUSH, CTD_PROC_F_EXCL,
-			     NULL, NULL) == 0) {
-		nl_flush_conntrack_table_selective();
-		exit(EXIT_SUCCESS);
-	}
+	nl_flush_conntrack_table_selective(NULL, NULL);
 }
 
 static void local_resync_master(void)
@@ -91,13 +84,7 @@ static void local_exp_flush_master(void)
 	STATE(stats).nl_kernel_table_flush++;
 	dlog(LOG_NOTICE, "flushing kernel expect table");
 
-	/* fork a child process that performs the flush operation,
-	 * meanwhile the parent process handles events. */
-	if (fork_process_new(CTD_PROC_FLUSH, CTD_PROC_F_EXCL,
-			     NULL, NULL) == 0) {
-		nl_flush_expect_table(STATE(flush));
-		exit(EXIT_SUCCESS);
-	}
+	nl_flush_expect_table(STATE(flush));
 }
 
 static void local_exp_resync_master(void)
@@ -30,13 +30,25 @@ static struct cache *external_exp;
 
 static int external_cache_init(void)
 {
+	struct cache_extra *extra = NULL;
+
+	/* track the entries that are already committed in background */
+	if (CONFIG(precommit_rate))
+		extra = &cache_ct_precommit_extra;
+
 	external = cache_create("external", CACHE_T_CT,
 				STATE_SYNC(sync)->external_cache_flags,
-				NULL, &cache_sync_external_ct_ops);
+				extra, &cache_sync_external_ct_ops);
 	if (external == NULL) {
 		dlog(LOG_ERR, "can't allocate memory for the external cache");
 		return -1;
 	}
+	if (CONFIG(precommit_rate) && cache_ct_precommit_init(external) == -1) {
+		dlog(LOG_ERR, "can't initialize background commit");
+		return -1;
+	}
+	external_cache.ct.data = external;
+
 	external_exp = cache_create("external", CACHE_T_EXP,
 				STATE_SYNC(sync)->external_cache_flags,
 				NULL, &cache_sync_external_exp_ops);
@@ -50,6 +62,7 @@ static int external_cache_init(void)
 
 static void external_cache_close(void)
 {
+	cache_ct_precommit_fini();
 	cache_destroy(external);
 	cache_destroy(external_exp);
 }
@@ -89,14 +102,16 @@ static void external_cache_ct_del(struct nf_conntrack *ct)
 
 	obj = cache_find(external, ct, &id);
 	if (obj) {
+		cache_ct_precommit_del(obj);
 		cache_del(external, obj);
 		cache_object_free(obj);
 	}
 }
 
-static void external_cache_ct_dump(int fd, int type)
+static void external_cache_ct_dump(int fd, int type,
+				   const struct ct_dump_filter *filter)
 {
-	cache_dump(external, fd, type);
+	cache_dump_stream(external, fd, type, filter);
 }
 
 static int external_cache_ct_commit(struct nfct_handle *h, int fd)
@@ -112,6 +127,7 @@ static void external_cache_ct_flush(void)
 static void external_cache_ct_stats(int fd)
 {
 	cache_stats(external, fd);
+	cache_ct_precommit_stats(fd);
 }
 
 static void external_cache_ct_stats_ext(int fd)
@@ -161,7 +177,7 @@ static void external_cache_exp_del(struct nf_expect *exp)
 
 static void external_cache_exp_dump(int fd, int type)
 {
-	cache_dump(external_exp, fd, type);
+	cache_dump_stream(external_exp, fd, type, NULL);
 }
 
 static int external_cache_exp_commit(struct nfct_handle *h, int fd)
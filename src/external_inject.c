@@ -23,132 +23,619 @@
 #include "origin.h"
 #include "external.h"
 #include "netlink.h"
+#include "network.h"
+#include "alarm.h"
+#include "fds.h"
+#include "jhash.h"
+#include "metrics.h"
 
+#include <libmnl/libmnl.h>
 #include <libnetfilter_conntrack/libnetfilter_conntrack.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef SO_RCVBUFFORCE
+#define SO_RCVBUFFORCE 33
+#endif
+
+#ifndef NETLINK_CAP_ACK
+#define NETLINK_CAP_ACK 10
+#endif
 
 static struct nfct_handle *inject;
+static struct mnl_socket *inject_nl;
+static uint32_t inject_seq;
 
 struct {
-	uint32_t	add_ok;
-	uint32_t	add_fail;
-	uint32_t	upd_ok;
-	uint32_t	upd_fail;
-	uint32_t	del_ok;
-	uint32_t	del_fail;
+	uint64_t	add_ok;
+	uint64_t	add_fail;
+	uint64_t	upd_ok;
+	uint64_t	upd_fail;
+	uint64_t	del_ok;
+	uint64_t	del_fail;
+	uint64_t	msgs;
+	uint64_t	batches;
+	uint64_t	batch_msgs;
+	uint32_t	batch_max;
+	uint32_t	send_fail;
+	uint32_t	ack_lost;
+	uint32_t	superseded;
+	uint64_t	latency_usecs;
+	uint64_t	latency_max;
+	struct metrics_histogram latency;
+	uint64_t	busy_usecs;
 } external_inject_stat;
 
-static int external_inject_init(void)
+/* time spent injecting: queueing, sending and reading acknowledgments */
+static void inject_busy(const struct timespec *start)
 {
-	/* handler to directly inject conntracks into kernel-space */
-	inject = nfct_open(CONFIG(netlink).subsys_id, 0);
-	if (inject == NULL) {
-		dlog(LOG_ERR, "can't open netlink handler: %s",
-		     strerror(errno));
-		dlog(LOG_ERR, "no ctnetlink kernel support?");
-		return -1;
+	struct timespec stop;
+
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	external_inject_stat.busy_usecs +=
+		(stop.tv_sec - start->tv_sec) * 1000000LL +
+		(stop.tv_nsec - start->tv_nsec) / 1000;
+}
+
+/* only for logging purposes, this message is not used after this */
+static void external_inject_log_msg(struct nethdr *net)
+{
+	struct nf_conntrack *ct;
+
+	ct = nfct_new();
+	if (ct == NULL)
+		return;
+
+	if (msg2ct(ct, net, net->len) == 0)
+		dlog_ct(STATE(log), ct, NFCT_O_PLAIN);
+
+	nfct_destroy(ct);
+}
+
+/*
+ * Inject operations are batched into one single send and the kernel
+ * acknowledges each of them. Every request in flight has an entry in
+ * the pending table, that is indexed by the netlink sequence number.
+ * Once the acknowledgment is received, the operation either finishes
+ * or it goes on with the EEXIST/ENOENT fallback by sending another
+ * request with a new sequence number.
+ */
+enum {
+	INJECT_OP_NEW,		/* create */
+	INJECT_OP_NEW_DEL,	/* create failed with EEXIST, delete it */
+	INJECT_OP_NEW_RETRY,	/* ... and create it again */
+	INJECT_OP_UPD,		/* update */
+	INJECT_OP_UPD_NEW,	/* update failed with ENOENT, create it */
+	INJECT_OP_UPD_DEL,	/* update failed, delete it */
+	INJECT_OP_UPD_DEL_NEW,	/* ... and create it again */
+	INJECT_OP_DEL,		/* delete */
+};
+
+struct inject_op {
+	uint32_t		seq;
+	int			state;
+	uint32_t		key;
+	int			superseded;	/* newer message for the entry */
+	struct hlist_node	hnode;		/* see inject_ops */
+	struct timespec		start;
+	struct nethdr		net[0];
+};
+
+#define INJECT_PENDING_MAX	1024	/* must be power of two */
+#define INJECT_BATCH_SIZE	65536
+#define INJECT_MSG_MAX		8192	/* largest request we may build */
+
+static struct inject_op *inject_pending[INJECT_PENDING_MAX];
+/* unfinished operations by key, to flag the ones that are superseded */
+static struct hlist_head inject_ops[INJECT_PENDING_MAX];
+static unsigned int inject_inflight;
+static char inject_batch_buf[INJECT_BATCH_SIZE + INJECT_MSG_MAX];
+static struct mnl_nlmsg_batch *inject_batch;
+static unsigned int inject_batch_msgs;
+static struct alarm_block inject_flush_alarm;
+static int inject_draining;
+
+static struct inject_op **inject_slot(uint32_t seq)
+{
+	return &inject_pending[seq & (INJECT_PENDING_MAX - 1)];
+}
+
+/* hash of the original tuple, to find pending operations on one entry */
+static uint32_t inject_key(const struct netattr *tb[])
+{
+	static const int attrs[] = {
+		NTA_IPV4, NTA_IPV6, NTA_PORT, NTA_L4PROTO, NTA_ZONE
+	};
+	uint32_t key = 0;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(attrs) / sizeof(attrs[0]); i++) {
+		const struct netattr *attr = tb[attrs[i]];
+
+		if (attr == NULL)
+			continue;
+
+		key = jhash(NTA_DATA(attr),
+			    ntohs(attr->nta_len) - NTA_LENGTH(0), key);
 	}
-	/* we are directly injecting the entries into the kernel */
-	origin_register(inject, CTD_ORIGIN_INJECT);
-	return 0;
+	return key;
 }
 
-static void external_inject_close(void)
+/* a newer message for this entry wins over the unfinished ones */
+static void inject_op_supersede(struct inject_op *op)
 {
-	origin_unregister(inject);
-	nfct_close(inject);
+	struct hlist_head *head;
+	struct hlist_node *n;
+	struct inject_op *this;
+
+	head = &inject_ops[op->key & (INJECT_PENDING_MAX - 1)];
+	hlist_for_each_entry(this, n, head, hnode) {
+		if (this->key == op->key)
+			this->superseded = 1;
+	}
+	hlist_add_head(&op->hnode, head);
 }
 
-static void external_inject_ct_new(struct nf_conntrack *ct)
+static void external_inject_send(int overflow);
+static void external_inject_drain(void);
+
+static int inject_op_queue(struct inject_op *op, const struct netattr *tb[])
 {
-	int ret, retry = 1;
+	struct nlmsghdr *nlh;
+	int type;
 
-retry:
-	if (nl_create_conntrack(inject, ct, 0) == -1) {
-		/* if the state entry exists, we delete and try again */
-		if (errno == EEXIST && retry == 1) {
-			ret = nl_destroy_conntrack(inject, ct);
-			if (ret == 0 || (ret == -1 && errno == ENOENT)) {
-				if (retry) {
-					retry = 0;
-					goto retry;
-				}
-			}
-			external_inject_stat.add_fail++;
-			dlog(LOG_WARNING,
-			     "could not add new ct entry, even when deleting it first: %s",
-			     strerror(errno));
-			dlog_ct(STATE(log), ct, NFCT_O_PLAIN);
-			return;
+	/* no room for more requests in flight, make some. We cannot do
+	 * this while processing acknowledgments, just give up. */
+	if (*inject_slot(inject_seq + 1) != NULL) {
+		if (!inject_draining) {
+			external_inject_send(0);
+			external_inject_drain();
 		}
-		external_inject_stat.add_fail++;
-		dlog(LOG_WARNING, "could not add new ct entry: %s", strerror(errno));
-		dlog_ct(STATE(log), ct, NFCT_O_PLAIN);
-	} else {
-		external_inject_stat.add_ok++;
+		if (*inject_slot(inject_seq + 1) != NULL) {
+			errno = EBUSY;
+			return -1;
+		}
+	}
+
+	switch (op->state) {
+	case INJECT_OP_NEW:
+	case INJECT_OP_NEW_RETRY:
+	case INJECT_OP_UPD_NEW:
+	case INJECT_OP_UPD_DEL_NEW:
+		type = NET_T_STATE_CT_NEW;
+		break;
+	case INJECT_OP_UPD:
+		type = NET_T_STATE_CT_UPD;
+		break;
+	default:
+		type = NET_T_STATE_CT_DEL;
+		break;
 	}
+
+	nlh = msg2nl_ct(mnl_nlmsg_batch_current(inject_batch), tb, type);
+	nlh->nlmsg_seq = op->seq = ++inject_seq;
+	*inject_slot(op->seq) = op;
+	inject_inflight++;
+	inject_batch_msgs++;
+
+	/* batch is full, the last message is moved to the next batch */
+	if (!mnl_nlmsg_batch_next(inject_batch))
+		external_inject_send(1);
+	else if (!alarm_pending(&inject_flush_alarm))
+		add_alarm(&inject_flush_alarm, 0, 0);
+
+	return 0;
 }
 
-static void external_inject_ct_upd(struct nf_conntrack *ct)
+static void inject_op_done(struct inject_op *op)
 {
-	int ret;
+	struct timespec now;
+	uint64_t usecs;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	usecs = (now.tv_sec - op->start.tv_sec) * 1000000LL +
+		(now.tv_nsec - op->start.tv_nsec) / 1000;
+
+	external_inject_stat.msgs++;
+	external_inject_stat.latency_usecs += usecs;
+	if (usecs > external_inject_stat.latency_max)
+		external_inject_stat.latency_max = usecs;
+	metrics_histogram_observe(&external_inject_stat.latency, usecs);
 
-	/* if we successfully update the entry, everything is OK */
-	if (nl_update_conntrack(inject, ct, 0) != -1) {
-		external_inject_stat.upd_ok++;
+	hlist_del(&op->hnode);
+	free(op);
+}
+
+static void inject_op_next(struct inject_op *op, int next)
+{
+	const struct netattr *tb[NTA_MAX];
+
+	/*
+	 * A newer message for this entry makes the create that follows a
+	 * failed update pointless. This does not hold for the fallbacks that
+	 * delete the kernel entry, e.g. after EEXIST: the newer message may
+	 * reach the kernel before the delete, so the entry is recreated.
+	 */
+	if (next == INJECT_OP_UPD_NEW && op->superseded) {
+		external_inject_stat.superseded++;
+		inject_op_done(op);
 		return;
 	}
 
-	/* state entries does not exist, we have to create it */
-	if (errno == ENOENT) {
-		if (nl_create_conntrack(inject, ct, 0) == -1) {
+	op->state = next;
+	if (msg2nl_ct_parse(op->net, op->net->len, tb) == -1 ||
+	    inject_op_queue(op, tb) == -1) {
+		if (op->state <= INJECT_OP_NEW_RETRY)
+			external_inject_stat.add_fail++;
+		else
 			external_inject_stat.upd_fail++;
-			dlog(LOG_WARNING,
-			     "could not update ct entry, even if creating it instead: %s",
-			     strerror(errno));
-			dlog_ct(STATE(log), ct, NFCT_O_PLAIN);
+
+		dlog(LOG_WARNING, "could not requeue ct entry: %s",
+		     strerror(errno));
+		external_inject_log_msg(op->net);
+		inject_op_done(op);
+	}
+}
+
+static void inject_op_fail(struct inject_op *op, uint64_t *counter,
+			   const char *msg, int error)
+{
+	(*counter)++;
+	dlog(LOG_WARNING, "%s: %s", msg, strerror(error));
+	external_inject_log_msg(op->net);
+	inject_op_done(op);
+}
+
+static void inject_op_ack(struct inject_op *op, int error)
+{
+	switch (op->state) {
+	case INJECT_OP_NEW:
+		if (error == 0) {
+			external_inject_stat.add_ok++;
+			inject_op_done(op);
+		} else if (error == EEXIST) {
+			/* the state entry exists, we delete and try again */
+			inject_op_next(op, INJECT_OP_NEW_DEL);
+		} else {
+			inject_op_fail(op, &external_inject_stat.add_fail,
+				       "could not add new ct entry", error);
+		}
+		break;
+	case INJECT_OP_NEW_DEL:
+		if (error == 0 || error == ENOENT) {
+			inject_op_next(op, INJECT_OP_NEW_RETRY);
+			break;
+		}
+		/* fall through */
+	case INJECT_OP_NEW_RETRY:
+		if (error == 0) {
+			external_inject_stat.add_ok++;
+			inject_op_done(op);
+			break;
+		}
+		inject_op_fail(op, &external_inject_stat.add_fail,
+			       "could not add new ct entry, "
+			       "even when deleting it first", error);
+		break;
+	case INJECT_OP_UPD:
+		if (error == 0) {
+			external_inject_stat.upd_ok++;
+			inject_op_done(op);
+		} else if (error == ENOENT) {
+			/* state entry does not exist, we have to create it */
+			inject_op_next(op, INJECT_OP_UPD_NEW);
 		} else {
+			/* we failed to update the entry, there are some
+			 * operations that may trigger this error, eg. unset
+			 * some status bits. Try harder, delete the existing
+			 * entry and create a new one. */
+			inject_op_next(op, INJECT_OP_UPD_DEL);
+		}
+		break;
+	case INJECT_OP_UPD_NEW:
+		if (error == 0) {
+			external_inject_stat.upd_ok++;
+			inject_op_done(op);
+			break;
+		}
+		inject_op_fail(op, &external_inject_stat.upd_fail,
+			       "could not update ct entry, "
+			       "even if creating it instead", error);
+		break;
+	case INJECT_OP_UPD_DEL:
+		if (error == 0 || error == ENOENT) {
+			inject_op_next(op, INJECT_OP_UPD_DEL_NEW);
+			break;
+		}
+		inject_op_fail(op, &external_inject_stat.upd_fail,
+			       "could not update ct entry", error);
+		break;
+	case INJECT_OP_UPD_DEL_NEW:
+		if (error == 0) {
 			external_inject_stat.upd_ok++;
+			inject_op_done(op);
+			break;
 		}
+		inject_op_fail(op, &external_inject_stat.upd_fail,
+			       "could not update ct entry, "
+			       "even when deleting it first", error);
+		break;
+	case INJECT_OP_DEL:
+		if (error == 0)
+			external_inject_stat.del_ok++;
+		else if (error != ENOENT) {
+			inject_op_fail(op, &external_inject_stat.del_fail,
+				       "could not destroy ct entry", error);
+			break;
+		}
+		inject_op_done(op);
+		break;
+	}
+}
+
+static void external_inject_send(int overflow)
+{
+	size_t len = mnl_nlmsg_batch_size(inject_batch);
+	/* the message that did not fit is left for the next batch */
+	unsigned int msgs = inject_batch_msgs - overflow;
+	int ret;
+
+	del_alarm(&inject_flush_alarm);
+
+	if (len == 0)
 		return;
+
+	/* requests are processed by the kernel from sendmsg() itself, so
+	 * acknowledgments are already enqueued once this returns. */
+	ret = mnl_socket_sendto(inject_nl, mnl_nlmsg_batch_head(inject_batch),
+				len);
+	if (ret < 0) {
+		dlog(LOG_ERR, "cannot send inject batch: %s", strerror(errno));
+		external_inject_stat.send_fail++;
+	} else {
+		external_inject_stat.batches++;
+		external_inject_stat.batch_msgs += msgs;
+		if (msgs > external_inject_stat.batch_max)
+			external_inject_stat.batch_max = msgs;
 	}
+	inject_batch_msgs -= msgs;
+	mnl_nlmsg_batch_reset(inject_batch);
 
-	/* we failed to update the entry, there are some operations that
-	 * may trigger this error, eg. unset some status bits. Try harder,
-	 * delete the existing entry and create a new one. */
-	ret = nl_destroy_conntrack(inject, ct);
-	if (ret == 0 || (ret == -1 && errno == ENOENT)) {
-		if (nl_create_conntrack(inject, ct, 0) == -1) {
-			external_inject_stat.upd_fail++;
-			dlog(LOG_WARNING,
-			     "could not update ct entry, even when deleting it first: %s",
-			     strerror(errno));
-			dlog_ct(STATE(log), ct, NFCT_O_PLAIN);
-		} else {
-			external_inject_stat.upd_ok++;
-		}
+	if (inject_batch_msgs)
+		add_alarm(&inject_flush_alarm, 0, 0);
+
+	/* these requests will never be acknowledged, release them */
+	if (ret < 0 && !inject_draining)
+		external_inject_drain();
+}
+
+static void external_inject_flush(void)
+{
+	external_inject_send(0);
+}
+
+static void do_inject_flush_alarm(struct alarm_block *a, void *data)
+{
+	struct timespec start;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	external_inject_flush();
+	inject_busy(&start);
+}
+
+static void external_inject_ack(const struct nlmsghdr *nlh)
+{
+	const struct nlmsgerr *err;
+	struct inject_op *op, **slot;
+
+	if (nlh->nlmsg_type != NLMSG_ERROR ||
+	    nlh->nlmsg_len < mnl_nlmsg_size(sizeof(struct nlmsgerr)))
 		return;
+
+	slot = inject_slot(nlh->nlmsg_seq);
+	op = *slot;
+	if (op == NULL || op->seq != nlh->nlmsg_seq)
+		return;
+
+	*slot = NULL;
+	inject_inflight--;
+
+	err = mnl_nlmsg_get_payload(nlh);
+	inject_op_ack(op, -err->error);
+}
+
+/* sent requests that were not acknowledged, never finish */
+static void external_inject_expire(void)
+{
+	uint32_t unsent = inject_seq - inject_batch_msgs;
+	unsigned int i;
+
+	for (i = 0; i < INJECT_PENDING_MAX; i++) {
+		struct inject_op *op = inject_pending[i];
+
+		/* not sent yet, still in the batch */
+		if (op == NULL || (int32_t)(op->seq - unsent) > 0)
+			continue;
+
+		inject_pending[i] = NULL;
+		inject_inflight--;
+		external_inject_stat.ack_lost++;
+		external_inject_log_msg(op->net);
+		inject_op_done(op);
 	}
-	external_inject_stat.upd_fail++;
-	dlog(LOG_WARNING, "could not update ct entry: %s", strerror(errno));
-	dlog_ct(STATE(log), ct, NFCT_O_PLAIN);
 }
 
-static void external_inject_ct_del(struct nf_conntrack *ct)
+static void external_inject_drain(void)
 {
-	if (nl_destroy_conntrack(inject, ct) == -1) {
-		if (errno != ENOENT) {
-			external_inject_stat.del_fail++;
-			dlog(LOG_WARNING, "could not destroy ct entry: %s", strerror(errno));
-			dlog_ct(STATE(log), ct, NFCT_O_PLAIN);
+	static char buf[INJECT_BATCH_SIZE];
+	int ret;
+
+	inject_draining = 1;
+	while (inject_inflight > inject_batch_msgs) {
+		const struct nlmsghdr *nlh;
+
+		ret = mnl_socket_recvfrom(inject_nl, buf, sizeof(buf));
+		if (ret == -1) {
+			/* receiver overrun, keep reading what is left */
+			if (errno == ENOBUFS)
+				continue;
+			break;
 		}
-	} else {
-		external_inject_stat.del_ok++;
+
+		nlh = (const struct nlmsghdr *)buf;
+		while (mnl_nlmsg_ok(nlh, ret)) {
+			external_inject_ack(nlh);
+			nlh = mnl_nlmsg_next(nlh, &ret);
+		}
+	}
+	/* all sent requests were already processed by the kernel, so
+	 * anything left here lost its acknowledgment due to overrun or
+	 * the batch could not be sent. */
+	if (inject_inflight > inject_batch_msgs) {
+		dlog(LOG_WARNING, "lost %u inject acknowledgments",
+		     inject_inflight - inject_batch_msgs);
+		external_inject_expire();
+	}
+	inject_draining = 0;
+}
+
+static void inject_nl_cb(void *data)
+{
+	struct timespec start;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	external_inject_drain();
+	inject_busy(&start);
+}
+
+static int external_inject_init(void)
+{
+	int fd, on = 1, rcvbuf = INJECT_PENDING_MAX * 2048;
+
+	/* handler to directly inject conntracks into kernel-space */
+	inject = nfct_open(CONFIG(netlink).subsys_id, 0);
+	if (inject == NULL) {
+		dlog(LOG_ERR, "can't open netlink handler: %s",
+		     strerror(errno));
+		dlog(LOG_ERR, "no ctnetlink kernel support?");
+		return -1;
+	}
+	/* we are directly injecting the entries into the kernel */
+	origin_register(inject, CTD_ORIGIN_INJECT);
+
+	/* conntrack entries are translated from network messages */
+	inject_nl = mnl_socket_open(NETLINK_NETFILTER);
+	if (inject_nl == NULL) {
+		dlog(LOG_ERR, "can't open netlink handler: %s",
+		     strerror(errno));
+		goto err;
+	}
+	if (mnl_socket_bind(inject_nl, 0, MNL_SOCKET_AUTOPID) < 0) {
+		dlog(LOG_ERR, "can't bind netlink handler: %s",
+		     strerror(errno));
+		goto err_nl;
+	}
+	fd = mnl_socket_get_fd(inject_nl);
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+
+	/* acknowledgments do not include the original request */
+	mnl_socket_setsockopt(inject_nl, NETLINK_CAP_ACK, &on, sizeof(on));
+
+	/* room for the acknowledgments of all requests in flight */
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE,
+		       &rcvbuf, sizeof(rcvbuf)) == -1)
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+	if (register_fd(fd, inject_nl_cb, NULL, STATE(fds)) == -1) {
+		dlog(LOG_ERR, "can't register netlink handler");
+		goto err_nl;
+	}
+	origin_register_portid(mnl_socket_get_portid(inject_nl),
+			       CTD_ORIGIN_INJECT);
+
+	inject_batch = mnl_nlmsg_batch_start(inject_batch_buf,
+					     INJECT_BATCH_SIZE);
+	init_alarm(&inject_flush_alarm, NULL, do_inject_flush_alarm);
+	return 0;
+err_nl:
+	mnl_socket_close(inject_nl);
+err:
+	origin_unregister(inject);
+	nfct_close(inject);
+	return -1;
+}
+
+static void external_inject_close(void)
+{
+	unsigned int i;
+
+	/* wait for the requests that are still in the batch */
+	external_inject_flush();
+	external_inject_drain();
+	for (i = 0; i < INJECT_PENDING_MAX; i++)
+		free(inject_pending[i]);
+
+	mnl_nlmsg_batch_stop(inject_batch);
+	del_alarm(&inject_flush_alarm);
+	origin_unregister_portid(mnl_socket_get_portid(inject_nl));
+	mnl_socket_close(inject_nl);
+	origin_unregister(inject);
+	nfct_close(inject);
+}
+
+static int external_inject_ct_msg(struct nethdr *net, size_t remain)
+{
+	const struct netattr *tb[NTA_MAX];
+	struct timespec start;
+	struct inject_op *op;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (msg2nl_ct_parse(net, remain, tb) == -1)
+		return -1;
+
+	op = malloc(sizeof(struct inject_op) + net->len);
+	if (op == NULL) {
+		dlog(LOG_ERR, "cannot allocate inject operation: %s",
+		     strerror(errno));
+		return 0;
+	}
+	memcpy(op->net, net, net->len);
+	clock_gettime(CLOCK_MONOTONIC, &op->start);
+	op->key = inject_key(tb);
+	op->superseded = 0;
+
+	switch (net->type) {
+	case NET_T_STATE_CT_NEW:
+		op->state = INJECT_OP_NEW;
+		break;
+	case NET_T_STATE_CT_UPD:
+		op->state = INJECT_OP_UPD;
+		break;
+	case NET_T_STATE_CT_DEL:
+		op->state = INJECT_OP_DEL;
+		break;
+	}
+
+	/* before queueing, its acknowledgment may come right away */
+	inject_op_supersede(op);
+
+	/* tb points to the original message, still valid here */
+	if (inject_op_queue(op, tb) == -1) {
+		dlog(LOG_WARNING, "could not queue ct entry: %s",
+		     strerror(errno));
+		external_inject_log_msg(net);
+		hlist_del(&op->hnode);
+		free(op);
 	}
+	inject_busy(&start);
+	return 0;
 }
 
-static void external_inject_ct_dump(int fd, int type)
+static void external_inject_ct_dump(int fd, int type,
+				    const struct ct_dump_filter *filter)
 {
 }
 
@@ -164,23 +651,107 @@ static void external_inject_ct_flush(void)
 
 static void external_inject_ct_stats(int fd)
 {
-	char buf[512];
+	char buf[1024];
+	uint64_t batch_avg = 0, latency_avg = 0, rate = 0;
 	int size;
 
+	if (external_inject_stat.batches) {
+		batch_avg = external_inject_stat.batch_msgs /
+			    external_inject_stat.batches;
+	}
+	if (external_inject_stat.msgs) {
+		latency_avg = external_inject_stat.latency_usecs /
+			      external_inject_stat.msgs;
+	}
+	/* we run in one single thread, this is the rate per core */
+	if (external_inject_stat.busy_usecs) {
+		rate = external_inject_stat.msgs * 1000000ULL /
+		       external_inject_stat.busy_usecs;
+	}
+
 	size = sprintf(buf, "external inject:\n"
-			    "connections created:\t\t%12u\tfailed:\t%12u\n"
-			    "connections updated:\t\t%12u\tfailed:\t%12u\n"
-			    "connections destroyed:\t\t%12u\tfailed:\t%12u\n\n",
-			    external_inject_stat.add_ok,
-			    external_inject_stat.add_fail,
-			    external_inject_stat.upd_ok,
-			    external_inject_stat.upd_fail,
-			    external_inject_stat.del_ok,
-			    external_inject_stat.del_fail);
+			    "connections created:\t\t%12llu\tfailed:\t%12llu\n"
+			    "connections updated:\t\t%12llu\tfailed:\t%12llu\n"
+			    "connections destroyed:\t\t%12llu\tfailed:\t%12llu\n"
+			    "messages injected:\t\t%12llu\n"
+			    "inject rate (per core):\t\t%12llu msgs/s\n"
+			    "batches sent:\t\t\t%12llu\tfailed:\t%12u\n"
+			    "batch size (avg=%llu max=%u msgs)\n"
+			    "inject latency (avg=%llu max=%llu usecs)\n"
+			    "acks lost:\t\t\t%12u\n"
+			    "messages superseded:\t\t%12u\n\n",
+			    (unsigned long long)external_inject_stat.add_ok,
+			    (unsigned long long)external_inject_stat.add_fail,
+			    (unsigned long long)external_inject_stat.upd_ok,
+			    (unsigned long long)external_inject_stat.upd_fail,
+			    (unsigned long long)external_inject_stat.del_ok,
+			    (unsigned long long)external_inject_stat.del_fail,
+			    (unsigned long long)external_inject_stat.msgs,
+			    (unsigned long long)rate,
+			    (unsigned long long)external_inject_stat.batches,
+			    external_inject_stat.send_fail,
+			    (unsigned long long)batch_avg,
+			    external_inject_stat.batch_max,
+			    (unsigned long long)latency_avg,
+			    (unsigned long long)external_inject_stat.latency_max,
+			    external_inject_stat.ack_lost,
+			    external_inject_stat.superseded);
 
 	send(fd, buf, size, 0);
 }
 
+static void external_inject_ct_metrics(struct metrics *m)
+{
+	static const char *ops[] = { "create", "update", "destroy" };
+	const uint64_t ok[] = {
+		external_inject_stat.add_ok,
+		external_inject_stat.upd_ok,
+		external_inject_stat.del_ok,
+	};
+	const uint64_t fail[] = {
+		external_inject_stat.add_fail,
+		external_inject_stat.upd_fail,
+		external_inject_stat.del_fail,
+	};
+	int i;
+
+	metrics_family(m, "inject_operations", METRICS_COUNTER,
+		       "Entries injected into the kernel table");
+	for (i = 0; i < 3; i++) {
+		metrics_sample(m, ok[i], "op=\"%s\",result=\"ok\"", ops[i]);
+		metrics_sample(m, fail[i], "op=\"%s\",result=\"failed\"",
+			       ops[i]);
+	}
+
+	metrics_family(m, "inject_messages", METRICS_COUNTER,
+		       "Messages acknowledged by the kernel");
+	metrics_sample(m, external_inject_stat.msgs, NULL);
+
+	metrics_family(m, "inject_batches", METRICS_COUNTER,
+		       "Batches sent to the kernel");
+	metrics_sample(m, external_inject_stat.batches, NULL);
+
+	metrics_family(m, "inject_batch_messages", METRICS_COUNTER,
+		       "Messages sent to the kernel in batches");
+	metrics_sample(m, external_inject_stat.batch_msgs, NULL);
+
+	metrics_family(m, "inject_send_failed", METRICS_COUNTER,
+		       "Batches that could not be sent");
+	metrics_sample(m, external_inject_stat.send_fail, NULL);
+
+	metrics_family(m, "inject_acks_lost", METRICS_COUNTER,
+		       "Messages whose acknowledgement never arrived");
+	metrics_sample(m, external_inject_stat.ack_lost, NULL);
+
+	metrics_family(m, "inject_superseded", METRICS_COUNTER,
+		       "Messages superseded by a newer one for the same entry");
+	metrics_sample(m, external_inject_stat.superseded, NULL);
+
+	metrics_family(m, "inject_latency_seconds", METRICS_HISTOGRAM,
+		       "Time until the kernel acknowledges a message");
+	metrics_histogram(m, &external_inject_stat.latency, NULL);
+}
+
 struct {
 	uint32_t	add_ok;
 	uint32_t	add_fail;
@@ -272,14 +843,13 @@ struct external_handler external_inject = {
 	.init		= external_inject_init,
 	.close		= external_inject_close,
 	.ct = {
-		.new		= external_inject_ct_new,
-		.upd		= external_inject_ct_upd,
-		.del		= external_inject_ct_del,
+		.msg		= external_inject_ct_msg,
 		.dump		= external_inject_ct_dump,
 		.commit		= external_inject_ct_commit,
 		.flush		= external_inject_ct_flush,
 		.stats		= external_inject_ct_stats,
 		.stats_ext	= external_inject_ct_stats,
+		.metrics	= external_inject_ct_metrics,
 	},
 	.exp = {
 		.new		= external_inject_exp_new,
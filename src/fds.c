@@ -46,33 +46,52 @@ void destroy_fds(struct fds *fds)
 	list_for_each_entry_safe(this, tmp, &fds->list, head) {
 		list_del(&this->head);
 		FD_CLR(this->fd, &fds->readfds);
+		FD_CLR(this->fd, &fds->writefds);
 		free(this);
 	}
 	free(fds);
 }
 
-int register_fd(int fd, void (*cb)(void *data), void *data, struct fds *fds)
+static int
+__register_fd(int fd, void (*cb)(void *data), void *data, struct fds *fds,
+	      int write)
 {
 	struct fds_item *item;
-	
-	FD_SET(fd, &fds->readfds);
-
-	if (fd > fds->maxfd)
-		fds->maxfd = fd;
 
 	item = calloc(sizeof(struct fds_item), 1);
 	if (item == NULL)
 		return -1;
 
+	if (write)
+		FD_SET(fd, &fds->writefds);
+	else
+		FD_SET(fd, &fds->readfds);
+
+	if (fd > fds->maxfd)
+		fds->maxfd = fd;
+
 	item->fd = fd;
 	item->cb = cb;
 	item->data = data;
+	item->write = write;
 	/* Order matters: the descriptors are served in FIFO basis. */
 	list_add_tail(&item->head, &fds->list);
 
 	return 0;
 }
 
+int register_fd(int fd, void (*cb)(void *data), void *data, struct fds *fds)
+{
+	return __register_fd(fd, cb, data, fds, 0);
+}
+
+/* the callback is invoked when the descriptor becomes writable. */
+int register_write_fd(int fd, void (*cb)(void *data), void *data,
+		      struct fds *fds)
+{
+	return __register_fd(fd, cb, data, fds, 1);
+}
+
 int unregister_fd(int fd, struct fds *fds)
 {
 	int found = 0, maxfd = -1;
@@ -82,6 +101,7 @@ int unregister_fd(int fd, struct fds *fds)
 		if (this->fd == fd) {
 			list_del(&this->head);
 			FD_CLR(this->fd, &fds->readfds);
+			FD_CLR(this->fd, &fds->writefds);
 			free(this);
 			found = 1;
 			/* ... and recalculate maxfd, see below. */
@@ -106,9 +126,11 @@ static void select_main_step(struct timeval *next_alarm)
 {
 	int ret;
 	fd_set readfds = STATE(fds)->readfds;
+	fd_set writefds = STATE(fds)->writefds;
 	struct fds_item *cur, *tmp;
 
-	ret = select(STATE(fds)->maxfd + 1, &readfds, NULL, NULL, next_alarm);
+	ret = select(STATE(fds)->maxfd + 1, &readfds, &writefds, NULL,
+		     next_alarm);
 	if (ret == -1) {
 		/* interrupted syscall, retry */
 		if (errno == EINTR)
@@ -122,7 +144,7 @@ static void select_main_step(struct timeval *next_alarm)
 	sigprocmask(SIG_BLOCK, &STATE(block), NULL);
 
 	list_for_each_entry_safe(cur, tmp, &STATE(fds)->list, head) {
-		if (FD_ISSET(cur->fd, &readfds))
+		if (FD_ISSET(cur->fd, cur->write ? &writefds : &readfds))
 			cur->cb(cur->data);
 	}
 
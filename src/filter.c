@@ -24,12 +24,18 @@
 #include "vector.h"
 #include "conntrackd.h"
 #include "log.h"
+#include "cidr.h"
 
 #include <libnetfilter_conntrack/libnetfilter_conntrack.h>
+#include <libnetfilter_conntrack/libnetfilter_conntrack_tcp.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <limits.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
 
 struct ct_filter {
 	int logic[CT_FILTER_MAX];
@@ -458,6 +464,229 @@ int ct_filter_master(const struct nf_conntrack *master)
 	return STATE(mode)->internal->exp.find(master) ? 0 : 1;
 }
 
+static const char *tcp_state_names[TCP_CONNTRACK_MAX] = {
+	[TCP_CONNTRACK_NONE]		= "NONE",
+	[TCP_CONNTRACK_SYN_SENT]	= "SYN_SENT",
+	[TCP_CONNTRACK_SYN_RECV]	= "SYN_RECV",
+	[TCP_CONNTRACK_ESTABLISHED]	= "ESTABLISHED",
+	[TCP_CONNTRACK_FIN_WAIT]	= "FIN_WAIT",
+	[TCP_CONNTRACK_CLOSE_WAIT]	= "CLOSE_WAIT",
+	[TCP_CONNTRACK_LAST_ACK]	= "LAST_ACK",
+	[TCP_CONNTRACK_TIME_WAIT]	= "TIME_WAIT",
+	[TCP_CONNTRACK_CLOSE]		= "CLOSE",
+	[TCP_CONNTRACK_LISTEN]		= "LISTEN",
+};
+
+const char *ct_dump_tcp_state_name(uint8_t val)
+{
+	if (val >= TCP_CONNTRACK_MAX || tcp_state_names[val] == NULL)
+		return "UNKNOWN";
+
+	return tcp_state_names[val];
+}
+
+static int ct_dump_filter_parse_addr(struct ct_dump_filter *f, char *val)
+{
+	char *slash;
+	int cidr = -1;
+
+	slash = strchr(val, '/');
+	if (slash != NULL) {
+		*slash = '\0';
+		cidr = atoi(slash + 1);
+	}
+	if (inet_pton(AF_INET, val, f->addr) == 1) {
+		f->family = AF_INET;
+		if (cidr < 0 || cidr > 32)
+			cidr = 32;
+		f->mask[0] = ipv4_cidr2mask_net(cidr);
+		f->addr[0] &= f->mask[0];
+	} else if (inet_pton(AF_INET6, val, f->addr) == 1) {
+		int i;
+
+		f->family = AF_INET6;
+		if (cidr < 0 || cidr > 128)
+			cidr = 128;
+		ipv6_cidr2mask_net(cidr, f->mask);
+		for (i = 0; i < 4; i++)
+			f->addr[i] &= f->mask[i];
+	} else
+		return -1;
+
+	f->flags |= CT_DUMP_F_ADDRESS;
+	return 0;
+}
+
+/*
+ * Parse a comma separated list of key=value pairs, eg.
+ * proto=tcp,addr=10.0.0.0/8,port=443,mark=0x10/0xff,zone=1,state=ESTABLISHED
+ */
+int ct_dump_filter_parse(struct ct_dump_filter *f, char *arg)
+{
+	char *tok, *val, *end, *save = NULL;
+	struct protoent *pent;
+	unsigned long num;
+	int i;
+
+	for (tok = strtok_r(arg, ",", &save); tok != NULL;
+	     tok = strtok_r(NULL, ",", &save)) {
+		val = strchr(tok, '=');
+		if (val == NULL)
+			return -1;
+		*val++ = '\0';
+
+		if (strcmp(tok, "proto") == 0) {
+			num = strtoul(val, &end, 0);
+			if (*end != '\0') {
+				pent = getprotobyname(val);
+				if (pent == NULL)
+					return -1;
+				num = pent->p_proto;
+			}
+			if (num > UINT8_MAX)
+				return -1;
+			f->l4proto = num;
+			f->flags |= CT_DUMP_F_L4PROTO;
+		} else if (strcmp(tok, "addr") == 0) {
+			if (ct_dump_filter_parse_addr(f, val) == -1)
+				return -1;
+		} else if (strcmp(tok, "port") == 0) {
+			num = strtoul(val, &end, 0);
+			if (*end != '\0' || num > UINT16_MAX)
+				return -1;
+			f->port = num;
+			f->flags |= CT_DUMP_F_PORT;
+		} else if (strcmp(tok, "mark") == 0) {
+			f->mark = strtoul(val, &end, 0);
+			f->mark_mask = UINT32_MAX;
+			if (*end == '/')
+				f->mark_mask = strtoul(end + 1, &end, 0);
+			if (*end != '\0')
+				return -1;
+			/* compared with the masked mark of the entries. */
+			f->mark &= f->mark_mask;
+			f->flags |= CT_DUMP_F_MARK;
+		} else if (strcmp(tok, "zone") == 0) {
+			num = strtoul(val, &end, 0);
+			if (*end != '\0' || num > UINT16_MAX)
+				return -1;
+			f->zone = num;
+			f->flags |= CT_DUMP_F_ZONE;
+		} else if (strcmp(tok, "state") == 0) {
+			for (i = 0; i < TCP_CONNTRACK_MAX; i++) {
+				if (tcp_state_names[i] &&
+				    strcasecmp(val, tcp_state_names[i]) == 0)
+					break;
+			}
+			if (i == TCP_CONNTRACK_MAX)
+				return -1;
+			f->state = i;
+			f->flags |= CT_DUMP_F_STATE;
+		} else
+			return -1;
+	}
+	return 0;
+}
+
+static int
+ct_dump_filter_match_addr(const struct ct_dump_filter *f,
+			  const struct nf_conntrack *ct)
+{
+	const uint32_t *src, *dst;
+	uint32_t a, b;
+	int i;
+
+	if (nfct_get_attr_u8(ct, ATTR_L3PROTO) != f->family)
+		return 0;
+
+	switch(f->family) {
+	case AF_INET:
+		a = nfct_get_attr_u32(ct, ATTR_ORIG_IPV4_SRC);
+		b = nfct_get_attr_u32(ct, ATTR_ORIG_IPV4_DST);
+		return (a & f->mask[0]) == f->addr[0] ||
+		       (b & f->mask[0]) == f->addr[0];
+	case AF_INET6:
+		src = nfct_get_attr(ct, ATTR_ORIG_IPV6_SRC);
+		dst = nfct_get_attr(ct, ATTR_ORIG_IPV6_DST);
+		for (i = 0; i < 4; i++) {
+			if ((src[i] & f->mask[i]) != f->addr[i])
+				break;
+		}
+		if (i == 4)
+			return 1;
+		for (i = 0; i < 4; i++) {
+			if ((dst[i] & f->mask[i]) != f->addr[i])
+				return 0;
+		}
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Read the filter that follows the dump request from the client. It is sent
+ * along with the request, so it is already there: do not let a client that
+ * does not send it stall the daemon.
+ */
+int ct_dump_filter_recv(int fd, struct ct_dump_filter *f)
+{
+	if (recv(fd, f, sizeof(*f), MSG_DONTWAIT) != sizeof(*f)) {
+		STATE(stats).local_read_failed++;
+		return -1;
+	}
+	switch(f->format) {
+	case NFCT_O_PLAIN:
+	case NFCT_O_XML:
+	case CTD_DUMP_JSON:
+	case CTD_DUMP_BINARY:
+		break;
+	default:
+		STATE(stats).local_unknown_request++;
+		return -1;
+	}
+	return 0;
+}
+
+/* returns 1 if the entry should be dumped, otherwise 0. */
+int ct_dump_filter_match(const struct ct_dump_filter *f,
+			 const struct nf_conntrack *ct)
+{
+	if (f == NULL)
+		return 1;
+
+	if (f->flags & CT_DUMP_F_L4PROTO &&
+	    nfct_get_attr_u8(ct, ATTR_L4PROTO) != f->l4proto)
+		return 0;
+
+	if (f->flags & CT_DUMP_F_ADDRESS && !ct_dump_filter_match_addr(f, ct))
+		return 0;
+
+	if (f->flags & CT_DUMP_F_PORT) {
+		if (!nfct_attr_is_set(ct, ATTR_ORIG_PORT_SRC))
+			return 0;
+		if (ntohs(nfct_get_attr_u16(ct, ATTR_ORIG_PORT_SRC)) != f->port &&
+		    ntohs(nfct_get_attr_u16(ct, ATTR_ORIG_PORT_DST)) != f->port)
+			return 0;
+	}
+
+	if (f->flags & CT_DUMP_F_MARK &&
+	    (nfct_get_attr_u32(ct, ATTR_MARK) & f->mark_mask) != f->mark)
+		return 0;
+
+	if (f->flags & CT_DUMP_F_ZONE &&
+	    nfct_get_attr_u16(ct, ATTR_ZONE) != f->zone)
+		return 0;
+
+	if (f->flags & CT_DUMP_F_STATE) {
+		if (nfct_get_attr_u8(ct, ATTR_L4PROTO) != IPPROTO_TCP ||
+		    !nfct_attr_is_set(ct, ATTR_TCP_STATE) ||
+		    nfct_get_attr_u8(ct, ATTR_TCP_STATE) != f->state)
+			return 0;
+	}
+
+	return 1;
+}
+
 struct exp_filter {
 	struct list_head 	list;
 };
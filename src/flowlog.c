@@ -0,0 +1,367 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Asynchronous flow logging for the statistics mode. The event path only
+ * copies a ctnetlink message of the destroyed flow into a ring buffer, a
+ * writer thread formats the records and writes them in large chunks. If
+ * the ring is full, the record is dropped and accounted.
+ */
+#include "conntrackd.h"
+#include "flowlog.h"
+#include "cache.h"
+#include "date.h"
+#include "log.h"
+#include "metrics.h"
+
+#include <libmnl/libmnl.h>
+#include <libnetfilter_conntrack/libnetfilter_conntrack.h>
+#include <pthread.h>
+#include <signal.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#define FLOWLOG_ALIGN(len)	(((len) + 7) & ~7)
+#define FLOWLOG_OUTSIZ		(256 * 1024)
+#define FLOWLOG_LINE_MAX	1024
+
+/* followed by a IPCTNL_MSG_CT_NEW message, zero length means wrap. */
+struct flowlog_rec {
+	uint32_t	len;		/* including this header */
+	uint32_t	time;		/* when the event was received */
+};
+
+struct flowlog {
+	char			*ring;
+	size_t			size;
+	uint64_t		head;		/* written by the daemon */
+	uint64_t		tail;		/* written by the thread */
+
+	FILE			*fp;
+	int			syslog_facility;
+	unsigned int		flush_interval;	/* msecs */
+
+	pthread_t		thread;
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	int			kicked;
+	int			stop;
+
+	char			*out;
+	size_t			outlen;
+
+	/* updated by the daemon */
+	struct {
+		uint64_t	queued;
+		uint64_t	dropped;
+	} stats;
+	/* updated by the thread */
+	struct {
+		uint64_t	written;
+		uint64_t	bytes;
+		uint64_t	failed;
+	} wstats;
+};
+
+static void flowlog_flush(struct flowlog *fl)
+{
+	size_t off = 0;
+	ssize_t ret;
+
+	/* write(2) instead of stdio, child processes have nothing to flush. */
+	while (off < fl->outlen) {
+		ret = write(fileno(fl->fp), fl->out + off, fl->outlen - off);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			__atomic_add_fetch(&fl->wstats.failed, 1,
+					   __ATOMIC_RELAXED);
+			break;
+		}
+		off += ret;
+	}
+	__atomic_add_fetch(&fl->wstats.bytes, off, __ATOMIC_RELAXED);
+	fl->outlen = 0;
+}
+
+static void flowlog_format(struct flowlog *fl, const struct flowlog_rec *rec,
+			   char *date, time_t *date_time)
+{
+	const struct nlmsghdr *nlh = (const struct nlmsghdr *)(rec + 1);
+	char line[FLOWLOG_LINE_MAX];
+	struct nf_conntrack *ct;
+	int size;
+
+	ct = nfct_new();
+	if (ct == NULL)
+		return;
+
+	if (nfct_nlmsg_parse(nlh, ct) == -1) {
+		nfct_destroy(ct);
+		return;
+	}
+
+	/* same format as dlog_ct(), the date only changes once a second. */
+	if (*date_time != rec->time) {
+		time_t t = rec->time;
+
+		ctime_r(&t, date);
+		date[strlen(date) - 1] = '\0';
+		*date_time = rec->time;
+	}
+	size = snprintf(line, sizeof(line), "%s\t", date);
+	size += nfct_snprintf(line + size, sizeof(line) - size, ct, 0,
+			      NFCT_O_PLAIN, 0);
+	if (size > (int)sizeof(line) - 2)
+		size = sizeof(line) - 2;
+	nfct_destroy(ct);
+
+	if (fl->syslog_facility != -1)
+		syslog(LOG_INFO, "%s", line + strlen(date) + 1);
+
+	if (fl->fp == NULL)
+		return;
+
+	line[size++] = '\n';
+	if (fl->outlen + size > FLOWLOG_OUTSIZ)
+		flowlog_flush(fl);
+
+	memcpy(fl->out + fl->outlen, line, size);
+	fl->outlen += size;
+}
+
+static void flowlog_drain(struct flowlog *fl)
+{
+	const struct flowlog_rec *rec;
+	char date[32] = "";
+	time_t date_time = 0;
+	uint64_t head, tail;
+	size_t off;
+
+	tail = fl->tail;
+	head = __atomic_load_n(&fl->head, __ATOMIC_ACQUIRE);
+
+	while (tail < head) {
+		off = tail % fl->size;
+		rec = (const struct flowlog_rec *)(fl->ring + off);
+		if (rec->len == 0) {
+			tail += fl->size - off;
+		} else {
+			flowlog_format(fl, rec, date, &date_time);
+			tail += FLOWLOG_ALIGN(rec->len);
+			__atomic_add_fetch(&fl->wstats.written, 1,
+					   __ATOMIC_RELAXED);
+		}
+		/* release the space as soon as possible. */
+		__atomic_store_n(&fl->tail, tail, __ATOMIC_RELEASE);
+
+		if (tail == head)
+			head = __atomic_load_n(&fl->head, __ATOMIC_ACQUIRE);
+	}
+	if (fl->fp != NULL && fl->outlen > 0)
+		flowlog_flush(fl);
+}
+
+static void *flowlog_run(void *data)
+{
+	struct flowlog *fl = data;
+	struct timespec ts;
+	int stop;
+
+	for (;;) {
+		pthread_mutex_lock(&fl->lock);
+		if (!fl->kicked && !fl->stop) {
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += fl->flush_interval / 1000;
+			ts.tv_nsec += (fl->flush_interval % 1000) * 1000000;
+			if (ts.tv_nsec >= 1000000000) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&fl->cond, &fl->lock, &ts);
+		}
+		fl->kicked = 0;
+		stop = fl->stop;
+		pthread_mutex_unlock(&fl->lock);
+
+		flowlog_drain(fl);
+		if (stop)
+			break;
+	}
+	return NULL;
+}
+
+struct flowlog *flowlog_create(FILE *fp, int syslog_facility, size_t size,
+			       unsigned int flush_interval)
+{
+	struct flowlog *fl;
+	sigset_t all, old;
+	int ret;
+
+	fl = calloc(1, sizeof(struct flowlog));
+	if (fl == NULL)
+		return NULL;
+
+	fl->size = FLOWLOG_ALIGN(size);
+	fl->ring = malloc(fl->size);
+	fl->out = malloc(FLOWLOG_OUTSIZ);
+	if (fl->ring == NULL || fl->out == NULL)
+		goto err;
+
+	fl->fp = fp;
+	fl->syslog_facility = syslog_facility;
+	fl->flush_interval = flush_interval ? flush_interval : 1;
+	pthread_mutex_init(&fl->lock, NULL);
+	pthread_cond_init(&fl->cond, NULL);
+
+	/* signals are handled by the main loop, never by this thread. */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	ret = pthread_create(&fl->thread, NULL, flowlog_run, fl);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret != 0) {
+		dlog(LOG_ERR, "can't create flow log thread: %s",
+		     strerror(ret));
+		pthread_cond_destroy(&fl->cond);
+		pthread_mutex_destroy(&fl->lock);
+		goto err;
+	}
+	return fl;
+err:
+	free(fl->out);
+	free(fl->ring);
+	free(fl);
+	return NULL;
+}
+
+void flowlog_destroy(struct flowlog *fl)
+{
+	/* the thread writes what is still in the ring before leaving. */
+	pthread_mutex_lock(&fl->lock);
+	fl->stop = 1;
+	pthread_cond_signal(&fl->cond);
+	pthread_mutex_unlock(&fl->lock);
+	pthread_join(fl->thread, NULL);
+
+	pthread_cond_destroy(&fl->cond);
+	pthread_mutex_destroy(&fl->lock);
+	free(fl->out);
+	free(fl->ring);
+	free(fl);
+}
+
+int flowlog_put(struct flowlog *fl, const struct nf_conntrack *ct)
+{
+	char buf[sizeof(struct flowlog_rec) + MNL_SOCKET_BUFFER_SIZE];
+	struct flowlog_rec *rec = (struct flowlog_rec *)buf;
+	uint64_t head = fl->head, tail, used;
+	size_t off, contig, len;
+	int size;
+
+	size = cache_ct_dump_binary(buf + sizeof(*rec), ct);
+	if (size == 0)
+		return -1;
+
+	rec->len = sizeof(*rec) + size;
+	rec->time = time_cached();
+	len = FLOWLOG_ALIGN(rec->len);
+
+	/* records are contiguous, the tail of the ring may be skipped. */
+	off = head % fl->size;
+	contig = fl->size - off;
+	tail = __atomic_load_n(&fl->tail, __ATOMIC_ACQUIRE);
+	used = head - tail;
+
+	if (used + len + (contig < len ? contig : 0) > fl->size) {
+		fl->stats.dropped++;
+		return -1;
+	}
+	if (contig < len) {
+		((struct flowlog_rec *)(fl->ring + off))->len = 0;
+		head += contig;
+		off = 0;
+	}
+	memcpy(fl->ring + off, buf, rec->len);
+	head += len;
+	__atomic_store_n(&fl->head, head, __ATOMIC_RELEASE);
+	fl->stats.queued++;
+
+	/* wake up the thread before the ring fills up. */
+	if (used < fl->size / 2 && head - tail >= fl->size / 2) {
+		pthread_mutex_lock(&fl->lock);
+		fl->kicked = 1;
+		pthread_cond_signal(&fl->cond);
+		pthread_mutex_unlock(&fl->lock);
+	}
+	return 0;
+}
+
+void flowlog_stats(struct flowlog *fl, int fd)
+{
+	char buf[512];
+	int size;
+
+	size = snprintf(buf, sizeof(buf),
+			"flow log:\n"
+			"%20llu Records queued  %20llu Records dropped\n"
+			"%20llu Records written %20llu Bytes written\n"
+			"%20llu Write errors    %20llu Ring usage (bytes)\n\n",
+			(unsigned long long)fl->stats.queued,
+			(unsigned long long)fl->stats.dropped,
+			(unsigned long long)
+			__atomic_load_n(&fl->wstats.written, __ATOMIC_RELAXED),
+			(unsigned long long)
+			__atomic_load_n(&fl->wstats.bytes, __ATOMIC_RELAXED),
+			(unsigned long long)
+			__atomic_load_n(&fl->wstats.failed, __ATOMIC_RELAXED),
+			(unsigned long long)(fl->head -
+			__atomic_load_n(&fl->tail, __ATOMIC_RELAXED)));
+
+	send(fd, buf, size, 0);
+}
+
+void flowlog_metrics(struct flowlog *fl, struct metrics *m)
+{
+	metrics_family(m, "flowlog_queued", METRICS_COUNTER,
+		       "Flow records queued for logging");
+	metrics_sample(m, fl->stats.queued, NULL);
+
+	metrics_family(m, "flowlog_dropped", METRICS_COUNTER,
+		       "Flow records dropped because the ring was full");
+	metrics_sample(m, fl->stats.dropped, NULL);
+
+	metrics_family(m, "flowlog_written", METRICS_COUNTER,
+		       "Flow records formatted by the writer thread");
+	metrics_sample(m, __atomic_load_n(&fl->wstats.written,
+					  __ATOMIC_RELAXED), NULL);
+
+	metrics_family(m, "flowlog_bytes", METRICS_COUNTER,
+		       "Bytes written to the flow log file");
+	metrics_sample(m, __atomic_load_n(&fl->wstats.bytes,
+					  __ATOMIC_RELAXED), NULL);
+
+	metrics_family(m, "flowlog_write_errors", METRICS_COUNTER,
+		       "Failed writes to the flow log file");
+	metrics_sample(m, __atomic_load_n(&fl->wstats.failed,
+					  __ATOMIC_RELAXED), NULL);
+
+	metrics_family(m, "flowlog_ring_bytes", METRICS_GAUGE,
+		       "Bytes pending in the flow log ring");
+	metrics_sample(m, fl->head - __atomic_load_n(&fl->tail,
+						     __ATOMIC_RELAXED), NULL);
+}
@@ -0,0 +1,487 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Heavy hitters for the statistics mode: the sources and destinations
+ * that create most connections and the flows that move most bytes.
+ *
+ * Every table is a Space-Saving summary (Metwally et al., 2005) with a
+ * fixed number of counters: a key that is not tracked replaces the one
+ * with the smallest count and inherits it as error. Counters are kept in
+ * a min-heap and indexed by a hash table, so updates are O(log n). All
+ * counters are halved every window, so they follow the recent traffic: a
+ * steady rate r converges to a count of 2 * r * window.
+ */
+#include "conntrackd.h"
+#include "hitters.h"
+#include "alarm.h"
+#include "metrics.h"
+
+#include <libnetfilter_conntrack/libnetfilter_conntrack.h>
+#include <arpa/inet.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include "jhash.h"
+
+/* entries shown by conntrackd -s top, and exported as metrics */
+#define HITTERS_SHOW		20
+#define HITTERS_METRICS		10
+
+struct hitters_key {
+	uint8_t		l3proto;
+	uint8_t		l4proto;
+	uint16_t	sport;
+	uint16_t	dport;
+	uint16_t	pad;
+	uint32_t	src[4];
+	uint32_t	dst[4];
+};
+
+struct hitters_entry {
+	struct hitters_key	key;
+	uint32_t		hash;
+	uint32_t		heap;	/* position in the heap */
+	uint64_t		count;
+	uint64_t		error;	/* overestimation upper bound */
+};
+
+struct hitters_table {
+	const char		*name;
+	const char		*unit;
+	struct hitters_entry	*entry;
+	uint32_t		*heap;	/* min-heap of entry indexes */
+	uint32_t		*slot;	/* entry index + 1, zero if free */
+	uint32_t		mask;
+	unsigned int		num;
+	unsigned int		max;
+	uint64_t		total;
+};
+
+enum {
+	HITTERS_SOURCES,
+	HITTERS_DESTINATIONS,
+	HITTERS_FLOWS,
+	HITTERS_MAX
+};
+
+struct hitters {
+	struct hitters_table	table[HITTERS_MAX];
+	unsigned int		window;		/* secs */
+	struct alarm_block	alarm;
+};
+
+static int hitters_table_init(struct hitters_table *t, const char *name,
+			      const char *unit, unsigned int max)
+{
+	uint32_t slots = 1;
+
+	while (slots < max * 2)
+		slots <<= 1;
+
+	t->entry = calloc(max, sizeof(struct hitters_entry));
+	t->heap = calloc(max, sizeof(uint32_t));
+	t->slot = calloc(slots, sizeof(uint32_t));
+	if (t->entry == NULL || t->heap == NULL || t->slot == NULL)
+		return -1;
+
+	t->name = name;
+	t->unit = unit;
+	t->mask = slots - 1;
+	t->max = max;
+
+	return 0;
+}
+
+static void hitters_table_free(struct hitters_table *t)
+{
+	free(t->entry);
+	free(t->heap);
+	free(t->slot);
+}
+
+static void hitters_heap_swap(struct hitters_table *t, uint32_t i, uint32_t j)
+{
+	uint32_t tmp = t->heap[i];
+
+	t->heap[i] = t->heap[j];
+	t->heap[j] = tmp;
+	t->entry[t->heap[i]].heap = i;
+	t->entry[t->heap[j]].heap = j;
+}
+
+static void hitters_heap_up(struct hitters_table *t, uint32_t i)
+{
+	uint32_t parent;
+
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (t->entry[t->heap[parent]].count <=
+		    t->entry[t->heap[i]].count)
+			break;
+		hitters_heap_swap(t, i, parent);
+		i = parent;
+	}
+}
+
+static void hitters_heap_down(struct hitters_table *t, uint32_t i)
+{
+	uint32_t child, min;
+
+	for (;;) {
+		min = i;
+		child = 2 * i + 1;
+		if (child < t->num && t->entry[t->heap[child]].count <
+				      t->entry[t->heap[min]].count)
+			min = child;
+		child++;
+		if (child < t->num && t->entry[t->heap[child]].count <
+				      t->entry[t->heap[min]].count)
+			min = child;
+		if (min == i)
+			break;
+		hitters_heap_swap(t, i, min);
+		i = min;
+	}
+}
+
+/* slot of the key, or the free slot where it would be inserted. */
+static uint32_t hitters_slot(struct hitters_table *t,
+			     const struct hitters_key *key, uint32_t hash)
+{
+	uint32_t i = hash & t->mask;
+	struct hitters_entry *e;
+
+	while (t->slot[i]) {
+		e = &t->entry[t->slot[i] - 1];
+		if (e->hash == hash && memcmp(&e->key, key, sizeof(*key)) == 0)
+			break;
+		i = (i + 1) & t->mask;
+	}
+	return i;
+}
+
+/* linear probing, shift back the next entries instead of tombstones. */
+static void hitters_slot_del(struct hitters_table *t, uint32_t i)
+{
+	uint32_t j = i, home;
+
+	for (;;) {
+		j = (j + 1) & t->mask;
+		if (!t->slot[j])
+			break;
+
+		home = t->entry[t->slot[j] - 1].hash & t->mask;
+		if (((j - home) & t->mask) >= ((j - i) & t->mask)) {
+			t->slot[i] = t->slot[j];
+			i = j;
+		}
+	}
+	t->slot[i] = 0;
+}
+
+static void hitters_add(struct hitters_table *t, const struct hitters_key *key,
+			uint64_t weight)
+{
+	uint32_t hash = jhash2((const uint32_t *)key,
+			       sizeof(*key) / sizeof(uint32_t), 0);
+	struct hitters_entry *e;
+	uint32_t i, idx;
+
+	t->total += weight;
+
+	i = hitters_slot(t, key, hash);
+	if (t->slot[i]) {
+		e = &t->entry[t->slot[i] - 1];
+		e->count += weight;
+		hitters_heap_down(t, e->heap);
+		return;
+	}
+
+	if (t->num < t->max) {
+		idx = t->num++;
+		e = &t->entry[idx];
+		e->count = weight;
+		e->error = 0;
+		e->heap = t->num - 1;
+		t->heap[e->heap] = idx;
+		hitters_heap_up(t, e->heap);
+	} else {
+		/* replace the entry with the minimum count. */
+		idx = t->heap[0];
+		e = &t->entry[idx];
+		hitters_slot_del(t, hitters_slot(t, &e->key, e->hash));
+		i = hitters_slot(t, key, hash);
+		e->error = e->count;
+		e->count += weight;
+		hitters_heap_down(t, 0);
+	}
+	e->key = *key;
+	e->hash = hash;
+	t->slot[i] = idx + 1;
+}
+
+/* halving all the counters keeps the heap ordered. */
+static void hitters_decay(struct hitters_table *t)
+{
+	unsigned int i;
+
+	for (i = 0; i < t->num; i++) {
+		t->entry[i].count /= 2;
+		t->entry[i].error /= 2;
+	}
+	t->total /= 2;
+}
+
+static void hitters_alarm(struct alarm_block *a, void *data)
+{
+	struct hitters *h = data;
+	int i;
+
+	for (i = 0; i < HITTERS_MAX; i++)
+		hitters_decay(&h->table[i]);
+
+	add_alarm(&h->alarm, h->window, 0);
+}
+
+struct hitters *hitters_create(unsigned int entries, unsigned int window)
+{
+	struct hitters *h;
+	int i;
+
+	h = calloc(1, sizeof(struct hitters));
+	if (h == NULL)
+		return NULL;
+
+	if (hitters_table_init(&h->table[HITTERS_SOURCES],
+			       "sources by new connections", "conns/s",
+			       entries) == -1 ||
+	    hitters_table_init(&h->table[HITTERS_DESTINATIONS],
+			       "destinations by new connections", "conns/s",
+			       entries) == -1 ||
+	    hitters_table_init(&h->table[HITTERS_FLOWS],
+			       "flows by bytes", "bytes/s",
+			       entries) == -1) {
+		for (i = 0; i < HITTERS_MAX; i++)
+			hitters_table_free(&h->table[i]);
+		free(h);
+		return NULL;
+	}
+	h->window = window;
+
+	init_alarm(&h->alarm, h, hitters_alarm);
+	add_alarm(&h->alarm, h->window, 0);
+
+	return h;
+}
+
+void hitters_destroy(struct hitters *h)
+{
+	int i;
+
+	del_alarm(&h->alarm);
+	for (i = 0; i < HITTERS_MAX; i++)
+		hitters_table_free(&h->table[i]);
+	free(h);
+}
+
+static void hitters_addr(struct hitters_key *key, uint32_t *addr,
+			 const struct nf_conntrack *ct, int attr4, int attr6)
+{
+	const void *ptr;
+
+	if (key->l3proto == AF_INET) {
+		addr[0] = nfct_get_attr_u32(ct, attr4);
+	} else {
+		ptr = nfct_get_attr(ct, attr6);
+		if (ptr)
+			memcpy(addr, ptr, sizeof(uint32_t) * 4);
+	}
+}
+
+void hitters_flow_new(struct hitters *h, const struct nf_conntrack *ct)
+{
+	struct hitters_key key;
+
+	memset(&key, 0, sizeof(key));
+	key.l3proto = nfct_get_attr_u8(ct, ATTR_L3PROTO);
+	if (key.l3proto != AF_INET && key.l3proto != AF_INET6)
+		return;
+
+	hitters_addr(&key, key.src, ct, ATTR_ORIG_IPV4_SRC, ATTR_ORIG_IPV6_SRC);
+	hitters_add(&h->table[HITTERS_SOURCES], &key, 1);
+
+	memset(key.src, 0, sizeof(key.src));
+	hitters_addr(&key, key.src, ct, ATTR_ORIG_IPV4_DST, ATTR_ORIG_IPV6_DST);
+	hitters_add(&h->table[HITTERS_DESTINATIONS], &key, 1);
+}
+
+void hitters_flow_end(struct hitters *h, const struct nf_conntrack *ct)
+{
+	struct hitters_key key;
+	uint64_t bytes;
+
+	bytes = nfct_get_attr_u64(ct, ATTR_ORIG_COUNTER_BYTES) +
+		nfct_get_attr_u64(ct, ATTR_REPL_COUNTER_BYTES);
+	if (bytes == 0)
+		return;
+
+	memset(&key, 0, sizeof(key));
+	key.l3proto = nfct_get_attr_u8(ct, ATTR_L3PROTO);
+	if (key.l3proto != AF_INET && key.l3proto != AF_INET6)
+		return;
+
+	key.l4proto = nfct_get_attr_u8(ct, ATTR_L4PROTO);
+	hitters_addr(&key, key.src, ct, ATTR_ORIG_IPV4_SRC, ATTR_ORIG_IPV6_SRC);
+	hitters_addr(&key, key.dst, ct, ATTR_ORIG_IPV4_DST, ATTR_ORIG_IPV6_DST);
+	if (nfct_attr_is_set(ct, ATTR_ORIG_PORT_SRC)) {
+		key.sport = ntohs(nfct_get_attr_u16(ct, ATTR_ORIG_PORT_SRC));
+		key.dport = ntohs(nfct_get_attr_u16(ct, ATTR_ORIG_PORT_DST));
+	}
+	hitters_add(&h->table[HITTERS_FLOWS], &key, bytes);
+}
+
+static int hitters_cmp(const void *a, const void *b)
+{
+	const struct hitters_entry *e1 = *(const void * const *)a;
+	const struct hitters_entry *e2 = *(const void * const *)b;
+
+	if (e1->count != e2->count)
+		return e1->count < e2->count ? 1 : -1;
+	return 0;
+}
+
+/* the busiest entries, up to max. */
+static unsigned int hitters_sort(struct hitters_table *t,
+				 struct hitters_entry **v, unsigned int max)
+{
+	struct hitters_entry **all;
+	unsigned int i, n = 0;
+
+	all = malloc((t->num + 1) * sizeof(struct hitters_entry *));
+	if (all == NULL)
+		return 0;
+
+	/* skip the entries that may be there only due to the error. */
+	for (i = 0; i < t->num; i++) {
+		if (t->entry[i].count > t->entry[i].error)
+			all[n++] = &t->entry[i];
+	}
+	qsort(all, n, sizeof(struct hitters_entry *), hitters_cmp);
+
+	if (n > max)
+		n = max;
+	memcpy(v, all, n * sizeof(struct hitters_entry *));
+	free(all);
+
+	return n;
+}
+
+static const char *hitters_key_str(const struct hitters_key *key, int flow,
+				   char *buf, size_t size)
+{
+	char src[INET6_ADDRSTRLEN], dst[INET6_ADDRSTRLEN];
+
+	if (!flow)
+		return inet_ntop(key->l3proto, key->src, buf, size);
+
+	inet_ntop(key->l3proto, key->src, src, sizeof(src));
+	inet_ntop(key->l3proto, key->dst, dst, sizeof(dst));
+	snprintf(buf, size, "%u %s:%u -> %s:%u", key->l4proto,
+		 src, key->sport, dst, key->dport);
+	return buf;
+}
+
+/* rate in tenths, a steady rate r gives a count of 2 * r * window. */
+static uint64_t hitters_rate(const struct hitters *h, uint64_t count)
+{
+	return count * 10 / (2 * h->window);
+}
+
+void hitters_dump(struct hitters *h, int fd)
+{
+	struct hitters_entry *v[HITTERS_SHOW];
+	char buf[HITTERS_SHOW * 160 + 256], key[160];
+	unsigned int i, n;
+	uint64_t rate, error;
+	int t, size;
+
+	for (t = 0; t < HITTERS_MAX; t++) {
+		n = hitters_sort(&h->table[t], v, HITTERS_SHOW);
+		rate = hitters_rate(h, h->table[t].total);
+
+		size = snprintf(buf, sizeof(buf),
+				"top %s (%u tracked, total %llu.%llu %s):\n"
+				"%16s %14s  %s\n",
+				h->table[t].name, h->table[t].num,
+				(unsigned long long)rate / 10,
+				(unsigned long long)rate % 10,
+				h->table[t].unit, h->table[t].unit,
+				"max error", t == HITTERS_FLOWS ?
+				"flow" : "address");
+
+		for (i = 0; i < n; i++) {
+			rate = hitters_rate(h, v[i]->count);
+			error = hitters_rate(h, v[i]->error);
+			size += snprintf(buf + size, sizeof(buf) - size,
+					 "%14llu.%llu %12llu.%llu  %s\n",
+					 (unsigned long long)rate / 10,
+					 (unsigned long long)rate % 10,
+					 (unsigned long long)error / 10,
+					 (unsigned long long)error % 10,
+					 hitters_key_str(&v[i]->key,
+							 t == HITTERS_FLOWS,
+							 key, sizeof(key)));
+		}
+		size += snprintf(buf + size, sizeof(buf) - size, "\n");
+
+		send(fd, buf, size, 0);
+	}
+}
+
+void hitters_metrics(struct hitters *h, struct metrics *m)
+{
+	static const char *name[HITTERS_MAX] = {
+		[HITTERS_SOURCES]	= "top_source_connections_rate",
+		[HITTERS_DESTINATIONS]	= "top_destination_connections_rate",
+		[HITTERS_FLOWS]		= "top_flow_bytes_rate",
+	};
+	static const char *help[HITTERS_MAX] = {
+		[HITTERS_SOURCES]	= "New connections per second of the "
+					  "busiest sources",
+		[HITTERS_DESTINATIONS]	= "New connections per second of the "
+					  "busiest destinations",
+		[HITTERS_FLOWS]		= "Bytes per second of the busiest "
+					  "destroyed flows",
+	};
+	struct hitters_entry *v[HITTERS_METRICS];
+	unsigned int i, n;
+	char key[160];
+	int t;
+
+	for (t = 0; t < HITTERS_MAX; t++) {
+		metrics_family(m, name[t], METRICS_GAUGE, help[t]);
+
+		n = hitters_sort(&h->table[t], v, HITTERS_METRICS);
+		for (i = 0; i < n; i++) {
+			metrics_sample(m, v[i]->count / (2 * h->window),
+				       "%s=\"%s\"",
+				       t == HITTERS_FLOWS ? "flow" : "address",
+				       hitters_key_str(&v[i]->key,
+						       t == HITTERS_FLOWS,
+						       key, sizeof(key)));
+		}
+	}
+}
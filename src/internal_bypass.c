@@ -16,6 +16,10 @@
 #include "netlink.h"
 #include "network.h"
 #include "origin.h"
+#include "filter.h"
+
+#include <stdlib.h>
+#include <libmnl/libmnl.h>
 
 static int internal_bypass_init(void)
 {
@@ -30,24 +34,46 @@ static int
 internal_bypass_ct_dump_cb(enum nf_conntrack_msg_type type,
 			   struct nf_conntrack *ct, void *data)
 {
-	char buf[1024];
-	int size, *fd = data;
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+	struct __dump_container *container = data;
+	int size;
 
 	if (ct_filter_conntrack(ct, 1))
 		return NFCT_CB_CONTINUE;
 
-	size = nfct_snprintf(buf, 1024, ct, NFCT_T_UNKNOWN, NFCT_O_DEFAULT, 0);
-	if (size < 1024) {
-		buf[size] = '\n';
-		size++;
+	if (!ct_dump_filter_match(container->filter, ct))
+		return NFCT_CB_CONTINUE;
+
+	switch(container->type) {
+	case CTD_DUMP_JSON:
+		size = cache_ct_dump_json(buf, sizeof(buf), ct, -1);
+		break;
+	case CTD_DUMP_BINARY:
+		size = cache_ct_dump_binary(buf, ct);
+		break;
+	default:
+		size = nfct_snprintf(buf, 1024, ct, NFCT_T_UNKNOWN,
+				     NFCT_O_DEFAULT, 0);
+		if (size < 1024) {
+			buf[size] = '\n';
+			size++;
+		}
+		break;
 	}
-	send(*fd, buf, size, 0);
+	if (size > 0)
+		send(container->fd, buf, size, 0);
 
 	return NFCT_CB_CONTINUE;
 }
 
-static void internal_bypass_ct_dump(int fd, int type)
+static void internal_bypass_ct_dump_kernel(int fd, int type,
+					   const struct ct_dump_filter *filter)
 {
+	struct __dump_container container = {
+		.fd	= fd,
+		.type	= type,
+		.filter	= filter,
+	};
 	struct nfct_handle *h;
 	uint32_t family = AF_UNSPEC;
 	int ret;
@@ -57,7 +83,8 @@ static void internal_bypass_ct_dump(int fd, int type)
 		dlog(LOG_ERR, "can't allocate memory for the internal cache");
 		return;
 	}
-	nfct_callback_register(h, NFCT_T_ALL, internal_bypass_ct_dump_cb, &fd);
+	nfct_callback_register(h, NFCT_T_ALL, internal_bypass_ct_dump_cb,
+			       &container);
 	ret = nfct_query(h, NFCT_Q_DUMP, &family);
 	if (ret == -1) {
 		dlog(LOG_ERR, "can't dump kernel table");
@@ -65,9 +92,16 @@ static void internal_bypass_ct_dump(int fd, int type)
 	nfct_close(h);
 }
 
+static void internal_bypass_ct_dump(int fd, int type,
+				    const struct ct_dump_filter *filter)
+{
+	/* kernel dumps are blocking, do them from a child process. */
+	cache_dump_kernel(fd, type, filter, internal_bypass_ct_dump_kernel);
+}
+
 static void internal_bypass_ct_flush(void)
 {
-	nl_flush_conntrack_table_selective();
+	nl_flush_conntrack_table_selective(NULL, NULL);
 }
 
 struct {
@@ -177,7 +211,8 @@ internal_bypass_exp_dump_cb(enum nf_conntrack_msg_type type,
 	return NFCT_CB_CONTINUE;
 }
 
-static void internal_bypass_exp_dump(int fd, int type)
+static void internal_bypass_exp_dump_kernel(int fd, int type,
+					    const struct ct_dump_filter *filter)
 {
 	struct nfct_handle *h;
 	uint32_t family = AF_UNSPEC;
@@ -197,6 +232,12 @@ static void internal_bypass_exp_dump(int fd, int type)
 	nfct_close(h);
 }
 
+static void internal_bypass_exp_dump(int fd, int type)
+{
+	/* kernel dumps are blocking, do them from a child process. */
+	cache_dump_kernel(fd, type, NULL, internal_bypass_exp_dump_kernel);
+}
+
 static void internal_bypass_exp_flush(void)
 {
 	nl_flush_expect_table(STATE(flush));
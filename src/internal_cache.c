@@ -53,9 +53,10 @@ static void internal_cache_close(void)
 	cache_destroy(STATE(mode)->internal->exp.data);
 }
 
-static void internal_cache_ct_dump(int fd, int type)
+static void internal_cache_ct_dump(int fd, int type,
+				   const struct ct_dump_filter *filter)
 {
-	cache_dump(STATE(mode)->internal->ct.data, fd, type);
+	cache_dump_stream(STATE(mode)->internal->ct.data, fd, type, filter);
 }
 
 static void internal_cache_ct_flush(void)
@@ -218,7 +219,7 @@ static int internal_cache_ct_event_del(struct nf_conntrack *ct, int origin)
 
 static void internal_cache_exp_dump(int fd, int type)
 {
-	cache_dump(STATE(mode)->internal->exp.data, fd, type);
+	cache_dump_stream(STATE(mode)->internal->exp.data, fd, type, NULL);
 }
 
 static void internal_cache_exp_flush(void)
@@ -0,0 +1,580 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * IPFIX (RFC 7011) export of the destroyed flows for the statistics mode.
+ * Data records are appended to a message buffer that is sent to the
+ * collector via UDP once it reaches the MTU, or every FlushInterval
+ * milliseconds. The same messages can also be written to a file in the
+ * IPFIX file format (RFC 5655).
+ */
+#include "conntrackd.h"
+#include "ipfix.h"
+#include "alarm.h"
+#include "log.h"
+#include "metrics.h"
+
+#include <libnetfilter_conntrack/libnetfilter_conntrack.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+struct ipfix_field {
+	uint16_t	id;
+	uint16_t	len;
+	uint32_t	pen;		/* enterprise number, zero if IANA */
+};
+
+#define IPFIX_IE(_id, _len)		{ .id = _id, .len = _len }
+#define IPFIX_IE_PEN(_id, _len, _pen)	{ .id = _id, .len = _len, .pen = _pen }
+
+enum {
+	IPFIX_T_IPV4,
+	IPFIX_T_IPV6,
+	IPFIX_T_MAX
+};
+
+static const uint16_t ipfix_template_id[IPFIX_T_MAX] = {
+	[IPFIX_T_IPV4]	= IPFIX_TEMPLATE_IPV4,
+	[IPFIX_T_IPV6]	= IPFIX_TEMPLATE_IPV6,
+};
+
+/* the records start with the addresses, they depend on the family. */
+static const struct ipfix_field ipfix_addr_fields[IPFIX_T_MAX][4] = {
+	[IPFIX_T_IPV4] = {
+		IPFIX_IE(8, 4),		/* sourceIPv4Address */
+		IPFIX_IE(12, 4),	/* destinationIPv4Address */
+		IPFIX_IE(225, 4),	/* postNATSourceIPv4Address */
+		IPFIX_IE(226, 4),	/* postNATDestinationIPv4Address */
+	},
+	[IPFIX_T_IPV6] = {
+		IPFIX_IE(27, 16),	/* sourceIPv6Address */
+		IPFIX_IE(28, 16),	/* destinationIPv6Address */
+		IPFIX_IE(281, 16),	/* postNATSourceIPv6Address */
+		IPFIX_IE(282, 16),	/* postNATDestinationIPv6Address */
+	},
+};
+
+static const struct ipfix_field ipfix_common_fields[] = {
+	IPFIX_IE(7, 2),					/* sourceTransportPort */
+	IPFIX_IE(11, 2),				/* destinationTransportPort */
+	IPFIX_IE(227, 2),				/* postNAPTSourceTransportPort */
+	IPFIX_IE(228, 2),				/* postNAPTDestinationTransportPort */
+	IPFIX_IE(4, 1),					/* protocolIdentifier */
+	IPFIX_IE(1, 8),					/* octetDeltaCount */
+	IPFIX_IE(2, 8),					/* packetDeltaCount */
+	IPFIX_IE_PEN(1, 8, IPFIX_PEN_REVERSE),		/* reverseOctetDeltaCount */
+	IPFIX_IE_PEN(2, 8, IPFIX_PEN_REVERSE),		/* reversePacketDeltaCount */
+	IPFIX_IE(152, 8),				/* flowStartMilliseconds */
+	IPFIX_IE(153, 8),				/* flowEndMilliseconds */
+	IPFIX_IE_PEN(4, 4, IPFIX_PEN_NETFILTER),	/* conntrack mark */
+	IPFIX_IE_PEN(9, 2, IPFIX_PEN_NETFILTER),	/* conntrack zone */
+};
+
+#define IPFIX_NUM_FIELDS	(4 + sizeof(ipfix_common_fields) / \
+				     sizeof(ipfix_common_fields[0]))
+
+struct ipfix_exporter {
+	int			fd;		/* UDP socket, or -1 */
+	int			file;		/* IPFIX file, or -1 */
+
+	char			*buf;
+	size_t			size;		/* maximum message size */
+	size_t			len;		/* zero if no message is open */
+	size_t			set;		/* offset of the open data set */
+	uint16_t		set_id;
+
+	uint32_t		domain;
+	uint32_t		seq;		/* data records exported */
+	uint32_t		pending;	/* records in the open message */
+	size_t			reclen[IPFIX_T_MAX];
+
+	int			template_due;
+	time_t			template_sent;
+	unsigned int		template_refresh;
+
+	unsigned int		flush_interval;	/* msecs */
+	struct alarm_block	alarm;
+
+	struct {
+		uint64_t	records;
+		uint64_t	messages;
+		uint64_t	bytes;
+		uint64_t	templates;
+		uint64_t	send_failed;
+		uint64_t	write_failed;
+	} stats;
+};
+
+static void ipfix_put16(char *p, uint16_t v)
+{
+	v = htons(v);
+	memcpy(p, &v, sizeof(v));
+}
+
+static void ipfix_put32(char *p, uint32_t v)
+{
+	v = htonl(v);
+	memcpy(p, &v, sizeof(v));
+}
+
+static void ipfix_put64(char *p, uint64_t v)
+{
+	ipfix_put32(p, v >> 32);
+	ipfix_put32(p + 4, v & 0xffffffff);
+}
+
+static char *ipfix_put_field(char *p, const struct ipfix_field *f)
+{
+	if (f->pen) {
+		ipfix_put16(p, f->id | 0x8000);
+		ipfix_put16(p + 2, f->len);
+		ipfix_put32(p + 4, f->pen);
+		return p + 8;
+	}
+	ipfix_put16(p, f->id);
+	ipfix_put16(p + 2, f->len);
+	return p + 4;
+}
+
+static size_t ipfix_template_len(void)
+{
+	size_t len = sizeof(struct ipfix_set_hdr);
+	unsigned int i, j;
+
+	for (i = 0; i < IPFIX_T_MAX; i++) {
+		len += 4;
+		for (j = 0; j < 4; j++)
+			len += ipfix_addr_fields[i][j].pen ? 8 : 4;
+		for (j = 0; j < IPFIX_NUM_FIELDS - 4; j++)
+			len += ipfix_common_fields[j].pen ? 8 : 4;
+	}
+	return len;
+}
+
+static size_t ipfix_record_len(int type)
+{
+	size_t len = 0;
+	unsigned int i;
+
+	for (i = 0; i < 4; i++)
+		len += ipfix_addr_fields[type][i].len;
+	for (i = 0; i < IPFIX_NUM_FIELDS - 4; i++)
+		len += ipfix_common_fields[i].len;
+
+	return len;
+}
+
+/* one template set that defines the IPv4 and the IPv6 template. */
+static size_t ipfix_put_templates(char *buf)
+{
+	char *p = buf + sizeof(struct ipfix_set_hdr);
+	unsigned int i, j;
+
+	for (i = 0; i < IPFIX_T_MAX; i++) {
+		ipfix_put16(p, ipfix_template_id[i]);
+		ipfix_put16(p + 2, IPFIX_NUM_FIELDS);
+		p += 4;
+		for (j = 0; j < 4; j++)
+			p = ipfix_put_field(p, &ipfix_addr_fields[i][j]);
+		for (j = 0; j < IPFIX_NUM_FIELDS - 4; j++)
+			p = ipfix_put_field(p, &ipfix_common_fields[j]);
+	}
+	ipfix_put16(buf, IPFIX_SET_TEMPLATE);
+	ipfix_put16(buf + 2, p - buf);
+
+	return p - buf;
+}
+
+static void ipfix_msg_begin(struct ipfix_exporter *exp)
+{
+	time_t now = time(NULL);
+
+	exp->len = sizeof(struct ipfix_hdr);
+	exp->set = 0;
+
+	/* UDP collectors lose the templates if they restart. */
+	if (exp->fd != -1 && exp->template_refresh &&
+	    now - exp->template_sent >= exp->template_refresh)
+		exp->template_due = 1;
+
+	if (exp->template_due) {
+		exp->len += ipfix_put_templates(exp->buf + exp->len);
+		exp->template_due = 0;
+		exp->template_sent = now;
+		exp->stats.templates++;
+	}
+}
+
+static void ipfix_set_close(struct ipfix_exporter *exp)
+{
+	if (exp->set == 0)
+		return;
+
+	ipfix_put16(exp->buf + exp->set, exp->set_id);
+	ipfix_put16(exp->buf + exp->set + 2, exp->len - exp->set);
+	exp->set = 0;
+}
+
+static void ipfix_set_open(struct ipfix_exporter *exp, uint16_t id)
+{
+	exp->set = exp->len;
+	exp->set_id = id;
+	exp->len += sizeof(struct ipfix_set_hdr);
+}
+
+static void ipfix_write(struct ipfix_exporter *exp)
+{
+	size_t off = 0;
+	ssize_t ret;
+
+	while (off < exp->len) {
+		ret = write(exp->file, exp->buf + off, exp->len - off);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			exp->stats.write_failed++;
+			return;
+		}
+		off += ret;
+	}
+}
+
+void ipfix_flush(struct ipfix_exporter *exp)
+{
+	struct ipfix_hdr *hdr = (struct ipfix_hdr *)exp->buf;
+
+	if (exp->len == 0)
+		return;
+
+	ipfix_set_close(exp);
+
+	hdr->version = htons(IPFIX_VERSION);
+	hdr->length = htons(exp->len);
+	hdr->export_time = htonl(time(NULL));
+	hdr->seq = htonl(exp->seq);
+	hdr->domain = htonl(exp->domain);
+
+	if (exp->fd != -1 &&
+	    send(exp->fd, exp->buf, exp->len, MSG_DONTWAIT) == -1)
+		exp->stats.send_failed++;
+	if (exp->file != -1)
+		ipfix_write(exp);
+
+	exp->stats.messages++;
+	exp->stats.bytes += exp->len;
+	exp->seq += exp->pending;
+	exp->pending = 0;
+	exp->len = 0;
+}
+
+static void ipfix_alarm(struct alarm_block *a, void *data)
+{
+	struct ipfix_exporter *exp = data;
+
+	ipfix_flush(exp);
+	add_alarm(&exp->alarm, exp->flush_interval / 1000,
+		  (exp->flush_interval % 1000) * 1000);
+}
+
+static uint64_t ipfix_msecs(const struct nf_conntrack *ct, int attr,
+			    time_t fallback)
+{
+	if (nfct_attr_is_set(ct, attr))
+		return nfct_get_attr_u64(ct, attr) / 1000000;
+
+	return (uint64_t)fallback * 1000;
+}
+
+static void ipfix_put_ports(char *p, const struct nf_conntrack *ct,
+			    uint8_t l4proto)
+{
+	const void *port;
+
+	switch (l4proto) {
+	case IPPROTO_ICMP:
+	case IPPROTO_ICMPV6:
+		/* like other exporters, type and code as destination port. */
+		memset(p, 0, 8);
+		ipfix_put16(p + 2, nfct_get_attr_u8(ct, ATTR_ICMP_TYPE) << 8 |
+				   nfct_get_attr_u8(ct, ATTR_ICMP_CODE));
+		return;
+	}
+
+	/* ports are already in network byte order. */
+	port = nfct_get_attr(ct, ATTR_ORIG_PORT_SRC);
+	port ? memcpy(p, port, 2) : memset(p, 0, 2);
+	port = nfct_get_attr(ct, ATTR_ORIG_PORT_DST);
+	port ? memcpy(p + 2, port, 2) : memset(p + 2, 0, 2);
+	port = nfct_get_attr(ct, ATTR_REPL_PORT_DST);
+	port ? memcpy(p + 4, port, 2) : memset(p + 4, 0, 2);
+	port = nfct_get_attr(ct, ATTR_REPL_PORT_SRC);
+	port ? memcpy(p + 6, port, 2) : memset(p + 6, 0, 2);
+}
+
+static size_t ipfix_put_data(char *buf, const struct nf_conntrack *ct,
+			     int type, time_t start)
+{
+	static const int attr[IPFIX_T_MAX][4] = {
+		[IPFIX_T_IPV4] = {
+			ATTR_ORIG_IPV4_SRC, ATTR_ORIG_IPV4_DST,
+			ATTR_REPL_IPV4_DST, ATTR_REPL_IPV4_SRC,
+		},
+		[IPFIX_T_IPV6] = {
+			ATTR_ORIG_IPV6_SRC, ATTR_ORIG_IPV6_DST,
+			ATTR_REPL_IPV6_DST, ATTR_REPL_IPV6_SRC,
+		},
+	};
+	size_t alen = ipfix_addr_fields[type][0].len;
+	uint8_t l4proto = nfct_get_attr_u8(ct, ATTR_L4PROTO);
+	const void *addr;
+	char *p = buf;
+	int i;
+
+	/* the post-NAT addresses are the reply tuple, swapped. */
+	for (i = 0; i < 4; i++) {
+		addr = nfct_get_attr(ct, attr[type][i]);
+		addr ? memcpy(p, addr, alen) : memset(p, 0, alen);
+		p += alen;
+	}
+	ipfix_put_ports(p, ct, l4proto);
+	p += 8;
+	*p++ = l4proto;
+
+	ipfix_put64(p, nfct_get_attr_u64(ct, ATTR_ORIG_COUNTER_BYTES));
+	ipfix_put64(p + 8, nfct_get_attr_u64(ct, ATTR_ORIG_COUNTER_PACKETS));
+	ipfix_put64(p + 16, nfct_get_attr_u64(ct, ATTR_REPL_COUNTER_BYTES));
+	ipfix_put64(p + 24, nfct_get_attr_u64(ct, ATTR_REPL_COUNTER_PACKETS));
+	p += 32;
+
+	ipfix_put64(p, ipfix_msecs(ct, ATTR_TIMESTAMP_START, start));
+	ipfix_put64(p + 8, ipfix_msecs(ct, ATTR_TIMESTAMP_STOP, time(NULL)));
+	p += 16;
+
+	ipfix_put32(p, nfct_get_attr_u32(ct, ATTR_MARK));
+	ipfix_put16(p + 4, nfct_get_attr_u16(ct, ATTR_ZONE));
+	p += 6;
+
+	return p - buf;
+}
+
+int ipfix_put(struct ipfix_exporter *exp, const struct nf_conntrack *ct,
+	      time_t start)
+{
+	size_t need;
+	int type;
+
+	switch (nfct_get_attr_u8(ct, ATTR_L3PROTO)) {
+	case AF_INET:
+		type = IPFIX_T_IPV4;
+		break;
+	case AF_INET6:
+		type = IPFIX_T_IPV6;
+		break;
+	default:
+		return -1;
+	}
+
+	if (exp->len == 0)
+		ipfix_msg_begin(exp);
+
+	need = exp->reclen[type];
+	if (exp->set == 0 || exp->set_id != ipfix_template_id[type])
+		need += sizeof(struct ipfix_set_hdr);
+
+	if (exp->len + need > exp->size) {
+		ipfix_flush(exp);
+		ipfix_msg_begin(exp);
+	}
+	if (exp->set == 0 || exp->set_id != ipfix_template_id[type]) {
+		ipfix_set_close(exp);
+		ipfix_set_open(exp, ipfix_template_id[type]);
+	}
+
+	exp->len += ipfix_put_data(exp->buf + exp->len, ct, type, start);
+	exp->pending++;
+	exp->stats.records++;
+
+	return 0;
+}
+
+static int ipfix_socket(void)
+{
+	union {
+		struct sockaddr_in	ipv4;
+		struct sockaddr_in6	ipv6;
+	} addr;
+	socklen_t addrlen;
+	int fd;
+
+	memset(&addr, 0, sizeof(addr));
+	switch (CONFIG(stats).ipfix.ipproto) {
+	case AF_INET:
+		addr.ipv4.sin_family = AF_INET;
+		addr.ipv4.sin_port = htons(CONFIG(stats).ipfix.port);
+		addr.ipv4.sin_addr.s_addr = CONFIG(stats).ipfix.collector.ipv4;
+		addrlen = sizeof(addr.ipv4);
+		break;
+	case AF_INET6:
+		addr.ipv6.sin6_family = AF_INET6;
+		addr.ipv6.sin6_port = htons(CONFIG(stats).ipfix.port);
+		memcpy(&addr.ipv6.sin6_addr, CONFIG(stats).ipfix.collector.ipv6,
+		       sizeof(struct in6_addr));
+		addrlen = sizeof(addr.ipv6);
+		break;
+	default:
+		return -1;
+	}
+
+	fd = socket(CONFIG(stats).ipfix.ipproto,
+		    SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		return -1;
+
+	if (connect(fd, (struct sockaddr *)&addr, addrlen) == -1) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+struct ipfix_exporter *ipfix_create(void)
+{
+	struct ipfix_exporter *exp;
+	int i;
+
+	exp = calloc(1, sizeof(struct ipfix_exporter));
+	if (exp == NULL)
+		return NULL;
+
+	exp->fd = -1;
+	exp->file = -1;
+	exp->domain = CONFIG(stats).ipfix.domain;
+	exp->template_due = 1;
+	exp->template_refresh = CONFIG(stats).ipfix.template_refresh;
+	exp->flush_interval = CONFIG(stats).ipfix.flush_interval;
+
+	for (i = 0; i < IPFIX_T_MAX; i++)
+		exp->reclen[i] = ipfix_record_len(i);
+
+	if (CONFIG(stats).ipfix.ipproto) {
+		exp->fd = ipfix_socket();
+		if (exp->fd == -1) {
+			dlog(LOG_ERR, "can't open IPFIX collector socket: %s",
+			     strerror(errno));
+			goto err;
+		}
+		/* leave room for the IP and UDP headers. */
+		exp->size = CONFIG(stats).ipfix.mtu - 8 -
+			    (CONFIG(stats).ipfix.ipproto == AF_INET ? 20 : 40);
+	} else {
+		exp->size = IPFIX_MSG_MAX;
+	}
+
+	if (CONFIG(stats).ipfix.path[0]) {
+		exp->file = open(CONFIG(stats).ipfix.path,
+				 O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+				 0644);
+		if (exp->file == -1) {
+			dlog(LOG_ERR, "can't open IPFIX file `%s': %s",
+			     CONFIG(stats).ipfix.path, strerror(errno));
+			goto err;
+		}
+	}
+
+	if (exp->size < sizeof(struct ipfix_hdr) + ipfix_template_len() +
+			sizeof(struct ipfix_set_hdr) + exp->reclen[IPFIX_T_IPV6]) {
+		dlog(LOG_ERR, "IPFIX MTU %u is too small",
+		     CONFIG(stats).ipfix.mtu);
+		goto err;
+	}
+
+	exp->buf = malloc(exp->size);
+	if (exp->buf == NULL)
+		goto err;
+
+	init_alarm(&exp->alarm, exp, ipfix_alarm);
+	add_alarm(&exp->alarm, exp->flush_interval / 1000,
+		  (exp->flush_interval % 1000) * 1000);
+
+	return exp;
+err:
+	if (exp->fd != -1)
+		close(exp->fd);
+	if (exp->file != -1)
+		close(exp->file);
+	free(exp);
+	return NULL;
+}
+
+void ipfix_destroy(struct ipfix_exporter *exp)
+{
+	del_alarm(&exp->alarm);
+	ipfix_flush(exp);
+
+	if (exp->fd != -1)
+		close(exp->fd);
+	if (exp->file != -1)
+		close(exp->file);
+	free(exp->buf);
+	free(exp);
+}
+
+void ipfix_stats(struct ipfix_exporter *exp, int fd)
+{
+	char buf[512];
+	int size;
+
+	size = snprintf(buf, sizeof(buf),
+			"IPFIX export:\n"
+			"%20llu Records exported %20llu Messages\n"
+			"%20llu Bytes            %20llu Templates\n"
+			"%20llu Send failed      %20llu Write failed\n\n",
+			(unsigned long long)exp->stats.records,
+			(unsigned long long)exp->stats.messages,
+			(unsigned long long)exp->stats.bytes,
+			(unsigned long long)exp->stats.templates,
+			(unsigned long long)exp->stats.send_failed,
+			(unsigned long long)exp->stats.write_failed);
+
+	send(fd, buf, size, 0);
+}
+
+void ipfix_metrics(struct ipfix_exporter *exp, struct metrics *m)
+{
+	metrics_family(m, "ipfix_records", METRICS_COUNTER,
+		       "IPFIX data records exported");
+	metrics_sample(m, exp->stats.records, NULL);
+
+	metrics_family(m, "ipfix_messages", METRICS_COUNTER,
+		       "IPFIX messages exported");
+	metrics_sample(m, exp->stats.messages, NULL);
+
+	metrics_family(m, "ipfix_bytes", METRICS_COUNTER,
+		       "Bytes of IPFIX messages exported");
+	metrics_sample(m, exp->stats.bytes, NULL);
+
+	metrics_family(m, "ipfix_templates", METRICS_COUNTER,
+		       "IPFIX template sets exported");
+	metrics_sample(m, exp->stats.templates, NULL);
+
+	metrics_family(m, "ipfix_errors", METRICS_COUNTER,
+		       "IPFIX messages that could not be exported");
+	metrics_sample(m, exp->stats.send_failed, "output=\"udp\"");
+	metrics_sample(m, exp->stats.write_failed, "output=\"file\"");
+}
@@ -160,3 +160,43 @@ err1:
 	local_client_destroy(fd);
 	return -1;
 }
+
+/*
+ * Send a request that carries extra data and copy the reply to outfd as is,
+ * the reply may be in binary format.
+ */
+int do_local_request_data(int request, const void *data, size_t len,
+			  struct local_conf *conf, int outfd)
+{
+	char buf[4096];
+	ssize_t ret, off;
+	int fd;
+
+	if (len > sizeof(buf) - sizeof(int))
+		return -1;
+
+	fd = local_client_create(conf);
+	if (fd == -1)
+		return -1;
+
+	/* the daemon reads request and data in one go. */
+	memcpy(buf, &request, sizeof(int));
+	memcpy(buf + sizeof(int), data, len);
+	if (send(fd, buf, sizeof(int) + len, 0) == -1)
+		goto err1;
+
+	while ((ret = recv(fd, buf, sizeof(buf), 0)) > 0) {
+		for (off = 0; off < ret; ) {
+			ssize_t n = write(outfd, buf + off, ret - off);
+			if (n == -1)
+				goto err1;
+			off += n;
+		}
+	}
+	local_client_destroy(fd);
+
+	return 0;
+err1:
+	local_client_destroy(fd);
+	return -1;
+}
@@ -51,12 +51,14 @@ static const char usage_client_commands[] =
 	"  -i [ct|expect], display content of the internal cache\n"
 	"  -e [ct|expect], display the content of the external cache\n"
 	"  -k, kill conntrack daemon\n"
-	"  -s  [network|cache|runtime|link|rsqueue|queue|ct|expect], "
-		"dump statistics\n"
+	"  -s  [network|cache|runtime|link|rsqueue|queue|metrics|accounting|"
+		"top|ct|expect], dump statistics\n"
 	"  -R [ct|expect], resync with kernel conntrack table\n"
 	"  -n, request resync with other node (only FT-FW and NOTRACK modes)\n"
 	"  -B, force a bulk send to other replica firewalls\n"
 	"  -x, dump cache in XML format (requires -i or -e)\n"
+	"  -o [plain|xml|json|binary], dump format (requires -i or -e)\n"
+	"  -w [key=value,...], only dump matching entries (requires -i or -e)\n"
 	"  -t, reset the kernel timeout (see PurgeTimeout clause)\n";
 
 static void
@@ -121,7 +123,8 @@ do_chdir(const char *d)
 int main(int argc, char *argv[])
 {
 	char config_file[PATH_MAX + 1] = {};
-	int ret, i, action = -1;
+	struct ct_dump_filter dump_filter = {};
+	int ret, i, action = -1, dump_filtered = 0;
 	int type = 0;
 	struct utsname u;
 	int version, major, minor;
@@ -262,6 +265,18 @@ int main(int argc, char *argv[])
 						strlen(argv[i+1])) == 0) {
 					action = STATS_QUEUE;
 					i++;
+				} else if (strncmp(argv[i+1], "metrics",
+						strlen(argv[i+1])) == 0) {
+					action = STATS_METRICS;
+					i++;
+				} else if (strncmp(argv[i+1], "accounting",
+						strlen(argv[i+1])) == 0) {
+					action = STATS_ACCOUNTING;
+					i++;
+				} else if (strncmp(argv[i+1], "top",
+						strlen(argv[i+1])) == 0) {
+					action = STATS_TOP;
+					i++;
 				} else if (strncmp(argv[i+1], "ct",
 						strlen(argv[i+1])) == 0) {
 					action = STATS;
@@ -300,6 +315,36 @@ int main(int argc, char *argv[])
 
 			}
 			break;
+		case 'o':
+			if (++i >= argc) {
+				show_usage(argv[0]);
+				dlog(LOG_ERR, "Missing dump format");
+				exit(EXIT_FAILURE);
+			}
+			if (strcmp(argv[i], "plain") == 0)
+				dump_filter.format = NFCT_O_PLAIN;
+			else if (strcmp(argv[i], "xml") == 0)
+				dump_filter.format = NFCT_O_XML;
+			else if (strcmp(argv[i], "json") == 0)
+				dump_filter.format = CTD_DUMP_JSON;
+			else if (strcmp(argv[i], "binary") == 0)
+				dump_filter.format = CTD_DUMP_BINARY;
+			else {
+				dlog(LOG_ERR, "unknown dump format `%s'",
+				     argv[i]);
+				exit(EXIT_FAILURE);
+			}
+			dump_filtered = 1;
+			break;
+		case 'w':
+			if (++i >= argc ||
+			    ct_dump_filter_parse(&dump_filter, argv[i]) == -1) {
+				show_usage(argv[0]);
+				dlog(LOG_ERR, "Invalid dump filter");
+				exit(EXIT_FAILURE);
+			}
+			dump_filtered = 1;
+			break;
 		case 'v':
 			show_version();
 			exit(EXIT_SUCCESS);
@@ -333,7 +378,38 @@ int main(int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 
-	if (type == REQUEST) {
+	if (dump_filtered) {
+		switch(action) {
+		case CT_DUMP_INT_XML:
+		case CT_DUMP_EXT_XML:
+			if (dump_filter.format == NFCT_O_PLAIN)
+				dump_filter.format = NFCT_O_XML;
+			/* fall through */
+		case CT_DUMP_INTERNAL:
+		case CT_DUMP_EXTERNAL:
+			if (action == CT_DUMP_INTERNAL ||
+			    action == CT_DUMP_INT_XML)
+				action = CT_DUMP_INT_FILTER;
+			else
+				action = CT_DUMP_EXT_FILTER;
+			break;
+		default:
+			show_usage(argv[0]);
+			dlog(LOG_ERR, "-o and -w require -i ct or -e ct");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (type == REQUEST && dump_filtered) {
+		if (do_local_request_data(action, &dump_filter,
+					  sizeof(dump_filter), &conf.local,
+					  STDOUT_FILENO) == -1) {
+			dlog(LOG_ERR, "can't connect: is conntrackd "
+			     "running? appropriate permissions?");
+			exit(EXIT_FAILURE);
+		}
+		exit(EXIT_SUCCESS);
+	} else if (type == REQUEST) {
 		if (do_local_request(action, &conf.local, local_step) == -1) {
 			dlog(LOG_ERR, "can't connect: is conntrackd "
 			     "running? appropriate permissions?");
@@ -0,0 +1,384 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Description: export of the daemon counters in OpenMetrics text format,
+ * via the UNIX socket and, optionally, via a HTTP listener on localhost.
+ */
+
+#include "metrics.h"
+#include "conntrackd.h"
+#include "fds.h"
+#include "log.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#define METRICS_BUFSIZ		16384
+
+static const uint64_t metrics_hist_bounds[METRICS_HIST_BUCKETS - 1] = {
+	100, 500, 1000, 5000, 10000, 50000,
+	100000, 500000, 1000000, 5000000, 10000000,
+};
+
+void metrics_histogram_observe(struct metrics_histogram *h, uint64_t usecs)
+{
+	int i;
+
+	for (i = 0; i < METRICS_HIST_BUCKETS - 1; i++) {
+		if (usecs <= metrics_hist_bounds[i])
+			break;
+	}
+	h->bucket[i]++;
+	h->count++;
+	h->sum += usecs;
+}
+
+int metrics_init(struct metrics *m)
+{
+	memset(m, 0, sizeof(*m));
+	m->buf = malloc(METRICS_BUFSIZ);
+	if (m->buf == NULL)
+		return -1;
+	m->size = METRICS_BUFSIZ;
+	return 0;
+}
+
+void metrics_free(struct metrics *m)
+{
+	free(m->buf);
+	m->buf = NULL;
+}
+
+static void metrics_printf(struct metrics *m, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+static void metrics_printf(struct metrics *m, const char *fmt, ...)
+{
+	va_list ap;
+	char *tmp;
+	int ret;
+
+	if (m->err)
+		return;
+retry:
+	va_start(ap, fmt);
+	ret = vsnprintf(m->buf + m->len, m->size - m->len, fmt, ap);
+	va_end(ap);
+
+	if (ret < 0) {
+		m->err = 1;
+		return;
+	}
+	if ((size_t)ret >= m->size - m->len) {
+		tmp = realloc(m->buf, m->size * 2);
+		if (tmp == NULL) {
+			m->err = 1;
+			return;
+		}
+		m->buf = tmp;
+		m->size *= 2;
+		goto retry;
+	}
+	m->len += ret;
+}
+
+static const char *metrics_type_name[] = {
+	[METRICS_COUNTER]	= "counter",
+	[METRICS_GAUGE]		= "gauge",
+	[METRICS_HISTOGRAM]	= "histogram",
+};
+
+void metrics_family(struct metrics *m, const char *name,
+		    enum metrics_type type, const char *help)
+{
+	m->family = name;
+	m->type = type;
+	metrics_printf(m, "# TYPE conntrackd_%s %s\n"
+			  "# HELP conntrackd_%s %s\n",
+		       name, metrics_type_name[type], name, help);
+}
+
+static void metrics_labels(char *buf, size_t size, const char *fmt,
+			   va_list ap)
+{
+	if (fmt == NULL || vsnprintf(buf, size, fmt, ap) < 0)
+		buf[0] = '\0';
+}
+
+void metrics_sample(struct metrics *m, uint64_t value,
+		    const char *labels, ...)
+{
+	char buf[256];
+	va_list ap;
+
+	va_start(ap, labels);
+	metrics_labels(buf, sizeof(buf), labels, ap);
+	va_end(ap);
+
+	metrics_printf(m, "conntrackd_%s%s%s%s%s %llu\n", m->family,
+		       m->type == METRICS_COUNTER ? "_total" : "",
+		       buf[0] ? "{" : "", buf, buf[0] ? "}" : "",
+		       (unsigned long long)value);
+}
+
+void metrics_histogram(struct metrics *m, const struct metrics_histogram *h,
+		       const char *labels, ...)
+{
+	const char *sep;
+	uint64_t cumulative = 0;
+	char buf[256];
+	va_list ap;
+	int i;
+
+	va_start(ap, labels);
+	metrics_labels(buf, sizeof(buf), labels, ap);
+	va_end(ap);
+	sep = buf[0] ? "," : "";
+
+	/* bounds are exposed in seconds, as OpenMetrics recommends. */
+	for (i = 0; i < METRICS_HIST_BUCKETS - 1; i++) {
+		cumulative += h->bucket[i];
+		metrics_printf(m, "conntrackd_%s_bucket{%s%sle=\"%llu.%06llu\"}"
+				  " %llu\n",
+			       m->family, buf, sep,
+			       (unsigned long long)
+					metrics_hist_bounds[i] / 1000000,
+			       (unsigned long long)
+					metrics_hist_bounds[i] % 1000000,
+			       (unsigned long long)cumulative);
+	}
+	metrics_printf(m, "conntrackd_%s_bucket{%s%sle=\"+Inf\"} %llu\n"
+			  "conntrackd_%s_count%s%s%s %llu\n"
+			  "conntrackd_%s_sum%s%s%s %llu.%06llu\n",
+		       m->family, buf, sep, (unsigned long long)h->count,
+		       m->family, buf[0] ? "{" : "", buf, buf[0] ? "}" : "",
+		       (unsigned long long)h->count,
+		       m->family, buf[0] ? "{" : "", buf, buf[0] ? "}" : "",
+		       (unsigned long long)h->sum / 1000000,
+		       (unsigned long long)h->sum % 1000000);
+}
+
+static int metrics_write(int fd, const char *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = send(fd, buf, len, MSG_NOSIGNAL);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+int metrics_send(struct metrics *m, int fd)
+{
+	metrics_printf(m, "# EOF\n");
+	if (m->err)
+		return -1;
+
+	return metrics_write(fd, m->buf, m->len);
+}
+
+/*
+ * HTTP listener. Scrapers send a small request and wait for the whole
+ * response, so the request is read without blocking the main loop and the
+ * response is sent right away, like the replies to the UNIX socket.
+ */
+#define METRICS_HTTP_CLIENTS	16
+#define METRICS_HTTP_REQSIZ	2048
+
+struct metrics_http_client {
+	int	fd;
+	size_t	len;
+	char	req[METRICS_HTTP_REQSIZ];
+};
+
+static struct {
+	int				fd;
+	void				(*build)(struct metrics *m);
+	struct metrics_http_client	*client[METRICS_HTTP_CLIENTS];
+} metrics_http = {
+	.fd = -1,
+};
+
+static void metrics_http_close(struct metrics_http_client *c)
+{
+	int i;
+
+	for (i = 0; i < METRICS_HTTP_CLIENTS; i++) {
+		if (metrics_http.client[i] == c)
+			metrics_http.client[i] = NULL;
+	}
+	unregister_fd(c->fd, STATE(fds));
+	close(c->fd);
+	free(c);
+}
+
+static void metrics_http_reply(struct metrics_http_client *c)
+{
+	static const char not_found[] =
+		"HTTP/1.0 404 Not Found\r\n"
+		"Content-Length: 0\r\n"
+		"Connection: close\r\n\r\n";
+	struct timeval tv = { .tv_sec = 1 };
+	struct metrics m;
+	char hdr[256];
+	int size;
+
+	/* a stalled scraper must not stall the daemon for long. */
+	setsockopt(c->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	if (strncmp(c->req, "GET /metrics", strlen("GET /metrics")) != 0 &&
+	    strncmp(c->req, "GET / ", strlen("GET / ")) != 0) {
+		metrics_write(c->fd, not_found, strlen(not_found));
+		return;
+	}
+
+	if (metrics_init(&m) == -1)
+		return;
+
+	metrics_http.build(&m);
+	metrics_printf(&m, "# EOF\n");
+	if (m.err) {
+		metrics_free(&m);
+		return;
+	}
+
+	size = snprintf(hdr, sizeof(hdr),
+			"HTTP/1.0 200 OK\r\n"
+			"Content-Type: application/openmetrics-text; "
+			"version=1.0.0; charset=utf-8\r\n"
+			"Content-Length: %zu\r\n"
+			"Connection: close\r\n\r\n", m.len);
+
+	if (metrics_write(c->fd, hdr, size) == 0)
+		metrics_write(c->fd, m.buf, m.len);
+
+	metrics_free(&m);
+}
+
+static void metrics_http_client_cb(void *data)
+{
+	struct metrics_http_client *c = data;
+	ssize_t ret;
+
+	ret = recv(c->fd, c->req + c->len, sizeof(c->req) - c->len - 1,
+		   MSG_DONTWAIT);
+	if (ret == -1 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (ret <= 0) {
+		metrics_http_close(c);
+		return;
+	}
+	c->len += ret;
+	c->req[c->len] = '\0';
+
+	/* wait for the end of the request header. */
+	if (strstr(c->req, "\r\n\r\n") == NULL &&
+	    strstr(c->req, "\n\n") == NULL &&
+	    c->len < sizeof(c->req) - 1)
+		return;
+
+	metrics_http_reply(c);
+	metrics_http_close(c);
+}
+
+static void metrics_http_accept_cb(void *data)
+{
+	struct metrics_http_client *c;
+	int fd, i;
+
+	fd = accept(metrics_http.fd, NULL, NULL);
+	if (fd == -1)
+		return;
+
+	for (i = 0; i < METRICS_HTTP_CLIENTS; i++) {
+		if (metrics_http.client[i] == NULL)
+			break;
+	}
+	if (i == METRICS_HTTP_CLIENTS) {
+		close(fd);
+		return;
+	}
+
+	c = calloc(1, sizeof(struct metrics_http_client));
+	if (c == NULL) {
+		close(fd);
+		return;
+	}
+	c->fd = fd;
+
+	if (register_fd(fd, metrics_http_client_cb, c, STATE(fds)) == -1) {
+		close(fd);
+		free(c);
+		return;
+	}
+	metrics_http.client[i] = c;
+}
+
+int metrics_http_create(unsigned short port,
+			void (*build)(struct metrics *m))
+{
+	struct sockaddr_in addr = {
+		.sin_family		= AF_INET,
+		.sin_port		= htons(port),
+		.sin_addr.s_addr	= htonl(INADDR_LOOPBACK),
+	};
+	int fd, one = 1;
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		return -1;
+
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -1 ||
+	    bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+	    listen(fd, METRICS_HTTP_CLIENTS) == -1 ||
+	    register_fd(fd, metrics_http_accept_cb, NULL, STATE(fds)) == -1) {
+		dlog(LOG_ERR, "can't open metrics listener on port %u: %s",
+		     port, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	metrics_http.fd = fd;
+	metrics_http.build = build;
+
+	return 0;
+}
+
+void metrics_http_destroy(void)
+{
+	int i;
+
+	if (metrics_http.fd == -1)
+		return;
+
+	for (i = 0; i < METRICS_HTTP_CLIENTS; i++) {
+		if (metrics_http.client[i] != NULL)
+			metrics_http_close(metrics_http.client[i]);
+	}
+	unregister_fd(metrics_http.fd, STATE(fds));
+	close(metrics_http.fd);
+	metrics_http.fd = -1;
+}
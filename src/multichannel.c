@@ -8,9 +8,11 @@
  */
 
 #include <stdlib.h>
+#include <net/if.h>
 
 #include "channel.h"
 #include "network.h"
+#include "metrics.h"
 
 struct multichannel *
 multichannel_open(struct channel_conf *conf, int len)
@@ -94,6 +96,73 @@ multichannel_stats_extended(struct multichannel *m,
 	}
 }
 
+static const char *channel_type_name[CHANNEL_MAX] = {
+	[CHANNEL_MCAST]	= "multicast",
+	[CHANNEL_UDP]	= "udp",
+	[CHANNEL_TCP]	= "tcp",
+};
+
+static const struct {
+	const char	*name;
+	const char	*help;
+} channel_metrics[] = {
+	{ "channel_sent_bytes", "Bytes sent through the dedicated link" },
+	{ "channel_sent_messages", "Messages sent through the dedicated link" },
+	{ "channel_send_errors", "Errors sending through the dedicated link" },
+	{ "channel_received_bytes",
+	  "Bytes received through the dedicated link" },
+	{ "channel_received_messages",
+	  "Messages received through the dedicated link" },
+	{ "channel_receive_errors",
+	  "Errors receiving through the dedicated link" },
+};
+
+#define CHANNEL_METRICS_MAX \
+	(sizeof(channel_metrics) / sizeof(channel_metrics[0]))
+
+void multichannel_metrics(struct multichannel *m, struct metrics *metrics)
+{
+	uint64_t val[MULTICHANNEL_MAX][CHANNEL_METRICS_MAX];
+	char ifname[MULTICHANNEL_MAX][IFNAMSIZ];
+	struct channel_counters tx, rx;
+	unsigned int i;
+	int j;
+
+	for (j = 0; j < m->channel_num; j++) {
+		channel_counters(m->channel[j], &tx, &rx);
+		val[j][0] = tx.bytes;
+		val[j][1] = tx.messages;
+		val[j][2] = tx.error;
+		val[j][3] = rx.bytes;
+		val[j][4] = rx.messages;
+		val[j][5] = rx.error;
+
+		if (if_indextoname(m->channel[j]->channel_ifindex,
+				   ifname[j]) == NULL)
+			ifname[j][0] = '\0';
+	}
+
+	for (i = 0; i < CHANNEL_METRICS_MAX; i++) {
+		metrics_family(metrics, channel_metrics[i].name,
+			       METRICS_COUNTER, channel_metrics[i].help);
+
+		for (j = 0; j < m->channel_num; j++) {
+			metrics_sample(metrics, val[j][i],
+				       "device=\"%s\",type=\"%s\"", ifname[j],
+				       channel_type_name[m->channel[j]->
+							 channel_type]);
+		}
+	}
+
+	metrics_family(metrics, "channel_active", METRICS_GAUGE,
+		       "Dedicated link currently used to synchronize");
+	for (j = 0; j < m->channel_num; j++) {
+		metrics_sample(metrics, m->current == m->channel[j],
+			       "device=\"%s\",type=\"%s\"", ifname[j],
+			       channel_type_name[m->channel[j]->channel_type]);
+	}
+}
+
 int multichannel_get_ifindex(struct multichannel *m, int i)
 {
 	return m->channel[i]->channel_ifindex;
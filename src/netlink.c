@@ -21,12 +21,16 @@
 #include "conntrackd.h"
 #include "filter.h"
 #include "log.h"
+#include "process.h"
 
 #include <string.h>
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <fcntl.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <libmnl/libmnl.h>
 #include <libnetfilter_conntrack/libnetfilter_conntrack_tcp.h>
 
 struct nfct_handle *nl_init_event_handler(void)
@@ -153,17 +157,82 @@ int nl_dump_conntrack_table(struct nfct_handle *h)
 	return nfct_query(h, NFCT_Q_DUMP, &family);
 }
 
+#define NL_FLUSH_BATCH_SIZE	65536
+#define NL_FLUSH_MSG_MAX	8192	/* largest request we may build */
+
+static struct {
+	struct mnl_nlmsg_batch	*b;
+	char			buf[NL_FLUSH_BATCH_SIZE + NL_FLUSH_MSG_MAX];
+	uint32_t		seq;
+	uint64_t		entries;	/* removed by this flush */
+} nl_flush;
+
+/*
+ * The requests go through the flush handle, so that their events are known
+ * to come from the flush. The kernel processes the whole batch from send().
+ */
+static void nl_flush_send(void)
+{
+	int fd = nfct_fd(STATE(flush));
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+	const struct nlmsgerr *err;
+	int ret;
+
+	if (send(fd, mnl_nlmsg_batch_head(nl_flush.b),
+		 mnl_nlmsg_batch_size(nl_flush.b), 0) < 0) {
+		dlog(LOG_ERR, "cannot flush entries: %s", strerror(errno));
+		return;
+	}
+
+	/* acknowledgments are already there once send() returns */
+	while ((ret = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0 ||
+	       errno == ENOBUFS) {
+		const struct nlmsghdr *nlh = (const struct nlmsghdr *)buf;
+
+		while (ret > 0 && mnl_nlmsg_ok(nlh, ret)) {
+			if (nlh->nlmsg_type == NLMSG_ERROR) {
+				err = mnl_nlmsg_get_payload(nlh);
+				/* -ENOENT: it has expired in the meantime */
+				if (err->error == 0)
+					nl_flush.entries++;
+			}
+			nlh = mnl_nlmsg_next(nlh, &ret);
+		}
+	}
+}
+
 static int
 nl_flush_selective_cb(enum nf_conntrack_msg_type type,
 		      struct nf_conntrack *ct, void *data)
 {
+	void *buf = mnl_nlmsg_batch_current(nl_flush.b);
+	struct nlmsghdr *nlh;
+	struct nfgenmsg *nfh;
+
 	/* don't delete this conntrack, it's in the ignore filter */
 	if (ct_filter_conntrack(ct, 1))
 		return NFCT_CB_CONTINUE;
 
 	switch(type) {
 	case NFCT_T_UPDATE:
-		nl_destroy_conntrack(STATE(flush), ct);
+		nlh = mnl_nlmsg_put_header(buf);
+		nlh->nlmsg_type = (NFNL_SUBSYS_CTNETLINK << 8) |
+				  IPCTNL_MSG_CT_DELETE;
+		nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+		nlh->nlmsg_seq = ++nl_flush.seq;
+
+		nfh = mnl_nlmsg_put_extra_header(nlh, sizeof(struct nfgenmsg));
+		nfh->nfgen_family = nfct_get_attr_u8(ct, ATTR_L3PROTO);
+		nfh->version = NFNETLINK_V0;
+		nfh->res_id = 0;
+
+		nfct_nlmsg_build(nlh, ct);
+
+		/* batch is full, the last message goes in the next one */
+		if (!mnl_nlmsg_batch_next(nl_flush.b)) {
+			nl_flush_send();
+			mnl_nlmsg_batch_reset(nl_flush.b);
+		}
 		break;
 	default:
 		STATE(stats).nl_dump_unknown_type++;
@@ -172,7 +241,41 @@ nl_flush_selective_cb(enum nf_conntrack_msg_type type,
 	return NFCT_CB_CONTINUE;
 }
 
-int nl_flush_conntrack_table_selective(void)
+/* entries in the kernel table, zero if unknown. */
+static uint64_t nl_conntrack_count(void)
+{
+	unsigned long long count = 0;
+	FILE *fd;
+
+	fd = fopen("/proc/sys/net/netfilter/nf_conntrack_count", "r");
+	if (fd == NULL)
+		return 0;
+
+	if (fscanf(fd, "%llu", &count) != 1)
+		count = 0;
+
+	fclose(fd);
+	return count;
+}
+
+/* a single request, the kernel cannot tell the ignored entries apart. */
+static int nl_flush_conntrack_table_all(void)
+{
+	int ret;
+
+	nl_flush.entries = nl_conntrack_count();
+	ret = nfct_query(STATE(flush), NFCT_Q_FLUSH, &family);
+	if (ret == -1)
+		nl_flush.entries = 0;
+
+	return ret;
+}
+
+/*
+ * The kernel only filters flushes by mark, so the table is dumped and the
+ * entries that are not in the ignore filter are deleted in batches.
+ */
+static int nl_flush_conntrack_table_filtered(void)
 {
 	struct nfct_handle *h;
 	int ret;
@@ -182,15 +285,126 @@ int nl_flush_conntrack_table_selective(void)
 		dlog(LOG_ERR, "cannot open handle");
 		return -1;
 	}
+	nl_flush.b = mnl_nlmsg_batch_start(nl_flush.buf, NL_FLUSH_BATCH_SIZE);
+	if (nl_flush.b == NULL) {
+		nfct_close(h);
+		return -1;
+	}
 	nfct_callback_register(h, NFCT_T_ALL, nl_flush_selective_cb, NULL);
 
 	ret = nfct_query(h, NFCT_Q_DUMP, &family);
 
+	if (!mnl_nlmsg_batch_is_empty(nl_flush.b))
+		nl_flush_send();
+	mnl_nlmsg_batch_stop(nl_flush.b);
+	nl_flush.b = NULL;
+
 	nfct_close(h);
 
 	return ret;
 }
 
+static uint64_t nl_flush_usecs(const struct timeval *start)
+{
+	struct timeval stop;
+
+	gettimeofday(&stop, NULL);
+	return (stop.tv_sec - start->tv_sec) * 1000000 +
+	       (stop.tv_usec - start->tv_usec);
+}
+
+/* the filtered flush in progress in a child process. */
+static struct {
+	struct timeval	start;
+	void		(*cb)(void *data);
+	void		*data;
+	uint64_t	*entries;	/* shared with the child */
+} nl_flush_child;
+
+static void nl_flush_child_done(void *data)
+{
+	STATE(stats).nl_kernel_table_flush_entries += *nl_flush_child.entries;
+	STATE(stats).nl_kernel_table_flush_usecs +=
+		nl_flush_usecs(&nl_flush_child.start);
+
+	if (nl_flush_child.cb)
+		nl_flush_child.cb(nl_flush_child.data);
+}
+
+/*
+ * Removes the entries that are not in the ignore filter from the kernel.
+ * Without user-space filter, this is a single flush request and @cb is called
+ * before returning. Otherwise the dump and the deletes of the whole table are
+ * too long to stall the event handling, a child process does them and @cb is
+ * called once it is gone. Returns -1 if a flush is still in progress.
+ */
+int nl_flush_conntrack_table_selective(void (*cb)(void *data), void *data)
+{
+	struct timeval start;
+	uint64_t usecs;
+	int ret;
+
+	/* the flush handle is still in use by the child. */
+	if (fork_process_running(CTD_PROC_FLUSH))
+		return -1;
+
+	gettimeofday(&start, NULL);
+	nl_flush.entries = 0;
+
+	if (STATE(us_filter) != NULL) {
+		/* the child reports the entries it removed through this page,
+		 * it is kept for the next flushes. */
+		if (nl_flush_child.entries == NULL) {
+			nl_flush_child.entries =
+				mmap(NULL, sizeof(uint64_t),
+				     PROT_READ | PROT_WRITE,
+				     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+			if (nl_flush_child.entries == MAP_FAILED) {
+				nl_flush_child.entries = NULL;
+				dlog(LOG_ERR, "cannot flush kernel table: %s",
+				     strerror(errno));
+				return -1;
+			}
+		}
+		*nl_flush_child.entries = 0;
+		nl_flush_child.start = start;
+		nl_flush_child.cb = cb;
+		nl_flush_child.data = data;
+
+		ret = fork_process_new(CTD_PROC_FLUSH, CTD_PROC_F_EXCL,
+				       nl_flush_child_done, NULL);
+		if (ret != 0)
+			return ret == -1 ? -1 : 0;
+
+		ret = nl_flush_conntrack_table_filtered();
+	} else
+		ret = nl_flush_conntrack_table_all();
+
+	if (ret == -1)
+		dlog(LOG_ERR, "cannot flush kernel table: %s",
+		     strerror(errno));
+
+	usecs = nl_flush_usecs(&start);
+
+	dlog(LOG_NOTICE, "kernel conntrack table flushed, %llu entries "
+			 "removed in %llu usecs",
+	     (unsigned long long)nl_flush.entries, (unsigned long long)usecs);
+
+	/* the daemon accounts for it once the child is gone. */
+	if (STATE(us_filter) != NULL) {
+		*nl_flush_child.entries = nl_flush.entries;
+		exit(ret == -1 ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+
+	STATE(stats).nl_kernel_table_flush_entries += nl_flush.entries;
+	STATE(stats).nl_kernel_table_flush_usecs += usecs;
+
+	if (cb)
+		cb(data);
+
+	return ret;
+}
+
 int nl_send_resync(struct nfct_handle *h)
 {
 	return nfct_send(h, NFCT_Q_DUMP, &family);
@@ -230,16 +444,15 @@ static void ctd_force_tcp_be_liberal(struct nf_conntrack *ct)
 	}
 }
 
-int nl_create_conntrack(struct nfct_handle *h, 
-			const struct nf_conntrack *orig,
-			int timeout)
+/* clone the object and prepare it to be created in the kernel */
+struct nf_conntrack *
+nl_prepare_create_conntrack(const struct nf_conntrack *orig, int timeout)
 {
 	struct nf_conntrack *ct;
-	int ret;
 
 	ct = nfct_clone(orig);
 	if (ct == NULL)
-		return -1;
+		return NULL;
 
 	if (timeout > 0)
 		nfct_set_attr_u32(ct, ATTR_TIMEOUT, timeout);
@@ -257,6 +470,20 @@ int nl_create_conntrack(struct nfct_handle *h,
 	if (!CONFIG(sync).tcp_window_tracking)
 		ctd_force_tcp_be_liberal(ct);
 
+	return ct;
+}
+
+int nl_create_conntrack(struct nfct_handle *h, 
+			const struct nf_conntrack *orig,
+			int timeout)
+{
+	struct nf_conntrack *ct;
+	int ret;
+
+	ct = nl_prepare_create_conntrack(orig, timeout);
+	if (ct == NULL)
+		return -1;
+
 	ret = nfct_query(h, NFCT_Q_CREATE, ct);
 	nfct_destroy(ct);
 
@@ -368,6 +595,10 @@ int nl_dump_expect_table(struct nfct_handle *h)
 
 int nl_flush_expect_table(struct nfct_handle *h)
 {
+	/* the conntrack flush child still uses the flush handle. */
+	if (h == STATE(flush) && fork_process_running(CTD_PROC_FLUSH))
+		return -1;
+
 	return nfexp_query(h, NFCT_Q_FLUSH, &family);
 }
 
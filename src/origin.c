@@ -27,7 +27,7 @@ struct origin {
 };
 
 /* register a Netlink socket as origin of possible events */
-int origin_register(struct nfct_handle *h, int origin_type)
+int origin_register_portid(unsigned int portid, int origin_type)
 {
 	struct origin *nlp;
 
@@ -35,13 +35,18 @@ int origin_register(struct nfct_handle *h, int origin_type)
 	if (nlp == NULL)
 		return -1;
 
-	nlp->nl_portid = nfnl_portid(nfct_nfnlh(h));
+	nlp->nl_portid = portid;
 	nlp->type = origin_type;
 
 	list_add(&nlp->head, &origin_list);
 	return 0;
 }
 
+int origin_register(struct nfct_handle *h, int origin_type)
+{
+	return origin_register_portid(nfnl_portid(nfct_nfnlh(h)), origin_type);
+}
+
 /* look up for the origin of this Netlink event */
 int origin_find(const struct nlmsghdr *nlh)
 {
@@ -55,12 +60,12 @@ int origin_find(const struct nlmsghdr *nlh)
 	return CTD_ORIGIN_NOT_ME;
 }
 
-int origin_unregister(struct nfct_handle *h)
+int origin_unregister_portid(unsigned int portid)
 {
 	struct origin *this, *tmp;
 
 	list_for_each_entry_safe(this, tmp, &origin_list, head) {
-		if (this->nl_portid == nfnl_portid(nfct_nfnlh(h))) {
+		if (this->nl_portid == portid) {
 			list_del(&this->head);
 			free(this);
 			return 1;
@@ -68,3 +73,8 @@ int origin_unregister(struct nfct_handle *h)
 	}
 	return 0;
 }
+
+int origin_unregister(struct nfct_handle *h)
+{
+	return origin_unregister_portid(nfnl_portid(nfct_nfnlh(h)));
+}
@@ -18,8 +18,14 @@
  */
 
 #include "network.h"
+#include "conntrackd.h"
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <netinet/ip_icmp.h>
+#include <netinet/icmp6.h>
+#include <libmnl/libmnl.h>
 #include <libnetfilter_conntrack/libnetfilter_conntrack.h>
 
 #ifndef ssizeof
@@ -626,3 +632,458 @@ err_expected:
 err_master:
 	return -1;
 }
+
+/*
+ * Direct translation of conntrack network messages into ctnetlink messages.
+ * This is used by the inject path to skip the intermediate nf_conntrack
+ * object, the attributes are only validated and indexed in one pass.
+ */
+int msg2nl_ct_parse(struct nethdr *net, size_t remain,
+		    const struct netattr *tb[NTA_MAX])
+{
+	const struct netattr *attr;
+	uint16_t attr_len, attr_type;
+	int len;
+
+	if (remain < net->len)
+		return -1;
+
+	memset(tb, 0, sizeof(struct netattr *) * NTA_MAX);
+
+	len = net->len - NETHDR_SIZ;
+	attr = NETHDR_DATA(net);
+
+	/* attribute headers are left in network byte order, so msg2ct()
+	 * can still be used on this message later on. */
+	while (len > ssizeof(struct netattr)) {
+		attr_len = ntohs(attr->nta_len);
+		attr_type = ntohs(attr->nta_attr);
+
+		if (attr_len > len)
+			return -1;
+		if (attr_len < NTA_LENGTH(0))
+			return -1;
+		if (attr_type >= NTA_MAX)
+			return -1;
+		if (h[attr_type].size && attr_len != h[attr_type].size)
+			return -1;
+		if (h[attr_type].max_size && attr_len > h[attr_type].max_size)
+			return -1;
+
+		tb[attr_type] = attr;
+
+		len -= NTA_ALIGN(attr_len);
+		attr = (const struct netattr *)
+			(((const char *)attr) + NTA_ALIGN(attr_len));
+	}
+
+	/* we cannot do anything without the original tuple */
+	if ((tb[NTA_IPV4] == NULL && tb[NTA_IPV6] == NULL) ||
+	    tb[NTA_L4PROTO] == NULL)
+		return -1;
+
+	return 0;
+}
+
+#define NTA_GET(tb, type)	((const void *)NTA_DATA(tb[type]))
+#define NTA_GET_U8(tb, type)	(*((const uint8_t *)NTA_GET(tb, type)))
+#define NTA_GET_BE16(tb, type)	(*((const uint16_t *)NTA_GET(tb, type)))
+#define NTA_GET_BE32(tb, type)	(*((const uint32_t *)NTA_GET(tb, type)))
+#define NTA_PAYLOAD_LEN(tb, type) \
+	(ntohs(tb[type]->nta_len) - NTA_LENGTH(0))
+
+#ifndef IPPROTO_DCCP
+#define IPPROTO_DCCP 33
+#endif
+
+#ifndef ICMP6_NI_QUERY
+#define ICMP6_NI_QUERY 139
+#define ICMP6_NI_REPLY 140
+#endif
+
+static const uint8_t icmp_invmap[] = {
+	[ICMP_ECHO]		= ICMP_ECHOREPLY + 1,
+	[ICMP_ECHOREPLY]	= ICMP_ECHO + 1,
+	[ICMP_TIMESTAMP]	= ICMP_TIMESTAMPREPLY + 1,
+	[ICMP_TIMESTAMPREPLY]	= ICMP_TIMESTAMP + 1,
+	[ICMP_INFO_REQUEST]	= ICMP_INFO_REPLY + 1,
+	[ICMP_INFO_REPLY]	= ICMP_INFO_REQUEST + 1,
+	[ICMP_ADDRESS]		= ICMP_ADDRESSREPLY + 1,
+	[ICMP_ADDRESSREPLY]	= ICMP_ADDRESS + 1,
+};
+
+static const uint8_t icmpv6_invmap[] = {
+	[ICMP6_ECHO_REQUEST - 128]	= ICMP6_ECHO_REPLY + 1,
+	[ICMP6_ECHO_REPLY - 128]	= ICMP6_ECHO_REQUEST + 1,
+	[ICMP6_NI_QUERY - 128]		= ICMP6_NI_REPLY + 1,
+	[ICMP6_NI_REPLY - 128]		= ICMP6_NI_QUERY + 1,
+};
+
+static uint8_t msg2nl_icmp_invert(uint8_t l4proto, uint8_t type)
+{
+	if (l4proto == IPPROTO_ICMP) {
+		if (type < ARRAY_SIZE(icmp_invmap) && icmp_invmap[type])
+			return icmp_invmap[type] - 1;
+	} else {
+		if (type >= 128 && type - 128 < ssizeof(icmpv6_invmap) &&
+		    icmpv6_invmap[type - 128])
+			return icmpv6_invmap[type - 128] - 1;
+	}
+	return type;
+}
+
+static void
+msg2nl_build_ip(struct nlmsghdr *nlh, const struct netattr *tb[],
+		int ipv4_attr, int ipv6_attr, bool reply)
+{
+	struct nlattr *nest;
+
+	nest = mnl_attr_nest_start(nlh, CTA_TUPLE_IP);
+	if (tb[ipv4_attr]) {
+		const struct nfct_attr_grp_ipv4 *ip = NTA_GET(tb, ipv4_attr);
+
+		mnl_attr_put_u32(nlh, CTA_IP_V4_SRC, reply ? ip->dst : ip->src);
+		mnl_attr_put_u32(nlh, CTA_IP_V4_DST, reply ? ip->src : ip->dst);
+	} else {
+		const struct nfct_attr_grp_ipv6 *ip = NTA_GET(tb, ipv6_attr);
+
+		mnl_attr_put(nlh, CTA_IP_V6_SRC, sizeof(ip->src),
+			     reply ? ip->dst : ip->src);
+		mnl_attr_put(nlh, CTA_IP_V6_DST, sizeof(ip->dst),
+			     reply ? ip->src : ip->dst);
+	}
+	mnl_attr_nest_end(nlh, nest);
+}
+
+static void
+msg2nl_build_proto(struct nlmsghdr *nlh, const struct netattr *tb[],
+		   uint8_t l4proto, int port_attr, bool reply)
+{
+	struct nlattr *nest;
+
+	nest = mnl_attr_nest_start(nlh, CTA_TUPLE_PROTO);
+	mnl_attr_put_u8(nlh, CTA_PROTO_NUM, l4proto);
+
+	switch (l4proto) {
+	case IPPROTO_ICMP:
+	case IPPROTO_ICMPV6: {
+		uint8_t type;
+
+		/* only the master tuple lacks the ICMP information */
+		if (port_attr != NTA_PORT || tb[NTA_ICMP_TYPE] == NULL ||
+		    tb[NTA_ICMP_CODE] == NULL || tb[NTA_ICMP_ID] == NULL)
+			break;
+
+		type = NTA_GET_U8(tb, NTA_ICMP_TYPE);
+		if (reply)
+			type = msg2nl_icmp_invert(l4proto, type);
+
+		if (l4proto == IPPROTO_ICMP) {
+			mnl_attr_put_u8(nlh, CTA_PROTO_ICMP_TYPE, type);
+			mnl_attr_put_u8(nlh, CTA_PROTO_ICMP_CODE,
+					NTA_GET_U8(tb, NTA_ICMP_CODE));
+			mnl_attr_put_u16(nlh, CTA_PROTO_ICMP_ID,
+					 ntohs(NTA_GET_BE16(tb, NTA_ICMP_ID)));
+		} else {
+			mnl_attr_put_u8(nlh, CTA_PROTO_ICMPV6_TYPE, type);
+			mnl_attr_put_u8(nlh, CTA_PROTO_ICMPV6_CODE,
+					NTA_GET_U8(tb, NTA_ICMP_CODE));
+			mnl_attr_put_u16(nlh, CTA_PROTO_ICMPV6_ID,
+					 ntohs(NTA_GET_BE16(tb, NTA_ICMP_ID)));
+		}
+		break;
+	}
+	default:
+		if (tb[port_attr]) {
+			const struct nfct_attr_grp_port *port;
+
+			port = NTA_GET(tb, port_attr);
+			mnl_attr_put_u16(nlh, CTA_PROTO_SRC_PORT,
+					 reply ? port->dport : port->sport);
+			mnl_attr_put_u16(nlh, CTA_PROTO_DST_PORT,
+					 reply ? port->sport : port->dport);
+		}
+		break;
+	}
+	mnl_attr_nest_end(nlh, nest);
+}
+
+static void
+msg2nl_build_tuple(struct nlmsghdr *nlh, const struct netattr *tb[],
+		   int type, bool reply)
+{
+	struct nlattr *nest;
+
+	nest = mnl_attr_nest_start(nlh, type);
+	msg2nl_build_ip(nlh, tb, NTA_IPV4, NTA_IPV6, reply);
+	msg2nl_build_proto(nlh, tb, NTA_GET_U8(tb, NTA_L4PROTO),
+			   NTA_PORT, reply);
+	mnl_attr_nest_end(nlh, nest);
+}
+
+static void
+msg2nl_build_master(struct nlmsghdr *nlh, const struct netattr *tb[])
+{
+	struct nlattr *nest;
+
+	if ((tb[NTA_MASTER_IPV4] == NULL && tb[NTA_MASTER_IPV6] == NULL) ||
+	    tb[NTA_MASTER_L4PROTO] == NULL || tb[NTA_MASTER_PORT] == NULL)
+		return;
+
+	nest = mnl_attr_nest_start(nlh, CTA_TUPLE_MASTER);
+	msg2nl_build_ip(nlh, tb, NTA_MASTER_IPV4, NTA_MASTER_IPV6, false);
+	msg2nl_build_proto(nlh, tb, NTA_GET_U8(tb, NTA_MASTER_L4PROTO),
+			   NTA_MASTER_PORT, false);
+	mnl_attr_nest_end(nlh, nest);
+}
+
+static void
+msg2nl_build_nat(struct nlmsghdr *nlh, const struct netattr *tb[],
+		 int type, int ipv4_attr, int ipv6_attr, int port_attr)
+{
+	struct nlattr *nest, *nest_proto;
+
+	if (tb[ipv4_attr] == NULL && tb[ipv6_attr] == NULL &&
+	    tb[port_attr] == NULL)
+		return;
+
+	nest = mnl_attr_nest_start(nlh, type);
+	if (tb[ipv4_attr]) {
+		mnl_attr_put_u32(nlh, CTA_NAT_V4_MINIP,
+				 NTA_GET_BE32(tb, ipv4_attr));
+		mnl_attr_put_u32(nlh, CTA_NAT_V4_MAXIP,
+				 NTA_GET_BE32(tb, ipv4_attr));
+	} else if (tb[ipv6_attr]) {
+		mnl_attr_put(nlh, CTA_NAT_V6_MINIP, sizeof(uint32_t) * 4,
+			     NTA_GET(tb, ipv6_attr));
+		mnl_attr_put(nlh, CTA_NAT_V6_MAXIP, sizeof(uint32_t) * 4,
+			     NTA_GET(tb, ipv6_attr));
+	}
+	if (tb[port_attr]) {
+		uint16_t port = ntohs(NTA_GET_BE16(tb, port_attr));
+
+		nest_proto = mnl_attr_nest_start(nlh, CTA_NAT_PROTO);
+		mnl_attr_put_u16(nlh, CTA_PROTONAT_PORT_MIN, port);
+		mnl_attr_put_u16(nlh, CTA_PROTONAT_PORT_MAX, port);
+		mnl_attr_nest_end(nlh, nest_proto);
+	}
+	mnl_attr_nest_end(nlh, nest);
+}
+
+static void
+msg2nl_build_protoinfo(struct nlmsghdr *nlh, const struct netattr *tb[])
+{
+	struct nlattr *nest, *nest_proto;
+	struct {
+		uint8_t flags;
+		uint8_t mask;
+	} liberal = {
+		.flags	= IP_CT_TCP_FLAG_BE_LIBERAL,
+		.mask	= IP_CT_TCP_FLAG_BE_LIBERAL,
+	};
+
+	switch (NTA_GET_U8(tb, NTA_L4PROTO)) {
+	case IPPROTO_TCP:
+		if (tb[NTA_TCP_STATE] == NULL &&
+		    CONFIG(sync).tcp_window_tracking)
+			return;
+
+		nest = mnl_attr_nest_start(nlh, CTA_PROTOINFO);
+		nest_proto = mnl_attr_nest_start(nlh, CTA_PROTOINFO_TCP);
+		if (tb[NTA_TCP_STATE]) {
+			mnl_attr_put_u8(nlh, CTA_PROTOINFO_TCP_STATE,
+					NTA_GET_U8(tb, NTA_TCP_STATE));
+		}
+		if (tb[NTA_TCP_WSCALE_ORIG]) {
+			mnl_attr_put_u8(nlh, CTA_PROTOINFO_TCP_WSCALE_ORIGINAL,
+					NTA_GET_U8(tb, NTA_TCP_WSCALE_ORIG));
+		}
+		if (tb[NTA_TCP_WSCALE_REPL]) {
+			mnl_attr_put_u8(nlh, CTA_PROTOINFO_TCP_WSCALE_REPLY,
+					NTA_GET_U8(tb, NTA_TCP_WSCALE_REPL));
+		}
+		/* disable TCP window tracking for recovered connections */
+		if (!CONFIG(sync).tcp_window_tracking) {
+			mnl_attr_put(nlh, CTA_PROTOINFO_TCP_FLAGS_ORIGINAL,
+				     sizeof(liberal), &liberal);
+			mnl_attr_put(nlh, CTA_PROTOINFO_TCP_FLAGS_REPLY,
+				     sizeof(liberal), &liberal);
+		}
+		mnl_attr_nest_end(nlh, nest_proto);
+		mnl_attr_nest_end(nlh, nest);
+		break;
+	case IPPROTO_SCTP:
+		if (tb[NTA_SCTP_STATE] == NULL)
+			return;
+
+		nest = mnl_attr_nest_start(nlh, CTA_PROTOINFO);
+		nest_proto = mnl_attr_nest_start(nlh, CTA_PROTOINFO_SCTP);
+		mnl_attr_put_u8(nlh, CTA_PROTOINFO_SCTP_STATE,
+				NTA_GET_U8(tb, NTA_SCTP_STATE));
+		if (tb[NTA_SCTP_VTAG_ORIG]) {
+			mnl_attr_put_u32(nlh, CTA_PROTOINFO_SCTP_VTAG_ORIGINAL,
+					 NTA_GET_BE32(tb, NTA_SCTP_VTAG_ORIG));
+		}
+		if (tb[NTA_SCTP_VTAG_REPL]) {
+			mnl_attr_put_u32(nlh, CTA_PROTOINFO_SCTP_VTAG_REPLY,
+					 NTA_GET_BE32(tb, NTA_SCTP_VTAG_REPL));
+		}
+		mnl_attr_nest_end(nlh, nest_proto);
+		mnl_attr_nest_end(nlh, nest);
+		break;
+	case IPPROTO_DCCP:
+		if (tb[NTA_DCCP_STATE] == NULL)
+			return;
+
+		nest = mnl_attr_nest_start(nlh, CTA_PROTOINFO);
+		nest_proto = mnl_attr_nest_start(nlh, CTA_PROTOINFO_DCCP);
+		mnl_attr_put_u8(nlh, CTA_PROTOINFO_DCCP_STATE,
+				NTA_GET_U8(tb, NTA_DCCP_STATE));
+		if (tb[NTA_DCCP_ROLE]) {
+			mnl_attr_put_u8(nlh, CTA_PROTOINFO_DCCP_ROLE,
+					NTA_GET_U8(tb, NTA_DCCP_ROLE));
+		}
+		mnl_attr_nest_end(nlh, nest_proto);
+		mnl_attr_nest_end(nlh, nest);
+		break;
+	}
+}
+
+static void
+msg2nl_build_seqadj(struct nlmsghdr *nlh, const struct netattr *tb[])
+{
+	const struct nta_attr_natseqadj *this = NTA_GET(tb, NTA_NAT_SEQ_ADJ);
+	struct nlattr *nest;
+
+	nest = mnl_attr_nest_start(nlh, CTA_SEQ_ADJ_ORIG);
+	mnl_attr_put_u32(nlh, CTA_SEQADJ_CORRECTION_POS,
+			 this->orig_seq_correction_pos);
+	mnl_attr_put_u32(nlh, CTA_SEQADJ_OFFSET_BEFORE,
+			 this->orig_seq_offset_before);
+	mnl_attr_put_u32(nlh, CTA_SEQADJ_OFFSET_AFTER,
+			 this->orig_seq_offset_after);
+	mnl_attr_nest_end(nlh, nest);
+
+	nest = mnl_attr_nest_start(nlh, CTA_SEQ_ADJ_REPLY);
+	mnl_attr_put_u32(nlh, CTA_SEQADJ_CORRECTION_POS,
+			 this->repl_seq_correction_pos);
+	mnl_attr_put_u32(nlh, CTA_SEQADJ_OFFSET_BEFORE,
+			 this->repl_seq_offset_before);
+	mnl_attr_put_u32(nlh, CTA_SEQADJ_OFFSET_AFTER,
+			 this->repl_seq_offset_after);
+	mnl_attr_nest_end(nlh, nest);
+}
+
+static void
+msg2nl_build_synproxy(struct nlmsghdr *nlh, const struct netattr *tb[])
+{
+	const struct nta_attr_synproxy *this = NTA_GET(tb, NTA_SYNPROXY);
+	struct nlattr *nest;
+
+	nest = mnl_attr_nest_start(nlh, CTA_SYNPROXY);
+	mnl_attr_put_u32(nlh, CTA_SYNPROXY_ISN, this->isn);
+	mnl_attr_put_u32(nlh, CTA_SYNPROXY_ITS, this->its);
+	mnl_attr_put_u32(nlh, CTA_SYNPROXY_TSOFF, this->tsoff);
+	mnl_attr_nest_end(nlh, nest);
+}
+
+static void
+msg2nl_build_labels(struct nlmsghdr *nlh, const struct netattr *tb[])
+{
+	const uint32_t *words = NTA_GET(tb, NTA_LABELS);
+	unsigned int i, wordcount;
+	uint32_t *data;
+	struct nlattr *attr;
+
+	wordcount = NTA_PAYLOAD_LEN(tb, NTA_LABELS) / sizeof(uint32_t);
+	if (!wordcount)
+		return;
+
+	/* labels travel in network byte order, the kernel wants a bitmap */
+	attr = mnl_nlmsg_get_payload_tail(nlh);
+	mnl_attr_put(nlh, CTA_LABELS, wordcount * sizeof(uint32_t), words);
+	data = mnl_attr_get_payload(attr);
+	for (i = 0; i < wordcount; i++)
+		data[i] = ntohl(data[i]);
+}
+
+/* see nl_create_conntrack(), nl_update_conntrack() and
+ * nl_destroy_conntrack(), this does exactly the same. */
+struct nlmsghdr *
+msg2nl_ct(void *buf, const struct netattr *tb[], int type)
+{
+	struct nlmsghdr *nlh;
+	struct nfgenmsg *nfh;
+	uint32_t status;
+
+	nlh = mnl_nlmsg_put_header(buf);
+	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+
+	nfh = mnl_nlmsg_put_extra_header(nlh, sizeof(struct nfgenmsg));
+	nfh->nfgen_family = tb[NTA_IPV4] ? AF_INET : AF_INET6;
+	nfh->version = NFNETLINK_V0;
+	nfh->res_id = 0;
+
+	msg2nl_build_tuple(nlh, tb, CTA_TUPLE_ORIG, false);
+	if (tb[NTA_ZONE])
+		mnl_attr_put_u16(nlh, CTA_ZONE, NTA_GET_BE16(tb, NTA_ZONE));
+
+	if (type == NET_T_STATE_CT_DEL) {
+		nlh->nlmsg_type = (NFNL_SUBSYS_CTNETLINK << 8) |
+				  IPCTNL_MSG_CT_DELETE;
+		return nlh;
+	}
+	nlh->nlmsg_type = (NFNL_SUBSYS_CTNETLINK << 8) | IPCTNL_MSG_CT_NEW;
+
+	if (tb[NTA_STATUS]) {
+		status = ntohl(NTA_GET_BE32(tb, NTA_STATUS));
+		/* we hit error if we try to change the expected bit */
+		status &= ~IPS_EXPECTED;
+		/* unset NAT info on updates, otherwise we hit error */
+		if (type == NET_T_STATE_CT_UPD)
+			status &= ~IPS_NAT_MASK;
+
+		mnl_attr_put_u32(nlh, CTA_STATUS, htonl(status));
+	}
+	if (tb[NTA_TIMEOUT])
+		mnl_attr_put_u32(nlh, CTA_TIMEOUT, NTA_GET_BE32(tb, NTA_TIMEOUT));
+	if (tb[NTA_MARK])
+		mnl_attr_put_u32(nlh, CTA_MARK, NTA_GET_BE32(tb, NTA_MARK));
+
+	msg2nl_build_protoinfo(nlh, tb);
+
+	if (tb[NTA_NAT_SEQ_ADJ])
+		msg2nl_build_seqadj(nlh, tb);
+	if (tb[NTA_LABELS])
+		msg2nl_build_labels(nlh, tb);
+	if (tb[NTA_SYNPROXY])
+		msg2nl_build_synproxy(nlh, tb);
+
+	if (type == NET_T_STATE_CT_UPD)
+		return nlh;
+
+	nlh->nlmsg_flags |= NLM_F_CREATE | NLM_F_EXCL;
+
+	msg2nl_build_tuple(nlh, tb, CTA_TUPLE_REPLY, true);
+	msg2nl_build_master(nlh, tb);
+
+	msg2nl_build_nat(nlh, tb, CTA_NAT_SRC,
+			 NTA_SNAT_IPV4, NTA_SNAT_IPV6, NTA_SPAT_PORT);
+	msg2nl_build_nat(nlh, tb, CTA_NAT_DST,
+			 NTA_DNAT_IPV4, NTA_DNAT_IPV6, NTA_DPAT_PORT);
+
+	if (tb[NTA_HELPER_NAME]) {
+		char name[NFCT_HELPER_NAME_MAX];
+		struct nlattr *nest;
+
+		snprintf(name, sizeof(name), "%.*s",
+			 (int)NTA_PAYLOAD_LEN(tb, NTA_HELPER_NAME),
+			 (const char *)NTA_GET(tb, NTA_HELPER_NAME));
+
+		nest = mnl_attr_nest_start(nlh, CTA_HELP);
+		mnl_attr_put_strz(nlh, CTA_HELP_NAME, name);
+		mnl_attr_nest_end(nlh, nest);
+	}
+
+	return nlh;
+}
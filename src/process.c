@@ -19,9 +19,18 @@
 #include <signal.h>
 #include "conntrackd.h"
 #include "process.h"
+#include "metrics.h"
 
 static LIST_HEAD(process_list);
 
+/* runtime of the child processes that already finished, per type */
+static struct {
+	uint32_t	count;
+	uint64_t	usecs;
+	uint64_t	max_usecs;
+	struct metrics_histogram runtime;
+} process_stats[CTD_PROC_MAX];
+
 int fork_process_new(int type, int flags, void (*cb)(void *data), void *data)
 {
 	struct child_process *c, *this;
@@ -44,6 +53,7 @@ int fork_process_new(int type, int flags, void (*cb)(void *data), void *data)
 	c->type = type;
 	c->cb = cb;
 	c->data = data;
+	gettimeofday(&c->start, NULL);
 	c->pid = pid = fork();
 
 	if (c->pid > 0)
@@ -54,13 +64,34 @@ int fork_process_new(int type, int flags, void (*cb)(void *data), void *data)
 	return pid;
 }
 
+static uint64_t fork_process_runtime(const struct child_process *c)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - c->start.tv_sec) * 1000000 +
+	       (now.tv_usec - c->start.tv_usec);
+}
+
 int fork_process_delete(int pid)
 {
 	struct child_process *this, *tmp;
+	uint64_t usecs;
 
 	list_for_each_entry_safe(this, tmp, &process_list, head) {
 		if (this->pid == pid) {
 			list_del(&this->head);
+			if (this->type < CTD_PROC_MAX) {
+				usecs = fork_process_runtime(this);
+				process_stats[this->type].count++;
+				process_stats[this->type].usecs += usecs;
+				if (usecs > process_stats[this->type].max_usecs)
+					process_stats[this->type].max_usecs =
+									usecs;
+				metrics_histogram_observe(
+					&process_stats[this->type].runtime,
+					usecs);
+			}
 			if (this->cb) {
 				this->cb(this->data);
 			}
@@ -71,25 +102,83 @@ int fork_process_delete(int pid)
 	return 0;
 }
 
+/* a child process of this type has not finished yet. */
+int fork_process_running(int type)
+{
+	struct child_process *this;
+
+	list_for_each_entry(this, &process_list, head) {
+		if (this->type == type)
+			return 1;
+	}
+	return 0;
+}
+
 static const char *process_type_to_name[CTD_PROC_MAX] = {
 	[CTD_PROC_ANY]		= "any",
 	[CTD_PROC_FLUSH]	= "flush",
 	[CTD_PROC_COMMIT]	= "commit",
+	[CTD_PROC_DUMP]		= "dump",
+	[CTD_PROC_SNAPSHOT]	= "snapshot",
 };
 
 void fork_process_dump(int fd)
 {
 	struct child_process *this;
 	char buf[4096];
-	int size = 0;
+	int size = 0, i;
 
 	list_for_each_entry(this, &process_list, head) {
 		size += snprintf(buf + size, sizeof(buf) - size,
-				 "PID=%u type=%s\n",
+				 "PID=%u type=%s runtime=%llums\n",
 				 this->pid,
 				 this->type < CTD_PROC_MAX ?
-				 process_type_to_name[this->type] : "unknown");
+				 process_type_to_name[this->type] : "unknown",
+				 (unsigned long long)
+				 fork_process_runtime(this) / 1000);
+		if (size >= (int)sizeof(buf))
+			break;
+	}
+	for (i = 0; i < CTD_PROC_MAX && size < (int)sizeof(buf); i++) {
+		if (process_stats[i].count == 0)
+			continue;
+
+		size += snprintf(buf + size, sizeof(buf) - size,
+				 "type=%s finished=%u runtime avg=%llums "
+				 "max=%llums\n",
+				 process_type_to_name[i],
+				 process_stats[i].count,
+				 (unsigned long long)(process_stats[i].usecs /
+					process_stats[i].count / 1000),
+				 (unsigned long long)
+				 process_stats[i].max_usecs / 1000);
 	}
+	if (size > (int)sizeof(buf))
+		size = sizeof(buf);
 
 	send(fd, buf, size, 0);
 }
+
+void fork_process_metrics(struct metrics *m)
+{
+	struct child_process *this;
+	uint32_t running[CTD_PROC_MAX] = {};
+	int i;
+
+	list_for_each_entry(this, &process_list, head) {
+		if (this->type < CTD_PROC_MAX)
+			running[this->type]++;
+	}
+
+	metrics_family(m, "child_processes", METRICS_GAUGE,
+		       "Child processes currently running");
+	for (i = CTD_PROC_FLUSH; i < CTD_PROC_MAX; i++)
+		metrics_sample(m, running[i], "type=\"%s\"",
+			       process_type_to_name[i]);
+
+	metrics_family(m, "child_process_runtime_seconds", METRICS_HISTOGRAM,
+		       "Runtime of the child processes that finished");
+	for (i = CTD_PROC_FLUSH; i < CTD_PROC_MAX; i++)
+		metrics_histogram(m, &process_stats[i].runtime, "type=\"%s\"",
+				  process_type_to_name[i]);
+}
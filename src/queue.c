@@ -18,6 +18,7 @@
 
 #include "queue.h"
 #include "event.h"
+#include "metrics.h"
 
 #include <errno.h>
 #include <stdio.h>
@@ -87,6 +88,31 @@ void queue_stats_show(int fd)
 	send(fd, buf, size, 0);
 }
 
+void queue_metrics(struct metrics *m)
+{
+	struct queue *this;
+
+	metrics_family(m, "queue_nodes", METRICS_GAUGE,
+		       "Queue nodes currently allocated");
+	metrics_sample(m, qobjects_num, NULL);
+
+	metrics_family(m, "queue_elements", METRICS_GAUGE,
+		       "Elements in the queue");
+	list_for_each_entry(this, &queue_list, list)
+		metrics_sample(m, this->num_elems, "queue=\"%s\"", this->name);
+
+	metrics_family(m, "queue_max_elements", METRICS_GAUGE,
+		       "Maximum number of elements in the queue");
+	list_for_each_entry(this, &queue_list, list)
+		metrics_sample(m, this->max_elems, "queue=\"%s\"", this->name);
+
+	metrics_family(m, "queue_enospc", METRICS_COUNTER,
+		       "Elements not enqueued for lack of space");
+	list_for_each_entry(this, &queue_list, list)
+		metrics_sample(m, this->enospc_err, "queue=\"%s\"",
+			       this->name);
+}
+
 void queue_node_init(struct queue_node *n, int type)
 {
 	INIT_LIST_HEAD(&n->head);
@@ -31,6 +31,7 @@
 #include "cidr.h"
 #include "helper.h"
 #include "stack.h"
+#include "ipfix.h"
 #include <sched.h>
 #include <dlfcn.h>
 #include <libnetfilter_conntrack/libnetfilter_conntrack.h>
@@ -82,7 +83,14 @@ enum {
 %token T_OPTIONS T_TCP_WINDOW_TRACKING T_EXPECT_SYNC
 %token T_HELPER T_HELPER_QUEUE_NUM T_HELPER_QUEUE_LEN T_HELPER_POLICY
 %token T_HELPER_EXPECT_TIMEOUT T_HELPER_EXPECT_MAX
-%token T_SYSTEMD T_STARTUP_RESYNC
+%token T_SYSTEMD T_STARTUP_RESYNC T_ADAPTIVE_ACK T_COMMIT_THREADS
+%token T_PRECOMMIT_RATE
+%token T_DUMP_CHILDREN T_METRICS_PORT
+%token T_LOG_BUFFER_SIZE T_LOG_FLUSH_INTERVAL
+%token T_IPFIX T_MTU T_OBSERVATION_DOMAIN T_TEMPLATE_REFRESH T_FLUSH_INTERVAL
+%token T_ACCOUNTING T_ZONE T_MARK T_LABELS T_MAX_ENTRIES
+%token T_HEAVY_HITTERS T_WINDOW
+%token T_SNAPSHOT_FILE T_SNAPSHOT_INTERVAL T_SNAPSHOT_MAX_AGE
 
 %token <string> T_IP T_PATH_VAL
 %token <val> T_NUMBER
@@ -195,6 +203,43 @@ timeout: T_TIMEOUT T_NUMBER
 	conf.commit_timeout = $2;
 };
 
+commit_threads: T_COMMIT_THREADS T_NUMBER
+{
+	if ($2 < 1) {
+		dlog(LOG_WARNING, "CommitThreads must be at least 1, "
+		     "ignoring");
+		break;
+	}
+	conf.commit_threads = $2;
+};
+
+precommit_rate: T_PRECOMMIT_RATE T_NUMBER
+{
+	conf.precommit_rate = $2;
+};
+
+snapshot_file: T_SNAPSHOT_FILE T_PATH_VAL
+{
+	if (strlen($2) > FILENAME_MAXLEN) {
+		dlog(LOG_ERR, "SnapshotFile path is longer than %u characters",
+		     FILENAME_MAXLEN);
+		exit(EXIT_FAILURE);
+	}
+	snprintf(conf.sync.snapshot_path, sizeof(conf.sync.snapshot_path),
+		 "%s", $2);
+	free($2);
+};
+
+snapshot_interval: T_SNAPSHOT_INTERVAL T_NUMBER
+{
+	conf.sync.snapshot_interval = $2;
+};
+
+snapshot_max_age: T_SNAPSHOT_MAX_AGE T_NUMBER
+{
+	conf.sync.snapshot_max_age = $2;
+};
+
 purge: T_PURGE T_NUMBER
 {
 	conf.purge_timeout = $2;
@@ -729,6 +774,11 @@ sync_list:
 sync_line: refreshtime
 	 | expiretime
 	 | timeout
+	 | commit_threads
+	 | precommit_rate
+	 | snapshot_file
+	 | snapshot_interval
+	 | snapshot_max_age
 	 | purge
 	 | multicast_line
 	 | udp_line
@@ -817,6 +867,8 @@ sync_mode_alarm_list:
 sync_mode_alarm_line: refreshtime
               		 | expiretime
 	     		 | timeout
+			 | commit_threads
+			 | precommit_rate
 			 | purge
 			 ;
 
@@ -825,8 +877,11 @@ sync_mode_ftfw_list:
 
 sync_mode_ftfw_line: resend_queue_size
 		   | timeout
+		   | commit_threads
+		   | precommit_rate
 		   | purge
 		   | window_size
+		   | adaptive_ack
 		   | disable_external_cache
 		   | startup_resync
 		   ;
@@ -835,6 +890,8 @@ sync_mode_notrack_list:
 	      | sync_mode_notrack_list sync_mode_notrack_line;
 
 sync_mode_notrack_line: timeout
+		      | commit_threads
+		      | precommit_rate
 		      | purge
 		      | disable_internal_cache
 		      | disable_external_cache
@@ -881,6 +938,16 @@ window_size: T_WINDOWSIZE T_NUMBER
 	conf.window_size = $2;
 };
 
+adaptive_ack: T_ADAPTIVE_ACK T_ON
+{
+	conf.sync.adaptive_ack = 1;
+};
+
+adaptive_ack: T_ADAPTIVE_ACK T_OFF
+{
+	conf.sync.adaptive_ack = 0;
+};
+
 tcp_states:
 	  | tcp_states tcp_state;
 
@@ -974,6 +1041,8 @@ general_line: hashsize
 	    | netlink_buffer_size
 	    | netlink_buffer_size_max_grown
 	    | event_iterations_limit
+	    | dump_children
+	    | metrics_port
 	    | poll_secs
 	    | filter
 	    | netlink_overrun_resync
@@ -1062,6 +1131,21 @@ event_iterations_limit : T_EVENT_ITER_LIMIT T_NUMBER
 	CONFIG(event_iterations_limit) = $2;
 };
 
+dump_children : T_DUMP_CHILDREN T_NUMBER
+{
+	CONFIG(dump_children) = $2;
+};
+
+metrics_port : T_METRICS_PORT T_NUMBER
+{
+	if ($2 < 1 || $2 > 65535) {
+		dlog(LOG_WARNING, "MetricsPort must be a valid TCP port, "
+		     "ignoring");
+		break;
+	}
+	CONFIG(metrics_port) = $2;
+};
+
 poll_secs: T_POLL_SECS T_NUMBER
 {
 	conf.flags |= CTD_POLL;
@@ -1378,6 +1462,11 @@ stat_line: stat_logfile_bool
 	 | stat_logfile_path
 	 | stat_syslog_bool
 	 | stat_syslog_facility
+	 | stat_log_buffer_size
+	 | stat_log_flush_interval
+	 | stat_ipfix
+	 | stat_accounting
+	 | stat_hitters
 	 ;
 
 stat_logfile_bool : T_LOG T_ON
@@ -1400,6 +1489,194 @@ stat_logfile_path : T_LOG T_PATH_VAL
 	free($2);
 };
 
+stat_log_buffer_size : T_LOG_BUFFER_SIZE T_NUMBER
+{
+	if ($2 < 65536) {
+		dlog(LOG_WARNING, "LogBufferSize must be at least 65536 "
+		     "bytes, ignoring");
+		break;
+	}
+	conf.stats.buffer_size = $2;
+};
+
+stat_log_flush_interval : T_LOG_FLUSH_INTERVAL T_NUMBER
+{
+	conf.stats.flush_interval = $2;
+};
+
+stat_ipfix : T_IPFIX '{' ipfix_options '}'
+{
+	if (!conf.stats.ipfix.ipproto && !conf.stats.ipfix.path[0]) {
+		dlog(LOG_ERR, "missing collector address or Path in "
+		     "the IPFIX clause");
+		exit(EXIT_FAILURE);
+	}
+};
+
+ipfix_options :
+	      | ipfix_options ipfix_option
+	      ;
+
+ipfix_option : T_IPV4_DEST_ADDR T_IP
+{
+	if (!inet_aton($2, (struct in_addr *)&conf.stats.ipfix.collector.ipv4)) {
+		dlog(LOG_WARNING, "%s is not a valid IPv4 address", $2);
+		free($2);
+		break;
+	}
+	free($2);
+	conf.stats.ipfix.ipproto = AF_INET;
+};
+
+ipfix_option : T_IPV6_DEST_ADDR T_IP
+{
+	int err;
+
+	err = inet_pton(AF_INET6, $2, &conf.stats.ipfix.collector.ipv6);
+	if (err == 0) {
+		dlog(LOG_WARNING, "%s is not a valid IPv6 address", $2);
+		free($2);
+		break;
+	} else if (err < 0) {
+		dlog(LOG_ERR, "inet_pton(): IPv6 unsupported!");
+		exit(EXIT_FAILURE);
+	}
+	free($2);
+	conf.stats.ipfix.ipproto = AF_INET6;
+};
+
+ipfix_option : T_PORT T_NUMBER
+{
+	conf.stats.ipfix.port = $2;
+};
+
+ipfix_option : T_PATH T_PATH_VAL
+{
+	if (strlen($2) > FILENAME_MAXLEN) {
+		dlog(LOG_ERR, "IPFIX Path is longer than %u characters",
+		     FILENAME_MAXLEN);
+		exit(EXIT_FAILURE);
+	}
+	snprintf(conf.stats.ipfix.path, sizeof(conf.stats.ipfix.path),
+		 "%s", $2);
+	free($2);
+};
+
+ipfix_option : T_MTU T_NUMBER
+{
+	if ($2 < 576 || $2 > 65535) {
+		dlog(LOG_WARNING, "IPFIX MTU must be between 576 and 65535, "
+		     "ignoring");
+		break;
+	}
+	conf.stats.ipfix.mtu = $2;
+};
+
+ipfix_option : T_OBSERVATION_DOMAIN T_NUMBER
+{
+	conf.stats.ipfix.domain = $2;
+};
+
+ipfix_option : T_TEMPLATE_REFRESH T_NUMBER
+{
+	conf.stats.ipfix.template_refresh = $2;
+};
+
+ipfix_option : T_FLUSH_INTERVAL T_NUMBER
+{
+	if ($2 == 0) {
+		dlog(LOG_WARNING, "IPFIX FlushInterval must be greater "
+		     "than zero, ignoring");
+		break;
+	}
+	conf.stats.ipfix.flush_interval = $2;
+};
+
+stat_accounting : T_ACCOUNTING '{' acct_options '}'
+{
+	conf.stats.acct.enabled = 1;
+};
+
+acct_options :
+	     | acct_options acct_option
+	     ;
+
+acct_option : T_ZONE T_ON
+{
+	conf.stats.acct.zone = 1;
+};
+
+acct_option : T_ZONE T_OFF
+{
+	conf.stats.acct.zone = 0;
+};
+
+acct_option : T_MARK T_ON
+{
+	conf.stats.acct.mark = 1;
+	conf.stats.acct.mark_mask = 0xffffffff;
+};
+
+acct_option : T_MARK T_OFF
+{
+	conf.stats.acct.mark = 0;
+};
+
+acct_option : T_MARK T_NUMBER
+{
+	conf.stats.acct.mark = ($2 != 0);
+	conf.stats.acct.mark_mask = (uint32_t)$2;
+};
+
+acct_option : T_LABELS T_ON
+{
+	conf.stats.acct.labels = 1;
+};
+
+acct_option : T_LABELS T_OFF
+{
+	conf.stats.acct.labels = 0;
+};
+
+acct_option : T_MAX_ENTRIES T_NUMBER
+{
+	if ($2 <= 0) {
+		dlog(LOG_WARNING, "Accounting MaxEntries must be greater "
+		     "than zero, ignoring");
+		break;
+	}
+	conf.stats.acct.max_entries = $2;
+};
+
+stat_hitters : T_HEAVY_HITTERS '{' hitters_options '}'
+{
+	conf.stats.hitters.enabled = 1;
+};
+
+hitters_options :
+		| hitters_options hitters_option
+		;
+
+hitters_option : T_MAX_ENTRIES T_NUMBER
+{
+	if ($2 <= 0) {
+		dlog(LOG_WARNING, "HeavyHitters MaxEntries must be greater "
+		     "than zero, ignoring");
+		break;
+	}
+	conf.stats.hitters.entries = $2;
+};
+
+hitters_option : T_WINDOW T_NUMBER
+{
+	if ($2 <= 0) {
+		dlog(LOG_WARNING, "HeavyHitters Window must be greater "
+		     "than zero, ignoring");
+		break;
+	}
+	conf.stats.hitters.window = $2;
+};
+
 stat_syslog_bool : T_SYSLOG T_ON
 {
 	conf.stats.syslog_facility = DEFAULT_SYSLOG_FACILITY;
@@ -1724,6 +2001,9 @@ init_config(char *filename)
 	CONFIG(stats).syslog_facility = -1;
 	CONFIG(netlink).subsys_id = -1;
 
+	/* adapt the FTFW acknowledgement window unless told otherwise */
+	CONFIG(sync).adaptive_ack = 1;
+
 #ifdef BUILD_SYSTEMD
         CONFIG(systemd) = 1;
 #endif /* BUILD_SYSTEMD */
@@ -1771,6 +2051,35 @@ init_config(char *filename)
 	if (CONFIG(event_iterations_limit) == 0)
 		CONFIG(event_iterations_limit) = 100;
 
+	/* default to commit from the main thread only */
+	if (CONFIG(commit_threads) == 0)
+		CONFIG(commit_threads) = 1;
+
+	/* write the buffered flow log once per second */
+	if (CONFIG(stats).flush_interval == 0)
+		CONFIG(stats).flush_interval = 1000;
+
+	if (CONFIG(stats).ipfix.port == 0)
+		CONFIG(stats).ipfix.port = IPFIX_PORT;
+	if (CONFIG(stats).ipfix.mtu == 0)
+		CONFIG(stats).ipfix.mtu = 1500;
+	if (CONFIG(stats).ipfix.template_refresh == 0)
+		CONFIG(stats).ipfix.template_refresh = 600;
+	if (CONFIG(stats).ipfix.flush_interval == 0)
+		CONFIG(stats).ipfix.flush_interval = 1000;
+
+	if (CONFIG(stats).acct.max_entries == 0)
+		CONFIG(stats).acct.max_entries = 1024;
+
+	if (CONFIG(stats).hitters.entries == 0)
+		CONFIG(stats).hitters.entries = 1024;
+	if (CONFIG(stats).hitters.window == 0)
+		CONFIG(stats).hitters.window = 10;
+
+	/* ignore snapshots that are older than 5 minutes */
+	if (CONFIG(sync).snapshot_max_age == 0)
+		CONFIG(sync).snapshot_max_age = 300;
+
 	/* default number of bucket of the hashtable that are committed in
 	   one run loop. XXX: no option available to tune this value yet. */
 	if (CONFIG(general).commit_steps == 0)
@@ -31,6 +31,7 @@
 #include "date.h"
 #include "internal.h"
 #include "systemd.h"
+#include "metrics.h"
 
 #include <sched.h>
 #include <errno.h>
@@ -53,6 +54,7 @@ void killer(int signo)
 		sigprocmask(SIG_BLOCK, &STATE(block), NULL);
 
 	local_server_destroy(&STATE(local));
+	metrics_http_destroy();
 
 	if (CONFIG(flags) & (CTD_SYNC_MODE | CTD_STATS_MODE))
 		ctnl_kill();
@@ -140,51 +142,188 @@ static void uptime(char *buf, size_t bufsiz)
 
 static void dump_stats_runtime(int fd)
 {
-	char buf[1024], uptime_string[512];
+	char buf[2048], uptime_string[512];
+	uint64_t dump_rate = 0;
 	int size;
 
+	if (STATE(stats).dump_usecs)
+		dump_rate = STATE(stats).dump_entries * 1000000 /
+			    STATE(stats).dump_usecs;
+
 	uptime(uptime_string, sizeof(uptime_string));
 	size = snprintf(buf, sizeof(buf),
 			"daemon uptime: %s\n\n"
 			"netlink stats:\n"
 			"\tevents received:\t%20llu\n"
 			"\tevents filtered:\t%20llu\n"
-			"\tevents unknown type:\t\t%12u\n"
-			"\tcatch event failed:\t\t%12u\n"
-			"\tdump unknown type:\t\t%12u\n"
-			"\tnetlink overrun:\t\t%12u\n"
-			"\tflush kernel table:\t\t%12u\n"
-			"\tresync with kernel table:\t%12u\n"
+			"\tevents unknown type:\t\t%12llu\n"
+			"\tcatch event failed:\t\t%12llu\n"
+			"\tdump unknown type:\t\t%12llu\n"
+			"\tnetlink overrun:\t\t%12llu\n"
+			"\tflush kernel table:\t\t%12llu\n"
+			"\tentries flushed:\t\t%12llu\n"
+			"\tflush time (in usecs):\t\t%12llu\n"
+			"\tresync with kernel table:\t%12llu\n"
 			"\tcurrent buffer size (in bytes):\t%12u\n\n"
 			"runtime stats:\n"
-			"\tchild process failed:\t\t%12u\n"
-			"\t\tchild process segfault:\t%12u\n"
-			"\t\tchild process termsig:\t%12u\n"
-			"\tselect failed:\t\t\t%12u\n"
-			"\twait failed:\t\t\t%12u\n"
-			"\tlocal read failed:\t\t%12u\n"
-			"\tlocal unknown request:\t\t%12u\n\n",
+			"\tchild process failed:\t\t%12llu\n"
+			"\t\tchild process segfault:\t%12llu\n"
+			"\t\tchild process termsig:\t%12llu\n"
+			"\tselect failed:\t\t\t%12llu\n"
+			"\twait failed:\t\t\t%12llu\n"
+			"\tlocal read failed:\t\t%12llu\n"
+			"\tlocal unknown request:\t\t%12llu\n\n"
+			"dump stats:\n"
+			"\tdumps streamed:\t\t\t%12llu\n"
+			"\tdumps forked:\t\t\t%12llu\n"
+			"\tdumps queued:\t\t\t%12llu\n"
+			"\tdumps aborted:\t\t\t%12llu\n"
+			"\tentries dumped:\t\t%20llu\n"
+			"\tbytes dumped:\t\t%20llu\n"
+			"\tdump time (in usecs):\t%20llu\n"
+			"\tdump rate (entries/s):\t%20llu\n\n",
 			uptime_string,
 			(unsigned long long)STATE(stats).nl_events_received,
 			(unsigned long long)STATE(stats).nl_events_filtered,
-			STATE(stats).nl_events_unknown_type,
-			STATE(stats).nl_catch_event_failed,
-			STATE(stats).nl_dump_unknown_type,
-			STATE(stats).nl_overrun,
-			STATE(stats).nl_kernel_table_flush,
-			STATE(stats).nl_kernel_table_resync,
+			(unsigned long long)STATE(stats).nl_events_unknown_type,
+			(unsigned long long)STATE(stats).nl_catch_event_failed,
+			(unsigned long long)STATE(stats).nl_dump_unknown_type,
+			(unsigned long long)STATE(stats).nl_overrun,
+			(unsigned long long)STATE(stats).nl_kernel_table_flush,
+			(unsigned long long)
+				STATE(stats).nl_kernel_table_flush_entries,
+			(unsigned long long)
+				STATE(stats).nl_kernel_table_flush_usecs,
+			(unsigned long long)STATE(stats).nl_kernel_table_resync,
 			CONFIG(netlink_buffer_size),
-			STATE(stats).child_process_failed,
-			STATE(stats).child_process_error_segfault,
-			STATE(stats).child_process_error_term,
-			STATE(stats).select_failed,
-			STATE(stats).wait_failed,
-			STATE(stats).local_read_failed,
-			STATE(stats).local_unknown_request);
+			(unsigned long long)STATE(stats).child_process_failed,
+			(unsigned long long)
+				STATE(stats).child_process_error_segfault,
+			(unsigned long long)
+				STATE(stats).child_process_error_term,
+			(unsigned long long)STATE(stats).select_failed,
+			(unsigned long long)STATE(stats).wait_failed,
+			(unsigned long long)STATE(stats).local_read_failed,
+			(unsigned long long)STATE(stats).local_unknown_request,
+			(unsigned long long)STATE(stats).dump_streams,
+			(unsigned long long)STATE(stats).dump_forked,
+			(unsigned long long)STATE(stats).dump_queued,
+			(unsigned long long)STATE(stats).dump_aborted,
+			(unsigned long long)STATE(stats).dump_entries,
+			(unsigned long long)STATE(stats).dump_bytes,
+			(unsigned long long)STATE(stats).dump_usecs,
+			(unsigned long long)dump_rate);
 
 	send(fd, buf, size, 0);
 }
 
+static void metrics_runtime(struct metrics *m)
+{
+	const struct {
+		const char	*name;
+		const char	*help;
+		uint64_t	value;
+	} counters[] = {
+		{ "netlink_events_received", "Events received from the kernel",
+		  STATE(stats).nl_events_received },
+		{ "netlink_events_filtered", "Events discarded by the filter",
+		  STATE(stats).nl_events_filtered },
+		{ "netlink_events_unknown_type", "Events of unknown type",
+		  STATE(stats).nl_events_unknown_type },
+		{ "netlink_catch_event_failed", "Events that could not be read",
+		  STATE(stats).nl_catch_event_failed },
+		{ "netlink_dump_unknown_type", "Dumped entries of unknown type",
+		  STATE(stats).nl_dump_unknown_type },
+		{ "netlink_overruns", "Netlink socket overruns",
+		  STATE(stats).nl_overrun },
+		{ "kernel_table_flushes", "Flushes of the kernel table",
+		  STATE(stats).nl_kernel_table_flush },
+		{ "kernel_table_flush_entries",
+		  "Entries removed by the flushes",
+		  STATE(stats).nl_kernel_table_flush_entries },
+		{ "kernel_table_flush_microseconds",
+		  "Time spent in the flushes",
+		  STATE(stats).nl_kernel_table_flush_usecs },
+		{ "kernel_table_resyncs", "Resyncs with the kernel table",
+		  STATE(stats).nl_kernel_table_resync },
+		{ "child_process_failed", "Child processes that aborted",
+		  STATE(stats).child_process_failed },
+		{ "child_process_segfault", "Child processes that crashed",
+		  STATE(stats).child_process_error_segfault },
+		{ "child_process_termsig", "Child processes that were killed",
+		  STATE(stats).child_process_error_term },
+		{ "select_failed", "Failed calls to select()",
+		  STATE(stats).select_failed },
+		{ "wait_failed", "Failed calls to wait()",
+		  STATE(stats).wait_failed },
+		{ "local_read_failed", "Failed reads from the UNIX socket",
+		  STATE(stats).local_read_failed },
+		{ "local_unknown_request", "Unknown requests via UNIX socket",
+		  STATE(stats).local_unknown_request },
+		{ "dumps_streamed", "Cache dumps streamed by the daemon",
+		  STATE(stats).dump_streams },
+		{ "dumps_forked", "Cache dumps served by a child process",
+		  STATE(stats).dump_forked },
+		{ "dumps_queued", "Cache dumps that waited for a child slot",
+		  STATE(stats).dump_queued },
+		{ "dumps_aborted", "Cache dumps aborted by the client",
+		  STATE(stats).dump_aborted },
+		{ "dump_entries", "Entries sent in cache dumps",
+		  STATE(stats).dump_entries },
+		{ "dump_bytes", "Bytes sent in cache dumps",
+		  STATE(stats).dump_bytes },
+		{ "dump_microseconds", "Time spent streaming cache dumps",
+		  STATE(stats).dump_usecs },
+	};
+	unsigned int i;
+
+	metrics_family(m, "start_time_seconds", METRICS_GAUGE,
+		       "Time the daemon was started since the Epoch");
+	metrics_sample(m, STATE(stats).daemon_start_time, NULL);
+
+	metrics_family(m, "netlink_buffer_bytes", METRICS_GAUGE,
+		       "Current size of the netlink socket buffer");
+	metrics_sample(m, CONFIG(netlink_buffer_size), NULL);
+
+	for (i = 0; i < sizeof(counters) / sizeof(counters[0]); i++) {
+		metrics_family(m, counters[i].name, METRICS_COUNTER,
+			       counters[i].help);
+		metrics_sample(m, counters[i].value, NULL);
+	}
+
+	metrics_family(m, "traffic_bytes", METRICS_COUNTER,
+		       "Bytes accounted in the destroyed connections");
+	metrics_sample(m, STATE(stats).bytes_orig, "dir=\"original\"");
+	metrics_sample(m, STATE(stats).bytes_repl, "dir=\"reply\"");
+
+	metrics_family(m, "traffic_packets", METRICS_COUNTER,
+		       "Packets accounted in the destroyed connections");
+	metrics_sample(m, STATE(stats).packets_orig, "dir=\"original\"");
+	metrics_sample(m, STATE(stats).packets_repl, "dir=\"reply\"");
+}
+
+static void build_metrics(struct metrics *m)
+{
+	metrics_runtime(m);
+	fork_process_metrics(m);
+
+	if (CONFIG(flags) & (CTD_SYNC_MODE | CTD_STATS_MODE) &&
+	    STATE(mode)->metrics)
+		STATE(mode)->metrics(m);
+}
+
+static void dump_metrics(int fd)
+{
+	struct metrics m;
+
+	if (metrics_init(&m) == -1)
+		return;
+
+	build_metrics(&m);
+	metrics_send(&m, fd);
+	metrics_free(&m);
+}
+
 static int local_handler(int fd, void *data)
 {
 	int ret = LOCAL_RET_OK;
@@ -204,6 +343,9 @@ static int local_handler(int fd, void *data)
 	case STATS_PROCESS:
 		fork_process_dump(fd);
 		break;
+	case STATS_METRICS:
+		dump_metrics(fd);
+		break;
 	}
 
 	if (CONFIG(flags) & (CTD_SYNC_MODE | CTD_STATS_MODE))
@@ -309,6 +451,10 @@ init(void)
 #endif
 	time(&STATE(stats).daemon_start_time);
 
+	if (CONFIG(metrics_port) &&
+	    metrics_http_create(CONFIG(metrics_port), build_metrics) == -1)
+		return -1;
+
 	dlog(LOG_NOTICE, "initialization completed");
 
 	return 0;
@@ -0,0 +1,287 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Persistent snapshot of the conntrack caches. The file contains a header
+ * followed by one section per cache, every section is a sequence of
+ * records that wrap the ctnetlink message of one entry. The file is mapped
+ * in memory on load, so the entries are parsed in place.
+ */
+#include "conntrackd.h"
+#include "snapshot.h"
+#include "cache.h"
+#include "log.h"
+
+#include <libmnl/libmnl.h>
+#include <libnetfilter_conntrack/libnetfilter_conntrack.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+struct snapshot_container {
+	FILE		*fp;
+	time_t		now;
+	uint64_t	len;
+	uint32_t	count;
+	int		err;
+};
+
+static int snapshot_save_step(void *data1, void *data2)
+{
+	struct snapshot_container *container = data1;
+	struct cache_object *obj = data2;
+	char buf[sizeof(struct snapshot_record) + MNL_SOCKET_BUFFER_SIZE];
+	struct snapshot_record *rec = (struct snapshot_record *)buf;
+	int size;
+
+	/* these entries are gone, they are only kept to resend messages. */
+	if (obj->status == C_OBJ_DEAD)
+		return 0;
+
+	size = cache_ct_dump_binary(buf + sizeof(*rec), obj->ptr);
+	if (size == 0)
+		return 0;
+
+	memset(rec, 0, sizeof(*rec));
+	rec->len = sizeof(*rec) + size;
+	if (container->now > obj->lastupdate)
+		rec->lastupdate = container->now - obj->lastupdate;
+	if (container->now > obj->lifetime)
+		rec->lifetime = container->now - obj->lifetime;
+
+	if (fwrite(buf, rec->len, 1, container->fp) != 1) {
+		container->err = errno;
+		return -1;
+	}
+	container->len += rec->len;
+	container->count++;
+	return 0;
+}
+
+int snapshot_save(const char *path, struct cache *external)
+{
+	struct cache *caches[SNAPSHOT_MAX] = {
+		[SNAPSHOT_EXTERNAL]	= external,
+	};
+	struct snapshot_container container;
+	struct snapshot_hdr hdr;
+	char tmp[FILENAME_MAXLEN + 16];
+	uint64_t offset = sizeof(hdr);
+	int i;
+
+	/* write a temporary file first, the rename is atomic. */
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+
+	memset(&hdr, 0, sizeof(hdr));
+	memset(&container, 0, sizeof(container));
+	container.now = time(NULL);
+
+	container.fp = fopen(tmp, "w");
+	if (container.fp == NULL) {
+		dlog(LOG_ERR, "can't open snapshot file `%s': %s",
+		     tmp, strerror(errno));
+		return -1;
+	}
+	setvbuf(container.fp, NULL, _IOFBF, 1 << 20);
+
+	if (fwrite(&hdr, sizeof(hdr), 1, container.fp) != 1)
+		goto err;
+
+	for (i = 0; i < SNAPSHOT_MAX; i++) {
+		container.len = 0;
+		container.count = 0;
+
+		if (caches[i] != NULL)
+			cache_iterate(caches[i], &container,
+				      snapshot_save_step);
+		if (container.err)
+			goto err;
+
+		hdr.section[i].offset = offset;
+		hdr.section[i].len = container.len;
+		hdr.section[i].count = container.count;
+		offset += container.len;
+	}
+
+	memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+	hdr.version = SNAPSHOT_VERSION;
+	hdr.hdrlen = sizeof(hdr);
+	hdr.created = container.now;
+
+	if (fseek(container.fp, 0, SEEK_SET) == -1 ||
+	    fwrite(&hdr, sizeof(hdr), 1, container.fp) != 1 ||
+	    fflush(container.fp) == EOF ||
+	    fsync(fileno(container.fp)) == -1)
+		goto err;
+
+	fclose(container.fp);
+
+	if (rename(tmp, path) == -1) {
+		dlog(LOG_ERR, "can't rename snapshot file `%s': %s",
+		     tmp, strerror(errno));
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+err:
+	dlog(LOG_ERR, "can't write snapshot file `%s': %s", tmp,
+	     strerror(container.err ? container.err : errno));
+	fclose(container.fp);
+	unlink(tmp);
+	return -1;
+}
+
+static int
+snapshot_load_record(struct cache *c, const struct snapshot_record *rec,
+		     time_t now, long age)
+{
+	const struct nlmsghdr *nlh = (const struct nlmsghdr *)(rec + 1);
+	struct cache_object *obj;
+	struct nf_conntrack *ct;
+	long elapsed = rec->lastupdate + age;
+	int ret = 0;
+
+	ct = nfct_new();
+	if (ct == NULL)
+		return -1;
+
+	if (nfct_nlmsg_parse(nlh, ct) == -1) {
+		nfct_destroy(ct);
+		return -1;
+	}
+
+	/* prune the entries that have expired meanwhile. */
+	if (nfct_attr_is_set(ct, ATTR_TIMEOUT)) {
+		uint32_t timeout = nfct_get_attr_u32(ct, ATTR_TIMEOUT);
+
+		if (timeout <= elapsed) {
+			nfct_destroy(ct);
+			return 0;
+		}
+		nfct_set_attr_u32(ct, ATTR_TIMEOUT, timeout - elapsed);
+	}
+
+	obj = cache_update_force(c, ct);
+	if (obj != NULL) {
+		obj->lastupdate = now - elapsed;
+		obj->lifetime = now - (rec->lifetime + age);
+		ret = 1;
+	}
+	nfct_destroy(ct);
+
+	return ret;
+}
+
+int snapshot_load(const char *path, enum snapshot_section section,
+		  struct cache *c, unsigned int max_age)
+{
+	const struct snapshot_hdr *hdr;
+	const struct snapshot_record *rec;
+	uint32_t loaded = 0, pruned = 0, i;
+	struct timeval start, stop;
+	uint64_t off, end;
+	struct stat sb;
+	time_t now;
+	long age;
+	char *map;
+	int fd, ret;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		if (errno != ENOENT) {
+			dlog(LOG_WARNING, "can't open snapshot file `%s': %s",
+			     path, strerror(errno));
+		}
+		return -1;
+	}
+	if (fstat(fd, &sb) == -1 || sb.st_size < (off_t)sizeof(*hdr)) {
+		dlog(LOG_WARNING, "ignoring truncated snapshot file `%s'",
+		     path);
+		close(fd);
+		return -1;
+	}
+	map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		dlog(LOG_WARNING, "can't map snapshot file `%s': %s",
+		     path, strerror(errno));
+		return -1;
+	}
+	gettimeofday(&start, NULL);
+
+	hdr = (const struct snapshot_hdr *)map;
+	if (memcmp(hdr->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 ||
+	    hdr->version != SNAPSHOT_VERSION ||
+	    hdr->hdrlen != sizeof(*hdr)) {
+		dlog(LOG_WARNING, "ignoring snapshot file `%s' with unknown "
+		     "format", path);
+		goto err;
+	}
+
+	now = time(NULL);
+	age = now - hdr->created;
+	if (age < 0)
+		age = 0;
+	if (max_age && age > max_age) {
+		dlog(LOG_NOTICE, "ignoring snapshot file `%s', it is %lds old",
+		     path, age);
+		goto err;
+	}
+
+	off = hdr->section[section].offset;
+	end = off + hdr->section[section].len;
+	if (off < sizeof(*hdr) || end < off || end > (uint64_t)sb.st_size) {
+		dlog(LOG_WARNING, "ignoring corrupted snapshot file `%s'",
+		     path);
+		goto err;
+	}
+
+	for (i = 0; i < hdr->section[section].count && off < end; i++) {
+		rec = (const struct snapshot_record *)(map + off);
+		if (end - off < sizeof(*rec) + sizeof(struct nlmsghdr) ||
+		    rec->len > end - off ||
+		    rec->len < sizeof(*rec) + sizeof(struct nlmsghdr) ||
+		    ((const struct nlmsghdr *)(rec + 1))->nlmsg_len >
+						rec->len - sizeof(*rec)) {
+			dlog(LOG_WARNING, "snapshot file `%s' is corrupted "
+			     "after %u entries", path, i);
+			break;
+		}
+		ret = snapshot_load_record(c, rec, now, age);
+		if (ret == 1)
+			loaded++;
+		else if (ret == 0)
+			pruned++;
+
+		off += rec->len;
+	}
+	gettimeofday(&stop, NULL);
+
+	dlog(LOG_NOTICE, "restored %u entries from snapshot file `%s' "
+	     "(%lds old, %u expired) in %ld ms", loaded, path, age, pruned,
+	     (stop.tv_sec - start.tv_sec) * 1000 +
+	     (stop.tv_usec - start.tv_usec) / 1000);
+
+	munmap(map, sb.st_size);
+	return loaded;
+err:
+	munmap(map, sb.st_size);
+	return -1;
+}
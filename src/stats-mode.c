@@ -23,6 +23,10 @@
 #include "log.h"
 #include "conntrackd.h"
 #include "internal.h"
+#include "metrics.h"
+#include "flowlog.h"
+#include "ipfix.h"
+#include "hitters.h"
 
 #include <errno.h>
 #include <string.h>
@@ -48,25 +52,123 @@ static int init_stats(void)
 		return -1;
 	}
 
+	if (CONFIG(stats).buffer_size &&
+	    (STATE(stats_log) || CONFIG(stats).syslog_facility != -1)) {
+		STATE_STATS(flowlog) =
+			flowlog_create(STATE(stats_log),
+				       CONFIG(stats).syslog_facility,
+				       CONFIG(stats).buffer_size,
+				       CONFIG(stats).flush_interval);
+		if (STATE_STATS(flowlog) == NULL) {
+			dlog(LOG_ERR, "can't create the flow log buffer");
+			cache_destroy(STATE_STATS(cache));
+			free(state.stats);
+			return -1;
+		}
+	}
+
+	if (CONFIG(stats).ipfix.ipproto || CONFIG(stats).ipfix.path[0]) {
+		STATE_STATS(ipfix) = ipfix_create();
+		if (STATE_STATS(ipfix) == NULL) {
+			dlog(LOG_ERR, "can't create the IPFIX exporter");
+			if (STATE_STATS(flowlog))
+				flowlog_destroy(STATE_STATS(flowlog));
+			cache_destroy(STATE_STATS(cache));
+			free(state.stats);
+			return -1;
+		}
+	}
+
+	if (CONFIG(stats).acct.enabled) {
+		STATE_STATS(acct) =
+			traffic_acct_create(CONFIG(stats).acct.zone,
+					    CONFIG(stats).acct.mark,
+					    CONFIG(stats).acct.mark_mask,
+					    CONFIG(stats).acct.labels,
+					    CONFIG(stats).acct.max_entries);
+		if (STATE_STATS(acct) == NULL) {
+			dlog(LOG_ERR, "can't allocate memory for the "
+				      "accounting tables");
+			if (STATE_STATS(ipfix))
+				ipfix_destroy(STATE_STATS(ipfix));
+			if (STATE_STATS(flowlog))
+				flowlog_destroy(STATE_STATS(flowlog));
+			cache_destroy(STATE_STATS(cache));
+			free(state.stats);
+			return -1;
+		}
+	}
+
+	if (CONFIG(stats).hitters.enabled) {
+		STATE_STATS(hitters) =
+			hitters_create(CONFIG(stats).hitters.entries,
+				       CONFIG(stats).hitters.window);
+		if (STATE_STATS(hitters) == NULL) {
+			dlog(LOG_ERR, "can't allocate memory for the "
+				      "heavy hitters");
+			if (STATE_STATS(acct))
+				traffic_acct_destroy(STATE_STATS(acct));
+			if (STATE_STATS(ipfix))
+				ipfix_destroy(STATE_STATS(ipfix));
+			if (STATE_STATS(flowlog))
+				flowlog_destroy(STATE_STATS(flowlog));
+			cache_destroy(STATE_STATS(cache));
+			free(state.stats);
+			return -1;
+		}
+	}
+
 	return 0;
 }
 
 static void kill_stats(void)
 {
+	if (STATE_STATS(hitters))
+		hitters_destroy(STATE_STATS(hitters));
+	if (STATE_STATS(acct))
+		traffic_acct_destroy(STATE_STATS(acct));
+	if (STATE_STATS(ipfix))
+		ipfix_destroy(STATE_STATS(ipfix));
+	if (STATE_STATS(flowlog))
+		flowlog_destroy(STATE_STATS(flowlog));
 	cache_destroy(STATE_STATS(cache));
 }
 
+/* a flow is gone, either destroyed or found missing on purge. */
+static void stats_flow_end(struct nf_conntrack *ct, time_t start)
+{
+	if (STATE_STATS(acct))
+		traffic_acct_update(STATE_STATS(acct), ct);
+	if (STATE_STATS(hitters))
+		hitters_flow_end(STATE_STATS(hitters), ct);
+
+	if (STATE_STATS(ipfix))
+		ipfix_put(STATE_STATS(ipfix), ct, start);
+
+	if (STATE_STATS(flowlog))
+		flowlog_put(STATE_STATS(flowlog), ct);
+	else
+		dlog_ct(STATE(stats_log), ct, NFCT_O_PLAIN);
+}
+
 /* handler for requests coming via UNIX socket */
 static int local_handler_stats(int fd, int type, void *data)
 {
+	struct ct_dump_filter filter;
 	int ret = LOCAL_RET_OK;
 
 	switch(type) {
 	case CT_DUMP_INTERNAL:
-		cache_dump(STATE_STATS(cache), fd, NFCT_O_PLAIN);
+		cache_dump_stream(STATE_STATS(cache), fd, NFCT_O_PLAIN, NULL);
 		break;
 	case CT_DUMP_INT_XML:
-		cache_dump(STATE_STATS(cache), fd, NFCT_O_XML);
+		cache_dump_stream(STATE_STATS(cache), fd, NFCT_O_XML, NULL);
+		break;
+	case CT_DUMP_INT_FILTER:
+		if (ct_dump_filter_recv(fd, &filter) == -1)
+			break;
+		cache_dump_stream(STATE_STATS(cache), fd, filter.format,
+				  &filter);
 		break;
 	case CT_FLUSH_CACHE:
 	case CT_FLUSH_INT_CACHE:
@@ -79,10 +181,22 @@ static int local_handler_stats(int fd, int type, void *data)
 	case STATS:
 		cache_stats(STATE_STATS(cache), fd);
 		dump_traffic_stats(fd);
+		if (STATE_STATS(flowlog))
+			flowlog_stats(STATE_STATS(flowlog), fd);
+		if (STATE_STATS(ipfix))
+			ipfix_stats(STATE_STATS(ipfix), fd);
 		break;
 	case STATS_CACHE:
 		cache_stats_extended(STATE_STATS(cache), fd);
 		break;
+	case STATS_ACCOUNTING:
+		if (STATE_STATS(acct))
+			traffic_acct_dump(STATE_STATS(acct), fd);
+		break;
+	case STATS_TOP:
+		if (STATE_STATS(hitters))
+			hitters_dump(STATE_STATS(hitters), fd);
+		break;
 	default:
 		ret = 0;
 		break;
@@ -91,6 +205,19 @@ static int local_handler_stats(int fd, int type, void *data)
 	return ret;
 }
 
+static void metrics_stats(struct metrics *m)
+{
+	cache_metrics(&STATE_STATS(cache), 1, m);
+	if (STATE_STATS(flowlog))
+		flowlog_metrics(STATE_STATS(flowlog), m);
+	if (STATE_STATS(ipfix))
+		ipfix_metrics(STATE_STATS(ipfix), m);
+	if (STATE_STATS(acct))
+		traffic_acct_metrics(STATE_STATS(acct), m);
+	if (STATE_STATS(hitters))
+		hitters_metrics(STATE_STATS(hitters), m);
+}
+
 static void stats_populate(struct nf_conntrack *ct)
 {
 	nfct_attr_unset(ct, ATTR_ORIG_COUNTER_BYTES);
@@ -131,7 +258,7 @@ static int purge_step(void *data1, void *data2)
 	nl_get_conntrack(STATE(get), obj->ptr); /* modifies STATE(get_retval) */
 	if (!STATE(get_retval)) {
 		cache_del(STATE_STATS(cache), obj);
-		dlog_ct(STATE(stats_log), obj->ptr, NFCT_O_PLAIN);
+		stats_flow_end(obj->ptr, obj->lifetime);
 		cache_object_free(obj);
 	}
 
@@ -160,6 +287,8 @@ static void stats_event_new(struct nf_conntrack *ct, int origin)
 			cache_object_free(obj);
 			return;
 		}
+		if (STATE_STATS(hitters))
+			hitters_flow_new(STATE_STATS(hitters), ct);
 	}
 	return;
 }
@@ -180,7 +309,7 @@ static int stats_event_del(struct nf_conntrack *ct, int origin)
 	obj = cache_find(STATE_STATS(cache), ct, &id);
 	if (obj) {
 		cache_del(STATE_STATS(cache), obj);
-		dlog_ct(STATE(stats_log), ct, NFCT_O_PLAIN);
+		stats_flow_end(ct, obj->lifetime);
 		cache_object_free(obj);
 		return 1;
 	}
@@ -202,6 +331,7 @@ static struct internal_handler internal_cache_stats = {
 struct ct_mode stats_mode = {
 	.init 			= init_stats,
 	.local			= local_handler_stats,
+	.metrics		= metrics_stats,
 	.kill			= kill_stats,
 	.internal		= &internal_cache_stats,
 };
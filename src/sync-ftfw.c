@@ -27,6 +27,8 @@
 #include "cache.h"
 #include "fds.h"
 #include "resync.h"
+#include "date.h"
+#include "metrics.h"
 
 #include <string.h>
 #include <errno.h>
@@ -40,6 +42,7 @@
 struct queue *rs_queue;
 static uint32_t exp_seq;
 static uint32_t window;
+static int window_left;
 static uint32_t ack_from;
 static int ack_from_set = 0;
 static struct alarm_block alive_alarm;
@@ -52,9 +55,42 @@ enum {
 static int hello_state = HELLO_INIT;
 static int say_hello_back;
 
-/* XXX: alive message expiration configurable */
+/* alive message interval (in secs), the upper bound with AdaptiveACK */
 #define ALIVE_INT 1
 
+/*
+ * Adaptive acknowledgement: the window, the delay before a pending
+ * acknowledgement is sent and the alive interval are recalculated every
+ * FTFW_ADAPT_INT seconds from the receive rate, the loss rate and the
+ * minimum round-trip time observed in the last period.
+ */
+#define FTFW_ADAPT_INT		1
+#define FTFW_WINDOW_MIN		16
+#define FTFW_ACK_DELAY_MIN	10000			/* usecs */
+#define FTFW_ACK_DELAY_MAX	(ALIVE_INT * 1000000)	/* usecs */
+#define FTFW_ALIVE_MIN		100000			/* usecs */
+#define FTFW_ALIVE_MAX		(ALIVE_INT * 1000000)	/* usecs */
+#define FTFW_RTT_RING		256			/* power of two */
+
+static struct alarm_block adapt_alarm;
+static uint32_t ack_delay = FTFW_ACK_DELAY_MAX;
+static uint32_t alive_int = FTFW_ALIVE_MAX;
+
+static struct {
+	struct {
+		uint32_t	seq;
+		struct timeval	tv;
+	} ring[FTFW_RTT_RING];
+	uint32_t		estimate;	/* usecs, zero if unknown */
+	uint32_t		period_min;	/* usecs, zero if no sample */
+	struct metrics_histogram samples;
+} rtt;
+
+static struct {
+	uint64_t		rcv;
+	uint64_t		lost;
+} adapt;
+
 struct cache_ftfw {
 	struct queue_node	qnode;
 	struct cache_object	*obj;
@@ -97,19 +133,115 @@ static void nethdr_set_hello(struct nethdr *net)
 	}
 }
 
+static void rtt_sample_sent(uint32_t seq)
+{
+	unsigned int i = seq & (FTFW_RTT_RING - 1);
+
+	rtt.ring[i].seq = seq;
+	gettimeofday_cached(&rtt.ring[i].tv);
+}
+
+/* the last message covered by an ack is likely to have triggered it */
+static void rtt_sample_ack(uint32_t seq)
+{
+	unsigned int i = seq & (FTFW_RTT_RING - 1);
+	struct timeval tv;
+	uint32_t sample;
+
+	if (rtt.ring[i].seq != seq || !timerisset(&rtt.ring[i].tv))
+		return;
+
+	gettimeofday_cached(&tv);
+	timersub(&tv, &rtt.ring[i].tv, &tv);
+	timerclear(&rtt.ring[i].tv);
+
+	if (tv.tv_sec >= ALIVE_INT)
+		return;
+
+	sample = tv.tv_usec;
+	metrics_histogram_observe(&rtt.samples, sample);
+	if (rtt.period_min == 0 || sample < rtt.period_min)
+		rtt.period_min = sample;
+}
+
+static void alive_alarm_arm(void)
+{
+	uint32_t usecs = FTFW_ALIVE_MAX;
+
+	/* messages are waiting for acknowledgement, the alive message tells
+	 * the other node our last sequence number, so that it notices if the
+	 * last ones were lost. */
+	if (queue_len(rs_queue))
+		usecs = alive_int;
+
+	/* we have data to acknowledge, do not wait for a full alive period */
+	if (ack_from_set && ack_delay < usecs)
+		usecs = ack_delay;
+
+	add_alarm(&alive_alarm, usecs / 1000000, usecs % 1000000);
+}
+
+static void do_adapt_alarm(struct alarm_block *a, void *data)
+{
+	uint32_t max = CONFIG(resend_queue_size) / 2;
+	uint64_t target;
+
+	if (rtt.period_min) {
+		rtt.estimate = rtt.period_min;
+		rtt.period_min = 0;
+	}
+
+	/* give the other node some slack to acknowledge a window */
+	if (rtt.estimate) {
+		ack_delay = rtt.estimate * 4;
+		if (ack_delay < FTFW_ACK_DELAY_MIN)
+			ack_delay = FTFW_ACK_DELAY_MIN;
+		else if (ack_delay > FTFW_ACK_DELAY_MAX)
+			ack_delay = FTFW_ACK_DELAY_MAX;
+
+		/* leave the other node its ack delay before asking again */
+		alive_int = rtt.estimate * 8;
+		if (alive_int < FTFW_ALIVE_MIN)
+			alive_int = FTFW_ALIVE_MIN;
+		else if (alive_int > FTFW_ALIVE_MAX)
+			alive_int = FTFW_ALIVE_MAX;
+	}
+
+	/* one acknowledgement per ack delay at the current receive rate */
+	if (adapt.rcv) {
+		target = adapt.rcv * ack_delay /
+			 (FTFW_ADAPT_INT * 1000000ULL);
+
+		/* under message loss, release the resend queue sooner */
+		if (adapt.lost * 100 > adapt.rcv + adapt.lost)
+			target /= 2;
+
+		target = (window * 3 + target) / 4;
+		if (target < FTFW_WINDOW_MIN)
+			target = FTFW_WINDOW_MIN;
+		if (max > FTFW_WINDOW_MIN && target > max)
+			target = max;
+
+		window = target;
+	}
+	adapt.rcv = adapt.lost = 0;
+
+	add_alarm(&adapt_alarm, FTFW_ADAPT_INT, 0);
+}
+
 /* this function is called from the alarm framework */
 static void do_alive_alarm(struct alarm_block *a, void *data)
 {
 	if (ack_from_set && nethdr_track_is_seq_set()) {
 		/* exp_seq contains the last update received */
-		tx_queue_add_ctlmsg(NET_F_ACK,
+		tx_queue_add_ctlmsg(NET_F_ACK | NET_F_ACK_DELAYED,
 				    ack_from,
 				    STATE_SYNC(last_seq_recv));
 		ack_from_set = 0;
 	} else
 		tx_queue_add_ctlmsg2(NET_F_ALIVE);
 
-	add_alarm(&alive_alarm, ALIVE_INT, 0);
+	alive_alarm_arm();
 }
 
 static int ftfw_init(void)
@@ -121,16 +253,24 @@ static int ftfw_init(void)
 	}
 
 	init_alarm(&alive_alarm, NULL, do_alive_alarm);
-	add_alarm(&alive_alarm, ALIVE_INT, 0);
+	alive_alarm_arm();
 
 	/* set ack window size */
-	window = CONFIG(window_size);
+	window = window_left = CONFIG(window_size);
+
+	if (CONFIG(sync).adaptive_ack) {
+		init_alarm(&adapt_alarm, NULL, do_adapt_alarm);
+		add_alarm(&adapt_alarm, FTFW_ADAPT_INT, 0);
+	}
 
 	return 0;
 }
 
 static void ftfw_kill(void)
 {
+	if (CONFIG(sync).adaptive_ack)
+		del_alarm(&adapt_alarm);
+
 	queue_destroy(rs_queue);
 }
 
@@ -179,11 +319,42 @@ static void ftfw_local_queue(int fd)
 	char buf[512];
 	int size;
 
-	size = sprintf(buf, "resent queue (len=%u)\n", queue_len(rs_queue));
+	size = sprintf(buf, "resent queue (len=%u)\n"
+			    "ack window (cur=%u configured=%u)\n"
+			    "ack delay (cur=%u.%06u secs) alive interval "
+			    "(cur=%u.%06u secs) rtt (%u usecs)\n",
+			    queue_len(rs_queue),
+			    window, CONFIG(window_size),
+			    ack_delay / 1000000, ack_delay % 1000000,
+			    alive_int / 1000000, alive_int % 1000000,
+			    rtt.estimate);
 	send(fd, buf, size, 0);
 	queue_iterate(rs_queue, &fd, rs_queue_dump);
 }
 
+static void ftfw_metrics(struct metrics *m)
+{
+	metrics_family(m, "ftfw_window", METRICS_GAUGE,
+		       "Messages sent before an acknowledgement is requested");
+	metrics_sample(m, window, NULL);
+
+	metrics_family(m, "ftfw_ack_delay_microseconds", METRICS_GAUGE,
+		       "Delay before a pending acknowledgement is sent");
+	metrics_sample(m, ack_delay, NULL);
+
+	metrics_family(m, "ftfw_alive_interval_microseconds", METRICS_GAUGE,
+		       "Alive interval while messages wait for acknowledgement");
+	metrics_sample(m, alive_int, NULL);
+
+	metrics_family(m, "ftfw_rtt_estimate_microseconds", METRICS_GAUGE,
+		       "Round-trip time estimate, zero if unknown");
+	metrics_sample(m, rtt.estimate, NULL);
+
+	metrics_family(m, "ftfw_rtt_seconds", METRICS_HISTOGRAM,
+		       "Round-trip time until a message is acknowledged");
+	metrics_histogram(m, &rtt.samples, NULL);
+}
+
 static int ftfw_local(int fd, int type, void *data)
 {
 	int ret = LOCAL_RET_OK;
@@ -299,6 +470,9 @@ static int digest_msg(const struct nethdr *net)
 		if (before(h->to, h->from))
 			return MSG_BAD;
 
+		/* a delayed ack tells about our ack delay, not about the rtt */
+		if (!(h->flags & NET_F_ACK_DELAYED))
+			rtt_sample_ack(h->to);
 		queue_iterate(rs_queue, h, rs_queue_empty);
 		return MSG_CTL;
 
@@ -347,7 +521,7 @@ static int ftfw_recv(const struct nethdr *net)
 		/* we have received a hello while we had data to acknowledge.
 		 * reset the window, the other doesn't know anthing about it. */
 		if (ack_from_set && before(net->seq, ack_from)) {
-			window = CONFIG(window_size) - 1;
+			window_left = window - 1;
 			ack_from = net->seq;
 		}
 
@@ -373,11 +547,13 @@ static int ftfw_recv(const struct nethdr *net)
 		}
 
 		tx_queue_add_ctlmsg(NET_F_NACK, exp_seq, net->seq-1);
+		adapt.lost += net->seq - exp_seq;
 
 		/* count this message as part of the new window */
-		window = CONFIG(window_size) - 1;
+		window_left = window - 1;
 		ack_from = net->seq;
 		ack_from_set = 1;
+		alive_alarm_arm();
 		break;
 
 	case SEQ_BEFORE:
@@ -397,19 +573,22 @@ bypass:
 		if (!ack_from_set) {
 			ack_from_set = 1;
 			ack_from = net->seq;
+			alive_alarm_arm();
 		}
 
-		if (--window <= 0) {
+		if (--window_left <= 0) {
 			/* received a window, send an acknowledgement */
 			tx_queue_add_ctlmsg(NET_F_ACK, ack_from, net->seq);
-			window = CONFIG(window_size);
+			window_left = window;
 			ack_from_set = 0;
 		}
 	}
 
 out:
-	if ((ret == MSG_DATA || ret == MSG_CTL))
+	if ((ret == MSG_DATA || ret == MSG_CTL)) {
 		nethdr_track_update_seq(net->seq);
+		adapt.rcv++;
+	}
 
 	return ret;
 }
@@ -457,6 +636,7 @@ static int tx_queue_xmit(struct queue_node *n, const void *data)
 
 		multichannel_send(STATE_SYNC(channel), net);
 		HDR_NETWORK2HOST(net);
+		rtt_sample_sent(net->seq);
 
 		if (IS_ACK(net) || IS_NACK(net) || IS_RESYNC(net)) {
 			if (queue_add(rs_queue, n) < 0) {
@@ -484,6 +664,7 @@ static int tx_queue_xmit(struct queue_node *n, const void *data)
 
 		multichannel_send(STATE_SYNC(channel), net);
 		cn->seq = ntohl(net->seq);
+		rtt_sample_sent(cn->seq);
 		if (queue_add(rs_queue, &cn->qnode) < 0) {
 			if (errno == ENOSPC) {
 				rs_queue_purge_full();
@@ -501,7 +682,7 @@ static int tx_queue_xmit(struct queue_node *n, const void *data)
 static void ftfw_xmit(void)
 {
 	queue_iterate(STATE_SYNC(tx_queue), NULL, tx_queue_xmit);
-	add_alarm(&alive_alarm, ALIVE_INT, 0);
+	alive_alarm_arm();
 	dp("tx_queue_len:%u rs_queue_len:%u\n", 
 		queue_len(tx_queue), queue_len(rs_queue));
 }
@@ -528,4 +709,5 @@ struct sync_mode sync_ftfw = {
 	.recv			= ftfw_recv,
 	.enqueue		= ftfw_enqueue,
 	.xmit			= ftfw_xmit,
+	.metrics		= ftfw_metrics,
 };
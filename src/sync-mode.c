@@ -31,6 +31,8 @@
 #include "origin.h"
 #include "internal.h"
 #include "external.h"
+#include "snapshot.h"
+#include "metrics.h"
 
 #include <errno.h>
 #include <unistd.h>
@@ -112,6 +114,15 @@ do_channel_handler_step(struct channel *c, struct nethdr *net, size_t remain)
 		return;
 	}
 
+	/* skip the nf_conntrack object if the handler does not need it */
+	if (net->type <= NET_T_STATE_CT_DEL && STATE_SYNC(external)->ct.msg) {
+		if (STATE_SYNC(external)->ct.msg(net, remain) == -1) {
+			STATE_SYNC(error).msg_rcv_malformed++;
+			STATE_SYNC(error).msg_rcv_bad_payload++;
+		}
+		return;
+	}
+
 	switch(net->type) {
 	case NET_T_STATE_CT_NEW:
 		ct = msg2ct_alloc(net, remain);
@@ -296,20 +307,40 @@ static void interface_handler(void *data)
 		interface_candidate();
 }
 
+static void reset_cache_done(void *data)
+{
+	/* entries committed in background are gone with the flush */
+	cache_ct_precommit_invalidate();
+}
+
 static void do_reset_cache_alarm(struct alarm_block *a, void *data)
 {
 	STATE(stats).nl_kernel_table_flush++;
 	dlog(LOG_NOTICE, "flushing kernel conntrack table (scheduled)");
 
-	/* fork a child process that performs the flush operation,
-	 * meanwhile the parent process handles events. */
-	if (fork_process_new(CTD_PROC_FLUSH, CTD_PROC_F_EXCL,
+	nl_flush_conntrack_table_selective(reset_cache_done, NULL);
+
+	/* this is not required if events don't get lost */
+	STATE(mode)->internal->ct.flush();
+}
+
+static void snapshot_sync(void)
+{
+	snapshot_save(CONFIG(sync).snapshot_path,
+		      STATE_SYNC(external)->ct.data);
+}
+
+static void do_snapshot_alarm(struct alarm_block *a, void *data)
+{
+	/* the child writes the copy-on-write snapshot of the caches. */
+	if (fork_process_new(CTD_PROC_SNAPSHOT, CTD_PROC_F_EXCL,
 			     NULL, NULL) == 0) {
-		nl_flush_conntrack_table_selective();
+		cache_dump_close_clients(-1);
+		snapshot_sync();
 		exit(EXIT_SUCCESS);
 	}
-	/* this is not required if events don't get lost */
-	STATE(mode)->internal->ct.flush();
+	add_alarm(&STATE_SYNC(snapshot_alarm),
+		  CONFIG(sync).snapshot_interval, 0);
 }
 
 static void commit_cb(void *data)
@@ -472,6 +503,18 @@ static int init_sync(void)
 
 	init_alarm(&STATE_SYNC(reset_cache_alarm), NULL, do_reset_cache_alarm);
 
+	/* the external cache is ready for failover right after restart. */
+	if (CONFIG(sync).snapshot_path[0] && STATE_SYNC(external)->ct.data) {
+		snapshot_load(CONFIG(sync).snapshot_path, SNAPSHOT_EXTERNAL,
+			      STATE_SYNC(external)->ct.data,
+			      CONFIG(sync).snapshot_max_age);
+	}
+	init_alarm(&STATE_SYNC(snapshot_alarm), NULL, do_snapshot_alarm);
+	if (CONFIG(sync).snapshot_path[0] && CONFIG(sync).snapshot_interval) {
+		add_alarm(&STATE_SYNC(snapshot_alarm),
+			  CONFIG(sync).snapshot_interval, 0);
+	}
+
 	/* initialization of message sequence generation */
 	STATE_SYNC(last_seq_sent) = time(NULL);
 
@@ -480,6 +523,9 @@ static int init_sync(void)
 
 static void kill_sync(void)
 {
+	if (CONFIG(sync).snapshot_path[0])
+		snapshot_sync();
+
 	STATE(mode)->internal->close();
 	STATE_SYNC(external)->close();
 
@@ -522,32 +568,87 @@ static void dump_stats_sync_extended(int fd)
 			"network statistics:\n"
 			"\trecv:\n"
 			"\t\tMalformed messages:\t%20llu\n"
-			"\t\tWrong protocol version:\t%20u\n"
-			"\t\tMalformed header:\t%20u\n"
-			"\t\tMalformed payload:\t%20u\n"
-			"\t\tBad message type:\t%20u\n"
-			"\t\tTruncated message:\t%20u\n"
-			"\t\tBad message size:\t%20u\n"
+			"\t\tWrong protocol version:\t%20llu\n"
+			"\t\tMalformed header:\t%20llu\n"
+			"\t\tMalformed payload:\t%20llu\n"
+			"\t\tBad message type:\t%20llu\n"
+			"\t\tTruncated message:\t%20llu\n"
+			"\t\tBad message size:\t%20llu\n"
 			"\tsend:\n"
-			"\t\tMalformed messages:\t%20u\n\n"
+			"\t\tMalformed messages:\t%20llu\n\n"
 			"sequence tracking statistics:\n"
 			"\trecv:\n"
 			"\t\tPackets lost:\t\t%20llu\n"
 			"\t\tPackets before:\t\t%20llu\n\n",
 			(unsigned long long)STATE_SYNC(error).msg_rcv_malformed,
-			STATE_SYNC(error).msg_rcv_bad_version,
-			STATE_SYNC(error).msg_rcv_bad_header,
-			STATE_SYNC(error).msg_rcv_bad_payload,
-			STATE_SYNC(error).msg_rcv_bad_type,
-			STATE_SYNC(error).msg_rcv_truncated,
-			STATE_SYNC(error).msg_rcv_bad_size,
-			STATE_SYNC(error).msg_snd_malformed,
+			(unsigned long long)
+				STATE_SYNC(error).msg_rcv_bad_version,
+			(unsigned long long)
+				STATE_SYNC(error).msg_rcv_bad_header,
+			(unsigned long long)
+				STATE_SYNC(error).msg_rcv_bad_payload,
+			(unsigned long long)STATE_SYNC(error).msg_rcv_bad_type,
+			(unsigned long long)STATE_SYNC(error).msg_rcv_truncated,
+			(unsigned long long)STATE_SYNC(error).msg_rcv_bad_size,
+			(unsigned long long)STATE_SYNC(error).msg_snd_malformed,
 			(unsigned long long)STATE_SYNC(error).msg_rcv_lost,
 			(unsigned long long)STATE_SYNC(error).msg_rcv_before);
 
 	send(fd, buf, size, 0);
 }
 
+static void metrics_sync(struct metrics *m)
+{
+	static const char *reasons[] = {
+		"bad_version", "bad_header", "bad_payload", "bad_type",
+		"truncated", "bad_size",
+	};
+	const uint32_t errors[] = {
+		STATE_SYNC(error).msg_rcv_bad_version,
+		STATE_SYNC(error).msg_rcv_bad_header,
+		STATE_SYNC(error).msg_rcv_bad_payload,
+		STATE_SYNC(error).msg_rcv_bad_type,
+		STATE_SYNC(error).msg_rcv_truncated,
+		STATE_SYNC(error).msg_rcv_bad_size,
+	};
+	struct cache *caches[4];
+	int i, num = 0;
+
+	if (STATE(mode)->internal->ct.data)
+		caches[num++] = STATE(mode)->internal->ct.data;
+	if (STATE_SYNC(external)->ct.data)
+		caches[num++] = STATE_SYNC(external)->ct.data;
+	if (CONFIG(flags) & CTD_EXPECT && STATE(mode)->internal->exp.data)
+		caches[num++] = STATE(mode)->internal->exp.data;
+	cache_metrics(caches, num, m);
+
+	if (STATE_SYNC(external)->ct.metrics)
+		STATE_SYNC(external)->ct.metrics(m);
+
+	queue_metrics(m);
+	multichannel_metrics(STATE_SYNC(channel), m);
+
+	metrics_family(m, "sync_received_malformed", METRICS_COUNTER,
+		       "Malformed messages received from the other node");
+	for (i = 0; i < (int)(sizeof(errors) / sizeof(errors[0])); i++)
+		metrics_sample(m, errors[i], "reason=\"%s\"", reasons[i]);
+
+	metrics_family(m, "sync_sent_malformed", METRICS_COUNTER,
+		       "Messages that could not be built");
+	metrics_sample(m, STATE_SYNC(error).msg_snd_malformed, NULL);
+
+	metrics_family(m, "sync_received_lost", METRICS_COUNTER,
+		       "Messages lost according to the sequence tracking");
+	metrics_sample(m, STATE_SYNC(error).msg_rcv_lost, NULL);
+
+	metrics_family(m, "sync_received_before", METRICS_COUNTER,
+		       "Messages received out of sequence");
+	metrics_sample(m, STATE_SYNC(error).msg_rcv_before, NULL);
+
+	if (STATE_SYNC(sync)->metrics)
+		STATE_SYNC(sync)->metrics(m);
+}
+
 static int local_commit(int fd)
 {
 	int ret;
@@ -572,32 +673,31 @@ static int local_commit(int fd)
 /* handler for requests coming via UNIX socket */
 static int local_handler_sync(int fd, int type, void *data)
 {
+	struct ct_dump_filter filter;
 	int ret = LOCAL_RET_OK;
 
 	switch(type) {
 	case CT_DUMP_INTERNAL:
-		if (fork_process_new(CTD_PROC_ANY, 0, NULL, NULL) == 0) {
-			STATE(mode)->internal->ct.dump(fd, NFCT_O_PLAIN);
-			exit(EXIT_SUCCESS);
-		}
+		STATE(mode)->internal->ct.dump(fd, NFCT_O_PLAIN, NULL);
 		break;
 	case CT_DUMP_EXTERNAL:
-		if (fork_process_new(CTD_PROC_ANY, 0, NULL, NULL) == 0) {
-			STATE_SYNC(external)->ct.dump(fd, NFCT_O_PLAIN);
-			exit(EXIT_SUCCESS);
-		} 
+		STATE_SYNC(external)->ct.dump(fd, NFCT_O_PLAIN, NULL);
 		break;
 	case CT_DUMP_INT_XML:
-		if (fork_process_new(CTD_PROC_ANY, 0, NULL, NULL) == 0) {
-			STATE(mode)->internal->ct.dump(fd, NFCT_O_XML);
-			exit(EXIT_SUCCESS);
-		}
+		STATE(mode)->internal->ct.dump(fd, NFCT_O_XML, NULL);
 		break;
 	case CT_DUMP_EXT_XML:
-		if (fork_process_new(CTD_PROC_ANY, 0, NULL, NULL) == 0) {
-			STATE_SYNC(external)->ct.dump(fd, NFCT_O_XML);
-			exit(EXIT_SUCCESS);
-		}
+		STATE_SYNC(external)->ct.dump(fd, NFCT_O_XML, NULL);
+		break;
+	case CT_DUMP_INT_FILTER:
+		if (ct_dump_filter_recv(fd, &filter) == -1)
+			break;
+		STATE(mode)->internal->ct.dump(fd, filter.format, &filter);
+		break;
+	case CT_DUMP_EXT_FILTER:
+		if (ct_dump_filter_recv(fd, &filter) == -1)
+			break;
+		STATE_SYNC(external)->ct.dump(fd, filter.format, &filter);
 		break;
 	case CT_COMMIT:
 		dlog(LOG_NOTICE, "committing conntrack cache");
@@ -678,19 +778,13 @@ static int local_handler_sync(int fd, int type, void *data)
 		if (!(CONFIG(flags) & CTD_EXPECT))
 			break;
 
-		if (fork_process_new(CTD_PROC_ANY, 0, NULL, NULL) == 0) {
-			STATE(mode)->internal->exp.dump(fd, NFCT_O_PLAIN);
-			exit(EXIT_SUCCESS);
-		}
+		STATE(mode)->internal->exp.dump(fd, NFCT_O_PLAIN);
 		break;
 	case EXP_DUMP_EXTERNAL:
 		if (!(CONFIG(flags) & CTD_EXPECT))
 			break;
 
-		if (fork_process_new(CTD_PROC_ANY, 0, NULL, NULL) == 0) {
-			STATE_SYNC(external)->exp.dump(fd, NFCT_O_PLAIN);
-			exit(EXIT_SUCCESS);
-		}
+		STATE_SYNC(external)->exp.dump(fd, NFCT_O_PLAIN);
 		break;
 	case EXP_COMMIT:
 		if (!(CONFIG(flags) & CTD_EXPECT))
@@ -730,16 +824,10 @@ static int local_handler_sync(int fd, int type, void *data)
 		ret = local_commit(fd);
 		break;
 	case EXP_DUMP_INT_XML:
-		if (fork_process_new(CTD_PROC_ANY, 0, NULL, NULL) == 0) {
-			STATE(mode)->internal->exp.dump(fd, NFCT_O_XML);
-			exit(EXIT_SUCCESS);
-		}
+		STATE(mode)->internal->exp.dump(fd, NFCT_O_XML);
 		break;
 	case EXP_DUMP_EXT_XML:
-		if (fork_process_new(CTD_PROC_ANY, 0, NULL, NULL) == 0) {
-			STATE_SYNC(external)->exp.dump(fd, NFCT_O_XML);
-			exit(EXIT_SUCCESS);
-		}
+		STATE_SYNC(external)->exp.dump(fd, NFCT_O_XML);
 		break;
 	default:
 		if (STATE_SYNC(sync)->local)
@@ -753,6 +841,7 @@ static int local_handler_sync(int fd, int type, void *data)
 struct ct_mode sync_mode = {
 	.init 			= init_sync,
 	.local			= local_handler_sync,
+	.metrics		= metrics_sync,
 	.kill			= kill_sync,
 	/* the internal handler is set in run-time. */
 };
@@ -18,17 +18,24 @@
 
 #include "traffic_stats.h"
 #include "conntrackd.h"
+#include "metrics.h"
+#include "jhash.h"
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netdb.h>
 
 void update_traffic_stats(struct nf_conntrack *ct)
 {
 	STATE(stats).bytes_orig +=
-		nfct_get_attr_u32(ct, ATTR_ORIG_COUNTER_BYTES);
+		nfct_get_attr_u64(ct, ATTR_ORIG_COUNTER_BYTES);
 	STATE(stats).bytes_repl +=
-		nfct_get_attr_u32(ct, ATTR_REPL_COUNTER_BYTES);
+		nfct_get_attr_u64(ct, ATTR_REPL_COUNTER_BYTES);
 	STATE(stats).packets_orig += 
-		nfct_get_attr_u32(ct, ATTR_ORIG_COUNTER_PACKETS);
+		nfct_get_attr_u64(ct, ATTR_ORIG_COUNTER_PACKETS);
 	STATE(stats).packets_repl +=
-		nfct_get_attr_u32(ct, ATTR_REPL_COUNTER_PACKETS);
+		nfct_get_attr_u64(ct, ATTR_REPL_COUNTER_PACKETS);
 }
 
 void dump_traffic_stats(int fd)
@@ -45,3 +52,484 @@ void dump_traffic_stats(int fd)
 
 	send(fd, buf, size, 0);
 }
+
+/*
+ * Accounting tables, updated once per destroyed flow. The protocol and the
+ * label tables are plain arrays, zones and marks go to fixed-size hash
+ * tables with open addressing. Once a hash table holds max_entries keys,
+ * the flows with new keys are accounted as `other'.
+ */
+#define TRAFFIC_ACCT_LABELS	128
+
+struct traffic_acct_entry {
+	uint32_t	key;
+	uint32_t	used;
+	uint64_t	flows;
+	uint64_t	packets[2];	/* original, reply */
+	uint64_t	bytes[2];
+};
+
+struct traffic_acct_table {
+	const char			*name;
+	int				hex;	/* show keys in hex */
+	struct traffic_acct_entry	*entry;
+	uint32_t			mask;	/* number of slots - 1 */
+	unsigned int			count;
+	unsigned int			max;
+	struct traffic_acct_entry	other;
+};
+
+struct traffic_acct {
+	struct traffic_acct_entry	proto[256];
+	struct traffic_acct_table	*zone;
+	struct traffic_acct_table	*mark;
+	uint32_t			mark_mask;
+	struct traffic_acct_entry	*label;
+	struct nfct_labelmap		*labelmap;
+};
+
+static struct traffic_acct_table *
+traffic_acct_table_create(const char *name, unsigned int max)
+{
+	struct traffic_acct_table *t;
+	uint32_t slots = 1;
+
+	/* keep the load factor under 50%, so probing stays short. */
+	while (slots < max * 2)
+		slots <<= 1;
+
+	t = calloc(1, sizeof(struct traffic_acct_table));
+	if (t == NULL)
+		return NULL;
+
+	t->entry = calloc(slots, sizeof(struct traffic_acct_entry));
+	if (t->entry == NULL) {
+		free(t);
+		return NULL;
+	}
+	t->name = name;
+	t->mask = slots - 1;
+	t->max = max;
+
+	return t;
+}
+
+static void traffic_acct_table_destroy(struct traffic_acct_table *t)
+{
+	if (t == NULL)
+		return;
+
+	free(t->entry);
+	free(t);
+}
+
+static struct traffic_acct_entry *
+traffic_acct_table_find(struct traffic_acct_table *t, uint32_t key)
+{
+	struct traffic_acct_entry *e;
+	uint32_t i = jhash_1word(key, 0) & t->mask;
+
+	for (;;) {
+		e = &t->entry[i];
+		if (!e->used) {
+			if (t->count >= t->max)
+				return &t->other;
+
+			e->used = 1;
+			e->key = key;
+			t->count++;
+			return e;
+		}
+		if (e->key == key)
+			return e;
+
+		i = (i + 1) & t->mask;
+	}
+}
+
+struct traffic_acct *traffic_acct_create(int zone, int mark,
+					 uint32_t mark_mask, int labels,
+					 unsigned int max_entries)
+{
+	struct traffic_acct *acct;
+
+	acct = calloc(1, sizeof(struct traffic_acct));
+	if (acct == NULL)
+		return NULL;
+
+	if (zone) {
+		acct->zone = traffic_acct_table_create("zone", max_entries);
+		if (acct->zone == NULL)
+			goto err;
+	}
+	if (mark) {
+		acct->mark = traffic_acct_table_create("mark", max_entries);
+		if (acct->mark == NULL)
+			goto err;
+		acct->mark->hex = 1;
+		acct->mark_mask = mark_mask;
+	}
+	if (labels) {
+		acct->label = calloc(TRAFFIC_ACCT_LABELS,
+				     sizeof(struct traffic_acct_entry));
+		if (acct->label == NULL)
+			goto err;
+
+		/* labels are shown by bit number if there is no map. */
+		acct->labelmap = nfct_labelmap_new(NULL);
+	}
+	return acct;
+err:
+	traffic_acct_destroy(acct);
+	return NULL;
+}
+
+void traffic_acct_destroy(struct traffic_acct *acct)
+{
+	traffic_acct_table_destroy(acct->zone);
+	traffic_acct_table_destroy(acct->mark);
+	if (acct->labelmap)
+		nfct_labelmap_destroy(acct->labelmap);
+	free(acct->label);
+	free(acct);
+}
+
+static void traffic_acct_add(struct traffic_acct_entry *e,
+			     const uint64_t *packets, const uint64_t *bytes)
+{
+	e->flows++;
+	e->packets[0] += packets[0];
+	e->packets[1] += packets[1];
+	e->bytes[0] += bytes[0];
+	e->bytes[1] += bytes[1];
+}
+
+void traffic_acct_update(struct traffic_acct *acct,
+			 const struct nf_conntrack *ct)
+{
+	const struct nfct_bitmask *b;
+	struct traffic_acct_entry *e;
+	uint64_t packets[2], bytes[2];
+	unsigned int i, maxbit;
+
+	packets[0] = nfct_get_attr_u64(ct, ATTR_ORIG_COUNTER_PACKETS);
+	packets[1] = nfct_get_attr_u64(ct, ATTR_REPL_COUNTER_PACKETS);
+	bytes[0] = nfct_get_attr_u64(ct, ATTR_ORIG_COUNTER_BYTES);
+	bytes[1] = nfct_get_attr_u64(ct, ATTR_REPL_COUNTER_BYTES);
+
+	traffic_acct_add(&acct->proto[nfct_get_attr_u8(ct, ATTR_L4PROTO)],
+			 packets, bytes);
+
+	if (acct->zone) {
+		e = traffic_acct_table_find(acct->zone,
+					    nfct_get_attr_u16(ct, ATTR_ZONE));
+		traffic_acct_add(e, packets, bytes);
+	}
+	if (acct->mark) {
+		e = traffic_acct_table_find(acct->mark,
+					    nfct_get_attr_u32(ct, ATTR_MARK) &
+					    acct->mark_mask);
+		traffic_acct_add(e, packets, bytes);
+	}
+	if (acct->label && nfct_attr_is_set(ct, ATTR_CONNLABELS)) {
+		b = nfct_get_attr(ct, ATTR_CONNLABELS);
+		maxbit = nfct_bitmask_maxbit(b);
+		if (maxbit >= TRAFFIC_ACCT_LABELS)
+			maxbit = TRAFFIC_ACCT_LABELS - 1;
+
+		for (i = 0; i <= maxbit; i++) {
+			if (nfct_bitmask_test_bit(b, i))
+				traffic_acct_add(&acct->label[i],
+						 packets, bytes);
+		}
+	}
+}
+
+static const char *traffic_acct_proto(unsigned int proto, char *buf,
+				      size_t size)
+{
+	struct protoent *pent = getprotobynumber(proto);
+
+	if (pent)
+		return pent->p_name;
+
+	snprintf(buf, size, "%u", proto);
+	return buf;
+}
+
+static const char *traffic_acct_label(struct traffic_acct *acct,
+				      unsigned int bit, char *buf, size_t size)
+{
+	const char *name = NULL;
+
+	if (acct->labelmap)
+		name = nfct_labelmap_get_name(acct->labelmap, bit);
+	if (name && name[0])
+		return name;
+
+	snprintf(buf, size, "%u", bit);
+	return buf;
+}
+
+static const char *traffic_acct_key(struct traffic_acct_table *t,
+				    const struct traffic_acct_entry *e,
+				    char *buf, size_t size)
+{
+	if (e == &t->other)
+		return "other";
+
+	if (t->hex)
+		snprintf(buf, size, "0x%08x", e->key);
+	else
+		snprintf(buf, size, "%u", e->key);
+
+	return buf;
+}
+
+/* busiest entries first. */
+static int traffic_acct_cmp(const void *a, const void *b)
+{
+	const struct traffic_acct_entry *e1 = *(const void * const *)a;
+	const struct traffic_acct_entry *e2 = *(const void * const *)b;
+	uint64_t b1 = e1->bytes[0] + e1->bytes[1];
+	uint64_t b2 = e2->bytes[0] + e2->bytes[1];
+
+	if (b1 != b2)
+		return b1 < b2 ? 1 : -1;
+
+	return e1->flows < e2->flows ? 1 : e1->flows > e2->flows ? -1 : 0;
+}
+
+/* used entries of a hash table, sorted, with `other' at the end. */
+static struct traffic_acct_entry **
+traffic_acct_table_sort(struct traffic_acct_table *t, unsigned int *num)
+{
+	struct traffic_acct_entry **v;
+	unsigned int i, n = 0;
+
+	v = malloc((t->count + 1) * sizeof(struct traffic_acct_entry *));
+	if (v == NULL)
+		return NULL;
+
+	for (i = 0; i <= t->mask; i++) {
+		if (t->entry[i].used)
+			v[n++] = &t->entry[i];
+	}
+	qsort(v, n, sizeof(struct traffic_acct_entry *), traffic_acct_cmp);
+
+	if (t->other.flows)
+		v[n++] = &t->other;
+
+	*num = n;
+	return v;
+}
+
+struct traffic_acct_out {
+	int	fd;
+	int	len;
+	char	buf[4096];
+};
+
+static void traffic_acct_printf(struct traffic_acct_out *out,
+				const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+static void traffic_acct_printf(struct traffic_acct_out *out,
+				const char *fmt, ...)
+{
+	va_list ap;
+	int ret;
+
+	/* lines are short, flush before one may not fit. */
+	if (out->len > (int)sizeof(out->buf) - 256) {
+		send(out->fd, out->buf, out->len, 0);
+		out->len = 0;
+	}
+	va_start(ap, fmt);
+	ret = vsnprintf(out->buf + out->len, sizeof(out->buf) - out->len,
+			fmt, ap);
+	va_end(ap);
+
+	if (ret > 0)
+		out->len += ret < (int)sizeof(out->buf) - out->len ?
+			    ret : (int)sizeof(out->buf) - out->len - 1;
+}
+
+static void traffic_acct_line(struct traffic_acct_out *out, const char *key,
+			      const struct traffic_acct_entry *e)
+{
+	traffic_acct_printf(out, "%-20s %12llu %14llu %18llu %14llu %18llu\n",
+			    key, (unsigned long long)e->flows,
+			    (unsigned long long)e->packets[0],
+			    (unsigned long long)e->bytes[0],
+			    (unsigned long long)e->packets[1],
+			    (unsigned long long)e->bytes[1]);
+}
+
+static void traffic_acct_header(struct traffic_acct_out *out,
+				const char *by, const char *extra)
+{
+	traffic_acct_printf(out, "accounting by %s%s:\n"
+			    "%-20s %12s %14s %18s %14s %18s\n",
+			    by, extra, by, "flows", "orig packets",
+			    "orig bytes", "reply packets", "reply bytes");
+}
+
+static void traffic_acct_table_dump(struct traffic_acct_out *out,
+				    struct traffic_acct_table *t,
+				    const char *extra)
+{
+	struct traffic_acct_entry **v;
+	unsigned int i, num;
+	char key[32];
+
+	v = traffic_acct_table_sort(t, &num);
+	if (v == NULL)
+		return;
+
+	traffic_acct_header(out, t->name, extra);
+	for (i = 0; i < num; i++)
+		traffic_acct_line(out, traffic_acct_key(t, v[i], key,
+							sizeof(key)), v[i]);
+	traffic_acct_printf(out, "\n");
+	free(v);
+}
+
+void traffic_acct_dump(struct traffic_acct *acct, int fd)
+{
+	struct traffic_acct_out out = {
+		.fd	= fd,
+	};
+	char key[32], extra[32];
+	unsigned int i;
+
+	traffic_acct_header(&out, "protocol", "");
+	for (i = 0; i < 256; i++) {
+		if (acct->proto[i].flows == 0)
+			continue;
+		traffic_acct_line(&out, traffic_acct_proto(i, key, sizeof(key)),
+				  &acct->proto[i]);
+	}
+	traffic_acct_printf(&out, "\n");
+
+	if (acct->zone)
+		traffic_acct_table_dump(&out, acct->zone, "");
+
+	if (acct->mark) {
+		snprintf(extra, sizeof(extra), " (mask 0x%08x)",
+			 acct->mark_mask);
+		traffic_acct_table_dump(&out, acct->mark, extra);
+	}
+
+	if (acct->label) {
+		traffic_acct_header(&out, "label", "");
+		for (i = 0; i < TRAFFIC_ACCT_LABELS; i++) {
+			if (acct->label[i].flows == 0)
+				continue;
+			traffic_acct_line(&out, traffic_acct_label(acct, i, key,
+								   sizeof(key)),
+					  &acct->label[i]);
+		}
+		traffic_acct_printf(&out, "\n");
+	}
+
+	if (out.len)
+		send(fd, out.buf, out.len, 0);
+}
+
+enum traffic_acct_value {
+	TRAFFIC_ACCT_FLOWS,
+	TRAFFIC_ACCT_PACKETS,
+	TRAFFIC_ACCT_BYTES,
+};
+
+static void traffic_acct_sample(struct metrics *m, const char *by,
+				const char *key,
+				const struct traffic_acct_entry *e,
+				enum traffic_acct_value value)
+{
+	switch (value) {
+	case TRAFFIC_ACCT_FLOWS:
+		metrics_sample(m, e->flows, "by=\"%s\",key=\"%s\"", by, key);
+		break;
+	case TRAFFIC_ACCT_PACKETS:
+		metrics_sample(m, e->packets[0],
+			       "by=\"%s\",key=\"%s\",dir=\"original\"", by, key);
+		metrics_sample(m, e->packets[1],
+			       "by=\"%s\",key=\"%s\",dir=\"reply\"", by, key);
+		break;
+	case TRAFFIC_ACCT_BYTES:
+		metrics_sample(m, e->bytes[0],
+			       "by=\"%s\",key=\"%s\",dir=\"original\"", by, key);
+		metrics_sample(m, e->bytes[1],
+			       "by=\"%s\",key=\"%s\",dir=\"reply\"", by, key);
+		break;
+	}
+}
+
+static void traffic_acct_table_metrics(struct traffic_acct_table *t,
+				       struct metrics *m,
+				       enum traffic_acct_value value)
+{
+	char key[32];
+	uint32_t i;
+
+	for (i = 0; i <= t->mask; i++) {
+		if (!t->entry[i].used)
+			continue;
+		traffic_acct_sample(m, t->name, traffic_acct_key(t,
+				    &t->entry[i], key, sizeof(key)),
+				    &t->entry[i], value);
+	}
+	if (t->other.flows)
+		traffic_acct_sample(m, t->name, "other", &t->other, value);
+}
+
+void traffic_acct_metrics(struct traffic_acct *acct, struct metrics *m)
+{
+	static const struct {
+		const char		*name;
+		const char		*help;
+	} family[] = {
+		[TRAFFIC_ACCT_FLOWS]	= {
+			"accounting_flows", "Destroyed flows"
+		},
+		[TRAFFIC_ACCT_PACKETS]	= {
+			"accounting_packets", "Packets of the destroyed flows"
+		},
+		[TRAFFIC_ACCT_BYTES]	= {
+			"accounting_bytes", "Bytes of the destroyed flows"
+		},
+	};
+	enum traffic_acct_value value;
+	char key[32];
+	unsigned int i;
+
+	for (value = TRAFFIC_ACCT_FLOWS; value <= TRAFFIC_ACCT_BYTES; value++) {
+		metrics_family(m, family[value].name, METRICS_COUNTER,
+			       family[value].help);
+
+		for (i = 0; i < 256; i++) {
+			if (acct->proto[i].flows == 0)
+				continue;
+			traffic_acct_sample(m, "protocol",
+					    traffic_acct_proto(i, key,
+							       sizeof(key)),
+					    &acct->proto[i], value);
+		}
+		if (acct->zone)
+			traffic_acct_table_metrics(acct->zone, m, value);
+		if (acct->mark)
+			traffic_acct_table_metrics(acct->mark, m, value);
+		if (acct->label) {
+			for (i = 0; i < TRAFFIC_ACCT_LABELS; i++) {
+				if (acct->label[i].flows == 0)
+					continue;
+				traffic_acct_sample(m, "label",
+					traffic_acct_label(acct, i, key,
+							   sizeof(key)),
+					&acct->label[i], value);
+			}
+		}
+	}
+}
@@ -0,0 +1,141 @@
+#!/bin/bash
+
+DEFAULT_CT="../../src/conntrack"
+DEFAULT_TMP_FILE="./ct_data.bin"
+DEFAULT_CT_ZONE=124
+
+CT=$DEFAULT_CT
+TMP_FILE=$DEFAULT_TMP_FILE
+CT_ZONE=$DEFAULT_CT_ZONE
+
+print_help()
+{
+	me=$(basename "$0")
+
+	echo "Script for testing the binary save/restore round trip (-o binary, -R)"
+	echo ""
+	echo "Usage: $me [options]"
+	echo ""
+	echo "Where options can be:"
+	echo ""
+	echo "-ct <ct_tool_path>    -  path to the conntrack tool."
+	echo "                         Default is ${DEFAULT_CT}."
+	echo ""
+	echo "-z <ct_zone>          -  ct zone to be used."
+	echo "                         Default is ${DEFAULT_CT_ZONE}."
+	echo ""
+	echo "-f <tmp_file_name>    -  tmp file to save the entries to."
+	echo "                         Default is ${DEFAULT_TMP_FILE}."
+	echo ""
+	echo "-h                    -  Print this help and exit."
+}
+
+# the timeouts go down between the two dumps, leave them out.
+function ct_dump()
+{
+	${CT} -L -w $CT_ZONE -o save 2> /dev/null | \
+		sed -e "s/ -t [0-9]*//" | sort
+}
+
+if [ $UID -ne 0 ]
+then
+        echo "Run this test as root"
+        exit 1
+fi
+
+while [ $# -gt 0 ]
+do
+	case "$1" in
+	-ct)
+		CT=${2:-}
+		if [ -z "$CT" ]
+		then
+			echo "conntrack path must be specified!"
+			print_help
+			exit 1
+		fi
+		shift
+		;;
+	-z)
+		CT_ZONE=${2:-}
+		if [ -z "$CT_ZONE" ]
+		then
+			echo "ct zone must be specified!"
+			print_help
+			exit 1
+		fi
+		shift
+		;;
+	-f)
+		TMP_FILE=${2:-}
+		if [ -z "$TMP_FILE" ]
+		then
+			echo "Tmp file must be specified!"
+			print_help
+			exit 1
+		fi
+		shift
+		;;
+	-h)
+		print_help
+		exit 1
+		;;
+	*)
+		echo "Unknown paramerer \"$1\""
+		print_help
+		exit 1
+		;;
+	esac
+	shift
+done
+
+# only zone ${CT_ZONE} is flushed, the rest of the table is left alone.
+${CT} -D -w $CT_ZONE > /dev/null 2>&1
+
+echo "Creating the entries in zone ${CT_ZONE}.."
+${CT} -R - <<EOF
+-I -w $CT_ZONE -s 1.1.1.1 -d 2.2.2.2 -p tcp --sport 10 --dport 20 --state ESTABLISHED -u SEEN_REPLY,ASSURED -m 7 -t 500
+-I -w $CT_ZONE -s 1.1.1.1 -d 2.2.2.2 -r 3.3.3.3 -q 1.1.1.1 -p tcp --sport 11 --dport 20 --reply-port-src 20 --reply-port-dst 11 --state ESTABLISHED -u SEEN_REPLY -t 500
+-I -w $CT_ZONE -s 1.1.1.1 -d 2.2.2.2 -p udp --sport 10 --dport 53 -u SEEN_REPLY -t 500
+-I -w $CT_ZONE -s 2001:DB8::1.1.1.1 -d 2001:DB8::2.2.2.2 -p tcp --sport 10 --dport 20 --state LISTEN -u SEEN_REPLY -t 500
+-I -w $CT_ZONE -s 1.1.1.1 -d 2.2.2.2 -r 2.2.2.2 -q 1.1.1.1 -p icmp --icmp-type 8 --icmp-code 0 --icmp-id 1226 -u SEEN_REPLY -t 500
+-I -w $CT_ZONE -s 0.0.0.0 -d 224.0.0.22 -r 224.0.0.22 -q 0.0.0.0 -p 2 -t 500
+EOF
+if [ $? -ne 0 ]; then
+	echo "cannot create the entries"
+	exit 1
+fi
+
+BEFORE=$(ct_dump)
+NUM_ENTRIES=$(echo "$BEFORE" | wc -l)
+
+echo "Saving ${NUM_ENTRIES} entries to ${TMP_FILE} .."
+${CT} -L -w $CT_ZONE -o binary > $TMP_FILE
+
+echo "Flushing zone ${CT_ZONE}.."
+${CT} -D -w $CT_ZONE > /dev/null
+if [ -n "$(ct_dump)" ]; then
+	echo "zone ${CT_ZONE} is not empty after the flush"
+	exit 1
+fi
+
+echo "Restoring the entries from ${TMP_FILE} .."
+${CT} -R $TMP_FILE
+RET=$?
+
+AFTER=$(ct_dump)
+
+echo "Cleaning up zone ${CT_ZONE}.."
+${CT} -D -w $CT_ZONE > /dev/null
+rm $TMP_FILE
+
+if [ $RET -ne 0 ]; then
+	echo "FAIL: the restore failed"
+	exit 1
+fi
+if [ "$BEFORE" != "$AFTER" ]; then
+	echo "FAIL: the restored entries differ"
+	diff <(echo "$BEFORE") <(echo "$AFTER")
+	exit 1
+fi
+echo "OK: ${NUM_ENTRIES} entries restored"
@@ -0,0 +1,255 @@
+#!/usr/bin/env python3
+
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 3 of the License, or
+# (at your option) any later version.
+#
+
+# Minimal IPFIX collector to validate the flow records exported by
+# conntrackd in stats mode. It reads messages from a UDP socket or from an
+# IPFIX file, checks the message, set and template structure plus the
+# sequence numbers, and then checks that every --expect matches at least
+# one data record, e.g.:
+#
+#   ipfix-collector.py --file /tmp/flows.ipfix \
+#       --expect proto=17,src=1.1.1.1,dst=2.2.2.2,sport=10,dport=20
+
+import argparse
+import ipaddress
+import socket
+import struct
+import sys
+import time
+
+PEN_REVERSE = 29305
+PEN_NETFILTER = 21373
+
+# (enterprise number, element id) -> name
+ELEMENTS = {
+    (0, 1): "bytes",
+    (0, 2): "packets",
+    (0, 4): "proto",
+    (0, 7): "sport",
+    (0, 8): "src",
+    (0, 11): "dport",
+    (0, 12): "dst",
+    (0, 27): "src",
+    (0, 28): "dst",
+    (0, 152): "start",
+    (0, 153): "end",
+    (0, 225): "nat_src",
+    (0, 226): "nat_dst",
+    (0, 227): "nat_sport",
+    (0, 228): "nat_dport",
+    (0, 281): "nat_src",
+    (0, 282): "nat_dst",
+    (PEN_REVERSE, 1): "reply_bytes",
+    (PEN_REVERSE, 2): "reply_packets",
+    (PEN_NETFILTER, 4): "mark",
+    (PEN_NETFILTER, 9): "zone",
+}
+
+
+class CollectorError(Exception):
+    pass
+
+
+class Collector:
+    def __init__(self):
+        self.templates = {}
+        self.records = []
+        self.next_seq = {}
+        self.messages = 0
+        self.lost = 0
+        self.strict = True
+
+    def decode_value(self, name, data):
+        if name in ("src", "dst", "nat_src", "nat_dst"):
+            return str(ipaddress.ip_address(data))
+        return int.from_bytes(data, "big")
+
+    def parse_template_set(self, data):
+        off = 0
+        while len(data) - off >= 4:
+            tid, count = struct.unpack_from("!HH", data, off)
+            off += 4
+            if tid < 256:
+                raise CollectorError("invalid template id {}".format(tid))
+            fields = []
+            for _ in range(count):
+                if len(data) - off < 4:
+                    raise CollectorError("truncated template {}".format(tid))
+                eid, length = struct.unpack_from("!HH", data, off)
+                off += 4
+                pen = 0
+                if eid & 0x8000:
+                    if len(data) - off < 4:
+                        raise CollectorError("truncated template field")
+                    (pen,) = struct.unpack_from("!I", data, off)
+                    off += 4
+                    eid &= 0x7FFF
+                if length == 0xFFFF:
+                    raise CollectorError("unexpected variable length field")
+                fields.append((pen, eid, length))
+            self.templates[tid] = fields
+
+    def parse_data_set(self, tid, data):
+        if tid not in self.templates:
+            raise CollectorError("data set {} without template".format(tid))
+        fields = self.templates[tid]
+        reclen = sum(f[2] for f in fields)
+        count = 0
+        off = 0
+        # the rest of the set, if shorter than one record, is padding.
+        while len(data) - off >= reclen:
+            record = {}
+            for pen, eid, length in fields:
+                name = ELEMENTS.get((pen, eid), "{}.{}".format(pen, eid))
+                record[name] = self.decode_value(name, data[off:off + length])
+                off += length
+            self.records.append(record)
+            count += 1
+        return count
+
+    def parse_message(self, msg):
+        if len(msg) < 16:
+            raise CollectorError("truncated message header")
+        version, length, export_time, seq, domain = \
+            struct.unpack_from("!HHIII", msg, 0)
+        if version != 10:
+            raise CollectorError("bad version {}".format(version))
+        if length != len(msg):
+            raise CollectorError("message length {} but got {} bytes"
+                                 .format(length, len(msg)))
+        expected = self.next_seq.get(domain, seq)
+        gap = (seq - expected) & 0xFFFFFFFF
+        # UDP may lose messages, a file must be complete.
+        if gap and (self.strict or gap >= 0x80000000):
+            raise CollectorError("sequence number {}, expected {}"
+                                 .format(seq, expected))
+        self.lost += gap
+
+        count = 0
+        off = 16
+        while off < length:
+            if length - off < 4:
+                raise CollectorError("truncated set header")
+            sid, slen = struct.unpack_from("!HH", msg, off)
+            if slen < 4 or off + slen > length:
+                raise CollectorError("bad set length {}".format(slen))
+            body = msg[off + 4:off + slen]
+            if sid == 2:
+                self.parse_template_set(body)
+            elif sid >= 256:
+                count += self.parse_data_set(sid, body)
+            else:
+                raise CollectorError("unexpected set id {}".format(sid))
+            off += slen
+
+        self.next_seq[domain] = (seq + count) & 0xFFFFFFFF
+        self.messages += 1
+
+    def read_file(self, path):
+        with open(path, "rb") as f:
+            data = f.read()
+        off = 0
+        while off < len(data):
+            if len(data) - off < 4:
+                raise CollectorError("trailing garbage in file")
+            (length,) = struct.unpack_from("!H", data, off + 2)
+            if length < 16 or off + length > len(data):
+                raise CollectorError("truncated message in file")
+            self.parse_message(data[off:off + length])
+            off += length
+
+    def listen(self, addr, port, timeout, count, expect):
+        family = socket.AF_INET6 if ":" in addr else socket.AF_INET
+        sock = socket.socket(family, socket.SOCK_DGRAM)
+        self.strict = False
+        sock.bind((addr, port))
+        deadline = time.time() + timeout
+        while time.time() < deadline:
+            if count and len(self.records) >= count:
+                break
+            if expect and all(self.match(e) for e in expect):
+                break
+            sock.settimeout(max(deadline - time.time(), 0.01))
+            try:
+                msg = sock.recv(65535)
+            except socket.timeout:
+                break
+            self.parse_message(msg)
+        sock.close()
+
+    def match(self, expect):
+        for record in self.records:
+            if all(str(record.get(k)) == v for k, v in expect.items()):
+                return True
+        return False
+
+
+def parse_expect(s):
+    expect = {}
+    for item in s.split(","):
+        key, _, value = item.partition("=")
+        expect[key.strip()] = value.strip()
+    return expect
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(description="IPFIX test collector")
+    src = parser.add_mutually_exclusive_group(required=True)
+    src.add_argument("--file", help="read an IPFIX file")
+    src.add_argument("--listen", metavar="ADDR:PORT",
+                     help="receive IPFIX messages via UDP")
+    parser.add_argument("--timeout", type=float, default=5,
+                        help="seconds to wait for messages (default: 5)")
+    parser.add_argument("--count", type=int, default=0,
+                        help="stop after this many data records")
+    parser.add_argument("--expect", action="append", default=[],
+                        metavar="KEY=VAL,...",
+                        help="a data record must match all the given values")
+    parser.add_argument("-v", "--verbose", action="store_true",
+                        help="print the data records")
+    return parser.parse_args()
+
+
+def main():
+    args = parse_args()
+    expect = [parse_expect(e) for e in args.expect]
+    collector = Collector()
+
+    try:
+        if args.file:
+            collector.read_file(args.file)
+        else:
+            addr, _, port = args.listen.rpartition(":")
+            collector.listen(addr.strip("[]"), int(port), args.timeout,
+                             args.count, expect)
+    except (CollectorError, OSError) as e:
+        print("ipfix-collector: {}".format(e), file=sys.stderr)
+        return 1
+
+    if args.verbose:
+        for record in collector.records:
+            print(" ".join("{}={}".format(k, v) for k, v in record.items()))
+
+    if args.count and len(collector.records) < args.count:
+        print("ipfix-collector: got {} data records ({} lost), expected {}"
+              .format(len(collector.records), collector.lost, args.count),
+              file=sys.stderr)
+        return 1
+
+    for e in expect:
+        if not collector.match(e):
+            print("ipfix-collector: no data record matches {}".format(e),
+                  file=sys.stderr)
+            return 1
+
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())